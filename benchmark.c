@@ -1,4 +1,6 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -44,6 +46,17 @@ int cmp(const void *a, const void *b, void *udata_qe, void *udata_idx) {
   return strcmp(ea->name, eb->name);
 }
 
+uint64_t hash(const void *entry_raw, void *udata_qe, void *udata_idx) {
+  const char *name   = ((struct entry *)entry_raw)->name;
+  uint64_t    output = 14695981039346656037ULL;
+  while(*name) output = (output ^ (unsigned char)*(name++)) * 1099511628211ULL;
+  return output;
+}
+
+int eq(const void *a, const void *b, void *udata_qe, void *udata_idx) {
+  return cmp(a, b, udata_qe, udata_idx) == 0;
+}
+
 void purge(void *entry_raw, void *udata) {
   struct entry *entry = (struct entry *)entry_raw;
   if (entry->name) free(entry->name);
@@ -66,7 +79,7 @@ char *random_str(int len) {
 
 /* void test_main() { */
 /*   struct query_engine_t *qe = qe_init("bmark.db", &serialize, &deserialize, &purge, NULL, PALLOC_DEFAULT | PALLOC_DYNAMIC); */
-/*   qe_index_add(qe, "nam", &cmp, NULL); */
+/*   qe_index_add(qe, "nam", &cmp, NULL, NULL); */
 
 /*   // Build random entry */
 /*   struct entry *e_00 = calloc(1, sizeof(struct entry)); */
@@ -109,7 +122,7 @@ void mindex_bmark_rstr_65536() {
 void mindex_bmark_assign_1024() {
   unlink(canonical_path("bmark.db"));
   struct query_engine_t *qe = qe_init("bmark.db", &serialize, &deserialize, &purge, NULL, PALLOC_DEFAULT | PALLOC_DYNAMIC);
-  qe_index_add(qe, "nam", &cmp, NULL);
+  qe_index_add(qe, "nam", &cmp, NULL, NULL);
   struct entry *my_entry = calloc(1, sizeof(struct entry));
   my_entry->data         = calloc(1, sizeof(struct buf));
   my_entry->data->len    = my_entry->data->cap = 16;
@@ -126,7 +139,7 @@ void mindex_bmark_assign_1024() {
 void mindex_bmark_assign_2048() {
   unlink(canonical_path("bmark.db"));
   struct query_engine_t *qe = qe_init("bmark.db", &serialize, &deserialize, &purge, NULL, PALLOC_DEFAULT | PALLOC_DYNAMIC);
-  qe_index_add(qe, "nam", &cmp, NULL);
+  qe_index_add(qe, "nam", &cmp, NULL, NULL);
   struct entry *my_entry = calloc(1, sizeof(struct entry));
   my_entry->data         = calloc(1, sizeof(struct buf));
   my_entry->data->len    = my_entry->data->cap = 16;
@@ -140,6 +153,214 @@ void mindex_bmark_assign_2048() {
   qe_close(qe);
 }
 
+void mindex_bmark_assign_many_2048() {
+  unlink(canonical_path("bmark.db"));
+  struct query_engine_t *qe = qe_init("bmark.db", &serialize, &deserialize, &purge, NULL, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  qe_index_add(qe, "nam", &cmp, NULL, NULL);
+  struct entry *my_entries = calloc(2048, sizeof(struct entry));
+  const void  **batch      = calloc(2048, sizeof(void *));
+  for(int i=0; i<2048; i++) {
+    my_entries[i].name       = random_str(15);
+    my_entries[i].data       = calloc(1, sizeof(struct buf));
+    my_entries[i].data->len  = my_entries[i].data->cap = 16;
+    my_entries[i].data->data = random_str(my_entries[i].data->len - 1);
+    batch[i]                 = &my_entries[i];
+  }
+  qe_set_many(qe, batch, 2048);
+  for(int i=0; i<2048; i++) {
+    free(my_entries[i].name);
+    free(my_entries[i].data->data);
+    free(my_entries[i].data);
+  }
+  free(my_entries);
+  free(batch);
+  qe_close(qe);
+}
+uint64_t shard(const void *entry_raw, void *udata) {
+  return hash(entry_raw, udata, NULL);
+}
+
+// Same batch, split over 4 files written at the same time
+void mindex_bmark_assign_many_sharded_2048() {
+  char path[32];
+  for(int i=0; i<4; i++) {
+    snprintf(path, sizeof(path), "bmark-shards.db.%d", i);
+    unlink(canonical_path(path));
+  }
+  struct qe_shards *shards = qe_shards_init("bmark-shards.db", 4, "nam", &shard, &serialize, &deserialize, &purge, NULL, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  struct qe_index_def def  = { .name = "nam", .cmp = &cmp };
+  qe_shards_index_add_many(shards, &def, 1);
+  struct entry *my_entries = calloc(2048, sizeof(struct entry));
+  const void  **batch      = calloc(2048, sizeof(void *));
+  for(int i=0; i<2048; i++) {
+    my_entries[i].name       = random_str(15);
+    my_entries[i].data       = calloc(1, sizeof(struct buf));
+    my_entries[i].data->len  = my_entries[i].data->cap = 16;
+    my_entries[i].data->data = random_str(my_entries[i].data->len - 1);
+    batch[i]                 = &my_entries[i];
+  }
+  qe_shards_set_many(shards, batch, 2048);
+  for(int i=0; i<2048; i++) {
+    free(my_entries[i].name);
+    free(my_entries[i].data->data);
+    free(my_entries[i].data);
+  }
+  free(my_entries);
+  free(batch);
+  qe_shards_close(shards);
+}
+
+// Shared, pre-filled engine for the read benchmarks
+#define BMARK_READ_ENTRIES 4096
+#define BMARK_READ_GETS    65536
+struct query_engine_t *bmark_read_qe = NULL;
+char                  *bmark_read_names[BMARK_READ_ENTRIES];
+
+void bmark_read_prepare() {
+  unlink(canonical_path("bmark-read.db"));
+  bmark_read_qe = qe_init("bmark-read.db", &serialize, &deserialize, &purge, NULL, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  qe_index_add(bmark_read_qe, "nam", &cmp, NULL, NULL);
+  qe_index_add_hash(bmark_read_qe, "hsh", &hash, &eq, NULL);
+  qe_index_add_typed(bmark_read_qe, "typ", QUERY_ENGINE_KEY_BYTES, 0, 15);
+  struct entry *my_entry = calloc(1, sizeof(struct entry));
+  my_entry->data         = calloc(1, sizeof(struct buf));
+  my_entry->data->len    = my_entry->data->cap = 16;
+  for(int i=0; i<BMARK_READ_ENTRIES; i++) {
+    bmark_read_names[i]  = random_str(15);
+    my_entry->name       = bmark_read_names[i];
+    my_entry->data->data = random_str(my_entry->data->len - 1);
+    qe_set(bmark_read_qe, my_entry);
+    free(my_entry->data->data);
+  }
+  free(my_entry->data);
+  free(my_entry);
+}
+
+void * bmark_read_worker(void *arg) {
+  int gets = (int)(intptr_t)arg;
+  struct entry pattern;
+  for(int i=0; i<gets; i++) {
+    pattern.name = bmark_read_names[rand() % BMARK_READ_ENTRIES];
+    purge(qe_get(bmark_read_qe, "nam", &pattern), NULL);
+  }
+  return NULL;
+}
+
+// Same amount of gets, spread over the given amount of threads
+void bmark_read_threads(int threads) {
+  pthread_t workers[threads];
+  for(int i=0; i<threads; i++) {
+    pthread_create(&workers[i], NULL, bmark_read_worker, (void *)(intptr_t)(BMARK_READ_GETS / threads));
+  }
+  for(int i=0; i<threads; i++) {
+    pthread_join(workers[i], NULL);
+  }
+}
+
+void mindex_bmark_get_threads_1() { bmark_read_threads(1); }
+void mindex_bmark_get_threads_2() { bmark_read_threads(2); }
+void mindex_bmark_get_threads_4() { bmark_read_threads(4); }
+void mindex_bmark_get_threads_8() { bmark_read_threads(8); }
+
+// Equality lookups through the hash index instead
+void mindex_bmark_get_hash() {
+  struct entry pattern;
+  for(int i=0; i<BMARK_READ_GETS; i++) {
+    pattern.name = bmark_read_names[rand() % BMARK_READ_ENTRIES];
+    purge(qe_get(bmark_read_qe, "hsh", &pattern), NULL);
+  }
+}
+
+// Same lookups, on the fixed-width name as a built-in key type
+void mindex_bmark_get_typed() {
+  struct entry pattern;
+  struct buf   data = { .data = "", .len = 0 };
+  pattern.data = &data;
+  for(int i=0; i<BMARK_READ_GETS; i++) {
+    pattern.name = bmark_read_names[rand() % BMARK_READ_ENTRIES];
+    purge(qe_get(bmark_read_qe, "typ", &pattern), NULL);
+  }
+}
+
+// Range counts between two random names, never reading records
+void mindex_bmark_count_typed() {
+  struct entry lower, upper;
+  struct buf   data = { .data = "", .len = 0 };
+  size_t       count;
+  lower.data = upper.data = &data;
+  for(int i=0; i<BMARK_READ_GETS; i++) {
+    lower.name = bmark_read_names[rand() % BMARK_READ_ENTRIES];
+    upper.name = bmark_read_names[rand() % BMARK_READ_ENTRIES];
+    qe_count(bmark_read_qe, "typ", &lower, &upper, QUERY_ENGINE_CURSOR_DEFAULT, &count);
+  }
+}
+
+// Full scans, keeping the records starting with a digit
+int bmark_scan_filter(const void *record, void *udata) {
+  const struct entry *my_entry = record;
+  return (my_entry->name[0] >= '0') && (my_entry->name[0] <= '9');
+}
+
+int bmark_scan_emit(void *record, void *udata) {
+  (*(size_t *)udata)++;
+  purge(record, NULL);
+  return 0;
+}
+
+#define BMARK_SCANS 16
+void mindex_bmark_scan() {
+  size_t found = 0;
+  for(int i=0; i<BMARK_SCANS; i++) {
+    qe_scan(bmark_read_qe, &bmark_scan_filter, &bmark_scan_emit, &found, 0);
+  }
+}
+
+// Full images of the read engine, streamed out & thrown away
+void mindex_bmark_snapshot() {
+  int fd = open("/dev/null", O_WRONLY);
+  for(int i=0; i<BMARK_SCANS; i++) {
+    qe_snapshot(bmark_read_qe, fd);
+  }
+  close(fd);
+}
+
+// Same lookups, batched through qe_get_many
+#define BMARK_READ_BATCH 256
+void mindex_bmark_get_many() {
+  struct entry  patterns[BMARK_READ_BATCH];
+  const void   *batch[BMARK_READ_BATCH];
+  void         *results[BMARK_READ_BATCH];
+  for(int i=0; i<BMARK_READ_GETS; i+=BMARK_READ_BATCH) {
+    for(int j=0; j<BMARK_READ_BATCH; j++) {
+      patterns[j].name = bmark_read_names[rand() % BMARK_READ_ENTRIES];
+      batch[j]         = &patterns[j];
+    }
+    qe_get_many(bmark_read_qe, "nam", batch, BMARK_READ_BATCH, results);
+    for(int j=0; j<BMARK_READ_BATCH; j++) {
+      purge(results[j], NULL);
+    }
+  }
+}
+
+// Rewriting records with same-sized data, replacing vs updating in place
+#define BMARK_WRITE_UPDATES 256
+void bmark_write_records(int inplace) {
+  struct entry pattern;
+  struct entry update;
+  struct buf   data = { .data = "0123456789abcde", .len = 15 };
+  update.data = &data;
+  for(int i=0; i<BMARK_WRITE_UPDATES; i++) {
+    pattern.name = update.name = bmark_read_names[rand() % BMARK_READ_ENTRIES];
+    if (inplace) {
+      qe_update(bmark_read_qe, "hsh", &pattern, &update);
+    } else {
+      qe_set(bmark_read_qe, &update);
+    }
+  }
+}
+
+void mindex_bmark_set_replace() { bmark_write_records(0); }
+void mindex_bmark_set_update()  { bmark_write_records(1); }
 
 int main() {
   // Seed random
@@ -149,10 +370,27 @@ int main() {
     1, 5, 50, 95, 99, 0
   };
 
+  bmark_read_prepare();
+
+  BMARK(mindex_bmark_set_update);
+  BMARK(mindex_bmark_set_replace);
+  BMARK(mindex_bmark_snapshot);
+  BMARK(mindex_bmark_scan);
+  BMARK(mindex_bmark_count_typed);
+  BMARK(mindex_bmark_get_typed);
+  BMARK(mindex_bmark_get_many);
+  BMARK(mindex_bmark_get_hash);
+  BMARK(mindex_bmark_get_threads_8);
+  BMARK(mindex_bmark_get_threads_4);
+  BMARK(mindex_bmark_get_threads_2);
+  BMARK(mindex_bmark_get_threads_1);
+  BMARK(mindex_bmark_assign_many_sharded_2048);
+  BMARK(mindex_bmark_assign_many_2048);
   BMARK(mindex_bmark_assign_2048);
   BMARK(mindex_bmark_assign_1024);
   BMARK(mindex_bmark_rstr_65536);
   BMARK(mindex_bmark_rstr_1024);
-  return bmark_run(100, percentiles);
-  return 0;
+  int result = bmark_run(100, percentiles);
+  qe_close(bmark_read_qe);
+  return result;
 }
@@ -3,8 +3,13 @@ extern "C" {
 #endif
 
 #include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "finwo/mindex.h"
 #include "finwo/palloc.h"
@@ -20,12 +25,30 @@ extern "C" {
 #define write_os _write
 #define read_os _read
 #define close_os _close
+#define fsync_os _commit
 #define unlink_os _unlink
 #define O_CREAT _O_CREAT
 #define O_RDWR  _O_RDWR
+#define O_TRUNC _O_TRUNC
+#define O_BINARY _O_BINARY
 #define OPENMODE  (_S_IREAD | _S_IWRITE)
 #define O_DSYNC 0
 #define ssize_t SSIZE_T
+#define rwlock_os SRWLOCK
+#define rwlock_destroy_os(l)
+#define rwlock_rdlock_os(l) AcquireSRWLockShared(l)
+#define rwlock_rdunlock_os(l) ReleaseSRWLockShared(l)
+#define rwlock_wrlock_os(l) AcquireSRWLockExclusive(l)
+#define rwlock_wrunlock_os(l) ReleaseSRWLockExclusive(l)
+#define mutex_os SRWLOCK
+#define mutex_init_os(m) InitializeSRWLock(m)
+#define mutex_destroy_os(m)
+#define mutex_lock_os(m) AcquireSRWLockExclusive(m)
+#define mutex_unlock_os(m) ReleaseSRWLockExclusive(m)
+#define thread_os HANDLE
+#define thread_create_os(t,f,a) ((*(t) = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)(f), (a), 0, NULL)) ? 0 : -1)
+#define thread_join_os(t) (WaitForSingleObject((t), INFINITE), CloseHandle(t))
+#define prefetch_os(fd,off,len)
 #elif defined(__APPLE__)
 #define stat_os stat
 #define fstat_os fstat
@@ -34,8 +57,14 @@ extern "C" {
 #define write_os write
 #define read_os read
 #define close_os close
+#define fsync_os fsync
 #define unlink_os unlink
+#define rename_os rename
 #define OPENMODE  (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)
+#define pread_os pread
+#define pwrite_os pwrite
+#define pwritev_os pwritev
+#define prefetch_os(fd,off,len)
 #else
 #define stat_os stat64
 #define fstat_os fstat64
@@ -43,10 +72,49 @@ extern "C" {
 #define open_os open
 #define write_os write
 #define read_os read
+#define pread_os pread64
+#define pwrite_os pwrite64
+#define pwritev_os pwritev64
+#define prefetch_os(fd,off,len) posix_fadvise((fd), (off), (len), POSIX_FADV_WILLNEED)
 #define close_os close
+#define fsync_os fsync
 #define unlink_os unlink
+#define rename_os rename
 #define OPENMODE  (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)
 #endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#define rwlock_os pthread_rwlock_t
+#define rwlock_destroy_os(l) pthread_rwlock_destroy(l)
+#define rwlock_rdlock_os(l) pthread_rwlock_rdlock(l)
+#define rwlock_rdunlock_os(l) pthread_rwlock_unlock(l)
+#define rwlock_wrlock_os(l) pthread_rwlock_wrlock(l)
+#define rwlock_wrunlock_os(l) pthread_rwlock_unlock(l)
+#define mutex_os pthread_mutex_t
+#define mutex_init_os(m) pthread_mutex_init(m, NULL)
+#define mutex_destroy_os(m) pthread_mutex_destroy(m)
+#define mutex_lock_os(m) pthread_mutex_lock(m)
+#define mutex_unlock_os(m) pthread_mutex_unlock(m)
+#define thread_os pthread_t
+#define thread_create_os(t,f,a) pthread_create((t), NULL, (f), (a))
+#define thread_join_os(t) pthread_join((t), NULL)
+#endif
+
+#if defined(_MSC_VER)
+#define thread_local_os __declspec(thread)
+#define atomic_add_os(p,v) InterlockedExchangeAdd64((volatile LONG64 *)(p), (LONG64)(v))
+#define atomic_load_os(p) ((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(p), 0, 0))
+#define atomic_cas_os(p,e,d) (InterlockedCompareExchange64((volatile LONG64 *)(p), (LONG64)(d), (LONG64)(e)) == (LONG64)(e))
+#else
+#define thread_local_os __thread
+#define atomic_add_os(p,v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define atomic_load_os(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define atomic_cas_os(p,e,d) __atomic_compare_exchange_n((p), &(e), (d), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#endif
 // }}}
 
 #if defined(_WIN32) || defined(_WIN64)
@@ -54,315 +122,5992 @@ extern "C" {
 #include <windows.h>
 #include <io.h>
 #include <BaseTsd.h>
+struct iovec {
+  void   *iov_base;
+  size_t  iov_len;
+};
+
+// Positional IO, leaving the shared file offset alone
+ssize_t pread_os(int fd, void *data, size_t len, uint64_t off) {
+  OVERLAPPED ov = {0};
+  DWORD      n  = 0;
+  ov.Offset     = (DWORD)(off & 0xFFFFFFFF);
+  ov.OffsetHigh = (DWORD)(off >> 32);
+  if (!ReadFile((HANDLE)_get_osfhandle(fd), data, (DWORD)len, &n, &ov)) return -1;
+  return n;
+}
+ssize_t pwrite_os(int fd, const void *data, size_t len, uint64_t off) {
+  OVERLAPPED ov = {0};
+  DWORD      n  = 0;
+  ov.Offset     = (DWORD)(off & 0xFFFFFFFF);
+  ov.OffsetHigh = (DWORD)(off >> 32);
+  if (!WriteFile((HANDLE)_get_osfhandle(fd), data, (DWORD)len, &n, &ov)) return -1;
+  return n;
+}
+
+void rwlock_init_os(SRWLOCK *lock) {
+  InitializeSRWLock(lock);
+}
+
+// Replaces the target, like rename does elsewhere
+int rename_os(const char *from, const char *to) {
+  return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ? 0 : -1;
+}
+
+// Renames are journaled by the filesystem
+int sync_dir_os(const char *path) {
+  return 0;
+}
+
+uint64_t now_ns_os() {
+  LARGE_INTEGER now, freq;
+  QueryPerformanceCounter(&now);
+  QueryPerformanceFrequency(&freq);
+  return (uint64_t)((now.QuadPart / freq.QuadPart) * 1000000000) + (uint64_t)(((now.QuadPart % freq.QuadPart) * 1000000000) / freq.QuadPart);
+}
+
+size_t cpu_count_os() {
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors;
+}
 #else
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
+
+// Writers are preferred, so a steady stream of readers can't starve them
+void rwlock_init_os(pthread_rwlock_t *lock) {
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+#if defined(__GLIBC__)
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+  pthread_rwlock_init(lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+}
+
+// Persist the directory entry of a (re)named file
+int sync_dir_os(const char *path) {
+  char *dir   = strdup(path);
+  char *slash = strrchr(dir, '/');
+  int   fd, result;
+  if (slash == dir) slash[1] = '\0';
+  else if (slash) slash[0] = '\0';
+  fd = open_os(slash ? dir : ".", O_RDONLY);
+  free(dir);
+  if (fd < 0) return -1;
+  result = fsync_os(fd);
+  close_os(fd);
+  return result;
+}
+
+uint64_t now_ns_os() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+size_t cpu_count_os() {
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (size_t)count : 1;
+}
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
 #endif
 
+// Mappings reserve room for the medium to grow in steps of this size
+#define QE_MAP_STEP       (16 * 1024 * 1024)
+
+// Batched writes coalesce allocations this close together, up to a span
+#define QE_COALESCE_GAP   64
+#define QE_COALESCE_SPAN  (1024 * 1024)
+
+// Records up to this size are read & decompressed into scratch on the stack
+#define QE_SCRATCH        4096
+
+// Index entries come from pages of this size, owned by their index
+#define QE_SLAB_PAGE      4096
+
+struct qe_slab_page {
+  struct qe_slab_page *next;
+};
+
+struct qe_slab {
+  size_t               size;
+  size_t               per_page;
+  size_t               used;
+  struct qe_slab_page *pages;
+  void                *free;
+};
+
+struct qe_arena {
+  char   *data;
+  char   *heap;
+  size_t  used;
+};
+
 struct qe_index {
   void            *next;
   char            *name;
   void            *udata;
   struct mindex_t *mindex;
   int (*cmp)(const void *a, const void *b, void *udata_qe, void *udata_idx);
+  struct buf * (*key)(const void *entry, void *udata_qe, void *udata_idx);
+  uint64_t (*hash)(const void *entry, void *udata_qe, void *udata_idx);
+  int (*eq)(const void *a, const void *b, void *udata_qe, void *udata_idx);
+  struct qe_hash  *table;
+  struct qe_bloom *bloom;
+  PALLOC_OFFSET    persisted;
+  struct qe_stats *stats;
+  struct qe_slab   slab;
+  int              key_type;
+  size_t           key_offset;
+  size_t           key_length;
   const struct query_engine_t *qe;
 };
 
 struct qe_index_entry {
   PALLOC_OFFSET ptr;
-  const void *hydrated;
+  PALLOC_SIZE   size;
+  const void   *hydrated;
+  struct buf   *key;
 };
 
-// Read from medium, cmp, free deserialized entries
-int cmp_internal(const void *a, const void *b, void *idx) {
-  struct qe_index       *index   = (struct qe_index *)idx;
-  struct qe_index_entry *entry_a = (struct qe_index_entry *)a;
-  struct qe_index_entry *entry_b = (struct qe_index_entry *)b;
-  struct buf *buf_a              = NULL;
-  struct buf *buf_b              = NULL;
+// Where compaction continues, if it's halfway a pass
+struct qe_compact {
+  PALLOC_OFFSET next;
+  int           active;
+};
 
-  int result = 0;
+// Persisted indexes listed on the medium & how its records are stored
+// Records are only known to be padded on media created padding them
+#define QE_CATALOG_CLEAN    1
+#define QE_CATALOG_PADDED   2
+#define QE_CATALOG_MAX      64
 
-  void *hydrated_a = (void *)entry_a->hydrated;
-  void *hydrated_b = (void *)entry_b->hydrated;
+struct qe_catalog {
+  PALLOC_OFFSET ptr;
+  uint32_t      flags;
+  uint64_t      generation;
+  uint32_t      count;
+  PALLOC_OFFSET blob[QE_CATALOG_MAX];
+  char         *name[QE_CATALOG_MAX];
+};
 
-  // Hydrate if needed
-  if (!(entry_a->hydrated)) {
-    buf_a       = calloc(1, sizeof(struct buf));
-    buf_a->cap  = palloc_size(index->qe->fd, entry_a->ptr);
-    buf_a->len  = buf_a->cap;
-    buf_a->data = malloc(buf_a->cap);
-    seek_os(index->qe->fd, entry_a->ptr, SEEK_SET);
-    if (read_os(index->qe->fd, buf_a->data, buf_a->len) != buf_a->len) {
-      buf_clear(buf_a);
-      free(buf_a);
-      return 0;
-    }
-    hydrated_a = index->qe->deserialize(buf_a, index->qe->udata);
-  }
+// Allocations released while snapshots are being copied, freed once they're done
+struct qe_snapshot {
+  mutex_os       lock;
+  size_t         refs;
+  PALLOC_OFFSET *held;
+  size_t         nheld;
+  size_t         maxheld;
+  int            sorted;
+};
 
-  if (!(entry_b->hydrated)) {
-    buf_b       = calloc(1, sizeof(struct buf));
-    buf_b->cap  = palloc_size(index->qe->fd, entry_b->ptr);
-    buf_b->len  = buf_b->cap;
-    buf_b->data = malloc(buf_b->cap);
-    seek_os(index->qe->fd, entry_b->ptr, SEEK_SET);
-    if (read_os(index->qe->fd, buf_b->data, buf_b->len) != buf_b->len) {
-      if (!(entry_a->hydrated)) {
-        buf_clear(buf_a);
-        free(buf_a);
-      }
-      buf_clear(buf_b);
-      free(buf_b);
-      return 0;
-    }
-    hydrated_b = index->qe->deserialize(buf_b, index->qe->udata);
-  }
+// Integers on the medium are little-endian
+void enc_u32_internal(char *dst, uint32_t value) {
+  for(int i=0; i<4; i++) dst[i] = (char)((value >> (i*8)) & 0xFF);
+}
+void enc_u64_internal(char *dst, uint64_t value) {
+  for(int i=0; i<8; i++) dst[i] = (char)((value >> (i*8)) & 0xFF);
+}
+uint32_t dec_u32_internal(const char *src) {
+  uint32_t value = 0;
+  for(int i=0; i<4; i++) value |= ((uint32_t)(unsigned char)src[i]) << (i*8);
+  return value;
+}
+uint64_t dec_u64_internal(const char *src) {
+  uint64_t value = 0;
+  for(int i=0; i<8; i++) value |= ((uint64_t)(unsigned char)src[i]) << (i*8);
+  return value;
+}
 
-  // Run the actual comparison
-  result = index->cmp(hydrated_a, hydrated_b, index->qe->udata, index->udata);
+// Record compression {{{
+//
+// With QUERY_ENGINE_COMPRESS, serialized records are compressed before being
+// stored, using a small LZ77 codec in the block format of LZ4: a token holding
+// the literal & match lengths, the literals, a 16-bit match offset and any
+// length extensions. Compressed records start with a header, so they coexist
+// with plain ones in the same medium:
+//
+//   magic (4) | raw length (4) | packed length (4) | dictionary (4) | checksum (4)
+//
+// Records that don't shrink are stored as-is, and anything without a valid
+// header & checksum is handed to deserialize unchanged. A dictionary primes
+// the window the codec matches against, so small records can refer to common
+// content they don't contain themselves.
 
-  // Don't hog memory
-  if (!(entry_a->hydrated)) {
-    buf_clear(buf_a);
-    free(buf_a);
-    index->qe->purge(hydrated_a, index->qe->udata);
-  }
-  if (!(entry_b->hydrated)) {
-    buf_clear(buf_b);
-    free(buf_b);
-    index->qe->purge(hydrated_b, index->qe->udata);
+#define QE_CODEC_MAGIC      "\xC7QZ\x01"
+#define QE_CODEC_HEADER     20
+#define QE_CODEC_MIN        32
+#define QE_CODEC_MIN_MATCH  4
+#define QE_CODEC_MAX_OFFSET 65535
+#define QE_CODEC_HASH_BITS  12
+#define QE_CODEC_DICT_MAX   QE_CODEC_MAX_OFFSET
+#define QE_CODEC_SEGMENT    32
+#define QE_CODEC_GRAM_BITS  16
+
+struct qe_codec {
+  int        compress;
+  uint32_t   id;
+  struct buf dict;
+};
+
+struct qe_codec_segment {
+  const char *data;
+  size_t      len;
+  uint64_t    score;
+};
+
+uint32_t codec_hash_internal(const char *data, int bits) {
+  return (uint32_t)(dec_u32_internal(data) * 2654435761U) >> (32 - bits);
+}
+
+// Cheap checksum of the raw contents, catching plain records that happen to look compressed
+uint32_t codec_sum_internal(const char *data, size_t len) {
+  uint64_t sum = 0x9E3779B97F4A7C15ULL ^ len;
+  for( ; len >= 8 ; data += 8, len -= 8 ) {
+    sum  = (sum ^ dec_u64_internal(data)) * 0xFF51AFD7ED558CCDULL;
+    sum ^= sum >> 32;
   }
+  while(len--) sum = (sum ^ (unsigned char)*(data++)) * 0x100000001B3ULL;
+  sum ^= sum >> 29;
+  return (uint32_t)(sum ^ (sum >> 32));
+}
 
-  // Return what the comparison said
-  return result;
+// Worst-case packed length of `len` bytes
+size_t codec_bound_internal(size_t len) {
+  return len + (len / 255) + 16;
 }
 
-// Remove an entry from the in-memory index & persist
-void purge_internal(void *sub, void *idx) {
-  struct qe_index *index = (struct qe_index *)idx;
-  struct qe_index_entry *subject = (struct qe_index_entry *)sub;
+// Lengths of 15 and up continue in extra bytes
+char * codec_length_internal(char *out, size_t len) {
+  for( ; len >= 255 ; len -= 255 ) *(out++) = (char)255;
+  *(out++) = (char)len;
+  return out;
+}
 
-  if (subject->hydrated) {
-    // This is a search pattern, do not free
-  } else {
-    pfree(index->qe->fd, subject->ptr);
-    free(subject);
+char * codec_sequence_internal(char *out, const char *literals, size_t nliterals, size_t offset, size_t match) {
+  char *token = out++;
+  *token = (char)((nliterals < 15 ? nliterals : 15) << 4);
+  if (nliterals >= 15) out = codec_length_internal(out, nliterals - 15);
+  memcpy(out, literals, nliterals);
+  out += nliterals;
+  if (!match) return out;
+  *(out++) = (char)(offset & 0xFF);
+  *(out++) = (char)(offset >> 8);
+  match  -= QE_CODEC_MIN_MATCH;
+  *token |= (char)(match < 15 ? match : 15);
+  if (match >= 15) out = codec_length_internal(out, match - 15);
+  return out;
+}
+
+// Packs `len` bytes of `window`, starting at `start`, matching against everything before it
+// `dst` must hold codec_bound_internal bytes, returns the packed length
+size_t codec_pack_internal(const char *window, size_t start, size_t len, char *dst) {
+  uint32_t table[1 << QE_CODEC_HASH_BITS];
+  size_t   end    = start + len;
+  size_t   pos    = start > QE_CODEC_MAX_OFFSET ? start - QE_CODEC_MAX_OFFSET : 0;
+  size_t   anchor = start;
+  size_t   ref, match;
+  uint32_t h;
+  char    *out    = dst;
+  memset(table, 0, sizeof(table));
+
+  // Anything before the start is only matched against
+  for( ; pos + QE_CODEC_MIN_MATCH <= start ; pos++ ) {
+    table[codec_hash_internal(window + pos, QE_CODEC_HASH_BITS)] = (uint32_t)(pos + 1);
   }
 
-  // Done
+  for( pos = start ; pos + QE_CODEC_MIN_MATCH <= end ; ) {
+    h        = codec_hash_internal(window + pos, QE_CODEC_HASH_BITS);
+    ref      = table[h];
+    table[h] = (uint32_t)(pos + 1);
+    if (!ref || (pos - (ref - 1) > QE_CODEC_MAX_OFFSET) || memcmp(window + ref - 1, window + pos, QE_CODEC_MIN_MATCH)) {
+      pos++;
+      continue;
+    }
+    ref--;
+    for( match = QE_CODEC_MIN_MATCH ; (pos + match < end) && (window[ref + match] == window[pos + match]) ; match++ );
+    out    = codec_sequence_internal(out, window + anchor, pos - anchor, pos - ref, match);
+    pos   += match;
+    anchor = pos;
+  }
+
+  // The last sequence holds only literals
+  out = codec_sequence_internal(out, window + anchor, end - anchor, 0, 0);
+  return (size_t)(out - dst);
 }
 
-struct query_engine_t * qe_init(const char *filename, struct buf * (*serialize)(const void *, void *), void * (*deserialize)(const struct buf *, void*), void (*purge)(void*, void*), void *udata, PALLOC_FLAGS flags) {
-  struct query_engine_t *instance = calloc(1, sizeof(struct query_engine_t));
+// Reads a length extension, SIZE_MAX on malformed input
+size_t codec_extend_internal(const char *src, size_t len, size_t *ip, size_t value) {
+  unsigned char byte;
+  do {
+    if (*ip >= len) return SIZE_MAX;
+    byte   = (unsigned char)src[(*ip)++];
+    value += byte;
+  } while(byte == 255);
+  return value;
+}
 
-  // Build our response
-  instance->fd          = palloc_open(filename, flags);
-  instance->serialize   = serialize;
-  instance->deserialize = deserialize;
-  instance->purge       = purge;
-  instance->index       = NULL;
-  instance->udata       = udata;
+// Unpacks exactly `rawlen` bytes into `dst`, matches before it coming from the dictionary
+int codec_unpack_internal(const char *src, size_t len, const char *dict, size_t dictlen, char *dst, size_t rawlen) {
+  size_t        ip = 0, op = 0;
+  size_t        nliterals, match, offset, n;
+  unsigned char token;
+  while(ip < len) {
+    token     = (unsigned char)src[ip++];
+    nliterals = token >> 4;
+    if (nliterals == 15) nliterals = codec_extend_internal(src, len, &ip, nliterals);
+    if ((nliterals > len - ip) || (nliterals > rawlen - op)) return -1;
+    memcpy(dst + op, src + ip, nliterals);
+    op += nliterals;
+    ip += nliterals;
+    if (ip == len) break;
 
-  // (Re)-initialize the medium
-  palloc_init(instance->fd, flags);
+    if (len - ip < 2) return -1;
+    offset = (unsigned char)src[ip] | ((size_t)(unsigned char)src[ip + 1] << 8);
+    ip    += 2;
+    match  = token & 15;
+    if (match == 15) match = codec_extend_internal(src, len, &ip, match);
+    if (match == SIZE_MAX) return -1;
+    match += QE_CODEC_MIN_MATCH;
+    if (!offset || (offset > op + dictlen) || (match > rawlen - op)) return -1;
 
-  // Aanndd.. done
-  return instance;
+    // Matches may start in the dictionary & continue into the output
+    if (offset > op) {
+      n = offset - op < match ? offset - op : match;
+      memcpy(dst + op, dict + dictlen - (offset - op), n);
+      op    += n;
+      match -= n;
+    }
+    if (offset >= match) {
+      memcpy(dst + op, dst + op - offset, match);
+      op += match;
+    } else {
+      for( ; match ; match--, op++ ) dst[op] = dst[op - offset];
+    }
+  }
+  return op == rawlen ? 0 : -1;
 }
 
-QUERY_ENGINE_RETURN_CODE qe_close(struct query_engine_t *instance) {
-  if (!instance) return QUERY_ENGINE_RETURN_OK;
+// Compressed copy of a serialized record, or the record itself if that doesn't pay off
+// Takes ownership of the given buffer
+struct buf * codec_encode_internal(const struct query_engine_t *instance, struct buf *raw) {
+  struct qe_codec *codec = instance->codec;
+  struct buf      *packed;
+  char            *window;
+  size_t           len;
+  if (!codec || !codec->compress || (raw->len < QE_CODEC_MIN)) return raw;
 
-  palloc_close(instance->fd);
-  free(instance);
+  // The dictionary goes right in front of the record
+  window = raw->data;
+  if (codec->dict.len) {
+    window = malloc(codec->dict.len + raw->len);
+    memcpy(window, codec->dict.data, codec->dict.len);
+    memcpy(window + codec->dict.len, raw->data, raw->len);
+  }
+  packed       = calloc(1, sizeof(struct buf));
+  packed->cap  = QE_CODEC_HEADER + codec_bound_internal(raw->len);
+  packed->data = malloc(packed->cap);
+  len          = codec_pack_internal(window, codec->dict.len, raw->len, packed->data + QE_CODEC_HEADER);
+  if (window != raw->data) free(window);
+  if (QE_CODEC_HEADER + len >= raw->len) {
+    buf_clear(packed);
+    free(packed);
+    return raw;
+  }
 
-  return QUERY_ENGINE_RETURN_OK;
+  memcpy(packed->data, QE_CODEC_MAGIC, 4);
+  enc_u32_internal(packed->data +  4, (uint32_t)raw->len);
+  enc_u32_internal(packed->data +  8, (uint32_t)len);
+  enc_u32_internal(packed->data + 12, codec->id);
+  enc_u32_internal(packed->data + 16, codec_sum_internal(raw->data, raw->len));
+  packed->len = QE_CODEC_HEADER + len;
+  buf_clear(raw);
+  free(raw);
+  return packed;
 }
 
-QUERY_ENGINE_RETURN_CODE qe_index_add(
-  struct query_engine_t *instance,
-  const char *name,
-  int (*cmp)(const void *a, const void *b, void *udata_qe, void *udata_index),
-  void *udata
-) {
+// Unpacks a stored record into `decoded`, using QE_SCRATCH bytes of scratch if it fits
+// The caller frees the decoded data if it's not the scratch
+// Returns 0 for plain records, 1 when decoded, -1 when the dictionary isn't known
+int codec_decode_internal(const struct query_engine_t *instance, const struct buf *raw, struct buf *decoded, char *scratch) {
+  struct qe_codec *codec = instance->codec;
+  const char      *dict  = NULL;
+  size_t           dictlen = 0;
+  uint32_t         rawlen, len, id;
+  if ((raw->len < QE_CODEC_HEADER) || memcmp(raw->data, QE_CODEC_MAGIC, 4)) return 0;
+  rawlen = dec_u32_internal(raw->data +  4);
+  len    = dec_u32_internal(raw->data +  8);
+  id     = dec_u32_internal(raw->data + 12);
+  if (len > raw->len - QE_CODEC_HEADER) return 0;
+  if (id) {
+    if (!codec || (codec->id != id)) return -1;
+    dict    = codec->dict.data;
+    dictlen = codec->dict.len;
+  }
 
-  // Find if the index already exists
-  struct qe_index *idx = instance->index;
-  while(idx) {
-    if (strcmp(idx->name,name) == 0) break;
-    idx = idx->next;
+  decoded->data = rawlen <= QE_SCRATCH ? scratch : malloc(rawlen);
+  decoded->len  = rawlen;
+  decoded->cap  = rawlen;
+  if (
+    codec_unpack_internal(raw->data + QE_CODEC_HEADER, len, dict, dictlen, decoded->data, rawlen) ||
+    (codec_sum_internal(decoded->data, rawlen) != dec_u32_internal(raw->data + 16))
+  ) {
+    if (decoded->data != scratch) free(decoded->data);
+    return 0;
   }
-  if (idx) {
-    /* fprintf(stderr,"Duplicate index '%s'", name); */
-    return QUERY_ENGINE_RETURN_ERR;
+  return 1;
+}
+
+int codec_segment_cmp_internal(const void *a, const void *b) {
+  const struct qe_codec_segment *segment_a = a;
+  const struct qe_codec_segment *segment_b = b;
+  if (segment_a->score > segment_b->score) return -1;
+  if (segment_a->score < segment_b->score) return  1;
+  return 0;
+}
+
+uint64_t codec_score_internal(const uint32_t *counts, const char *data, size_t len) {
+  uint64_t score = 0;
+  for(size_t i = 0; i + QE_CODEC_MIN_MATCH <= len; i++) {
+    score += counts[codec_hash_internal(data + i, QE_CODEC_GRAM_BITS)];
   }
+  return score;
+}
 
-  // Initialize the index & register id
-  idx = calloc(1, sizeof(struct qe_index));
-  idx->next       = instance->index;
-  idx->name       = strdup(name);
-  idx->udata      = udata;
-  idx->cmp        = cmp;
-  idx->qe         = instance;
-  idx->mindex = mindex_init(cmp_internal, purge_internal, idx);
-  if (!idx->mindex) {
-    free(idx->name);
-    free(idx);
-    return QUERY_ENGINE_RETURN_ERR;
+// Picks the segments of the samples whose content is shared by most samples
+// The best ones end up last, closest to the records & cheapest to refer to
+struct buf * codec_train_internal(struct buf **samples, size_t n, size_t size) {
+  uint32_t                *counts   = calloc(1 << QE_CODEC_GRAM_BITS, sizeof(uint32_t));
+  uint32_t                *seen     = calloc(1 << QE_CODEC_GRAM_BITS, sizeof(uint32_t));
+  struct qe_codec_segment *segments = NULL;
+  struct qe_codec_segment *segment;
+  struct buf              *dict     = calloc(1, sizeof(struct buf));
+  size_t                   nsegments = 0, max = 0, used = 0;
+  size_t                   i, j;
+  uint32_t                 h;
+  if (size > QE_CODEC_DICT_MAX) size = QE_CODEC_DICT_MAX;
+
+  // Count in how many samples every gram occurs
+  for( i = 0 ; i < n ; i++ ) {
+    for( j = 0 ; j + QE_CODEC_MIN_MATCH <= samples[i]->len ; j++ ) {
+      h = codec_hash_internal(samples[i]->data + j, QE_CODEC_GRAM_BITS);
+      if (seen[h] == i + 1) continue;
+      seen[h] = (uint32_t)(i + 1);
+      counts[h]++;
+    }
   }
 
-  // Scan entries and add to the index
-  PALLOC_OFFSET entry = 0;
-  struct qe_index_entry *idx_entry;
-  while(1) {
-    entry = palloc_next(instance->fd, entry);
-    if (!entry) break;
-    idx_entry      = calloc(1, sizeof(struct qe_index_entry));
-    idx_entry->ptr = entry;
-    mindex_set(idx->mindex, idx_entry);
+  for( i = 0 ; i < n ; i++ ) {
+    for( j = 0 ; j < samples[i]->len ; j += QE_CODEC_SEGMENT ) {
+      if (nsegments == max) {
+        max      = max ? max * 2 : 64;
+        segments = realloc(segments, max * sizeof(struct qe_codec_segment));
+      }
+      segment        = &(segments[nsegments++]);
+      segment->data  = samples[i]->data + j;
+      segment->len   = samples[i]->len - j < QE_CODEC_SEGMENT ? samples[i]->len - j : QE_CODEC_SEGMENT;
+      segment->score = codec_score_internal(counts, segment->data, segment->len);
+    }
   }
+  qsort(segments, nsegments, sizeof(struct qe_codec_segment), codec_segment_cmp_internal);
 
-  instance->index = idx;
-  return QUERY_ENGINE_RETURN_OK;
+  // Content already in the dictionary doesn't count again
+  dict->cap  = size;
+  dict->data = malloc(size ? size : 1);
+  for( i = 0 ; (i < nsegments) && (used < size) ; i++ ) {
+    segment = &(segments[i]);
+    if (segment->score < 2 * segment->len) break;
+    if (codec_score_internal(counts, segment->data, segment->len) * 2 < segment->score) continue;
+    for( j = 0 ; j + QE_CODEC_MIN_MATCH <= segment->len ; j++ ) {
+      counts[codec_hash_internal(segment->data + j, QE_CODEC_GRAM_BITS)] = 0;
+    }
+    j     = segment->len < size - used ? segment->len : size - used;
+    used += j;
+    memcpy(dict->data + size - used, segment->data, j);
+  }
+  memmove(dict->data, dict->data + size - used, used);
+  dict->len = used;
+
+  free(segments);
+  free(counts);
+  free(seen);
+  return dict;
 }
 
-QUERY_ENGINE_RETURN_CODE qe_index_del(struct query_engine_t *instance, const char *name) {
-  // Find if the index even exists
-  struct qe_index *idx_prev = NULL;
-  struct qe_index *idx      = instance->index;
-  while(idx) {
-    if (strcmp(idx->name,name) == 0) break;
-    idx_prev = idx;
-    idx      = idx->next;
-  }
-  if (!idx) {
-    return QUERY_ENGINE_RETURN_OK;
+void codec_free_internal(struct query_engine_t *instance) {
+  struct qe_codec *codec = instance->codec;
+  if (!codec) return;
+  buf_clear(&(codec->dict));
+  free(codec);
+  instance->codec = NULL;
+}
+
+// }}}
+
+// Statistics {{{
+//
+// With QUERY_ENGINE_STATS, counters are kept in a struct qe_stats per engine
+// & per index, updated with relaxed atomics as readers run concurrently.
+// Latencies go into log-linear buckets, 8 per power of 2, so percentiles are
+// within 12.5% whatever the range. Bytes per operation come from per-thread
+// totals, sampled when the operation starts & ends.
+
+static thread_local_os uint64_t qe_stats_thread_read    = 0;
+static thread_local_os uint64_t qe_stats_thread_written = 0;
+
+struct qe_stats_span {
+  uint64_t start;
+  uint64_t read;
+  uint64_t written;
+};
+
+void stats_max_internal(uint64_t *value, uint64_t candidate) {
+  uint64_t current = atomic_load_os(value);
+  while(current < candidate) {
+    if (atomic_cas_os(value, current, candidate)) break;
+    current = atomic_load_os(value);
   }
+}
 
-  // Remove the index from the list
-  if (idx_prev) {
-    idx_prev->next = idx->next;
-  } else {
-    instance->index = idx->next;
+size_t stats_bucket_internal(uint64_t value) {
+  int msb = 0;
+  if (value < 8) return (size_t)value;
+  for(int step = 32; step; step >>= 1) {
+    if (value >> (msb + step)) msb += step;
   }
+  return ((size_t)(msb - 2) * 8) + (size_t)((value >> (msb - 3)) & 7);
+}
 
-  // Prevents the purge from removing data from medium
-  idx->mindex->purge = NULL;
+void stats_cmp_internal(const struct qe_index *index) {
+  struct qe_stats *stats = index->qe->stats;
+  if (!stats) return;
+  atomic_add_os(&(stats->cmps), 1);
+  if (index->stats) atomic_add_os(&(index->stats->cmps), 1);
+}
 
-  // And free the index's memory
-  mindex_free(idx->mindex);
-  free(idx->name);
-  free(idx);
+void stats_hydration_internal(const struct query_engine_t *instance) {
+  struct qe_stats *stats = instance->stats;
+  if (!stats) return;
+  atomic_add_os(&(stats->hydrations), 1);
+}
 
-  // Done
-  return QUERY_ENGINE_RETURN_OK;
+void stats_read_internal(const struct query_engine_t *instance, uint64_t bytes) {
+  struct qe_stats *stats = instance->stats;
+  if (!stats) return;
+  atomic_add_os(&(stats->bytes_read), bytes);
+  qe_stats_thread_read += bytes;
 }
 
-QUERY_ENGINE_RETURN_CODE qe_set(struct query_engine_t *instance, const void *entry) {
-  if (!(instance->index)) {
-    return QUERY_ENGINE_RETURN_ERR;
+void stats_written_internal(const struct query_engine_t *instance, uint64_t bytes) {
+  struct qe_stats *stats = instance->stats;
+  if (!stats) return;
+  atomic_add_os(&(stats->bytes_written), bytes);
+  qe_stats_thread_written += bytes;
+}
+
+void * deserialize_internal(const struct query_engine_t *instance, const struct buf *raw) {
+  struct qe_stats *stats = instance->stats;
+  struct buf       decoded;
+  void            *record;
+  char             scratch[QE_SCRATCH];
+  if (stats) atomic_add_os(&(stats->deserializes), 1);
+  switch(codec_decode_internal(instance, raw, &decoded, scratch)) {
+    case 0:
+      return instance->deserialize(raw, instance->udata);
+    case 1:
+      record = instance->deserialize(&decoded, instance->udata);
+      if (decoded.data != scratch) free(decoded.data);
+      return record;
+    default:
+      return NULL;
   }
+}
 
-  // Turn into something we can write to disk
-  struct buf *serialized = instance->serialize(entry, instance->udata);
-  if (!serialized) {
-    return QUERY_ENGINE_RETURN_ERR;
+void purge_record_internal(const struct query_engine_t *instance, void *record) {
+  struct qe_stats *stats = instance->stats;
+  if (stats) atomic_add_os(&(stats->purges), 1);
+  instance->purge(record, instance->udata);
+}
+
+void stats_begin_internal(const struct query_engine_t *instance, struct qe_stats_span *span) {
+  if (!instance->stats) return;
+  span->read    = qe_stats_thread_read;
+  span->written = qe_stats_thread_written;
+  span->start   = now_ns_os();
+}
+
+void stats_op_internal(struct qe_stats *stats, int op, const struct qe_stats_span *span, uint64_t elapsed) {
+  struct qe_op_stats *op_stats = &(stats->op[op]);
+  atomic_add_os(&(op_stats->calls), 1);
+  atomic_add_os(&(op_stats->bytes_read), qe_stats_thread_read - span->read);
+  atomic_add_os(&(op_stats->bytes_written), qe_stats_thread_written - span->written);
+  atomic_add_os(&(op_stats->latency.count), 1);
+  atomic_add_os(&(op_stats->latency.total), elapsed);
+  atomic_add_os(&(op_stats->latency.bucket[stats_bucket_internal(elapsed)]), 1);
+  stats_max_internal(&(op_stats->latency.max), elapsed);
+}
+
+// Record an operation for the engine & the index it ran on, if any
+void stats_end_internal(const struct query_engine_t *instance, int op, const struct qe_stats *index_stats, const struct qe_stats_span *span) {
+  uint64_t elapsed;
+  if (!instance->stats) return;
+  elapsed = now_ns_os() - span->start;
+  stats_op_internal(instance->stats, op, span, elapsed);
+  if (index_stats) stats_op_internal((struct qe_stats *)index_stats, op, span, elapsed);
+}
+
+// Counters of a named index, if any
+struct qe_stats * index_stats_internal(const struct query_engine_t *instance, const char *name) {
+  struct qe_index *idx;
+  if (!instance->stats) return NULL;
+  for( idx = instance->index ; idx ; idx = idx->next ) {
+    if (strcmp(idx->name, name) == 0) return idx->stats;
   }
+  return NULL;
+}
 
-  // Reserve persistent allocation
-  PALLOC_OFFSET off = palloc(instance->fd, serialized->len);
-  if (!off) {
-    buf_clear(serialized);
-    free(serialized);
-    return QUERY_ENGINE_RETURN_ERR;
+// Upper bound of the bucket holding the given percentile
+uint64_t qe_histogram_percentile(const struct qe_histogram *histogram, double percentile) {
+  uint64_t target = (uint64_t)((percentile / 100.0) * (double)histogram->count);
+  uint64_t seen   = 0;
+  uint64_t upper;
+  size_t   i;
+  if (!histogram->count) return 0;
+  if (target < 1) target = 1;
+  if (target > histogram->count) target = histogram->count;
+  for( i = 0 ; i < QUERY_ENGINE_HISTOGRAM_BUCKETS ; i++ ) {
+    seen += histogram->bucket[i];
+    if (seen >= target) break;
+  }
+  if (i < 8) {
+    upper = i;
+  } else {
+    upper = ((((uint64_t)(8 + (i % 8))) + 1) << ((i / 8) - 1)) - 1;
   }
+  return upper < histogram->max ? upper : histogram->max;
+}
 
-  // Actually write to persistent storage
-  seek_os(instance->fd, off, SEEK_SET);
-  if (write_os(instance->fd, serialized->data, serialized->len) != serialized->len) {
-    // TODO: handle gracefully
-    buf_clear(serialized);
-    free(serialized);
-    return QUERY_ENGINE_RETURN_ERR;
+// Copy counters, which may be changing while we do
+void stats_copy_internal(struct qe_stats *dst, const struct qe_stats *src) {
+  const uint64_t *from = (const uint64_t *)src;
+  uint64_t       *to   = (uint64_t *)dst;
+  for(size_t i=0; i<sizeof(struct qe_stats)/8; i++) {
+    to[i] = atomic_load_os((uint64_t *)(from + i));
   }
+}
 
-  // We no longer need the serialized data
-  buf_clear(serialized);
-  free(serialized);
+// }}}
 
+// Read the first len bytes of an allocation into the given memory
+QUERY_ENGINE_RETURN_CODE read_into_internal(const struct query_engine_t *instance, PALLOC_OFFSET ptr, size_t len, char *dst) {
+  ssize_t n;
+  size_t  done = 0;
+  while(done < len) {
+    n = pread_os(instance->fd, dst + done, len - done, ptr + done);
+    if (n <= 0) return QUERY_ENGINE_RETURN_ERR;
+    done += n;
+  }
+  stats_read_internal(instance, len);
+  return QUERY_ENGINE_RETURN_OK;
+}
 
-  // Add to all indexes
-  // (auto-purges if duplicate found)
-  struct qe_index_entry *index_entry = calloc(1, sizeof(struct qe_index_entry));
-  index_entry->ptr                   = off;
-  struct qe_index *idx = instance->index;
-  while(idx) {
-    mindex_set(idx->mindex, index_entry);
-    idx = idx->next;
+// Read the first len bytes of an allocation from the medium
+struct buf * read_range_internal(const struct query_engine_t *instance, PALLOC_OFFSET ptr, size_t len) {
+  struct buf *contents = calloc(1, sizeof(struct buf));
+  contents->cap        = len;
+  contents->data       = malloc(contents->cap ? contents->cap : 1);
+  if (read_into_internal(instance, ptr, len, contents->data)) {
+    // Borked
+    buf_clear(contents);
+    free(contents);
+    return NULL;
   }
+  contents->len = len;
+  return contents;
+}
 
-  return QUERY_ENGINE_RETURN_OK;
+// Read a full allocation from the medium
+struct buf * read_internal(const struct query_engine_t *instance, PALLOC_OFFSET ptr) {
+  return read_range_internal(instance, ptr, palloc_size(instance->fd, ptr));
 }
 
-QUERY_ENGINE_RETURN_CODE qe_del(struct query_engine_t *instance, const void *pattern) {
-  struct qe_index       *idx              = NULL;
-  struct qe_index_entry *pattern_internal = calloc(1, sizeof(struct qe_index_entry));
-  pattern_internal->hydrated              = pattern;
-  for( idx = instance->index ; idx ; idx = idx->next ) {
-    mindex_delete(idx->mindex, pattern_internal);
+// Write a buffer to the medium in full
+QUERY_ENGINE_RETURN_CODE write_internal(const struct query_engine_t *instance, PALLOC_OFFSET ptr, const char *data, size_t len) {
+  ssize_t n;
+  size_t  written = 0;
+  while(written < len) {
+    n = pwrite_os(instance->fd, data + written, len - written, ptr + written);
+    if (n <= 0) return QUERY_ENGINE_RETURN_ERR;
+    written += n;
   }
-  free(pattern_internal);
+  stats_written_internal(instance, len);
   return QUERY_ENGINE_RETURN_OK;
 }
 
-void * qe_get(struct query_engine_t *instance, const char *index, void *pattern) {
-  struct qe_index       *idx              = instance->index;
-  struct qe_index_entry *pattern_internal = calloc(1, sizeof(struct qe_index_entry));
-  pattern_internal->hydrated              = pattern;
-  while(idx) {
-    if (strcmp(idx->name, index) == 0) break;
-    idx = idx->next;
+// Release an allocation, compaction restarting if it was about to visit it
+// A snapshot may still have to copy it, so it's held on to until they're done
+void release_internal(struct query_engine_t *instance, PALLOC_OFFSET ptr) {
+  struct qe_compact  *compact  = instance->compact;
+  struct qe_snapshot *snapshot = instance->snapshot;
+  if (compact && compact->active && (compact->next == ptr)) compact->active = 0;
+  if (!snapshot) {
+    pfree(instance->fd, ptr);
+    return;
   }
-  if (!idx) {
-    // No such index
-    free(pattern_internal);
-    return NULL;
+  mutex_lock_os(&(snapshot->lock));
+  if (snapshot->nheld == snapshot->maxheld) {
+    snapshot->maxheld = snapshot->maxheld ? snapshot->maxheld * 2 : 64;
+    snapshot->held    = realloc(snapshot->held, snapshot->maxheld * sizeof(PALLOC_OFFSET));
   }
+  snapshot->held[snapshot->nheld++] = ptr;
+  snapshot->sorted                  = 0;
+  mutex_unlock_os(&(snapshot->lock));
+}
 
-  struct qe_index_entry *entry = mindex_get(idx->mindex, pattern_internal);
-  free(pattern_internal);
-  if (!entry) {
-    // Not found
-    return NULL;
+// Write a set of buffers to a contiguous region of the medium
+QUERY_ENGINE_RETURN_CODE writev_internal(const struct query_engine_t *instance, PALLOC_OFFSET ptr, struct iovec *iov, int iovcnt) {
+#if defined(_WIN32) || defined(_WIN64)
+  for(int i=0; i<iovcnt; i++) {
+    if (write_internal(instance, ptr, iov[i].iov_base, iov[i].iov_len)) return QUERY_ENGINE_RETURN_ERR;
+    ptr += iov[i].iov_len;
   }
-
-  // Fetch the contents from the medium
-  int n;
-  struct buf *contents = calloc(1, sizeof(struct buf));
-  contents->cap        = palloc_size(instance->fd, entry->ptr);
-  contents->data       = malloc(contents->cap);
-  while(contents->len < contents->cap) {
-    seek_os(instance->fd, entry->ptr + contents->len, SEEK_SET);
-    n = read_os(instance->fd, contents->data + contents->len, contents->cap - contents->len);
-    if (n <= 0) {
-      // Borked
-      buf_clear(contents);
-      free(contents);
-      return NULL;
+  return QUERY_ENGINE_RETURN_OK;
+#else
+  ssize_t n;
+  while(iovcnt > 0) {
+    n = pwritev_os(instance->fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt, ptr);
+    if (n <= 0) return QUERY_ENGINE_RETURN_ERR;
+    stats_written_internal(instance, n);
+    ptr += n;
+    while(iovcnt && (n >= (ssize_t)iov->iov_len)) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt) {
+      iov->iov_base  = (char *)iov->iov_base + n;
+      iov->iov_len  -= n;
     }
-    contents->len += n;
   }
+  return QUERY_ENGINE_RETURN_OK;
+#endif
+}
 
-  // Deserialize by the client
-  void *deserialized = instance->deserialize(contents, instance->udata);
+// Memory-mapped reads {{{
 
-  buf_clear(contents);
-  free(contents);
+struct qe_map {
+  char   *data;
+  size_t  size;
+};
+
+// Pointer to a range of the medium, if it's mapped
+const char * map_internal(const struct query_engine_t *instance, PALLOC_OFFSET ptr, size_t len) {
+  struct qe_map *map = instance->map;
+  if (!map) return NULL;
+  if (ptr + len > map->size) return NULL;
+  return map->data + ptr;
+}
+
+// Called by writers, (re)maps when the medium grew beyond the mapping
+// Readers never remap, they fall back to regular reads instead
+void map_sync_internal(struct query_engine_t *instance) {
+#if !defined(_WIN32) && !defined(_WIN64)
+  struct qe_map  *map = instance->map;
+  struct stat_os  st;
+  size_t          size;
+  if (!map) return;
 
-  return deserialized;
+  // Pages beyond the end become valid as the medium grows into them
+  if (fstat_os(instance->fd, &st)) return;
+  if ((size_t)st.st_size <= map->size) return;
+  size = (((size_t)st.st_size / QE_MAP_STEP) + 1) * QE_MAP_STEP;
+  if (map->data) munmap(map->data, map->size);
+  map->data = mmap(NULL, size, PROT_READ, MAP_SHARED, instance->fd, 0);
+  if (map->data == MAP_FAILED) {
+    map->data = NULL;
+    map->size = 0;
+    return;
+  }
+  map->size = size;
+#endif
 }
 
+void map_free_internal(struct query_engine_t *instance) {
+  struct qe_map *map = instance->map;
+  if (!map) return;
+#if !defined(_WIN32) && !defined(_WIN64)
+  if (map->data) munmap(map->data, map->size);
+#endif
+  free(map);
+  instance->map = NULL;
+}
+
+// }}}
+
+// Record cache {{{
+//
+// Bounded LRU of records keyed by their offset, holding the serialized bytes
+// and, once a comparison needed it, the deserialized record. Readers share
+// entries by reference count, so an entry evicted while in use is only freed
+// by its last user. Size is accounted by the serialized length.
+
+struct qe_cache_entry {
+  struct qe_cache_entry *next;
+  struct qe_cache_entry *lru_prev;
+  struct qe_cache_entry *lru_next;
+  PALLOC_OFFSET          ptr;
+  struct buf             raw;
+  void                  *record;
+  int                    refs;
+  int                    dead;
+};
+
+struct qe_cache {
+  mutex_os                lock;
+  struct qe_cache_entry **buckets;
+  size_t                  nbuckets;
+  size_t                  count;
+  struct qe_cache_entry  *head;
+  struct qe_cache_entry  *tail;
+  size_t                  used;
+  size_t                  max;
+  uint64_t                hits;
+  uint64_t                misses;
+};
+
+#define QE_CACHE_OVERHEAD  (sizeof(struct qe_cache_entry))
+
+// Fibonacci hashing, nbuckets being a power of 2
+size_t cache_bucket_internal(size_t nbuckets, PALLOC_OFFSET ptr) {
+  return (size_t)(((uint64_t)ptr * 0x9E3779B97F4A7C15ULL) >> 20) & (nbuckets - 1);
+}
+
+void cache_entry_free_internal(const struct query_engine_t *instance, struct qe_cache_entry *entry) {
+  if (entry->record) purge_record_internal(instance, entry->record);
+  buf_clear(&(entry->raw));
+  free(entry);
+}
+
+// Take an entry out of the hash & LRU, freeing it unless still in use
+// Call with the cache locked
+void cache_unlink_internal(const struct query_engine_t *instance, struct qe_cache_entry *entry) {
+  struct qe_cache        *cache = instance->cache;
+  struct qe_cache_entry **slot  = &(cache->buckets[cache_bucket_internal(cache->nbuckets, entry->ptr)]);
+  while(*slot && (*slot != entry)) slot = &((*slot)->next);
+  if (*slot) *slot = entry->next;
+  if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+  else cache->head = entry->lru_next;
+  if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+  else cache->tail = entry->lru_prev;
+  cache->used -= entry->raw.len + QE_CACHE_OVERHEAD;
+  cache->count--;
+  entry->dead = 1;
+  if (!entry->refs) cache_entry_free_internal(instance, entry);
+}
+
+// Referenced entry for the offset, NULL on a miss
+struct qe_cache_entry * cache_get_internal(const struct query_engine_t *instance, PALLOC_OFFSET ptr) {
+  struct qe_cache       *cache = instance->cache;
+  struct qe_cache_entry *entry;
+  if (!cache) return NULL;
+  mutex_lock_os(&(cache->lock));
+  for( entry = cache->buckets[cache_bucket_internal(cache->nbuckets, ptr)] ; entry ; entry = entry->next ) {
+    if (entry->ptr == ptr) break;
+  }
+  if (!entry) {
+    cache->misses++;
+    mutex_unlock_os(&(cache->lock));
+    return NULL;
+  }
+  cache->hits++;
+  entry->refs++;
+
+  // Most recently used goes up front
+  if (entry->lru_prev) {
+    entry->lru_prev->lru_next = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else cache->tail = entry->lru_prev;
+    entry->lru_prev    = NULL;
+    entry->lru_next    = cache->head;
+    cache->head->lru_prev = entry;
+    cache->head        = entry;
+  }
+  mutex_unlock_os(&(cache->lock));
+  return entry;
+}
+
+void cache_release_internal(const struct query_engine_t *instance, struct qe_cache_entry *entry) {
+  struct qe_cache *cache = instance->cache;
+  mutex_lock_os(&(cache->lock));
+  entry->refs--;
+  if (entry->dead && !entry->refs) cache_entry_free_internal(instance, entry);
+  mutex_unlock_os(&(cache->lock));
+}
+
+// Evict least recently used entries until within budget
+// Call with the cache locked
+void cache_evict_internal(const struct query_engine_t *instance) {
+  struct qe_cache *cache = instance->cache;
+  while(cache->tail && (cache->used > cache->max)) {
+    cache_unlink_internal(instance, cache->tail);
+  }
+}
+
+// Insert the serialized contents of a record, taking ownership of them
+// Returns the referenced entry, which may be one inserted concurrently
+struct qe_cache_entry * cache_put_internal(const struct query_engine_t *instance, PALLOC_OFFSET ptr, const char *data, size_t len, void *record) {
+  struct qe_cache        *cache = instance->cache;
+  struct qe_cache_entry  *entry;
+  struct qe_cache_entry **grown;
+  struct qe_cache_entry  *next;
+  size_t                  i, b;
+  if (!cache) return NULL;
+  if (len + QE_CACHE_OVERHEAD > cache->max) return NULL;
+
+  mutex_lock_os(&(cache->lock));
+  for( entry = cache->buckets[cache_bucket_internal(cache->nbuckets, ptr)] ; entry ; entry = entry->next ) {
+    if (entry->ptr == ptr) break;
+  }
+  if (entry) {
+    entry->refs++;
+    mutex_unlock_os(&(cache->lock));
+    if (record) purge_record_internal(instance, record);
+    return entry;
+  }
+
+  // Keep chains short
+  if (cache->count >= cache->nbuckets) {
+    grown = calloc(cache->nbuckets * 2, sizeof(struct qe_cache_entry *));
+    for( i = 0 ; i < cache->nbuckets ; i++ ) {
+      for( entry = cache->buckets[i] ; entry ; entry = next ) {
+        next = entry->next;
+        b    = cache_bucket_internal(cache->nbuckets * 2, entry->ptr);
+        entry->next = grown[b];
+        grown[b]    = entry;
+      }
+    }
+    free(cache->buckets);
+    cache->buckets   = grown;
+    cache->nbuckets *= 2;
+  }
+
+  entry         = calloc(1, sizeof(struct qe_cache_entry));
+  entry->ptr    = ptr;
+  entry->record = record;
+  entry->refs   = 1;
+  buf_append(&(entry->raw), data, len);
+  b             = cache_bucket_internal(cache->nbuckets, ptr);
+  entry->next   = cache->buckets[b];
+  cache->buckets[b] = entry;
+  entry->lru_next   = cache->head;
+  if (cache->head) cache->head->lru_prev = entry;
+  cache->head = entry;
+  if (!cache->tail) cache->tail = entry;
+  cache->used += len + QE_CACHE_OVERHEAD;
+  cache->count++;
+  cache_evict_internal(instance);
+  mutex_unlock_os(&(cache->lock));
+  return entry;
+}
+
+// Drop a record that's being changed or freed
+void cache_invalidate_internal(const struct query_engine_t *instance, PALLOC_OFFSET ptr) {
+  struct qe_cache       *cache = instance->cache;
+  struct qe_cache_entry *entry;
+  if (!cache) return;
+  mutex_lock_os(&(cache->lock));
+  for( entry = cache->buckets[cache_bucket_internal(cache->nbuckets, ptr)] ; entry ; entry = entry->next ) {
+    if (entry->ptr == ptr) break;
+  }
+  if (entry) cache_unlink_internal(instance, entry);
+  mutex_unlock_os(&(cache->lock));
+}
+
+void cache_free_internal(struct query_engine_t *instance) {
+  struct qe_cache *cache = instance->cache;
+  if (!cache) return;
+  mutex_lock_os(&(cache->lock));
+  while(cache->head) cache_unlink_internal(instance, cache->head);
+  mutex_unlock_os(&(cache->lock));
+  mutex_destroy_os(&(cache->lock));
+  free(cache->buckets);
+  free(cache);
+  instance->cache = NULL;
+}
+
+// }}}
+
+// Contents of an allocation, pointing into the mapping or QE_SCRATCH bytes of scratch if possible
+// Returns the copy to free afterwards, if one was made
+struct buf * view_internal(const struct query_engine_t *instance, PALLOC_OFFSET ptr, size_t len, struct buf *view, char *scratch) {
+  struct buf *contents;
+  const char *mapped = map_internal(instance, ptr, len);
+  stats_hydration_internal(instance);
+  if (mapped) {
+    view->data = (char *)mapped;
+    view->len  = len;
+    view->cap  = len;
+    stats_read_internal(instance, len);
+    return NULL;
+  }
+  if (len <= QE_SCRATCH) {
+    view->data = read_into_internal(instance, ptr, len, scratch) ? NULL : scratch;
+    view->len  = len;
+    view->cap  = len;
+    return NULL;
+  }
+  contents = read_range_internal(instance, ptr, len);
+  if (contents) {
+    *view = *contents;
+  } else {
+    view->data = NULL;
+  }
+  return contents;
+}
+
+// Caller-owned record, deserialized from the cache or medium
+// Only fills the cache when asked to, so scans don't flush it
+void * hydrate_internal(const struct query_engine_t *instance, PALLOC_OFFSET ptr, size_t len, int cache) {
+  struct qe_cache_entry *cached = cache_get_internal(instance, ptr);
+  struct buf             view;
+  struct buf            *contents;
+  void                  *hydrated;
+  char                   scratch[QE_SCRATCH];
+
+  if (cached) {
+    hydrated = deserialize_internal(instance, &(cached->raw));
+    cache_release_internal(instance, cached);
+    return hydrated;
+  }
+
+  contents = view_internal(instance, ptr, len, &view, scratch);
+  if (!view.data) return NULL;
+  hydrated = deserialize_internal(instance, &view);
+  if (cache && hydrated) {
+    cached = cache_put_internal(instance, ptr, view.data, view.len, NULL);
+    if (cached) cache_release_internal(instance, cached);
+  }
+  if (contents) {
+    buf_clear(contents);
+    free(contents);
+  }
+  return hydrated;
+}
+
+// Record for internal use, possibly shared through the cache
+// Hand back through record_release_internal
+void * record_acquire_internal(const struct query_engine_t *instance, PALLOC_OFFSET ptr, size_t len, struct qe_cache_entry **handle) {
+  struct qe_cache       *cache  = instance->cache;
+  struct qe_cache_entry *cached = cache_get_internal(instance, ptr);
+  struct buf             view;
+  struct buf            *contents;
+  void                  *record;
+  char                   scratch[QE_SCRATCH];
+  *handle = NULL;
+
+  // Fetch & offer to the cache on a miss
+  if (!cached) {
+    contents = view_internal(instance, ptr, len, &view, scratch);
+    if (!view.data) return NULL;
+    record = deserialize_internal(instance, &view);
+    if (record) cached = cache_put_internal(instance, ptr, view.data, view.len, record);
+    if (contents) {
+      buf_clear(contents);
+      free(contents);
+    }
+    if (!cached) return record;
+  }
+
+  // Deserialize cached contents once, for all comparisons to use
+  mutex_lock_os(&(cache->lock));
+  record = cached->record;
+  mutex_unlock_os(&(cache->lock));
+  if (!record) {
+    record = deserialize_internal(instance, &(cached->raw));
+    mutex_lock_os(&(cache->lock));
+    if (cached->record) {
+      purge_record_internal(instance, record);
+      record = cached->record;
+    } else {
+      cached->record = record;
+    }
+    mutex_unlock_os(&(cache->lock));
+  }
+  *handle = cached;
+  return record;
+}
+
+void record_release_internal(const struct query_engine_t *instance, void *record, struct qe_cache_entry *handle) {
+  if (handle) {
+    cache_release_internal(instance, handle);
+  } else {
+    purge_record_internal(instance, record);
+  }
+}
+
+// Frees an extracted key, which may hold its data itself
+void key_free_internal(struct buf *key) {
+  if (!key) return;
+  if (key->data != (char *)(key + 1)) buf_clear(key);
+  free(key);
+}
+
+// Bytewise key order, shorter keys first on equal prefix
+int key_cmp_internal(const struct buf *a, const struct buf *b) {
+  size_t len = a->len < b->len ? a->len : b->len;
+  int result = len ? memcmp(a->data, b->data, len) : 0;
+  if (result) return result;
+  if (a->len < b->len) return -1;
+  if (a->len > b->len) return  1;
+  return 0;
+}
+
+// Typed keys {{{
+//
+// Typed indexes take their key straight from the serialized record, at a
+// fixed offset, so neither extracting nor comparing keys involves a callback.
+// Keys are kept in a form that orders bytewise: integers big-endian, with the
+// sign bit of signed ones flipped, and byte strings as-is. Their data lives in
+// the same allocation as the key buffer itself.
+//
+// Stored records are padded up to their allocation's size with at least one
+// byte they don't end in, so their exact length is known without asking the
+// application. Keys of stored records come from those exact bytes, just like
+// they come from the serialized record while storing it. Media the catalog
+// doesn't mark as padded may hold records that aren't, which are serialized
+// again instead.
+
+// Whether the index orders by keys rather than records
+int keyed_internal(const struct qe_index *index) {
+  return index->key || index->key_type;
+}
+
+// Whether the type & width of a typed key make sense
+int key_type_valid_internal(int type, size_t length) {
+  switch(type) {
+    case QUERY_ENGINE_KEY_UINT:
+    case QUERY_ENGINE_KEY_INT:
+      return (length == 1) || (length == 2) || (length == 4) || (length == 8);
+    case QUERY_ENGINE_KEY_BYTES:
+      return length > 0;
+    case QUERY_ENGINE_KEY_PREFIXED:
+      return (length == 1) || (length == 2) || (length == 4);
+  }
+  return 0;
+}
+
+struct buf * key_new_internal(const char *data, size_t len) {
+  struct buf *key = malloc(sizeof(struct buf) + (len ? len : 1));
+  key->data = (char *)(key + 1);
+  key->len  = len;
+  key->cap  = len;
+  if (len) memcpy(key->data, data, len);
+  return key;
+}
+
+// Key of a serialized record, NULL if the record is too short to hold one
+struct buf * key_typed_internal(const struct qe_index *index, const struct buf *raw) {
+  const char *data   = raw->data + index->key_offset;
+  size_t      length = index->key_length;
+  size_t      len    = 0;
+  char        value[8];
+  size_t      i;
+  if ((index->key_offset > raw->len) || (length > raw->len - index->key_offset)) return NULL;
+  switch(index->key_type) {
+    case QUERY_ENGINE_KEY_UINT:
+    case QUERY_ENGINE_KEY_INT:
+      for( i = 0 ; i < length ; i++ ) value[i] = data[length - 1 - i];
+      if (index->key_type == QUERY_ENGINE_KEY_INT) value[0] ^= (char)0x80;
+      return key_new_internal(value, length);
+    case QUERY_ENGINE_KEY_BYTES:
+      return key_new_internal(data, length);
+    case QUERY_ENGINE_KEY_PREFIXED:
+      for( i = 0 ; i < length ; i++ ) len |= ((size_t)(unsigned char)data[i]) << (i*8);
+      if (len > raw->len - index->key_offset - length) return NULL;
+      return key_new_internal(data + length, len);
+  }
+  return NULL;
+}
+
+// Key of a record, from its serialized form if the index is typed
+// Serializes the record if that form isn't given
+struct buf * key_internal(const struct qe_index *index, const void *record, const struct buf *raw) {
+  struct buf *serialized;
+  struct buf *key;
+  if (index->key) return index->key(record, index->qe->udata, index->udata);
+  if (raw) return key_typed_internal(index, raw);
+  serialized = index->qe->serialize(record, index->qe->udata);
+  if (!serialized) return NULL;
+  key = key_typed_internal(index, serialized);
+  buf_clear(serialized);
+  free(serialized);
+  return key;
+}
+
+// Pad a stored record to the size of its allocation with a byte it doesn't end in
+// Padding what's padded already extends that run, so the record's length can always be told
+void pad_internal(struct buf *stored, size_t size, int padded) {
+  char fill = 0;
+  if (stored->len) fill = stored->data[stored->len - 1];
+  if (stored->len && !padded) fill = fill ? 0 : (char)0xFF;
+  while(stored->len < size) buf_append(stored, &fill, 1);
+}
+
+// Length of a plain stored record, without the padding of its allocation
+size_t stored_len_internal(const struct buf *stored) {
+  size_t len = stored->len;
+  while(len && (stored->data[len - 1] == stored->data[stored->len - 1])) len--;
+  return len;
+}
+
+// Whether every plain record on the medium is padded
+int padded_internal(const struct query_engine_t *instance) {
+  const struct qe_catalog *catalog = instance->catalog;
+  return catalog && (catalog->flags & QE_CATALOG_PADDED);
+}
+
+// Exact serialized form of a stored record, decoded or without its padding
+// Plain records on older media may not be padded, those are serialized again instead
+// Returns 0 for plain records, 1 when decoded or serialized, -1 when that failed
+int stored_exact_internal(const struct query_engine_t *instance, const struct buf *stored, struct buf *exact, char *scratch) {
+  struct buf *serialized;
+  void       *record;
+  int         state = codec_decode_internal(instance, stored, exact, scratch);
+  if (state) return state;
+  if (padded_internal(instance)) {
+    exact->data = stored->data;
+    exact->len  = stored_len_internal(stored);
+    exact->cap  = exact->len;
+    return 0;
+  }
+  record = deserialize_internal(instance, stored);
+  if (!record) return -1;
+  serialized = instance->serialize(record, instance->udata);
+  purge_record_internal(instance, record);
+  if (!serialized) return -1;
+  *exact = *serialized;
+  free(serialized);
+  return 1;
+}
+
+// }}}
+
+// Slabs & arenas {{{
+//
+// Index entries are carved from pages owned by their index, rather than each
+// being allocated on its own. That saves the allocator's header on every
+// entry, and freed entries go onto a free list for the next mutation to
+// reuse. Pages are only released along with the index. Slabs aren't locked,
+// so only use them with the engine locked for writing, or give every thread
+// a slab of its own and have the index adopt those afterwards.
+//
+// Arrays only needed during a single call come from an arena instead, which
+// is a buffer on the caller's stack when they fit, or a single allocation.
+
+void slab_init_internal(struct qe_slab *slab, size_t size) {
+  memset(slab, 0, sizeof(struct qe_slab));
+  slab->size     = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  slab->per_page = (QE_SLAB_PAGE - sizeof(struct qe_slab_page)) / slab->size;
+  slab->used     = slab->per_page;
+}
+
+// Zeroed object, from the free list or the newest page
+void * slab_alloc_internal(struct qe_slab *slab) {
+  struct qe_slab_page *page;
+  void                *object = slab->free;
+  if (object) {
+    slab->free = *((void **)object);
+  } else {
+    if (slab->used == slab->per_page) {
+      page        = malloc(QE_SLAB_PAGE);
+      page->next  = slab->pages;
+      slab->pages = page;
+      slab->used  = 0;
+    }
+    object = ((char *)(slab->pages + 1)) + (slab->used++ * slab->size);
+  }
+  memset(object, 0, slab->size);
+  return object;
+}
+
+void slab_free_internal(struct qe_slab *slab, void *object) {
+  *((void **)object) = slab->free;
+  slab->free         = object;
+}
+
+// Takes over the pages of another slab of the same size, which is left empty
+void slab_adopt_internal(struct qe_slab *slab, struct qe_slab *other) {
+  struct qe_slab_page **tail = &(slab->pages);
+  void                 *object;
+  if (!other->pages) return;
+
+  // What's left of its newest page becomes free
+  while(other->used < other->per_page) {
+    slab_free_internal(other, ((char *)(other->pages + 1)) + (other->used++ * other->size));
+  }
+
+  // Its pages go after ours, so we keep allocating from our newest page
+  while(*tail) tail = &((*tail)->next);
+  *tail        = other->pages;
+  other->pages = NULL;
+  while((object = other->free)) {
+    other->free = *((void **)object);
+    slab_free_internal(slab, object);
+  }
+}
+
+void slab_destroy_internal(struct qe_slab *slab) {
+  struct qe_slab_page *page;
+  while((page = slab->pages)) {
+    slab->pages = page->next;
+    free(page);
+  }
+  slab->free = NULL;
+  slab->used = slab->per_page;
+}
+
+// Room for an array in an arena, including alignment
+size_t arena_size_internal(size_t n, size_t size) {
+  return ((n * size) + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+}
+
+// Arena of `size` bytes, using the given stack buffer if that's large enough
+void arena_init_internal(struct qe_arena *arena, char *stack, size_t stack_size, size_t size) {
+  arena->used = 0;
+  arena->heap = size > stack_size ? malloc(size) : NULL;
+  arena->data = arena->heap ? arena->heap : stack;
+}
+
+// Zeroed array, sized by arena_size_internal up-front
+void * arena_alloc_internal(struct qe_arena *arena, size_t n, size_t size) {
+  void *array  = arena->data + arena->used;
+  arena->used += arena_size_internal(n, size);
+  memset(array, 0, n * size);
+  return array;
+}
+
+void arena_free_internal(struct qe_arena *arena) {
+  free(arena->heap);
+}
+
+// }}}
+
+// Hash indexes {{{
+//
+// Hash indexes answer equality lookups with a single probe. Every entry keeps
+// the hash of its record, so only records with a matching hash are read to
+// run `eq` on. Growing is incremental: the previous table is drained a few
+// buckets per mutation, lookups checking both tables while that happens.
+
+#define QE_HASH_MIN   16
+#define QE_HASH_STEP  8
+
+struct qe_hash_entry {
+  struct qe_index_entry  entry;
+  struct qe_hash_entry  *next;
+  uint64_t               hash;
+};
+
+struct qe_hash {
+  struct qe_hash_entry **table;
+  size_t                 size;
+  struct qe_hash_entry **old;
+  size_t                 old_size;
+  size_t                 migrated;
+  size_t                 count;
+};
+
+// Spreads all bits of a hash, user hashes may be weak in the low bits we use
+uint64_t mix_internal(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+uint64_t hash_of_internal(const struct qe_index *index, const void *record) {
+  return mix_internal(index->hash(record, index->qe->udata, index->udata));
+}
+
+// Builds an index entry from the given slab, extracting the key from the given record if the index uses one
+// Typed indexes use the serialized record if given, the record itself may be NULL then
+struct qe_index_entry * entry_internal(struct qe_index *index, struct qe_slab *slab, PALLOC_OFFSET ptr, PALLOC_SIZE size, const void *record, const struct buf *raw) {
+  struct qe_index_entry *entry = slab_alloc_internal(slab);
+  entry->ptr  = ptr;
+  entry->size = size;
+  if (index->hash) {
+    ((struct qe_hash_entry *)entry)->hash = hash_of_internal(index, record);
+  }
+  if (keyed_internal(index)) {
+    entry->key = key_internal(index, record, raw);
+    if (!entry->key) {
+      slab_free_internal(slab, entry);
+      return NULL;
+    }
+  }
+  return entry;
+}
+
+// Read from medium, cmp, free deserialized entries
+int cmp_internal(const void *a, const void *b, void *idx) {
+  struct qe_index       *index   = (struct qe_index *)idx;
+  struct qe_index_entry *entry_a = (struct qe_index_entry *)a;
+  struct qe_index_entry *entry_b = (struct qe_index_entry *)b;
+
+  int result = 0;
+  stats_cmp_internal(index);
+
+  // Keyed indexes never touch the medium
+  if (keyed_internal(index)) {
+    if (index->cmp) {
+      return index->cmp(entry_a->key, entry_b->key, index->qe->udata, index->udata);
+    }
+    return key_cmp_internal(entry_a->key, entry_b->key);
+  }
+
+  void *hydrated_a = (void *)entry_a->hydrated;
+  void *hydrated_b = (void *)entry_b->hydrated;
+  struct qe_cache_entry *cached_a = NULL;
+  struct qe_cache_entry *cached_b = NULL;
+
+  // Hydrate if needed
+  if (!(entry_a->hydrated)) {
+    hydrated_a = record_acquire_internal(index->qe, entry_a->ptr, entry_a->size, &cached_a);
+    if (!hydrated_a) return 0;
+  }
+
+  if (!(entry_b->hydrated)) {
+    hydrated_b = record_acquire_internal(index->qe, entry_b->ptr, entry_b->size, &cached_b);
+    if (!hydrated_b) {
+      if (!(entry_a->hydrated)) {
+        record_release_internal(index->qe, hydrated_a, cached_a);
+      }
+      return 0;
+    }
+  }
+
+  // Run the actual comparison
+  result = index->cmp(hydrated_a, hydrated_b, index->qe->udata, index->udata);
+
+  // Don't hog memory
+  if (!(entry_a->hydrated)) {
+    record_release_internal(index->qe, hydrated_a, cached_a);
+  }
+  if (!(entry_b->hydrated)) {
+    record_release_internal(index->qe, hydrated_b, cached_b);
+  }
+
+  // Return what the comparison said
+  return result;
+}
+
+// Remove an entry from the in-memory index
+void purge_internal(void *sub, void *idx) {
+  struct qe_index_entry *subject = (struct qe_index_entry *)sub;
+
+  if (subject->hydrated) {
+    // This is a search pattern, do not free
+  } else {
+    key_free_internal(subject->key);
+    slab_free_internal(&(((struct qe_index *)idx)->slab), subject);
+  }
+
+  // Done
+}
+
+// Turn a user-given record into a search pattern for the given index
+int pattern_internal(struct qe_index *index, const void *record, struct qe_index_entry *pattern) {
+  pattern->ptr      = 0;
+  pattern->hydrated = record;
+  pattern->key      = NULL;
+  if (keyed_internal(index)) {
+    pattern->key = key_internal(index, record, NULL);
+    if (!pattern->key) return QUERY_ENGINE_RETURN_ERR;
+  }
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+// Search pattern for a stored record, typed keys coming from the exact bytes it was stored as
+int stored_pattern_internal(struct qe_index *index, const void *record, const struct buf *exact, struct qe_index_entry *pattern) {
+  if (!index->key_type) return pattern_internal(index, record, pattern);
+  pattern->ptr      = 0;
+  pattern->hydrated = record;
+  pattern->key      = exact ? key_typed_internal(index, exact) : NULL;
+  return pattern->key ? QUERY_ENGINE_RETURN_OK : QUERY_ENGINE_RETURN_ERR;
+}
+
+struct qe_hash * hash_init_internal() {
+  struct qe_hash *table = calloc(1, sizeof(struct qe_hash));
+  table->size  = QE_HASH_MIN;
+  table->table = calloc(table->size, sizeof(struct qe_hash_entry *));
+  return table;
+}
+
+// Move a few buckets of the previous table over
+void hash_step_internal(struct qe_hash *table, size_t steps) {
+  struct qe_hash_entry *entry;
+  struct qe_hash_entry *next;
+  size_t                b;
+  if (!table->old) return;
+  while(steps-- && (table->migrated < table->old_size)) {
+    for( entry = table->old[table->migrated] ; entry ; entry = next ) {
+      next            = entry->next;
+      b               = entry->hash & (table->size - 1);
+      entry->next     = table->table[b];
+      table->table[b] = entry;
+    }
+    table->old[table->migrated++] = NULL;
+  }
+  if (table->migrated == table->old_size) {
+    free(table->old);
+    table->old      = NULL;
+    table->old_size = 0;
+    table->migrated = 0;
+  }
+}
+
+void hash_insert_internal(struct qe_index *index, struct qe_hash_entry *entry) {
+  struct qe_hash *table = index->table;
+  size_t          b;
+  hash_step_internal(table, QE_HASH_STEP);
+
+  // Double in size, draining the current table from here on
+  if ((table->count + 1) > ((table->size / 4) * 3)) {
+    hash_step_internal(table, table->old_size);
+    table->old      = table->table;
+    table->old_size = table->size;
+    table->migrated = 0;
+    table->size    *= 2;
+    table->table    = calloc(table->size, sizeof(struct qe_hash_entry *));
+  }
+
+  b               = entry->hash & (table->size - 1);
+  entry->next     = table->table[b];
+  table->table[b] = entry;
+  table->count++;
+}
+
+// Slot pointing at the entry for an equal record, NULL if there's none
+// Hands out the caller-owned record that matched when asked for it
+struct qe_hash_entry ** hash_slot_internal(const struct qe_index *index, const void *record, uint64_t hash, void **found) {
+  struct qe_hash        *table = index->table;
+  struct qe_hash_entry **slot;
+  struct qe_hash_entry  *entry;
+  struct qe_cache_entry *cached;
+  void                  *hydrated;
+  size_t                 pass, b;
+  int                    equal;
+  for( pass = 0 ; pass < 2 ; pass++ ) {
+    if (pass) {
+      if (!table->old) break;
+      b = hash & (table->old_size - 1);
+      if (b < table->migrated) break;
+      slot = &(table->old[b]);
+    } else {
+      slot = &(table->table[hash & (table->size - 1)]);
+    }
+    for( ; (entry = *slot) ; slot = &(entry->next) ) {
+      if (entry->hash != hash) continue;
+      cached   = NULL;
+      hydrated = found
+        ? hydrate_internal(index->qe, entry->entry.ptr, entry->entry.size, 1)
+        : record_acquire_internal(index->qe, entry->entry.ptr, entry->entry.size, &cached);
+      if (!hydrated) continue;
+      stats_cmp_internal(index);
+      equal = index->eq(record, hydrated, index->qe->udata, index->udata);
+      if (equal && found) {
+        *found = hydrated;
+        return slot;
+      }
+      if (found) {
+        purge_record_internal(index->qe, hydrated);
+      } else {
+        record_release_internal(index->qe, hydrated, cached);
+      }
+      if (equal) return slot;
+    }
+  }
+  return NULL;
+}
+
+struct qe_hash_entry * hash_find_internal(const struct qe_index *index, const void *record, void **found) {
+  struct qe_hash_entry **slot = hash_slot_internal(index, record, hash_of_internal(index, record), found);
+  return slot ? *slot : NULL;
+}
+
+// Entries that may hold an equal record, going by their hash alone
+size_t hash_candidates_internal(const struct qe_index *index, uint64_t hash, struct qe_index_entry ***entries, size_t *max, size_t n) {
+  struct qe_hash       *table = index->table;
+  struct qe_hash_entry *entry;
+  size_t                pass, b;
+  for( pass = 0 ; pass < 2 ; pass++ ) {
+    if (pass) {
+      if (!table->old) break;
+      b = hash & (table->old_size - 1);
+      if (b < table->migrated) break;
+      entry = table->old[b];
+    } else {
+      entry = table->table[hash & (table->size - 1)];
+    }
+    for( ; entry ; entry = entry->next ) {
+      if (entry->hash != hash) continue;
+      if (n == *max) {
+        *max     = *max ? *max * 2 : 16;
+        *entries = realloc(*entries, *max * sizeof(struct qe_index_entry *));
+      }
+      (*entries)[n++] = &(entry->entry);
+    }
+  }
+  return n;
+}
+
+void hash_delete_internal(struct qe_index *index, const void *record) {
+  struct qe_hash        *table = index->table;
+  struct qe_hash_entry **slot;
+  struct qe_hash_entry  *entry;
+  hash_step_internal(table, QE_HASH_STEP);
+  slot = hash_slot_internal(index, record, hash_of_internal(index, record), NULL);
+  if (!slot) return;
+  entry = *slot;
+  *slot = entry->next;
+  table->count--;
+  purge_internal(entry, index);
+}
+
+// All entries, in no particular order
+struct qe_hash_entry ** hash_entries_internal(const struct qe_index *index, size_t *count) {
+  struct qe_hash        *table   = index->table;
+  struct qe_hash_entry **entries = malloc((table->count ? table->count : 1) * sizeof(struct qe_hash_entry *));
+  struct qe_hash_entry  *entry;
+  size_t                 i, n = 0;
+  for( i = 0 ; i < table->size ; i++ ) {
+    for( entry = table->table[i] ; entry ; entry = entry->next ) entries[n++] = entry;
+  }
+  for( i = table->migrated ; table->old && (i < table->old_size) ; i++ ) {
+    for( entry = table->old[i] ; entry ; entry = entry->next ) entries[n++] = entry;
+  }
+  *count = n;
+  return entries;
+}
+
+void hash_free_internal(struct qe_index *index) {
+  struct qe_hash        *table = index->table;
+  struct qe_hash_entry **entries;
+  size_t                 i, n;
+  if (!table) return;
+  entries = hash_entries_internal(index, &n);
+  for( i = 0 ; i < n ; i++ ) purge_internal(entries[i], index);
+  free(entries);
+  free(table->table);
+  free(table->old);
+  free(table);
+  index->table = NULL;
+}
+
+// Entry for a record equal to the pattern, if the index holds one
+struct qe_index_entry * index_find_internal(struct qe_index *index, struct qe_index_entry *pattern) {
+  if (index->table) return (struct qe_index_entry *)hash_find_internal(index, pattern->hydrated, NULL);
+  return mindex_get(index->mindex, pattern);
+}
+
+void index_delete_internal(struct qe_index *index, struct qe_index_entry *pattern) {
+  if (index->table) {
+    hash_delete_internal(index, pattern->hydrated);
+    return;
+  }
+  mindex_delete(index->mindex, pattern);
+}
+
+// }}}
+
+// Bloom filters {{{
+//
+// An index may keep a counting Bloom filter, so lookups for records that
+// aren't there are answered from memory. Counters make deletes possible,
+// saturated ones are never decremented again to stay on the safe side.
+// The filter is sized for twice the index it's built for & rebuilt at
+// double the capacity once that fills up.
+
+#define QE_BLOOM_MIN  1024
+
+struct qe_bloom {
+  uint64_t (*hash)(const void *entry, void *udata_qe, void *udata_idx);
+  double    fpr;
+  int       ready;
+  uint32_t  k;
+  uint64_t  capacity;
+  uint64_t  count;
+  uint64_t  m;
+  uint8_t  *counters;
+  uint64_t  negatives;
+  uint64_t  false_positives;
+};
+
+// Sized for the capacity at the given false-positive rate, ~1.44 * log2(1/fpr) counters per entry
+struct qe_bloom * bloom_init_internal(double fpr, uint64_t capacity) {
+  struct qe_bloom *bloom = calloc(1, sizeof(struct qe_bloom));
+  double           p;
+  bloom->fpr      = fpr;
+  bloom->capacity = capacity < QE_BLOOM_MIN ? QE_BLOOM_MIN : capacity;
+  for( p = 1.0 ; p > fpr ; p /= 2 ) bloom->k++;
+  if (!bloom->k) bloom->k = 1;
+  bloom->m        = (bloom->capacity * bloom->k * 1443) / 1000;
+  bloom->counters = calloc(bloom->m, sizeof(uint8_t));
+  return bloom;
+}
+
+void bloom_free_internal(struct qe_index *index) {
+  if (!index->bloom) return;
+  free(index->bloom->counters);
+  free(index->bloom);
+  index->bloom = NULL;
+}
+
+// What the filter knows an entry by, like the index compares it
+// Either the entry's key, its stored hash or the given record
+uint64_t bloom_hash_internal(const struct qe_index *index, const struct qe_index_entry *entry, const void *record) {
+  struct qe_bloom *bloom = index->bloom;
+  uint64_t         h     = 14695981039346656037ULL;
+  size_t           i;
+  if (index->table) {
+    return record ? hash_of_internal(index, record) : ((const struct qe_hash_entry *)entry)->hash;
+  }
+  if (bloom->hash) {
+    return mix_internal(bloom->hash(keyed_internal(index) ? (const void *)entry->key : record, index->qe->udata, index->udata));
+  }
+  for( i = 0 ; i < entry->key->len ; i++ ) {
+    h = (h ^ (unsigned char)entry->key->data[i]) * 1099511628211ULL;
+  }
+  return mix_internal(h);
+}
+
+// Counter of the n-th probe, by double hashing
+uint8_t * bloom_counter_internal(const struct qe_bloom *bloom, uint64_t hash, uint32_t n) {
+  uint64_t step = mix_internal(hash ^ 0x9E3779B97F4A7C15ULL) | 1;
+  return &(bloom->counters[(hash + (n * step)) % bloom->m]);
+}
+
+int bloom_contains_internal(const struct qe_bloom *bloom, uint64_t hash) {
+  uint32_t n;
+  for( n = 0 ; n < bloom->k ; n++ ) {
+    if (!*bloom_counter_internal(bloom, hash, n)) return 0;
+  }
+  return 1;
+}
+
+void bloom_insert_internal(struct qe_bloom *bloom, uint64_t hash) {
+  uint8_t  *counter;
+  uint32_t  n;
+  for( n = 0 ; n < bloom->k ; n++ ) {
+    counter = bloom_counter_internal(bloom, hash, n);
+    if (*counter < UINT8_MAX) (*counter)++;
+  }
+  bloom->count++;
+}
+
+void bloom_remove_internal(struct qe_bloom *bloom, uint64_t hash) {
+  uint8_t  *counter;
+  uint32_t  n;
+  for( n = 0 ; n < bloom->k ; n++ ) {
+    counter = bloom_counter_internal(bloom, hash, n);
+    if (*counter && (*counter < UINT8_MAX)) (*counter)--;
+  }
+  if (bloom->count) bloom->count--;
+}
+
+// (Re)-fill the filter from the index' entries, reading records only if there's no other way
+void bloom_build_internal(struct qe_index *index, uint64_t capacity) {
+  struct qe_bloom        *old = index->bloom;
+  struct qe_index_entry **entries;
+  struct qe_cache_entry  *cached;
+  void                   *record;
+  size_t                  i, n;
+  if (index->table) {
+    entries = (struct qe_index_entry **)hash_entries_internal(index, &n);
+  } else {
+    entries = (struct qe_index_entry **)index->mindex->items;
+    n       = index->mindex->length;
+  }
+  if (capacity < 2 * n) capacity = 2 * n;
+  index->bloom        = bloom_init_internal(old->fpr, capacity);
+  index->bloom->hash  = old->hash;
+  index->bloom->ready = 1;
+  index->bloom->negatives       = old->negatives;
+  index->bloom->false_positives = old->false_positives;
+  free(old->counters);
+  free(old);
+  for( i = 0 ; i < n ; i++ ) {
+    record = (void *)entries[i]->hydrated;
+    cached = NULL;
+    if (!record && !keyed_internal(index) && !index->table) {
+      record = record_acquire_internal(index->qe, entries[i]->ptr, entries[i]->size, &cached);
+      if (!record) continue;
+      bloom_insert_internal(index->bloom, bloom_hash_internal(index, entries[i], record));
+      record_release_internal(index->qe, record, cached);
+      continue;
+    }
+    bloom_insert_internal(index->bloom, bloom_hash_internal(index, entries[i], record));
+  }
+  if (index->table) free(entries);
+}
+
+// Track entries just inserted into the index, still holding their record
+void bloom_add_internal(struct qe_index *index, struct qe_index_entry **entries, size_t n) {
+  struct qe_bloom *bloom = index->bloom;
+  size_t           i;
+  if (!bloom || !bloom->ready) return;
+  if (bloom->count + n > bloom->capacity) {
+    bloom_build_internal(index, 2 * (bloom->count + n));
+    return;
+  }
+  for( i = 0 ; i < n ; i++ ) {
+    bloom_insert_internal(bloom, bloom_hash_internal(index, entries[i], entries[i]->hydrated));
+  }
+}
+
+void bloom_delete_internal(struct qe_index *index, const struct qe_index_entry *pattern) {
+  if (!index->bloom || !index->bloom->ready) return;
+  bloom_remove_internal(index->bloom, bloom_hash_internal(index, pattern, pattern->hydrated));
+}
+
+// Whether the filter rules out the pattern being in the index
+int bloom_miss_internal(struct qe_index *index, const struct qe_index_entry *pattern) {
+  struct qe_bloom *bloom = index->bloom;
+  if (!bloom || !bloom->ready) return 0;
+  if (bloom_contains_internal(bloom, bloom_hash_internal(index, pattern, pattern->hydrated))) return 0;
+  atomic_add_os(&(bloom->negatives), 1);
+  return 1;
+}
+
+// }}}
+
+// Drop a record from all indexes & the cache, leaving its allocation to the caller
+QUERY_ENGINE_RETURN_CODE remove_internal(struct query_engine_t *instance, PALLOC_OFFSET ptr, PALLOC_SIZE size) {
+  struct qe_index       *idx;
+  struct qe_index_entry  pattern;
+  struct buf             view, exact;
+  struct buf            *contents = NULL;
+  char                   scratch[QE_SCRATCH];
+  char                   unpacked[QE_SCRATCH];
+  int                    state    = -1;
+  void *record = hydrate_internal(instance, ptr, size, 0);
+  if (!record) {
+    return QUERY_ENGINE_RETURN_ERR;
+  }
+
+  // Typed keys come from the record as stored, read only if there are typed indexes
+  for( idx = instance->index ; idx && !(idx->key_type) ; idx = idx->next );
+  if (idx) {
+    contents = view_internal(instance, ptr, size, &view, scratch);
+    if (view.data) state = stored_exact_internal(instance, &view, &exact, unpacked);
+  }
+  cache_invalidate_internal(instance, ptr);
+
+  // Every index holds one entry for the record, typed ones none if it was too short for them
+  for( idx = instance->index ; idx ; idx = idx->next ) {
+    if (stored_pattern_internal(idx, record, (state >= 0) ? &exact : NULL, &pattern)) continue;
+    bloom_delete_internal(idx, &pattern);
+    index_delete_internal(idx, &pattern);
+    key_free_internal(pattern.key);
+  }
+
+  if ((state > 0) && (exact.data != unpacked)) free(exact.data);
+  if (contents) {
+    buf_clear(contents);
+    free(contents);
+  }
+  purge_record_internal(instance, record);
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+// First position in the index comparing above (strict) or at/above the pattern
+size_t bound_internal(struct qe_index *index, size_t lo, struct qe_index_entry *pattern, int strict, int (*cmp)(struct qe_index *, struct qe_index_entry *, struct qe_index_entry *)) {
+  size_t hi = index->mindex->length;
+  size_t mid;
+  int    result;
+  while(lo < hi) {
+    mid    = lo + ((hi - lo) / 2);
+    result = cmp(index, index->mindex->items[mid], pattern);
+    if ((result < 0) || (strict && (result == 0))) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Regular index order
+int bound_cmp_internal(struct qe_index *index, struct qe_index_entry *entry, struct qe_index_entry *pattern) {
+  return cmp_internal(entry, pattern, index);
+}
+
+// Entries starting with the pattern's key compare equal
+int bound_prefix_internal(struct qe_index *index, struct qe_index_entry *entry, struct qe_index_entry *pattern) {
+  size_t len    = entry->key->len < pattern->key->len ? entry->key->len : pattern->key->len;
+  int    result = len ? memcmp(entry->key->data, pattern->key->data, len) : 0;
+  if (result) return result;
+  if (entry->key->len < pattern->key->len) return -1;
+  return 0;
+}
+
+// Merge 2 sorted neighbouring runs, keeping equal items in order
+void merge_runs_internal(void **items, void **tmp, size_t lo, size_t mid, size_t hi, int (*cmp)(const void *, const void *, void *), void *udata) {
+  size_t i, j, k;
+  for( i = lo, j = mid, k = lo ; k < hi ; k++ ) {
+    if ((i < mid) && ((j >= hi) || (cmp(items[i], items[j], udata) <= 0))) {
+      tmp[k] = items[i++];
+    } else {
+      tmp[k] = items[j++];
+    }
+  }
+  memcpy(items + lo, tmp + lo, (hi - lo) * sizeof(void *));
+}
+
+// Stable merge sort, with context for the comparison
+void sort_internal(void **items, size_t n, int (*cmp)(const void *, const void *, void *), void *udata) {
+  void   **tmp;
+  size_t   width, lo, mid, hi;
+  if (n < 2) return;
+  tmp = malloc(n * sizeof(void *));
+  for( width = 1 ; width < n ; width *= 2 ) {
+    for( lo = 0 ; lo < n ; lo += 2 * width ) {
+      mid = (lo + width     < n) ? lo + width     : n;
+      hi  = (lo + 2 * width < n) ? lo + 2 * width : n;
+      merge_runs_internal(items, tmp, lo, mid, hi, cmp, udata);
+    }
+  }
+  free(tmp);
+}
+
+// Insert sorted entries, none of which are in the index yet, in a single pass
+void merge_internal(struct qe_index *index, struct qe_index_entry **entries, size_t n) {
+  struct mindex_t *mindex = index->mindex;
+  size_t          *pos;
+  size_t           i, src, dst;
+  if (!n) return;
+
+  // Entries are sorted, so each search continues where the last ended
+  pos = malloc(n * sizeof(size_t));
+  for( i = 0 ; i < n ; i++ ) {
+    pos[i] = bound_internal(index, i ? pos[i-1] : 0, entries[i], 0, bound_cmp_internal);
+  }
+
+  // Grow once & fill from the back
+  if (mindex->length + n > mindex->max) {
+    mindex->max   = mindex->length + n;
+    mindex->items = realloc(mindex->items, mindex->max * sizeof(void *));
+  }
+  src = mindex->length;
+  dst = mindex->length + n;
+  i   = n;
+  while(i--) {
+    while(src > pos[i]) mindex->items[--dst] = mindex->items[--src];
+    mindex->items[--dst] = entries[i];
+  }
+  mindex->length += n;
+  free(pos);
+}
+
+// Insert entries, none of which are in the index yet, sorted for ordered indexes
+void index_insert_internal(struct qe_index *index, struct qe_index_entry **entries, size_t n) {
+  size_t i;
+  if (!index->table) {
+    merge_internal(index, entries, n);
+    return;
+  }
+  for( i = 0 ; i < n ; i++ ) {
+    hash_insert_internal(index, (struct qe_hash_entry *)entries[i]);
+  }
+}
+
+// Compare hash entries by hash alone
+int hash_cmp_internal(const void *a, const void *b, void *udata) {
+  const struct qe_hash_entry *entry_a = a;
+  const struct qe_hash_entry *entry_b = b;
+  if (entry_a->hash < entry_b->hash) return -1;
+  if (entry_a->hash > entry_b->hash) return  1;
+  return 0;
+}
+
+// Mark batch entries (ptr holding their position) colliding with a later one
+// Leaves ordered blocks sorted, ready to be merged
+void index_collide_internal(struct qe_index *index, struct qe_index_entry **block, size_t n, char *dead) {
+  size_t i, j, k, end;
+  if (!index->table) {
+    sort_internal((void **)block, n, cmp_internal, index);
+    for( i = 1 ; i < n ; i++ ) {
+      if (cmp_internal(block[i-1], block[i], index) == 0) {
+        dead[block[i-1]->ptr] = 1;
+      }
+    }
+    return;
+  }
+
+  // Only entries sharing a hash need a closer look
+  sort_internal((void **)block, n, hash_cmp_internal, NULL);
+  for( i = 0 ; i < n ; i = end ) {
+    for( end = i + 1 ; (end < n) && !hash_cmp_internal(block[i], block[end], NULL) ; end++ );
+    for( j = i ; j < end ; j++ ) {
+      for( k = j + 1 ; k < end ; k++ ) {
+        stats_cmp_internal(index);
+        if (index->eq(block[j]->hydrated, block[k]->hydrated, index->qe->udata, index->udata)) {
+          dead[block[j]->ptr] = 1;
+          break;
+        }
+      }
+    }
+  }
+}
+
+// Free an index's memory
+// (purge_internal only touches memory, the medium stays intact)
+void index_free_internal(struct qe_index *index) {
+  if (index->mindex) mindex_free(index->mindex);
+  hash_free_internal(index);
+  bloom_free_internal(index);
+  slab_destroy_internal(&(index->slab));
+  free(index->stats);
+  free(index->name);
+  free(index);
+}
+
+// Persisted index catalog {{{
+//
+// The first allocation of a medium created by qe_init holds the catalog,
+// listing allocations holding a serialized index. Those are only trusted
+// while the catalog is marked clean, which qe_close does after writing them
+// and the first mutation undoes after freeing them. It also marks media that
+// were padding their records from the start, older ones may hold records
+// that aren't padded.
+
+#define QE_CATALOG_MAGIC    "QECATLG"
+#define QE_CATALOG_VERSION  1
+#define QE_CATALOG_HEADER   32
+#define QE_CATALOG_SIZE     (QE_CATALOG_HEADER + (QE_CATALOG_MAX * 8))
+
+#define QE_BLOB_MAGIC       "QEINDEX"
+#define QE_BLOB_VERSION     3
+#define QE_BLOB_KEYED       1
+#define QE_BLOB_HASHED      2
+#define QE_BLOB_BLOOM       4
+#define QE_BLOB_BLOOM_HEAD  36
+#define QE_BLOB_HEADER      36
+
+// Plain CRC-32 (IEEE), bitwise to keep it small
+uint32_t crc32_internal(uint32_t crc, const char *data, size_t len) {
+  crc = ~crc;
+  while(len--) {
+    crc ^= (unsigned char)*(data++);
+    for(int k=0; k<8; k++) crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+  }
+  return ~crc;
+}
+
+QUERY_ENGINE_RETURN_CODE catalog_write_internal(const struct query_engine_t *instance) {
+  struct qe_catalog *catalog = instance->catalog;
+  char data[QE_CATALOG_SIZE];
+  memset(data, 0, sizeof(data));
+  memcpy(data, QE_CATALOG_MAGIC, 8);
+  enc_u32_internal(data +  8, QE_CATALOG_VERSION);
+  enc_u32_internal(data + 12, catalog->flags);
+  enc_u64_internal(data + 16, catalog->generation);
+  enc_u32_internal(data + 24, catalog->count);
+  for(uint32_t i=0; i<catalog->count; i++) {
+    enc_u64_internal(data + QE_CATALOG_HEADER + (i*8), catalog->blob[i]);
+  }
+  enc_u32_internal(data + 28, crc32_internal(0, data, QE_CATALOG_SIZE));
+  return write_internal(instance, catalog->ptr, data, QE_CATALOG_SIZE);
+}
+
+// Forget about a persisted index & release its allocation
+void catalog_drop_internal(struct query_engine_t *instance, uint32_t i) {
+  struct qe_catalog *catalog = instance->catalog;
+  release_internal(instance, catalog->blob[i]);
+  free(catalog->name[i]);
+  catalog->count--;
+  catalog->blob[i] = catalog->blob[catalog->count];
+  catalog->name[i] = catalog->name[catalog->count];
+}
+
+// Loads the catalog, or creates one on an empty medium
+void catalog_open_internal(struct query_engine_t *instance) {
+  struct qe_catalog *catalog = calloc(1, sizeof(struct qe_catalog));
+  struct buf        *contents;
+  uint32_t           crc;
+  instance->catalog = catalog;
+
+  // A new medium pads its records from the start
+  catalog->ptr = palloc_next(instance->fd, 0);
+  if (!catalog->ptr) {
+    catalog->flags = QE_CATALOG_PADDED;
+    catalog->ptr   = palloc(instance->fd, QE_CATALOG_SIZE);
+    if (!catalog->ptr || catalog_write_internal(instance)) {
+      free(catalog);
+      instance->catalog = NULL;
+    }
+    return;
+  }
+
+  // Media written before the catalog existed have none
+  contents = NULL;
+  if (palloc_size(instance->fd, catalog->ptr) >= QE_CATALOG_SIZE) {
+    contents = read_range_internal(instance, catalog->ptr, QE_CATALOG_SIZE);
+  }
+  if (contents) {
+    crc = dec_u32_internal(contents->data + 28);
+    memset(contents->data + 28, 0, 4);
+  }
+  if (
+    (!contents) ||
+    (memcmp(contents->data, QE_CATALOG_MAGIC, 8)) ||
+    (dec_u32_internal(contents->data + 8) != QE_CATALOG_VERSION) ||
+    (dec_u32_internal(contents->data + 24) > QE_CATALOG_MAX) ||
+    (crc32_internal(0, contents->data, QE_CATALOG_SIZE) != crc)
+  ) {
+    if (contents) {
+      buf_clear(contents);
+      free(contents);
+    }
+    free(catalog);
+    instance->catalog = NULL;
+    return;
+  }
+
+  catalog->flags      = dec_u32_internal(contents->data + 12);
+  catalog->generation = dec_u64_internal(contents->data + 16);
+  catalog->count      = dec_u32_internal(contents->data + 24);
+  for(uint32_t i=0; i<catalog->count; i++) {
+    catalog->blob[i] = dec_u64_internal(contents->data + QE_CATALOG_HEADER + (i*8));
+  }
+  buf_clear(contents);
+  free(contents);
+
+  // Fetch the names of the persisted indexes
+  for(uint32_t i=0; i<catalog->count; i++) {
+    contents = NULL;
+    if (palloc_size(instance->fd, catalog->blob[i]) >= QE_BLOB_HEADER) {
+      contents = read_range_internal(instance, catalog->blob[i], QE_BLOB_HEADER);
+    }
+    if (contents && (dec_u32_internal(contents->data + 32) <= palloc_size(instance->fd, catalog->blob[i]) - QE_BLOB_HEADER)) {
+      catalog->name[i] = calloc(dec_u32_internal(contents->data + 32) + 1, sizeof(char));
+      if (pread_os(instance->fd, catalog->name[i], dec_u32_internal(contents->data + 32), catalog->blob[i] + QE_BLOB_HEADER) != dec_u32_internal(contents->data + 32)) {
+        catalog->name[i][0] = '\0';
+      }
+    } else {
+      catalog->name[i] = strdup("");
+    }
+    if (contents) {
+      buf_clear(contents);
+      free(contents);
+    }
+  }
+
+  // Not closed cleanly, whatever was persisted is stale
+  if (!(catalog->flags & QE_CATALOG_CLEAN)) {
+    while(catalog->count) catalog_drop_internal(instance, 0);
+    catalog_write_internal(instance);
+  }
+}
+
+// Called before mutating, persisted indexes no longer match the medium
+void catalog_dirty_internal(struct query_engine_t *instance) {
+  struct qe_catalog *catalog = instance->catalog;
+  struct qe_index   *idx;
+  if (!catalog) return;
+  if (!(catalog->flags & QE_CATALOG_CLEAN)) return;
+
+  // Marked dirty on the medium before the copies are freed & reused
+  catalog->flags &= ~QE_CATALOG_CLEAN;
+  catalog->generation++;
+  catalog_write_internal(instance);
+  fsync_os(instance->fd);
+  while(catalog->count) catalog_drop_internal(instance, 0);
+  for( idx = instance->index ; idx ; idx = idx->next ) {
+    idx->persisted = 0;
+    if (idx->bloom && !idx->bloom->ready) bloom_free_internal(idx);
+  }
+  catalog_write_internal(instance);
+}
+
+// Whether an allocation belongs to the catalog instead of being a record
+int catalog_meta_internal(const struct query_engine_t *instance, PALLOC_OFFSET ptr) {
+  struct qe_catalog *catalog = instance->catalog;
+  if (!catalog) return 0;
+  if (ptr == catalog->ptr) return 1;
+  for(uint32_t i=0; i<catalog->count; i++) {
+    if (ptr == catalog->blob[i]) return 1;
+  }
+  return 0;
+}
+
+// What kind of entries a blob holds, typed keys being told apart by their type
+uint32_t blob_flags_internal(const struct qe_index *index) {
+  return (keyed_internal(index) ? QE_BLOB_KEYED : 0) | (index->table ? QE_BLOB_HASHED : 0) | ((uint32_t)index->key_type << 8);
+}
+
+// A filter goes along with the entries, waiting for qe_index_bloom to be used again
+void bloom_blob_internal(const struct qe_index *index, struct buf *blob) {
+  struct qe_bloom *bloom = index->bloom;
+  char             head[QE_BLOB_BLOOM_HEAD];
+  uint64_t         fpr;
+  memcpy(&fpr, &(bloom->fpr), sizeof(fpr));
+  enc_u64_internal(head +  0, fpr);
+  enc_u32_internal(head +  8, bloom->k);
+  enc_u64_internal(head + 12, bloom->capacity);
+  enc_u64_internal(head + 20, bloom->count);
+  enc_u64_internal(head + 28, bloom->m);
+  buf_append(blob, head, QE_BLOB_BLOOM_HEAD);
+  buf_append(blob, (const char *)bloom->counters, bloom->m);
+}
+
+struct qe_bloom * bloom_load_internal(const struct buf *blob, size_t *pos) {
+  struct qe_bloom *bloom;
+  uint64_t         fpr;
+  uint64_t         m;
+  if (*pos + QE_BLOB_BLOOM_HEAD > blob->len) return NULL;
+  m = dec_u64_internal(blob->data + *pos + 28);
+  if (m > blob->len - *pos - QE_BLOB_BLOOM_HEAD) return NULL;
+  bloom           = calloc(1, sizeof(struct qe_bloom));
+  fpr             = dec_u64_internal(blob->data + *pos);
+  memcpy(&(bloom->fpr), &fpr, sizeof(fpr));
+  bloom->k        = dec_u32_internal(blob->data + *pos +  8);
+  bloom->capacity = dec_u64_internal(blob->data + *pos + 12);
+  bloom->count    = dec_u64_internal(blob->data + *pos + 20);
+  bloom->m        = m;
+  bloom->counters = malloc(m ? m : 1);
+  memcpy(bloom->counters, blob->data + *pos + QE_BLOB_BLOOM_HEAD, m);
+  *pos += QE_BLOB_BLOOM_HEAD + m;
+  return bloom;
+}
+
+// Serialize an in-memory index
+struct buf * index_blob_internal(const struct query_engine_t *instance, const struct qe_index *index) {
+  struct qe_catalog      *catalog = instance->catalog;
+  struct qe_index_entry  *entry;
+  struct qe_index_entry **entries;
+  struct buf             *blob = calloc(1, sizeof(struct buf));
+  char                    header[QE_BLOB_HEADER];
+  char                    num[8];
+  size_t                  count;
+  if (index->table) {
+    entries = (struct qe_index_entry **)hash_entries_internal(index, &count);
+  } else {
+    entries = (struct qe_index_entry **)index->mindex->items;
+    count   = index->mindex->length;
+  }
+  memcpy(header, QE_BLOB_MAGIC, 8);
+  enc_u32_internal(header +  8, QE_BLOB_VERSION);
+  enc_u32_internal(header + 12, blob_flags_internal(index) | (index->bloom ? QE_BLOB_BLOOM : 0));
+  enc_u64_internal(header + 16, catalog->generation);
+  enc_u64_internal(header + 24, count);
+  enc_u32_internal(header + 32, strlen(index->name));
+  buf_append(blob, header, QE_BLOB_HEADER);
+  buf_append(blob, index->name, strlen(index->name));
+  for(size_t i=0; i<count; i++) {
+    entry = entries[i];
+    enc_u64_internal(num, entry->ptr);
+    buf_append(blob, num, 8);
+    enc_u64_internal(num, entry->size);
+    buf_append(blob, num, 8);
+    if (index->table) {
+      enc_u64_internal(num, ((struct qe_hash_entry *)entry)->hash);
+      buf_append(blob, num, 8);
+    }
+    if (!keyed_internal(index)) continue;
+    enc_u32_internal(num, entry->key->len);
+    buf_append(blob, num, 4);
+    buf_append(blob, entry->key->data, entry->key->len);
+  }
+  if (index->table) free(entries);
+  if (index->bloom) bloom_blob_internal(index, blob);
+  enc_u32_internal(num, crc32_internal(0, blob->data, blob->len));
+  buf_append(blob, num, 4);
+  return blob;
+}
+
+// Fill an empty index from its persisted copy, if there's a valid one
+QUERY_ENGINE_RETURN_CODE index_load_internal(struct query_engine_t *instance, struct qe_index *index) {
+  struct qe_catalog      *catalog = instance->catalog;
+  struct qe_index_entry **items   = NULL;
+  struct buf             *blob    = NULL;
+  uint32_t                i;
+  uint64_t                count   = 0;
+  uint64_t                loaded  = 0;
+  struct qe_bloom        *bloom   = NULL;
+  size_t                  pos, width;
+  if (!catalog) return QUERY_ENGINE_RETURN_ERR;
+  if (!(catalog->flags & QE_CATALOG_CLEAN)) return QUERY_ENGINE_RETURN_ERR;
+
+  for(i=0; i<catalog->count; i++) {
+    if (strcmp(catalog->name[i], index->name) == 0) break;
+  }
+  if (i == catalog->count) return QUERY_ENGINE_RETURN_ERR;
+
+  blob = read_internal(instance, catalog->blob[i]);
+  if (!blob) return QUERY_ENGINE_RETURN_ERR;
+  if (
+    (blob->len < QE_BLOB_HEADER + 4) ||
+    (memcmp(blob->data, QE_BLOB_MAGIC, 8)) ||
+    (dec_u32_internal(blob->data +  8) != QE_BLOB_VERSION) ||
+    ((dec_u32_internal(blob->data + 12) & ~QE_BLOB_BLOOM) != blob_flags_internal(index)) ||
+    (dec_u64_internal(blob->data + 16) != catalog->generation) ||
+    (dec_u32_internal(blob->data + 32) != strlen(index->name))
+  ) goto fail;
+
+  // Rebuild the entries, already sorted
+  count = dec_u64_internal(blob->data + 24);
+  pos   = QE_BLOB_HEADER + strlen(index->name);
+  width = index->table ? 24 : 16;
+  if (count > (blob->len - pos) / width) goto fail;
+  items = calloc(count ? count : 1, sizeof(struct qe_index_entry *));
+  for(loaded=0; loaded<count; loaded++) {
+    if (pos + width > blob->len) goto fail;
+    items[loaded] = slab_alloc_internal(&(index->slab));
+    items[loaded]->ptr  = dec_u64_internal(blob->data + pos);
+    items[loaded]->size = dec_u64_internal(blob->data + pos + 8);
+    if (index->table) {
+      ((struct qe_hash_entry *)items[loaded])->hash = dec_u64_internal(blob->data + pos + 16);
+    }
+    pos += width;
+    if (!keyed_internal(index)) continue;
+    if (pos + 4 > blob->len) { loaded++; goto fail; }
+    if (dec_u32_internal(blob->data + pos) > blob->len - pos - 4) { loaded++; goto fail; }
+    items[loaded]->key = key_new_internal(blob->data + pos + 4, dec_u32_internal(blob->data + pos));
+    pos += 4 + dec_u32_internal(blob->data + pos);
+  }
+  if (dec_u32_internal(blob->data + 12) & QE_BLOB_BLOOM) {
+    bloom = bloom_load_internal(blob, &pos);
+    if (!bloom) goto fail;
+  }
+  if (pos + 4 > blob->len) goto fail;
+  if (crc32_internal(0, blob->data, pos) != dec_u32_internal(blob->data + pos)) goto fail;
+  buf_clear(blob);
+  free(blob);
+
+  // Hand the sorted entries to the index as-is
+  index->persisted = catalog->blob[i];
+  index->bloom     = bloom;
+  if (index->table) {
+    index_insert_internal(index, items, count);
+    free(items);
+    return QUERY_ENGINE_RETURN_OK;
+  }
+  free(index->mindex->items);
+  index->mindex->items  = (void **)items;
+  index->mindex->length = count;
+  index->mindex->max    = count ? count : 1;
+  return QUERY_ENGINE_RETURN_OK;
+
+fail:
+  while(loaded--) purge_internal(items[loaded], index);
+  free(items);
+  if (bloom) {
+    free(bloom->counters);
+    free(bloom);
+  }
+  buf_clear(blob);
+  free(blob);
+  return QUERY_ENGINE_RETURN_ERR;
+}
+
+// Write all indexes without a valid persisted copy to the medium
+QUERY_ENGINE_RETURN_CODE catalog_persist_internal(struct query_engine_t *instance) {
+  struct qe_catalog *catalog = instance->catalog;
+  struct qe_index   *idx;
+  struct buf        *blobs[QE_CATALOG_MAX];
+  PALLOC_OFFSET      ptrs[QE_CATALOG_MAX];
+  uint32_t           fresh = 0;
+  uint32_t           i;
+  if (!catalog) return QUERY_ENGINE_RETURN_OK;
+
+  // Replaced copies go first, making room in the catalog
+  for( idx = instance->index ; idx ; idx = idx->next ) {
+    if (idx->persisted) continue;
+    for(i=0; i<catalog->count; i++) {
+      if (strcmp(catalog->name[i], idx->name) == 0) {
+        catalog_drop_internal(instance, i);
+        break;
+      }
+    }
+  }
+
+  // Reserve space for the fresh copies
+  for( idx = instance->index ; idx ; idx = idx->next ) {
+    if (idx->persisted) continue;
+    if (catalog->count >= QE_CATALOG_MAX) break;
+    blobs[fresh] = index_blob_internal(instance, idx);
+    ptrs[fresh]  = palloc(instance->fd, blobs[fresh]->len);
+    if (!ptrs[fresh]) {
+      buf_clear(blobs[fresh]);
+      free(blobs[fresh]);
+      continue;
+    }
+    catalog->blob[catalog->count] = ptrs[fresh];
+    catalog->name[catalog->count] = strdup(idx->name);
+    catalog->count++;
+    idx->persisted = ptrs[fresh];
+    fresh++;
+  }
+  if (!fresh && (catalog->flags & QE_CATALOG_CLEAN)) {
+    return QUERY_ENGINE_RETURN_OK;
+  }
+
+  // List the allocations before writing them, so a crash doesn't leak them
+  catalog->flags &= ~QE_CATALOG_CLEAN;
+  catalog_write_internal(instance);
+  for(i=0; i<fresh; i++) {
+    write_internal(instance, ptrs[i], blobs[i]->data, blobs[i]->len);
+    buf_clear(blobs[i]);
+    free(blobs[i]);
+  }
+  fsync_os(instance->fd);
+  catalog->flags |= QE_CATALOG_CLEAN;
+  catalog_write_internal(instance);
+  fsync_os(instance->fd);
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+void catalog_free_internal(struct query_engine_t *instance) {
+  struct qe_catalog *catalog = instance->catalog;
+  if (!catalog) return;
+  for(uint32_t i=0; i<catalog->count; i++) {
+    free(catalog->name[i]);
+  }
+  free(catalog);
+  instance->catalog = NULL;
+}
+
+// }}}
+
+// Change feed {{{
+//
+// With QUERY_ENGINE_CHANGES, every committed mutation appends a change per
+// record it stores or drops to a log next to the medium, each under the
+// next sequence number. Changes hold records as stored, so reading them
+// back decodes & deserializes like a qe_get. The log starts with a header
+// holding the sequence number before its first change, which is all that
+// remains of changes trimmed off its head. Every QE_CHANGES_STRIDE changes
+// the offset is remembered, so reading from a sequence number only walks
+// the changes since the nearest one before it.
+
+#define QE_CHANGES_MAGIC      "QECHLOG"
+#define QE_CHANGES_VERSION    1
+#define QE_CHANGES_HEADER     24
+#define QE_CHANGES_RECORD     "QECR"
+#define QE_CHANGES_REC_HEADER 20
+#define QE_CHANGES_STRIDE     256
+#define QE_CHANGES_CHUNK      (1024 * 1024)
+
+struct qe_changes {
+  mutex_os  lock;
+  int       fd;
+  char     *path;
+  uint64_t  offset;
+  uint64_t  base;
+  uint64_t  seq;
+  uint64_t *marks;
+  size_t    nmarks;
+  size_t    maxmarks;
+  uint64_t  undo_offset;
+  uint64_t  undo_seq;
+  size_t    undo_nmarks;
+};
+
+// A stretch of the log read ahead of the walk
+struct qe_changes_window {
+  char     *data;
+  size_t    cap;
+  size_t    len;
+  uint64_t  start;
+};
+
+// Remember where a change lives if it starts a stride
+void changes_mark_internal(struct qe_changes *changes, uint64_t seq, uint64_t offset) {
+  if ((seq - changes->base - 1) % QE_CHANGES_STRIDE) return;
+  if (changes->nmarks == changes->maxmarks) {
+    changes->maxmarks = changes->maxmarks ? changes->maxmarks * 2 : 64;
+    changes->marks    = realloc(changes->marks, changes->maxmarks * sizeof(uint64_t));
+  }
+  changes->marks[changes->nmarks++] = offset;
+}
+
+// Have the window hold need bytes at off, reading a chunk at once where possible
+const char * changes_window_internal(struct qe_changes_window *win, int fd, uint64_t off, size_t need, uint64_t end) {
+  size_t  want;
+  ssize_t n;
+  if (off + need > end) return NULL;
+  if ((off >= win->start) && (off + need <= win->start + win->len)) return win->data + (off - win->start);
+  want = (end - off < QE_CHANGES_CHUNK) ? (end - off) : QE_CHANGES_CHUNK;
+  if (want < need) want = need;
+  if (want > win->cap) {
+    win->cap  = want;
+    win->data = realloc(win->data, win->cap);
+  }
+  win->start = off;
+  win->len   = 0;
+  while(win->len < want) {
+    n = pread_os(fd, win->data + win->len, want - win->len, off + win->len);
+    if (n <= 0) break;
+    win->len += n;
+  }
+  return (win->len >= need) ? win->data : NULL;
+}
+
+// Walk the valid changes between offset & end, seq being the one before the first
+// fn stops the walk by returning nonzero, returns the offset after the last change walked
+uint64_t changes_walk_internal(struct qe_changes *changes, uint64_t offset, uint64_t end, uint64_t seq, int (*fn)(uint64_t seq, int type, const struct buf *payload, uint64_t offset, void *udata), void *udata) {
+  struct qe_changes_window win = {0};
+  struct buf               payload;
+  const char              *data;
+  uint32_t                 plen;
+  while((data = changes_window_internal(&win, changes->fd, offset, QE_CHANGES_REC_HEADER + 4, end))) {
+    if (memcmp(data, QE_CHANGES_RECORD, 4)) break;
+    if (dec_u64_internal(data + 8) != seq + 1) break;
+    plen = dec_u32_internal(data + 4);
+    data = changes_window_internal(&win, changes->fd, offset, QE_CHANGES_REC_HEADER + plen + 4, end);
+    if (!data) break;
+    if (crc32_internal(0, data, QE_CHANGES_REC_HEADER + plen) != dec_u32_internal(data + QE_CHANGES_REC_HEADER + plen)) break;
+    payload.data = (char *)data + QE_CHANGES_REC_HEADER;
+    payload.len  = plen;
+    payload.cap  = plen;
+    seq++;
+    if (fn && fn(seq, dec_u32_internal(data + 16), &payload, offset, udata)) break;
+    offset += QE_CHANGES_REC_HEADER + plen + 4;
+  }
+  free(win.data);
+  return offset;
+}
+
+int changes_load_internal(uint64_t seq, int type, const struct buf *payload, uint64_t offset, void *udata) {
+  struct qe_changes *changes = udata;
+  changes->seq = seq;
+  changes_mark_internal(changes, seq, offset);
+  return 0;
+}
+
+// Start a log holding nothing after base
+QUERY_ENGINE_RETURN_CODE changes_header_internal(int fd, uint64_t base) {
+  char    header[QE_CHANGES_HEADER];
+  ssize_t n;
+  memset(header, 0, QE_CHANGES_HEADER);
+  memcpy(header, QE_CHANGES_MAGIC, 8);
+  enc_u32_internal(header +  8, QE_CHANGES_VERSION);
+  enc_u64_internal(header + 16, base);
+  n = pwrite_os(fd, header, QE_CHANGES_HEADER, 0);
+  if (n != QE_CHANGES_HEADER) return QUERY_ENGINE_RETURN_ERR;
+  return fsync_os(fd) ? QUERY_ENGINE_RETURN_ERR : QUERY_ENGINE_RETURN_OK;
+}
+
+// Pick up the log from its header, up to its first torn change
+QUERY_ENGINE_RETURN_CODE changes_load_log_internal(struct qe_changes *changes) {
+  struct stat_os st;
+  char           header[QE_CHANGES_HEADER];
+  if (pread_os(changes->fd, header, QE_CHANGES_HEADER, 0) != QE_CHANGES_HEADER) {
+    if (changes_header_internal(changes->fd, 0)) return QUERY_ENGINE_RETURN_ERR;
+    memset(header, 0, QE_CHANGES_HEADER);
+  } else if (memcmp(header, QE_CHANGES_MAGIC, 8) || (dec_u32_internal(header + 8) != QE_CHANGES_VERSION)) {
+    return QUERY_ENGINE_RETURN_ERR;
+  }
+  if (fstat_os(changes->fd, &st)) return QUERY_ENGINE_RETURN_ERR;
+  changes->base   = dec_u64_internal(header + 16);
+  changes->seq    = changes->base;
+  changes->nmarks = 0;
+  changes->offset = changes_walk_internal(changes, QE_CHANGES_HEADER, st.st_size, changes->base, changes_load_internal, changes);
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+QUERY_ENGINE_RETURN_CODE changes_open_internal(struct query_engine_t *instance, const char *filename) {
+  struct qe_changes *changes = calloc(1, sizeof(struct qe_changes));
+  changes->path = malloc(strlen(filename) + 9);
+  sprintf(changes->path, "%s.changes", filename);
+  mutex_init_os(&(changes->lock));
+  instance->changes = changes;
+  changes->fd = open_os(changes->path, O_CREAT | O_RDWR | O_BINARY, OPENMODE);
+  if (changes->fd < 0) return QUERY_ENGINE_RETURN_ERR;
+  return changes_load_log_internal(changes);
+}
+
+void changes_free_internal(struct query_engine_t *instance) {
+  struct qe_changes *changes = instance->changes;
+  if (!changes) return;
+  if (changes->fd >= 0) {
+    fsync_os(changes->fd);
+    close_os(changes->fd);
+  }
+  mutex_destroy_os(&(changes->lock));
+  free(changes->marks);
+  free(changes->path);
+  free(changes);
+  instance->changes = NULL;
+}
+
+void changes_record_internal(struct buf *log, uint64_t seq, int type, const struct buf *payload) {
+  char   num[QE_CHANGES_REC_HEADER];
+  size_t start = log->len;
+  memcpy(num, QE_CHANGES_RECORD, 4);
+  enc_u32_internal(num +  4, payload->len);
+  enc_u64_internal(num +  8, seq);
+  enc_u32_internal(num + 16, type);
+  buf_append(log, num, QE_CHANGES_REC_HEADER);
+  buf_append(log, payload->data, payload->len);
+  enc_u32_internal(num, crc32_internal(0, log->data + start, log->len - start));
+  buf_append(log, num, 4);
+}
+
+// Log the changes of a mutation, like the write-ahead log takes it: records dropped, then stored
+// The dropped records are read from the medium, so this goes before anything is freed
+QUERY_ENGINE_RETURN_CODE changes_append_internal(struct query_engine_t *instance, const PALLOC_OFFSET *ptrs, struct buf **data, size_t n, struct qe_index_entry **frees, size_t nfrees) {
+  struct qe_changes *changes = instance->changes;
+  struct buf         log     = {0};
+  struct buf        *dropped;
+  uint64_t           seq;
+  size_t             i, nmarks, written = 0;
+  ssize_t            w;
+  if (!changes) return QUERY_ENGINE_RETURN_OK;
+  seq    = changes->seq;
+  nmarks = changes->nmarks;
+  changes->undo_offset = changes->offset;
+  changes->undo_seq    = changes->seq;
+  changes->undo_nmarks = nmarks;
+  for( i = 0 ; i < nfrees ; i++ ) {
+    dropped = read_range_internal(instance, frees[i]->ptr, frees[i]->size);
+    if (!dropped) {
+      changes->nmarks = nmarks;
+      buf_clear(&log);
+      return QUERY_ENGINE_RETURN_ERR;
+    }
+    changes_mark_internal(changes, ++seq, changes->offset + log.len);
+    changes_record_internal(&log, seq, QUERY_ENGINE_CHANGE_DEL, dropped);
+    buf_clear(dropped);
+    free(dropped);
+  }
+  for( i = 0 ; i < n ; i++ ) {
+    if (!ptrs[i]) continue;
+    changes_mark_internal(changes, ++seq, changes->offset + log.len);
+    changes_record_internal(&log, seq, QUERY_ENGINE_CHANGE_SET, data[i]);
+  }
+  if (!log.len) return QUERY_ENGINE_RETURN_OK;
+
+  // A failed append is overwritten by the next one
+  while(written < log.len) {
+    w = pwrite_os(changes->fd, log.data + written, log.len - written, changes->offset + written);
+    if (w <= 0) {
+      changes->nmarks = nmarks;
+      buf_clear(&log);
+      return QUERY_ENGINE_RETURN_ERR;
+    }
+    written += w;
+  }
+  stats_written_internal(instance, log.len);
+  changes->offset += log.len;
+  changes->seq     = seq;
+  buf_clear(&log);
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+// Take back the last append, for a mutation failing after it
+// Its first change is invalidated, so a reopen doesn't pick it up either
+void changes_undo_internal(struct query_engine_t *instance) {
+  struct qe_changes *changes = instance->changes;
+  if (!changes) return;
+  if (changes->offset == changes->undo_offset) return;
+  pwrite_os(changes->fd, "\0\0\0\0", 4, changes->undo_offset);
+  changes->offset = changes->undo_offset;
+  changes->seq    = changes->undo_seq;
+  changes->nmarks = changes->undo_nmarks;
+}
+
+QUERY_ENGINE_RETURN_CODE changes_sync_internal(struct query_engine_t *instance) {
+  struct qe_changes *changes = instance->changes;
+  QUERY_ENGINE_RETURN_CODE result;
+  if (!changes) return QUERY_ENGINE_RETURN_OK;
+  mutex_lock_os(&(changes->lock));
+  result = fsync_os(changes->fd) ? QUERY_ENGINE_RETURN_ERR : QUERY_ENGINE_RETURN_OK;
+  mutex_unlock_os(&(changes->lock));
+  return result;
+}
+
+int changes_stop_internal(uint64_t seq, int type, const struct buf *payload, uint64_t offset, void *udata) {
+  return seq > *((uint64_t *)udata);
+}
+
+// Offset of the change after seq, walking from the nearest mark before it
+uint64_t changes_find_internal(struct qe_changes *changes, uint64_t seq) {
+  size_t k = (seq - changes->base) / QE_CHANGES_STRIDE;
+  if (k >= changes->nmarks) return changes->offset;
+  if (seq == changes->base + (k * QE_CHANGES_STRIDE)) return changes->marks[k];
+  return changes_walk_internal(changes, changes->marks[k], changes->offset, changes->base + (k * QE_CHANGES_STRIDE), changes_stop_internal, &seq);
+}
+
+struct qe_changes_feed {
+  struct query_engine_t *qe;
+  int                  (*callback)(uint64_t seq, int type, void *record, void *udata);
+  void                  *udata;
+};
+
+int changes_feed_internal(uint64_t seq, int type, const struct buf *payload, uint64_t offset, void *udata) {
+  struct qe_changes_feed *feed = udata;
+  stats_hydration_internal(feed->qe);
+  return feed->callback(seq, type, deserialize_internal(feed->qe, payload), feed->udata);
+}
+
+QUERY_ENGINE_RETURN_CODE changes_since_internal(struct query_engine_t *instance, uint64_t seq, int (*callback)(uint64_t seq, int type, void *record, void *udata), void *udata) {
+  struct qe_changes      *changes = instance->changes;
+  struct qe_changes_feed  feed    = { .qe = instance, .callback = callback, .udata = udata };
+  if (!changes || !callback) return QUERY_ENGINE_RETURN_ERR;
+  if (seq < changes->base) return QUERY_ENGINE_RETURN_ERR;
+  if (seq >= changes->seq) return QUERY_ENGINE_RETURN_OK;
+  changes_walk_internal(changes, changes_find_internal(changes, seq), changes->offset, seq, changes_feed_internal, &feed);
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+// Rewrite the log without the changes up to seq, aside & moved into place
+QUERY_ENGINE_RETURN_CODE changes_trim_internal(struct query_engine_t *instance, uint64_t seq) {
+  struct qe_changes        *changes = instance->changes;
+  struct qe_changes_window  win     = {0};
+  const char               *data;
+  char                     *tmp;
+  uint64_t                  from, off;
+  size_t                    len;
+  int                       fd;
+  QUERY_ENGINE_RETURN_CODE  result  = QUERY_ENGINE_RETURN_OK;
+  if (!changes) return QUERY_ENGINE_RETURN_ERR;
+  if (seq > changes->seq) seq = changes->seq;
+  if (seq <= changes->base) return QUERY_ENGINE_RETURN_OK;
+  from = changes_find_internal(changes, seq);
+
+  tmp = malloc(strlen(changes->path) + 5);
+  sprintf(tmp, "%s.tmp", changes->path);
+  fd = open_os(tmp, O_CREAT | O_RDWR | O_TRUNC | O_BINARY, OPENMODE);
+  if (fd < 0) {
+    free(tmp);
+    return QUERY_ENGINE_RETURN_ERR;
+  }
+  for( off = from ; (off < changes->offset) && !result ; off += len ) {
+    len  = (changes->offset - off < QE_CHANGES_CHUNK) ? (changes->offset - off) : QE_CHANGES_CHUNK;
+    data = changes_window_internal(&win, changes->fd, off, len, changes->offset);
+    if (!data || (pwrite_os(fd, data, len, QE_CHANGES_HEADER + (off - from)) != (ssize_t)len)) {
+      result = QUERY_ENGINE_RETURN_ERR;
+    }
+  }
+  free(win.data);
+  if (result || changes_header_internal(fd, seq)) {
+    close_os(fd);
+    unlink_os(tmp);
+    free(tmp);
+    return QUERY_ENGINE_RETURN_ERR;
+  }
+
+  mutex_lock_os(&(changes->lock));
+  if (rename_os(tmp, changes->path) || sync_dir_os(changes->path)) {
+    close_os(fd);
+    unlink_os(tmp);
+    result = QUERY_ENGINE_RETURN_ERR;
+  } else {
+    close_os(changes->fd);
+    changes->fd = fd;
+    result      = changes_load_log_internal(changes);
+  }
+  mutex_unlock_os(&(changes->lock));
+  free(tmp);
+  return result;
+}
+
+// }}}
+
+// Write-ahead log {{{
+//
+// With QUERY_ENGINE_WAL, every mutation appends a record to a log next to
+// the medium, holding the bytes written to new allocations and the
+// allocations it frees. The log starts with a checkpoint, listing the
+// records on the medium as of its last sync. Frees only reach the medium
+// once the log holding them is synced, so replaying the log on top of the
+// checkpoint always gives the committed set of records. The medium itself
+// is only synced at checkpoints.
+
+#define QE_WAL_MAGIC       "QEWALOG"
+#define QE_WAL_VERSION     1
+#define QE_WAL_HEADER      24
+#define QE_WAL_RECORD      "QEWR"
+#define QE_WAL_REC_HEADER  16
+#define QE_WAL_CHECKPOINT  (64 * 1024 * 1024)
+
+struct qe_wal_pending {
+  PALLOC_OFFSET ptr;
+  uint64_t      lsn;
+};
+
+struct qe_wal {
+  mutex_os               lock;
+  mutex_os               sync_lock;
+  int                    fd;
+  char                  *path;
+  uint64_t               offset;
+  uint64_t               appended;
+  uint64_t               synced;
+  uint64_t               since;
+  size_t                 bytes;
+  unsigned int           ms;
+  struct qe_wal_pending *pending;
+  size_t                 npending;
+  size_t                 maxpending;
+};
+
+struct qe_wal_event {
+  PALLOC_OFFSET  ptr;
+  uint64_t       seq;
+  const char    *data;
+  uint32_t       len;
+  int            write;
+};
+
+QUERY_ENGINE_RETURN_CODE wal_write_internal(int fd, uint64_t off, const char *data, size_t len) {
+  ssize_t n;
+  size_t  written = 0;
+  while(written < len) {
+    n = pwrite_os(fd, data + written, len - written, off + written);
+    if (n <= 0) return QUERY_ENGINE_RETURN_ERR;
+    written += n;
+  }
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+int wal_ptr_cmp_internal(const void *a, const void *b) {
+  PALLOC_OFFSET off_a = *((const PALLOC_OFFSET *)a);
+  PALLOC_OFFSET off_b = *((const PALLOC_OFFSET *)b);
+  if (off_a < off_b) return -1;
+  if (off_a > off_b) return  1;
+  return 0;
+}
+
+// Whether an allocation is only held on to by a snapshot, rather than a record
+int snapshot_held_internal(const struct query_engine_t *instance, PALLOC_OFFSET ptr) {
+  struct qe_snapshot *snapshot = instance->snapshot;
+  int                 held;
+  if (!snapshot) return 0;
+  mutex_lock_os(&(snapshot->lock));
+  if (!snapshot->sorted && snapshot->nheld) {
+    qsort(snapshot->held, snapshot->nheld, sizeof(PALLOC_OFFSET), wal_ptr_cmp_internal);
+    snapshot->sorted = 1;
+  }
+  held = snapshot->nheld && bsearch(&ptr, snapshot->held, snapshot->nheld, sizeof(PALLOC_OFFSET), wal_ptr_cmp_internal);
+  mutex_unlock_os(&(snapshot->lock));
+  return held;
+}
+
+int wal_event_cmp_internal(const void *a, const void *b) {
+  const struct qe_wal_event *ev_a = a;
+  const struct qe_wal_event *ev_b = b;
+  if (ev_a->ptr != ev_b->ptr) return wal_ptr_cmp_internal(&(ev_a->ptr), &(ev_b->ptr));
+  if (ev_a->seq < ev_b->seq) return -1;
+  if (ev_a->seq > ev_b->seq) return  1;
+  return 0;
+}
+
+// Log a mutation, before any index sees it
+QUERY_ENGINE_RETURN_CODE wal_append_internal(struct query_engine_t *instance, const PALLOC_OFFSET *ptrs, struct buf **data, size_t n, struct qe_index_entry **frees, size_t nfrees) {
+  struct qe_wal *wal     = instance->wal;
+  struct buf     record  = {0};
+  char           num[QE_WAL_REC_HEADER];
+  uint32_t       nwrites = 0;
+  size_t         i;
+  if (!wal) return QUERY_ENGINE_RETURN_OK;
+
+  memset(num, 0, QE_WAL_REC_HEADER);
+  buf_append(&record, num, QE_WAL_REC_HEADER);
+  for( i = 0 ; i < n ; i++ ) {
+    if (!ptrs[i]) continue;
+    enc_u64_internal(num, ptrs[i]);
+    enc_u32_internal(num + 8, data[i]->len);
+    buf_append(&record, num, 12);
+    buf_append(&record, data[i]->data, data[i]->len);
+    nwrites++;
+  }
+  for( i = 0 ; i < nfrees ; i++ ) {
+    enc_u64_internal(num, frees[i]->ptr);
+    buf_append(&record, num, 8);
+  }
+  if (!nwrites && !nfrees) {
+    buf_clear(&record);
+    return QUERY_ENGINE_RETURN_OK;
+  }
+  memcpy(record.data, QE_WAL_RECORD, 4);
+  enc_u32_internal(record.data +  4, record.len - QE_WAL_REC_HEADER);
+  enc_u32_internal(record.data +  8, nwrites);
+  enc_u32_internal(record.data + 12, nfrees);
+  enc_u32_internal(num, crc32_internal(0, record.data, record.len));
+  buf_append(&record, num, 4);
+
+  // A failed append is overwritten by the next one
+  if (wal_write_internal(wal->fd, wal->offset, record.data, record.len)) {
+    buf_clear(&record);
+    return QUERY_ENGINE_RETURN_ERR;
+  }
+  stats_written_internal(instance, record.len);
+  mutex_lock_os(&(wal->lock));
+  if (wal->appended == wal->synced) wal->since = (now_ns_os() / 1000000);
+  wal->offset   += record.len;
+  wal->appended += record.len;
+  mutex_unlock_os(&(wal->lock));
+  buf_clear(&record);
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+// Release an allocation, waiting for the log to cover it if there is one
+void wal_pfree_internal(struct query_engine_t *instance, PALLOC_OFFSET ptr) {
+  struct qe_wal *wal = instance->wal;
+  if (!wal) {
+    release_internal(instance, ptr);
+    return;
+  }
+  if (wal->npending == wal->maxpending) {
+    wal->maxpending = wal->maxpending ? wal->maxpending * 2 : 64;
+    wal->pending    = realloc(wal->pending, wal->maxpending * sizeof(struct qe_wal_pending));
+  }
+  wal->pending[wal->npending].ptr = ptr;
+  wal->pending[wal->npending].lsn = wal->appended;
+  wal->npending++;
+}
+
+// Make the log durable up to lsn, one fsync covering every writer waiting
+QUERY_ENGINE_RETURN_CODE wal_sync_internal(struct query_engine_t *instance, uint64_t lsn) {
+  struct qe_wal *wal    = instance->wal;
+  uint64_t       target = 0;
+  QUERY_ENGINE_RETURN_CODE result = QUERY_ENGINE_RETURN_OK;
+  if (!wal) return QUERY_ENGINE_RETURN_OK;
+  mutex_lock_os(&(wal->sync_lock));
+  mutex_lock_os(&(wal->lock));
+  if ((wal->synced < lsn) && (wal->synced < wal->appended)) {
+    target = wal->appended;
+  }
+  mutex_unlock_os(&(wal->lock));
+  if (target) {
+    if (changes_sync_internal(instance) || fsync_os(wal->fd)) {
+      result = QUERY_ENGINE_RETURN_ERR;
+    } else {
+      mutex_lock_os(&(wal->lock));
+      if (target > wal->synced) wal->synced = target;
+      mutex_unlock_os(&(wal->lock));
+    }
+  }
+  mutex_unlock_os(&(wal->sync_lock));
+  return result;
+}
+
+// Sequence number to sync up to after a mutation, 0 if the policy allows waiting
+uint64_t wal_due_internal(struct query_engine_t *instance) {
+  struct qe_wal *wal = instance->wal;
+  uint64_t       due = 0;
+  if (!wal) return 0;
+  mutex_lock_os(&(wal->lock));
+  if (wal->appended > wal->synced) {
+    if (
+      ((!wal->bytes) && (!wal->ms)) ||
+      (wal->bytes && (wal->appended - wal->synced >= wal->bytes)) ||
+      (wal->ms && ((now_ns_os() / 1000000) - wal->since >= wal->ms))
+    ) {
+      due = wal->appended;
+    }
+  }
+  mutex_unlock_os(&(wal->lock));
+  return due;
+}
+
+// Hand frees covered by the synced log to the medium
+void wal_release_internal(struct query_engine_t *instance) {
+  struct qe_wal *wal = instance->wal;
+  uint64_t       synced;
+  size_t         i, kept;
+  if (!wal) return;
+  if (!wal->npending) return;
+  mutex_lock_os(&(wal->lock));
+  synced = wal->synced;
+  mutex_unlock_os(&(wal->lock));
+  for( i = 0, kept = 0 ; i < wal->npending ; i++ ) {
+    if (wal->pending[i].lsn <= synced) {
+      release_internal(instance, wal->pending[i].ptr);
+    } else {
+      wal->pending[kept++] = wal->pending[i];
+    }
+  }
+  wal->npending = kept;
+}
+
+// Sync the whole log, leaving nothing pending
+QUERY_ENGINE_RETURN_CODE wal_flush_internal(struct query_engine_t *instance) {
+  struct qe_wal *wal = instance->wal;
+  if (!wal) return QUERY_ENGINE_RETURN_OK;
+  if (wal_sync_internal(instance, wal->appended)) return QUERY_ENGINE_RETURN_ERR;
+  wal_release_internal(instance);
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+// Start a fresh log, listing the records on the already synced medium
+QUERY_ENGINE_RETURN_CODE wal_reset_internal(struct query_engine_t *instance) {
+  struct qe_wal *wal        = instance->wal;
+  struct buf     checkpoint = {0};
+  char           num[QE_WAL_HEADER];
+  char          *tmp;
+  PALLOC_OFFSET  ptr        = 0;
+  uint64_t       count      = 0;
+  int            fd;
+  QUERY_ENGINE_RETURN_CODE result = QUERY_ENGINE_RETURN_OK;
+
+  memset(num, 0, QE_WAL_HEADER);
+  buf_append(&checkpoint, num, QE_WAL_HEADER);
+  while((ptr = palloc_next(instance->fd, ptr))) {
+    if (catalog_meta_internal(instance, ptr)) continue;
+    if (snapshot_held_internal(instance, ptr)) continue;
+    enc_u64_internal(num, ptr);
+    buf_append(&checkpoint, num, 8);
+    count++;
+  }
+  memcpy(checkpoint.data, QE_WAL_MAGIC, 8);
+  enc_u32_internal(checkpoint.data +  8, QE_WAL_VERSION);
+  enc_u64_internal(checkpoint.data + 16, count);
+  enc_u32_internal(num, crc32_internal(0, checkpoint.data, checkpoint.len));
+  buf_append(&checkpoint, num, 4);
+
+  // Written aside & moved into place, there's always a valid log
+  tmp = malloc(strlen(wal->path) + 5);
+  sprintf(tmp, "%s.tmp", wal->path);
+  fd = open_os(tmp, O_CREAT | O_RDWR | O_TRUNC | O_BINARY, OPENMODE);
+  if (fd < 0) {
+    buf_clear(&checkpoint);
+    free(tmp);
+    return QUERY_ENGINE_RETURN_ERR;
+  }
+  if (wal_write_internal(fd, 0, checkpoint.data, checkpoint.len) || fsync_os(fd)) {
+    close_os(fd);
+    unlink_os(tmp);
+    buf_clear(&checkpoint);
+    free(tmp);
+    return QUERY_ENGINE_RETURN_ERR;
+  }
+  close_os(fd);
+
+  mutex_lock_os(&(wal->sync_lock));
+  if (wal->fd >= 0) close_os(wal->fd);
+  if (rename_os(tmp, wal->path) || sync_dir_os(wal->path)) {
+    unlink_os(tmp);
+    result = QUERY_ENGINE_RETURN_ERR;
+  } else {
+    wal->offset = checkpoint.len;
+  }
+  wal->fd = open_os(wal->path, O_RDWR | O_BINARY);
+  if (wal->fd < 0) result = QUERY_ENGINE_RETURN_ERR;
+  mutex_unlock_os(&(wal->sync_lock));
+
+  buf_clear(&checkpoint);
+  free(tmp);
+  return result;
+}
+
+// Sync everything & truncate the log to a checkpoint
+QUERY_ENGINE_RETURN_CODE wal_checkpoint_internal(struct query_engine_t *instance) {
+  if (!instance->wal) return QUERY_ENGINE_RETURN_OK;
+  if (wal_flush_internal(instance)) return QUERY_ENGINE_RETURN_ERR;
+  if (fsync_os(instance->fd)) return QUERY_ENGINE_RETURN_ERR;
+  return wal_reset_internal(instance);
+}
+
+// Before mutating, free what the log covers & keep it from growing unbounded
+void wal_prepare_internal(struct query_engine_t *instance) {
+  struct qe_wal *wal = instance->wal;
+  if (!wal) return;
+  wal_release_internal(instance);
+  if (wal->offset > QE_WAL_CHECKPOINT) wal_checkpoint_internal(instance);
+}
+
+// Bring the medium to the state the log describes
+// Torn & uncommitted allocations are freed, committed writes redone
+void wal_recover_internal(struct query_engine_t *instance) {
+  struct qe_wal       *wal     = instance->wal;
+  struct buf           log     = {0};
+  struct stat_os       st;
+  struct qe_wal_event *events  = NULL;
+  struct qe_wal_event *event;
+  PALLOC_OFFSET       *live    = NULL;
+  PALLOC_OFFSET       *allocs  = NULL;
+  PALLOC_OFFSET        ptr     = 0;
+  struct buf           record;
+  uint64_t             nlive, nwrites, nfrees, seq = 0;
+  size_t               nevents = 0, maxevents = 0, nallocs = 0, maxallocs = 0;
+  size_t               pos, end, i, j;
+  uint32_t             plen;
+  ssize_t              n;
+  int                  committed;
+  int                  fd      = open_os(wal->path, O_RDWR | O_BINARY);
+  if (fd < 0) return;
+
+  // Read the whole log, it's bounded by checkpoints
+  if (fstat_os(fd, &st) || (st.st_size < QE_WAL_HEADER + 4)) {
+    close_os(fd);
+    return;
+  }
+  log.cap  = st.st_size;
+  log.data = malloc(log.cap);
+  while(log.len < log.cap) {
+    n = pread_os(fd, log.data + log.len, log.cap - log.len, log.len);
+    if (n <= 0) break;
+    log.len += n;
+  }
+  close_os(fd);
+
+  // Without a valid checkpoint, there's nothing to trust
+  if (log.len < QE_WAL_HEADER + 4) goto done;
+  nlive = dec_u64_internal(log.data + 16);
+  if (
+    (memcmp(log.data, QE_WAL_MAGIC, 8)) ||
+    (dec_u32_internal(log.data + 8) != QE_WAL_VERSION) ||
+    (nlive > (log.len - QE_WAL_HEADER - 4) / 8) ||
+    (crc32_internal(0, log.data, QE_WAL_HEADER + (nlive * 8)) != dec_u32_internal(log.data + QE_WAL_HEADER + (nlive * 8)))
+  ) goto done;
+  live = malloc((nlive ? nlive : 1) * sizeof(PALLOC_OFFSET));
+  for( i = 0 ; i < nlive ; i++ ) {
+    live[i] = dec_u64_internal(log.data + QE_WAL_HEADER + (i * 8));
+  }
+  qsort(live, nlive, sizeof(PALLOC_OFFSET), wal_ptr_cmp_internal);
+
+  // Collect mutations up to the first torn record
+  pos = QE_WAL_HEADER + (nlive * 8) + 4;
+  while(pos + QE_WAL_REC_HEADER + 4 <= log.len) {
+    if (memcmp(log.data + pos, QE_WAL_RECORD, 4)) break;
+    plen = dec_u32_internal(log.data + pos + 4);
+    if (plen > log.len - pos - QE_WAL_REC_HEADER - 4) break;
+    end = pos + QE_WAL_REC_HEADER + plen;
+    if (crc32_internal(0, log.data + pos, end - pos) != dec_u32_internal(log.data + end)) break;
+    nwrites = dec_u32_internal(log.data + pos +  8);
+    nfrees  = dec_u32_internal(log.data + pos + 12);
+    if (nevents + nwrites + nfrees > maxevents) {
+      maxevents = (nevents + nwrites + nfrees) * 2;
+      events    = realloc(events, maxevents * sizeof(struct qe_wal_event));
+    }
+    for( pos += QE_WAL_REC_HEADER ; nwrites && (pos + 12 <= end) ; nwrites-- ) {
+      if (dec_u32_internal(log.data + pos + 8) > end - pos - 12) break;
+      event        = &(events[nevents++]);
+      event->ptr   = dec_u64_internal(log.data + pos);
+      event->len   = dec_u32_internal(log.data + pos + 8);
+      event->data  = log.data + pos + 12;
+      event->seq   = seq++;
+      event->write = 1;
+      pos += 12 + event->len;
+    }
+    for( ; nfrees && (pos + 8 <= end) ; nfrees-- ) {
+      event        = &(events[nevents++]);
+      event->ptr   = dec_u64_internal(log.data + pos);
+      event->seq   = seq++;
+      event->write = 0;
+      pos += 8;
+    }
+    pos = end + 4;
+  }
+  if (!nevents) goto done;
+
+  // Only the last mutation of every allocation counts
+  qsort(events, nevents, sizeof(struct qe_wal_event), wal_event_cmp_internal);
+  for( i = 0, j = 0 ; i < nevents ; i++ ) {
+    if (j && (events[j-1].ptr == events[i].ptr)) j--;
+    events[j++] = events[i];
+  }
+  nevents = j;
+
+  // Free whatever isn't a committed record, events are found by their leading ptr
+  while((ptr = palloc_next(instance->fd, ptr))) {
+    if (nallocs == maxallocs) {
+      maxallocs = maxallocs ? maxallocs * 2 : 64;
+      allocs    = realloc(allocs, maxallocs * sizeof(PALLOC_OFFSET));
+    }
+    allocs[nallocs++] = ptr;
+  }
+  for( i = 0 ; i < nallocs ; i++ ) {
+    if (catalog_meta_internal(instance, allocs[i])) continue;
+    event     = bsearch(&(allocs[i]), events, nevents, sizeof(struct qe_wal_event), wal_ptr_cmp_internal);
+    committed = event ? event->write : (bsearch(&(allocs[i]), live, nlive, sizeof(PALLOC_OFFSET), wal_ptr_cmp_internal) != NULL);
+    if (!committed) pfree(instance->fd, allocs[i]);
+  }
+
+  // Redo committed writes, re-allocating what the medium lost
+  for( i = 0 ; i < nevents ; i++ ) {
+    event = &(events[i]);
+    if (!event->write) continue;
+    ptr = event->ptr;
+    if (
+      (!bsearch(&ptr, allocs, nallocs, sizeof(PALLOC_OFFSET), wal_ptr_cmp_internal)) ||
+      (palloc_size(instance->fd, ptr) < event->len)
+    ) {
+      ptr = palloc(instance->fd, event->len);
+    }
+    if (!ptr) continue;
+    if (palloc_size(instance->fd, ptr) <= event->len) {
+      write_internal(instance, ptr, event->data, event->len);
+      continue;
+    }
+
+    // A larger allocation gets the padding extended, like any other
+    memset(&record, 0, sizeof(record));
+    buf_append(&record, event->data, event->len);
+    pad_internal(&record, palloc_size(instance->fd, ptr), 1);
+    write_internal(instance, ptr, record.data, record.len);
+    buf_clear(&record);
+  }
+  catalog_dirty_internal(instance);
+
+done:
+  free(events);
+  free(allocs);
+  free(live);
+  buf_clear(&log);
+}
+
+// Open the log next to the medium, recovering from it first
+QUERY_ENGINE_RETURN_CODE wal_open_internal(struct query_engine_t *instance, const char *filename) {
+  struct qe_wal *wal = calloc(1, sizeof(struct qe_wal));
+  wal->fd   = -1;
+  wal->path = malloc(strlen(filename) + 5);
+  sprintf(wal->path, "%s.wal", filename);
+  mutex_init_os(&(wal->lock));
+  mutex_init_os(&(wal->sync_lock));
+  instance->wal = wal;
+
+  wal_recover_internal(instance);
+  if (fsync_os(instance->fd)) return QUERY_ENGINE_RETURN_ERR;
+  return wal_reset_internal(instance);
+}
+
+void wal_free_internal(struct query_engine_t *instance) {
+  struct qe_wal *wal = instance->wal;
+  if (!wal) return;
+  if (wal->fd >= 0) close_os(wal->fd);
+  mutex_destroy_os(&(wal->lock));
+  mutex_destroy_os(&(wal->sync_lock));
+  free(wal->pending);
+  free(wal->path);
+  free(wal);
+  instance->wal = NULL;
+}
+
+// }}}
+
+struct query_engine_t * qe_init(const char *filename, struct buf * (*serialize)(const void *, void *), void * (*deserialize)(const struct buf *, void*), void (*purge)(void*, void*), void *udata, PALLOC_FLAGS flags) {
+  struct query_engine_t *instance = calloc(1, sizeof(struct query_engine_t));
+
+  // Build our response
+  instance->fd          = palloc_open(filename, flags & ~QUERY_ENGINE_FLAGS);
+  instance->serialize   = serialize;
+  instance->deserialize = deserialize;
+  instance->purge       = purge;
+  instance->index       = NULL;
+  instance->catalog     = NULL;
+  instance->map         = NULL;
+  instance->cache       = NULL;
+  instance->wal         = NULL;
+  instance->stats       = NULL;
+  instance->compact     = NULL;
+  instance->codec       = NULL;
+  instance->changes     = NULL;
+  instance->snapshot    = NULL;
+  instance->udata       = udata;
+
+  // Readers share the engine, writers get it to themselves
+  instance->lock = calloc(1, sizeof(rwlock_os));
+  rwlock_init_os(instance->lock);
+
+  // Counters only exist when asked for
+  if (flags & QUERY_ENGINE_STATS) {
+    instance->stats = calloc(1, sizeof(struct qe_stats));
+  }
+
+  // Records are only compressed when asked for, but always decompressed
+  if (flags & QUERY_ENGINE_COMPRESS) {
+    instance->codec = calloc(1, sizeof(struct qe_codec));
+    ((struct qe_codec *)instance->codec)->compress = 1;
+  }
+
+  // Reads come from a mapping if requested
+  if (flags & QUERY_ENGINE_MMAP) {
+    instance->map = calloc(1, sizeof(struct qe_map));
+  }
+
+  // (Re)-initialize the medium
+  palloc_init(instance->fd, flags & ~QUERY_ENGINE_FLAGS);
+
+  // Find out which indexes were persisted
+  catalog_open_internal(instance);
+
+  // Replay the log onto the medium
+  if ((flags & QUERY_ENGINE_WAL) && wal_open_internal(instance, filename)) {
+    wal_free_internal(instance);
+    qe_close(instance);
+    return NULL;
+  }
+  map_sync_internal(instance);
+
+  // Pick up the change feed where it left off
+  if ((flags & QUERY_ENGINE_CHANGES) && changes_open_internal(instance, filename)) {
+    qe_close(instance);
+    return NULL;
+  }
+
+  // Aanndd.. done
+  return instance;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_close(struct query_engine_t *instance) {
+  struct qe_index *idx;
+  if (!instance) return QUERY_ENGINE_RETURN_OK;
+
+  // Persist & release the in-memory indexes
+  catalog_persist_internal(instance);
+  wal_checkpoint_internal(instance);
+  wal_free_internal(instance);
+  changes_free_internal(instance);
+  while(instance->index) {
+    idx             = instance->index;
+    instance->index = idx->next;
+    index_free_internal(idx);
+  }
+  catalog_free_internal(instance);
+  map_free_internal(instance);
+  cache_free_internal(instance);
+  codec_free_internal(instance);
+  free(instance->compact);
+  free(instance->stats);
+  rwlock_destroy_os(instance->lock);
+  free(instance->lock);
+
+  palloc_close(instance->fd);
+  free(instance);
+
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+// Bulk index builds {{{
+//
+// Indexes without a valid persisted copy are built from a single scan of the
+// medium, shared by all indexes added together. A few threads each read &
+// deserialize a contiguous stretch of the medium, extracting every index's
+// entry from each record. Every index then sorts its entries in parallel
+// runs, merged into the mindex in one go. For indexes comparing records, the
+// records stay in memory during the sort (up to QE_BUILD_HYDRATED bytes of
+// them), so those comparisons don't touch the medium either.
+
+#define QE_BUILD_THREADS   8
+#define QE_BUILD_MIN       1024
+#define QE_BUILD_HYDRATED  (256 * 1024 * 1024)
+
+struct qe_build {
+  struct query_engine_t  *qe;
+  struct qe_index       **indexes;
+  size_t                  nindexes;
+  PALLOC_OFFSET          *ptrs;
+  PALLOC_SIZE            *sizes;
+  void                  **records;
+  struct qe_index_entry **entries;
+  size_t                  n;
+  int                     hydrate;
+  int                     keep;
+  uint64_t                kept;
+};
+
+struct qe_build_job {
+  struct qe_build *build;
+  struct qe_slab  *slabs;
+  struct qe_index *index;
+  void           **items;
+  size_t           from;
+  size_t           to;
+};
+
+// Run all jobs, the calling thread taking the first one
+void build_run_internal(struct qe_build_job *jobs, size_t njobs, void * (*fn)(void *)) {
+  thread_os threads[QE_BUILD_THREADS];
+  char      started[QE_BUILD_THREADS] = {0};
+  size_t    i;
+  for( i = 1 ; i < njobs ; i++ ) {
+    started[i] = !thread_create_os(&threads[i], fn, &jobs[i]);
+  }
+  fn(&jobs[0]);
+  for( i = 1 ; i < njobs ; i++ ) {
+    if (started[i]) {
+      thread_join_os(threads[i]);
+    } else {
+      fn(&jobs[i]);
+    }
+  }
+}
+
+// Hydrate a stretch of records, building every index' entry for them
+// Typed indexes only need the serialized records, if those are all there is nothing is deserialized
+void * build_scan_internal(void *arg) {
+  struct qe_build_job *job   = arg;
+  struct qe_build     *build = job->build;
+  struct qe_index     *idx;
+  struct buf           view, exact;
+  struct buf          *contents;
+  void                *record;
+  char                 scratch[QE_SCRATCH];
+  char                 unpacked[QE_SCRATCH];
+  size_t               i, k;
+  int                  keep, state;
+  for( i = job->from ; i < job->to ; i++ ) {
+    contents = view_internal(build->qe, build->ptrs[i], build->sizes[i], &view, scratch);
+    if (!view.data) continue;
+    state  = stored_exact_internal(build->qe, &view, &exact, unpacked);
+    record = NULL;
+    if ((state >= 0) && build->hydrate) record = deserialize_internal(build->qe, state ? &exact : &view);
+    if ((state >= 0) && (record || !build->hydrate)) {
+      keep = build->keep && ((atomic_add_os(&(build->kept), build->sizes[i]) + build->sizes[i]) <= QE_BUILD_HYDRATED);
+      for( k = 0 ; k < build->nindexes ; k++ ) {
+        idx = build->indexes[k];
+        build->entries[(k * build->n) + i] = entry_internal(idx, &(job->slabs[k]), build->ptrs[i], build->sizes[i], record, &exact);
+        if (keep && build->entries[(k * build->n) + i] && !keyed_internal(idx) && !(idx->table)) {
+          build->entries[(k * build->n) + i]->hydrated = record;
+        }
+      }
+      if (keep) {
+        build->records[i] = record;
+      } else if (record) {
+        purge_record_internal(build->qe, record);
+      }
+    }
+    if ((state > 0) && (exact.data != unpacked)) free(exact.data);
+    if (contents) {
+      buf_clear(contents);
+      free(contents);
+    }
+  }
+  return NULL;
+}
+
+void * build_sort_internal(void *arg) {
+  struct qe_build_job *job = arg;
+  sort_internal(job->items + job->from, job->to - job->from, cmp_internal, job->index);
+  return NULL;
+}
+
+// Sort in parallel runs, merging those afterwards
+void build_order_internal(struct qe_index *index, void **items, size_t n, size_t nthreads) {
+  struct qe_build_job jobs[QE_BUILD_THREADS];
+  size_t              bounds[QE_BUILD_THREADS + 1];
+  void              **tmp;
+  size_t              width, i;
+  for( i = 0 ; i <= nthreads ; i++ ) bounds[i] = (n * i) / nthreads;
+  for( i = 0 ; i < nthreads ; i++ ) {
+    jobs[i].index = index;
+    jobs[i].items = items;
+    jobs[i].from  = bounds[i];
+    jobs[i].to    = bounds[i + 1];
+  }
+  build_run_internal(jobs, nthreads, build_sort_internal);
+  tmp = malloc((n ? n : 1) * sizeof(void *));
+  for( width = 1 ; width < nthreads ; width *= 2 ) {
+    for( i = 0 ; i + width < nthreads ; i += 2 * width ) {
+      merge_runs_internal(items, tmp, bounds[i], bounds[i + width], bounds[(i + 2 * width < nthreads) ? i + 2 * width : nthreads], cmp_internal, index);
+    }
+  }
+  free(tmp);
+}
+
+// Fill empty indexes from a single scan of the medium
+void build_internal(struct query_engine_t *instance, struct qe_index **indexes, size_t nindexes) {
+  struct qe_build        build = { .qe = instance, .indexes = indexes, .nindexes = nindexes };
+  struct qe_build_job    jobs[QE_BUILD_THREADS];
+  struct qe_index_entry **items;
+  struct qe_index       *idx;
+  struct qe_hash        *table;
+  PALLOC_OFFSET          ptr   = 0;
+  size_t                 max   = 0;
+  size_t                 nthreads, i, k, m, n;
+
+  // List the records up-front, so the medium can be split into stretches
+  while((ptr = palloc_next(instance->fd, ptr))) {
+    if (catalog_meta_internal(instance, ptr)) continue;
+    if (snapshot_held_internal(instance, ptr)) continue;
+    if (build.n == max) {
+      max         = max ? max * 2 : 1024;
+      build.ptrs  = realloc(build.ptrs, max * sizeof(PALLOC_OFFSET));
+      build.sizes = realloc(build.sizes, max * sizeof(PALLOC_SIZE));
+    }
+    build.ptrs[build.n]  = ptr;
+    build.sizes[build.n] = palloc_size(instance->fd, ptr);
+    build.n++;
+  }
+  for( k = 0 ; k < nindexes ; k++ ) {
+    if (!(indexes[k]->key_type)) build.hydrate = 1;
+    if (!keyed_internal(indexes[k]) && !(indexes[k]->table)) build.keep = 1;
+  }
+  build.records = calloc(build.n ? build.n : 1, sizeof(void *));
+  build.entries = calloc(build.n ? build.n * nindexes : 1, sizeof(struct qe_index_entry *));
+
+  // Small media aren't worth the threads
+  nthreads = cpu_count_os();
+  if (nthreads > QE_BUILD_THREADS) nthreads = QE_BUILD_THREADS;
+  if (nthreads > (build.n / QE_BUILD_MIN)) nthreads = build.n / QE_BUILD_MIN;
+  if (!nthreads) nthreads = 1;
+  // Every thread allocates entries from slabs of its own
+  for( i = 0 ; i < nthreads ; i++ ) {
+    jobs[i].build = &build;
+    jobs[i].slabs = malloc(nindexes * sizeof(struct qe_slab));
+    jobs[i].from  = (build.n * i) / nthreads;
+    jobs[i].to    = (build.n * (i + 1)) / nthreads;
+    for( k = 0 ; k < nindexes ; k++ ) {
+      slab_init_internal(&(jobs[i].slabs[k]), indexes[k]->slab.size);
+    }
+  }
+  build_run_internal(jobs, nthreads, build_scan_internal);
+  for( i = 0 ; i < nthreads ; i++ ) {
+    for( k = 0 ; k < nindexes ; k++ ) {
+      slab_adopt_internal(&(indexes[k]->slab), &(jobs[i].slabs[k]));
+    }
+    free(jobs[i].slabs);
+  }
+
+  for( k = 0 ; k < nindexes ; k++ ) {
+    idx   = indexes[k];
+    items = build.entries + (k * build.n);
+    for( i = 0, m = 0 ; i < build.n ; i++ ) {
+      if (items[i]) items[m++] = items[i];
+    }
+
+    // Sized up-front, nothing to move around later
+    if (idx->table) {
+      table = idx->table;
+      free(table->table);
+      while(((table->size / 4) * 3) < m) table->size *= 2;
+      table->table = calloc(table->size, sizeof(struct qe_hash_entry *));
+      index_insert_internal(idx, items, m);
+      continue;
+    }
+
+    // Records stored more than once keep the last copy, like inserting them one by one would
+    build_order_internal(idx, (void **)items, m, nthreads);
+    for( i = 0, n = 0 ; i < m ; i++ ) {
+      if ((i + 1 < m) && (cmp_internal(items[i], items[i + 1], idx) == 0)) {
+        items[i]->hydrated = NULL;
+        purge_internal(items[i], idx);
+        continue;
+      }
+      items[i]->hydrated = NULL;
+      items[n++]         = items[i];
+    }
+
+    // Hand the sorted entries to the index as-is
+    free(idx->mindex->items);
+    idx->mindex->items  = malloc((n ? n : 1) * sizeof(void *));
+    idx->mindex->length = n;
+    idx->mindex->max    = n ? n : 1;
+    memcpy(idx->mindex->items, items, n * sizeof(void *));
+  }
+
+  for( i = 0 ; i < build.n ; i++ ) {
+    if (build.records[i]) purge_record_internal(instance, build.records[i]);
+  }
+  free(build.records);
+  free(build.entries);
+  free(build.ptrs);
+  free(build.sizes);
+}
+
+// }}}
+
+// Allocate an index, without registering it yet
+struct qe_index * index_new_internal(struct query_engine_t *instance, const struct qe_index_def *def) {
+  struct qe_index *idx = calloc(1, sizeof(struct qe_index));
+  idx->name       = strdup(def->name);
+  idx->udata      = def->udata;
+  idx->cmp        = def->cmp;
+  idx->key        = def->key;
+  idx->hash       = def->hash;
+  idx->eq         = def->eq;
+  idx->key_type   = def->type;
+  idx->key_offset = def->offset;
+  idx->key_length = def->length;
+  idx->qe         = instance;
+  idx->stats      = instance->stats ? calloc(1, sizeof(struct qe_stats)) : NULL;
+  slab_init_internal(&(idx->slab), def->hash ? sizeof(struct qe_hash_entry) : sizeof(struct qe_index_entry));
+  if (def->hash) {
+    idx->table  = hash_init_internal();
+  } else {
+    idx->mindex = mindex_init(cmp_internal, purge_internal, idx);
+  }
+  if (!idx->mindex && !idx->table) {
+    free(idx->stats);
+    free(idx->name);
+    free(idx);
+    return NULL;
+  }
+  return idx;
+}
+
+QUERY_ENGINE_RETURN_CODE index_add_many_internal(struct query_engine_t *instance, const struct qe_index_def *defs, size_t n) {
+  struct qe_index **indexes;
+  struct qe_index **missing;
+  struct qe_index  *idx;
+  size_t            i, j, pending = 0;
+
+  for( i = 0 ; i < n ; i++ ) {
+
+    // Without a key, there's nothing to compare but records
+    // Hashed records are only ever compared for equality
+    // Typed keys always compare bytewise
+    if (!defs[i].name) return QUERY_ENGINE_RETURN_ERR;
+    if (defs[i].type) {
+      if (!key_type_valid_internal(defs[i].type, defs[i].length) || defs[i].cmp || defs[i].key || defs[i].hash) {
+        return QUERY_ENGINE_RETURN_ERR;
+      }
+    } else if (defs[i].hash ? (!defs[i].eq || defs[i].cmp || defs[i].key) : (!defs[i].cmp && !defs[i].key)) {
+      return QUERY_ENGINE_RETURN_ERR;
+    }
+
+    // Find if the index already exists
+    for( idx = instance->index ; idx ; idx = idx->next ) {
+      if (strcmp(idx->name, defs[i].name) == 0) break;
+    }
+    for( j = 0 ; j < i ; j++ ) {
+      if (strcmp(defs[j].name, defs[i].name) == 0) break;
+    }
+    if (idx || (j < i)) {
+      /* fprintf(stderr,"Duplicate index '%s'", defs[i].name); */
+      return QUERY_ENGINE_RETURN_ERR;
+    }
+  }
+
+  // Initialize the indexes, using persisted copies if they're still valid
+  indexes = calloc(n ? n : 1, sizeof(struct qe_index *));
+  for( i = 0 ; i < n ; i++ ) {
+    indexes[i] = index_new_internal(instance, &defs[i]);
+    if (!indexes[i]) {
+      while(i--) index_free_internal(indexes[i]);
+      free(indexes);
+      return QUERY_ENGINE_RETURN_ERR;
+    }
+  }
+  missing = calloc(n ? n : 1, sizeof(struct qe_index *));
+  for( i = 0 ; i < n ; i++ ) {
+    if (index_load_internal(instance, indexes[i])) missing[pending++] = indexes[i];
+  }
+
+  // The rest shares a single scan, records awaiting the log are gone already
+  if (pending) {
+    wal_flush_internal(instance);
+    build_internal(instance, missing, pending);
+  }
+
+  // Register them, in the order given
+  for( i = 0 ; i < n ; i++ ) {
+    indexes[i]->next = instance->index;
+    instance->index  = indexes[i];
+  }
+  free(missing);
+  free(indexes);
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+QUERY_ENGINE_RETURN_CODE index_del_internal(struct query_engine_t *instance, const char *name) {
+  // Find if the index even exists
+  struct qe_index *idx_prev = NULL;
+  struct qe_index *idx      = instance->index;
+  while(idx) {
+    if (strcmp(idx->name,name) == 0) break;
+    idx_prev = idx;
+    idx      = idx->next;
+  }
+
+  // Drop the persisted copy, it would outlive changes made without the index
+  struct qe_catalog *catalog = instance->catalog;
+  for(uint32_t i=0; catalog && i<catalog->count; i++) {
+    if (strcmp(catalog->name[i], name) == 0) {
+      catalog_drop_internal(instance, i);
+      catalog_write_internal(instance);
+      break;
+    }
+  }
+
+  if (!idx) {
+    return QUERY_ENGINE_RETURN_OK;
+  }
+
+  // Remove the index from the list
+  if (idx_prev) {
+    idx_prev->next = idx->next;
+  } else {
+    instance->index = idx->next;
+  }
+
+  // And free the index's memory
+  index_free_internal(idx);
+
+  // Done
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+QUERY_ENGINE_RETURN_CODE bloom_set_internal(struct query_engine_t *instance, const char *name, uint64_t (*hash)(const void *entry, void *udata_qe, void *udata_index), double fpr) {
+  struct qe_index *idx = instance->index;
+  struct qe_bloom *bloom;
+  while(idx) {
+    if (strcmp(idx->name, name) == 0) break;
+    idx = idx->next;
+  }
+  if (!idx) return QUERY_ENGINE_RETURN_ERR;
+  if (fpr >= 1.0) return QUERY_ENGINE_RETURN_ERR;
+  if (fpr <= 0.0) {
+    bloom_free_internal(idx);
+    return QUERY_ENGINE_RETURN_OK;
+  }
+
+  // Only bytewise keys & hash indexes know how to hash entries themselves
+  if (!hash && !idx->table && (!keyed_internal(idx) || idx->cmp)) {
+    return QUERY_ENGINE_RETURN_ERR;
+  }
+
+  // Adopt the persisted filter if the index is unchanged since loading it
+  bloom = idx->bloom;
+  if (bloom && !(bloom->ready) && idx->persisted && (bloom->fpr == fpr)) {
+    bloom->hash  = hash;
+    bloom->ready = 1;
+    return QUERY_ENGINE_RETURN_OK;
+  }
+
+  // Build a fresh one, to be persisted along with the index
+  bloom_free_internal(idx);
+  idx->bloom       = calloc(1, sizeof(struct qe_bloom));
+  idx->bloom->fpr  = fpr;
+  idx->bloom->hash = hash;
+  bloom_build_internal(idx, 0);
+  idx->persisted   = 0;
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+// Compare batch writes by their offset
+int write_cmp_internal(const void *a, const void *b, void *udata) {
+  PALLOC_OFFSET off_a = *((const PALLOC_OFFSET *)a);
+  PALLOC_OFFSET off_b = *((const PALLOC_OFFSET *)b);
+  if (off_a < off_b) return -1;
+  if (off_a > off_b) return  1;
+  return 0;
+}
+
+// Write a batch in offset order, neighbouring allocations in a single call
+QUERY_ENGINE_RETURN_CODE write_batch_internal(const struct query_engine_t *instance, PALLOC_OFFSET *ptrs, struct buf **data, size_t n) {
+  PALLOC_OFFSET **order;
+  struct iovec   *iov;
+  struct buf     *gaps  = NULL;
+  struct qe_arena arena;
+  char            stack[QE_SCRATCH];
+  PALLOC_OFFSET   end;
+  size_t          m     = 0;
+  size_t          i, j, k, a, b;
+  int             iovcnt;
+  QUERY_ENGINE_RETURN_CODE result = QUERY_ENGINE_RETURN_OK;
+
+  arena_init_internal(&arena, stack, sizeof(stack), arena_size_internal(n, sizeof(PALLOC_OFFSET *)) + arena_size_internal((2 * n) + 1, sizeof(struct iovec)));
+  order = arena_alloc_internal(&arena, n, sizeof(PALLOC_OFFSET *));
+  iov   = arena_alloc_internal(&arena, (2 * n) + 1, sizeof(struct iovec));
+  for( i = 0 ; i < n ; i++ ) {
+    if (ptrs[i]) order[m++] = &(ptrs[i]);
+  }
+  sort_internal((void **)order, m, write_cmp_internal, NULL);
+
+  for( i = 0 ; (i < m) && !result ; i = j ) {
+    a   = order[i] - ptrs;
+    end = ptrs[a] + data[a]->len;
+
+    // Find neighbours, only allocation headers in between
+    for( j = i + 1 ; j < m ; j++ ) {
+      b = order[j] - ptrs;
+      if (ptrs[b] - end > QE_COALESCE_GAP) break;
+      if (ptrs[b] + data[b]->len - ptrs[a] > QE_COALESCE_SPAN) break;
+      end = ptrs[b] + data[b]->len;
+    }
+    if (j == i + 1) {
+      result = write_internal(instance, ptrs[a], data[a]->data, data[a]->len);
+      continue;
+    }
+
+    // What's in between is written back as-is
+    gaps = read_range_internal(instance, ptrs[a], end - ptrs[a]);
+    if (!gaps) {
+      result = QUERY_ENGINE_RETURN_ERR;
+      break;
+    }
+    iovcnt = 0;
+    for( k = i ; k < j ; k++ ) {
+      b = order[k] - ptrs;
+      if (k > i) {
+        iov[iovcnt].iov_base = gaps->data + (end - ptrs[a]);
+        iov[iovcnt].iov_len  = ptrs[b] - end;
+        iovcnt++;
+      }
+      iov[iovcnt].iov_base = data[b]->data;
+      iov[iovcnt].iov_len  = data[b]->len;
+      iovcnt++;
+      end = ptrs[b] + data[b]->len;
+    }
+    result = writev_internal(instance, ptrs[a], iov, iovcnt);
+    buf_clear(gaps);
+    free(gaps);
+  }
+
+  arena_free_internal(&arena);
+  return result;
+}
+
+// Compare index entries by the allocation they point to
+int entry_ptr_cmp_internal(const void *a, const void *b, void *udata) {
+  const struct qe_index_entry *entry_a = a;
+  const struct qe_index_entry *entry_b = b;
+  if (entry_a->ptr < entry_b->ptr) return -1;
+  if (entry_a->ptr > entry_b->ptr) return  1;
+  return 0;
+}
+
+// Sort entries by allocation, keeping one per allocation
+size_t unique_internal(struct qe_index_entry **entries, size_t n) {
+  size_t i, m = 0;
+  sort_internal((void **)entries, n, entry_ptr_cmp_internal, NULL);
+  for( i = 0 ; i < n ; i++ ) {
+    if (m && (entries[m-1]->ptr == entries[i]->ptr)) continue;
+    entries[m++] = entries[i];
+  }
+  return m;
+}
+
+// Apply sets & deletes (del[i] set, entries[i] being a pattern) as a single mutation
+// Later operations win over earlier ones they collide with, as if applied one by one
+QUERY_ENGINE_RETURN_CODE batch_internal(struct query_engine_t *instance, const void **entries, const char *del, size_t n) {
+  struct qe_index        *idx;
+  struct qe_index_entry **index_entries = NULL;
+  struct qe_index_entry **block;
+  struct qe_index_entry  *found;
+  struct buf            **serialized    = NULL;
+  struct buf             *raw;
+  PALLOC_OFFSET          *ptrs          = NULL;
+  PALLOC_SIZE            *sizes         = NULL;
+  char                   *dead          = NULL;
+  char                   *plain         = NULL;
+  struct qe_index_entry **replaced      = NULL;
+  size_t                 *lens          = NULL;
+  struct qe_arena         arena;
+  char                    stack[QE_SCRATCH];
+  PALLOC_OFFSET           ptr;
+  size_t                  count         = 0;
+  size_t                  nreplaced     = 0;
+  size_t                  i, k, live;
+  QUERY_ENGINE_RETURN_CODE result = QUERY_ENGINE_RETURN_ERR;
+
+  // Deleting from nothing is fine, storing in nothing isn't
+  if (!(instance->index)) {
+    for( i = 0 ; i < n ; i++ ) {
+      if (!(del && del[i])) return QUERY_ENGINE_RETURN_ERR;
+    }
+    return QUERY_ENGINE_RETURN_OK;
+  }
+  if (!n) {
+    return QUERY_ENGINE_RETURN_OK;
+  }
+  wal_prepare_internal(instance);
+  catalog_dirty_internal(instance);
+
+  for( idx = instance->index ; idx ; idx = idx->next ) count++;
+  arena_init_internal(&arena, stack, sizeof(stack),
+    (2 * arena_size_internal(count * n, sizeof(struct qe_index_entry *))) +
+    arena_size_internal(n, sizeof(struct buf *)) +
+    arena_size_internal(n, sizeof(PALLOC_OFFSET)) +
+    arena_size_internal(n, sizeof(PALLOC_SIZE)) +
+    (2 * arena_size_internal(n, sizeof(char))) +
+    arena_size_internal(count, sizeof(size_t))
+  );
+  index_entries = arena_alloc_internal(&arena, count * n, sizeof(struct qe_index_entry *));
+  replaced      = arena_alloc_internal(&arena, count * n, sizeof(struct qe_index_entry *));
+  serialized    = arena_alloc_internal(&arena, n, sizeof(struct buf *));
+  ptrs          = arena_alloc_internal(&arena, n, sizeof(PALLOC_OFFSET));
+  sizes         = arena_alloc_internal(&arena, n, sizeof(PALLOC_SIZE));
+  dead          = arena_alloc_internal(&arena, n, sizeof(char));
+  plain         = arena_alloc_internal(&arena, n, sizeof(char));
+  lens          = arena_alloc_internal(&arena, count, sizeof(size_t));
+
+  // Turn into something we can write to disk, typed keys come from there
+  for( i = 0 ; i < n ; i++ ) {
+    if (del && del[i]) continue;
+    serialized[i] = instance->serialize(entries[i], instance->udata);
+    if (!serialized[i]) goto cleanup;
+  }
+
+  // Build index entries up-front, keys come from the entries themselves
+  // Until inserted, entries compare against the given entry & hold their batch position
+  // A pattern without a key for an index doesn't delete from it, a record too short for a typed
+  // index isn't indexed by it, as long as some index holds it
+  for( k = 0, idx = instance->index ; idx ; k++, idx = idx->next ) {
+    block = index_entries + (k * n);
+    for( i = 0 ; i < n ; i++ ) {
+      block[lens[k]] = entry_internal(idx, &(idx->slab), i, 0, entries[i], serialized[i]);
+      if (!block[lens[k]]) {
+        if ((del && del[i]) || idx->key_type) continue;
+        goto cleanup;
+      }
+      dead[i] = 1;
+      block[lens[k]++]->hydrated = entries[i];
+    }
+  }
+
+  // Until collisions are known, dead marks the records some index holds
+  for( i = 0 ; i < n ; i++ ) {
+    if (!dead[i] && !(del && del[i])) goto cleanup;
+  }
+
+  // Later entries replace earlier ones they collide with in any index
+  // Deletes are never inserted themselves
+  for( i = 0 ; i < n ; i++ ) {
+    dead[i] = del && del[i];
+  }
+  for( k = 0, idx = instance->index ; idx ; k++, idx = idx->next ) {
+    index_collide_internal(idx, index_entries + (k * n), lens[k], dead);
+  }
+
+  // Compress what's actually written
+  for( i = 0 ; i < n ; i++ ) {
+    if (dead[i]) continue;
+    raw           = serialized[i];
+    serialized[i] = codec_encode_internal(instance, raw);
+    plain[i]      = serialized[i] == raw;
+  }
+
+  // Reserve persistent allocations in a single pass
+  // Plain records get padded to tell their length, compressed ones carry it already
+  for( i = 0 ; i < n ; i++ ) {
+    if (dead[i]) continue;
+    ptrs[i] = palloc(instance->fd, serialized[i]->len + plain[i]);
+    if (!ptrs[i]) goto cleanup;
+    cache_invalidate_internal(instance, ptrs[i]);
+    sizes[i] = palloc_size(instance->fd, ptrs[i]);
+    if (plain[i]) pad_internal(serialized[i], sizes[i], 0);
+  }
+
+  // Actually write to persistent storage
+  if (write_batch_internal(instance, ptrs, serialized, n)) {
+    goto cleanup;
+  }
+
+  // Find whatever record we're replacing in any index
+  for( k = 0, idx = instance->index ; idx ; k++, idx = idx->next ) {
+    block = index_entries + (k * n);
+    for( i = 0 ; i < lens[k] ; i++ ) {
+      found = index_find_internal(idx, block[i]);
+      if (found) replaced[nreplaced++] = found;
+    }
+  }
+  nreplaced = unique_internal(replaced, nreplaced);
+
+  // Log before any index sees it, a failure leaves everything as it was
+  if (changes_append_internal(instance, ptrs, serialized, n, replaced, nreplaced)) {
+    goto cleanup;
+  }
+  if (wal_append_internal(instance, ptrs, serialized, n, replaced, nreplaced)) {
+    changes_undo_internal(instance);
+    goto cleanup;
+  }
+
+  // Drop the replaced records
+  for( i = 0 ; i < nreplaced ; i++ ) {
+    ptr  = replaced[i]->ptr;
+    if (!remove_internal(instance, ptr, replaced[i]->size)) {
+      wal_pfree_internal(instance, ptr);
+    }
+  }
+
+  // Insert the survivors into all indexes, in their sorted order
+  for( k = 0, idx = instance->index ; idx ; k++, idx = idx->next ) {
+    block = index_entries + (k * n);
+    live  = 0;
+    for( i = 0 ; i < lens[k] ; i++ ) {
+      if (dead[block[i]->ptr]) {
+        block[i]->hydrated = NULL;
+        purge_internal(block[i], idx);
+        continue;
+      }
+      block[i]->size = sizes[block[i]->ptr];
+      block[i]->ptr  = ptrs[block[i]->ptr];
+      block[live++]  = block[i];
+    }
+    index_insert_internal(idx, block, live);
+    bloom_add_internal(idx, block, live);
+    for( i = 0 ; i < live ; i++ ) {
+      block[i]->hydrated = NULL;
+    }
+    memset(block, 0, n * sizeof(struct qe_index_entry *));
+  }
+  result = QUERY_ENGINE_RETURN_OK;
+
+cleanup:
+  for( k = 0, idx = instance->index ; idx ; k++, idx = idx->next ) {
+    for( i = 0 ; i < n ; i++ ) {
+      if (!index_entries[(k * n) + i]) continue;
+      index_entries[(k * n) + i]->hydrated = NULL;
+      purge_internal(index_entries[(k * n) + i], idx);
+    }
+  }
+  for( i = 0 ; i < n ; i++ ) {
+    if (result && ptrs[i]) pfree(instance->fd, ptrs[i]);
+    if (!serialized[i]) continue;
+    buf_clear(serialized[i]);
+    free(serialized[i]);
+  }
+  arena_free_internal(&arena);
+  return result;
+}
+
+QUERY_ENGINE_RETURN_CODE set_many_internal(struct query_engine_t *instance, const void **entries, size_t n) {
+  return batch_internal(instance, entries, NULL, n);
+}
+
+QUERY_ENGINE_RETURN_CODE del_internal(struct query_engine_t *instance, const void *pattern) {
+  char del = 1;
+  return batch_internal(instance, &pattern, &del, 1);
+}
+
+// Whether the new record sorts or hashes differently from the old one in an index
+// Keyed indexes compare the keys as stored, the old one given
+int update_moved_internal(struct qe_index *index, const struct buf *old_key, const void *old, struct qe_index_entry *entry, const void *record) {
+  if (keyed_internal(index)) return key_cmp_internal(old_key, entry->key) != 0;
+  stats_cmp_internal(index);
+  if (index->table) {
+    if (hash_of_internal(index, old) != ((struct qe_hash_entry *)entry)->hash) return 1;
+    return !index->eq(old, record, index->qe->udata, index->udata);
+  }
+  return index->cmp(old, record, index->qe->udata, index->udata) != 0;
+}
+
+// Replace the record found by pattern, overwriting it if the new one fits its allocation
+// Only indexes the record moved in are touched, anything else goes through a batch
+QUERY_ENGINE_RETURN_CODE update_internal(struct query_engine_t *instance, const char *index, const void *pattern, const void *entry) {
+  struct qe_index        *idx;
+  struct qe_index_entry   lookup;
+  struct qe_index_entry  *found;
+  struct qe_index_entry   old_pattern;
+  struct qe_index_entry **entries   = NULL;
+  struct buf            **old_keys  = NULL;
+  char                   *moved     = NULL;
+  struct buf             *serialized = NULL;
+  struct buf             *raw;
+  struct buf             *contents;
+  struct buf              view, exact;
+  struct qe_arena         arena;
+  char                    stack[QE_SCRATCH];
+  char                    scratch[QE_SCRATCH];
+  char                    unpacked[QE_SCRATCH];
+  const void             *fallback[2];
+  char                    del[2]    = { 1, 0 };
+  void                   *old       = NULL;
+  PALLOC_OFFSET           ptr;
+  PALLOC_SIZE             size;
+  size_t                  k, count  = 0;
+  int                     state, plain, inplace = 0;
+  QUERY_ENGINE_RETURN_CODE result = QUERY_ENGINE_RETURN_ERR;
+
+  for( idx = instance->index ; idx ; idx = idx->next ) {
+    if (strcmp(idx->name, index) == 0) break;
+  }
+  if (!idx || pattern_internal(idx, pattern, &lookup)) return QUERY_ENGINE_RETURN_ERR;
+  found = index_find_internal(idx, &lookup);
+  key_free_internal(lookup.key);
+  if (!found) return QUERY_ENGINE_RETURN_ERR;
+  ptr  = found->ptr;
+  size = found->size;
+
+  // Typed keys of the old record come from its stored form
+  contents = view_internal(instance, ptr, size, &view, scratch);
+  if (!view.data) return QUERY_ENGINE_RETURN_ERR;
+  state = stored_exact_internal(instance, &view, &exact, unpacked);
+  if (state >= 0) old = deserialize_internal(instance, &view);
+  if (!old) goto cleanup;
+
+  for( idx = instance->index ; idx ; idx = idx->next ) count++;
+  arena_init_internal(&arena, stack, sizeof(stack),
+    arena_size_internal(count, sizeof(struct qe_index_entry *)) +
+    arena_size_internal(count, sizeof(struct buf *)) +
+    arena_size_internal(count, sizeof(char))
+  );
+  entries  = arena_alloc_internal(&arena, count, sizeof(struct qe_index_entry *));
+  old_keys = arena_alloc_internal(&arena, count, sizeof(struct buf *));
+  moved    = arena_alloc_internal(&arena, count, sizeof(char));
+  memset(entries, 0, count * sizeof(struct qe_index_entry *));
+  memset(old_keys, 0, count * sizeof(struct buf *));
+
+  serialized = instance->serialize(entry, instance->udata);
+  if (!serialized) goto done;
+
+  // Find out which indexes the record moves in, it mustn't land on another record there
+  for( k = 0, idx = instance->index ; idx ; k++, idx = idx->next ) {
+    entries[k] = entry_internal(idx, &(idx->slab), ptr, size, entry, serialized);
+    if (!entries[k]) goto done;
+    entries[k]->hydrated = entry;
+    if (keyed_internal(idx)) {
+      old_keys[k] = key_internal(idx, old, &exact);
+      if (!old_keys[k]) goto done;
+    }
+    moved[k] = update_moved_internal(idx, old_keys[k], old, entries[k], entry);
+    if (moved[k] && index_find_internal(idx, entries[k])) goto done;
+  }
+
+  // Needs to fit the existing allocation, along with padding if it's plain
+  // A snapshot may still have to copy the old record, so it's left alone meanwhile
+  raw        = serialized;
+  serialized = codec_encode_internal(instance, raw);
+  plain      = serialized == raw;
+  if (serialized->len + plain > size) goto done;
+  if (instance->snapshot) goto done;
+  pad_internal(serialized, size, !plain);
+  inplace = 1;
+
+  // Overwriting can't be undone, so the log is synced before the medium is touched
+  wal_prepare_internal(instance);
+  catalog_dirty_internal(instance);
+  if (changes_append_internal(instance, &ptr, &serialized, 1, &found, 1)) goto done;
+  if (wal_append_internal(instance, &ptr, &serialized, 1, NULL, 0)) {
+    changes_undo_internal(instance);
+    goto done;
+  }
+  if (wal_sync_internal(instance, UINT64_MAX)) goto done;
+
+  // Moved entries leave while the medium still holds the record they point at
+  for( k = 0, idx = instance->index ; idx ; k++, idx = idx->next ) {
+    if (!moved[k]) continue;
+    old_pattern.ptr      = 0;
+    old_pattern.hydrated = old;
+    old_pattern.key      = old_keys[k];
+    bloom_delete_internal(idx, &old_pattern);
+    index_delete_internal(idx, &old_pattern);
+  }
+  cache_invalidate_internal(instance, ptr);
+  result = write_internal(instance, ptr, serialized->data, serialized->len);
+
+  // A failed write is redone from the log on the next open, the indexes follow the log
+  for( k = 0, idx = instance->index ; idx ; k++, idx = idx->next ) {
+    if (!moved[k]) continue;
+    index_insert_internal(idx, &(entries[k]), 1);
+    bloom_add_internal(idx, &(entries[k]), 1);
+    entries[k]->hydrated = NULL;
+    entries[k] = NULL;
+  }
+
+done:
+  for( k = 0, idx = instance->index ; idx ; k++, idx = idx->next ) {
+    key_free_internal(old_keys[k]);
+    if (!entries[k]) continue;
+    entries[k]->hydrated = NULL;
+    purge_internal(entries[k], idx);
+  }
+  arena_free_internal(&arena);
+
+  // Whatever doesn't fit replaces the old record like qe_set would, through its own allocation
+  if (!inplace) {
+    fallback[0] = old;
+    fallback[1] = entry;
+    result = batch_internal(instance, fallback, del, 2);
+  }
+
+cleanup:
+  if (serialized) {
+    buf_clear(serialized);
+    free(serialized);
+  }
+  if (old) purge_record_internal(instance, old);
+  if ((state > 0) && (exact.data != unpacked)) free(exact.data);
+  if (contents) {
+    buf_clear(contents);
+    free(contents);
+  }
+  return result;
+}
+
+// Compaction {{{
+//
+// Compaction walks the medium front to back, moving every live record into
+// the first hole that fits it, if that's before where it is now. A move is
+// logged & written like a replacement, after which the index entries of the
+// record point at the new allocation. Each move holds the write lock by
+// itself, so readers keep being served in between.
+
+// Whether an allocation only waits for the log before being freed
+int wal_pending_internal(const struct query_engine_t *instance, PALLOC_OFFSET ptr) {
+  struct qe_wal *wal = instance->wal;
+  size_t         i;
+  if (!wal) return 0;
+  for( i = 0 ; i < wal->npending ; i++ ) {
+    if (wal->pending[i].ptr == ptr) return 1;
+  }
+  return 0;
+}
+
+// Move a record to an earlier hole, if there is one
+QUERY_ENGINE_RETURN_CODE compact_move_internal(struct query_engine_t *instance, PALLOC_OFFSET ptr, PALLOC_SIZE size) {
+  struct qe_index        *idx;
+  struct qe_index_entry **found = NULL;
+  struct qe_index_entry   pattern;
+  struct qe_index_entry   old   = { .ptr = ptr, .size = size };
+  struct qe_index_entry  *frees = &old;
+  struct buf             *raw;
+  struct buf              exact;
+  void                   *record;
+  char                    unpacked[QE_SCRATCH];
+  PALLOC_OFFSET           dst;
+  PALLOC_SIZE             dsize;
+  size_t                  k, n  = 0;
+  int                     live  = !(instance->index);
+  int                     state;
+  QUERY_ENGINE_RETURN_CODE result = QUERY_ENGINE_RETURN_ERR;
+
+  raw = read_range_internal(instance, ptr, size);
+  if (!raw) return QUERY_ENGINE_RETURN_ERR;
+  state  = stored_exact_internal(instance, raw, &exact, unpacked);
+  record = deserialize_internal(instance, raw);
+  if (!record) goto cleanup;
+
+  // Only records the indexes point at are live, whatever else is there is garbage
+  for( idx = instance->index ; idx ; idx = idx->next ) n++;
+  found = calloc(n ? n : 1, sizeof(struct qe_index_entry *));
+  n     = 0;
+  for( idx = instance->index ; idx ; idx = idx->next ) {
+    found[n] = NULL;
+    if (!stored_pattern_internal(idx, record, (state >= 0) ? &exact : NULL, &pattern)) {
+      found[n] = index_find_internal(idx, &pattern);
+      key_free_internal(pattern.key);
+    }
+    if (found[n] && (found[n]->ptr == ptr)) live = 1;
+    n++;
+  }
+  purge_record_internal(instance, record);
+  if (!live) {
+    result = QUERY_ENGINE_RETURN_OK;
+    goto cleanup;
+  }
+
+  // First fit lands past the record if there's no hole for it
+  dst = palloc(instance->fd, size);
+  if (!dst) goto cleanup;
+  if (dst > ptr) {
+    pfree(instance->fd, dst);
+    result = QUERY_ENGINE_RETURN_OK;
+    goto cleanup;
+  }
+
+  // Same as a replacement, copy & log before pointing the indexes at it
+  catalog_dirty_internal(instance);
+  dsize = palloc_size(instance->fd, dst);
+  pad_internal(raw, dsize, 1);
+  cache_invalidate_internal(instance, dst);
+  if (
+    write_internal(instance, dst, raw->data, raw->len) ||
+    wal_append_internal(instance, &dst, &raw, 1, &frees, 1)
+  ) {
+    pfree(instance->fd, dst);
+    goto cleanup;
+  }
+  for( k = 0 ; k < n ; k++ ) {
+    if (!found[k] || (found[k]->ptr != ptr)) continue;
+    found[k]->ptr  = dst;
+    found[k]->size = dsize;
+  }
+  cache_invalidate_internal(instance, ptr);
+  wal_pfree_internal(instance, ptr);
+  result = QUERY_ENGINE_RETURN_OK;
+
+cleanup:
+  if ((state > 0) && (exact.data != unpacked)) free(exact.data);
+  free(found);
+  buf_clear(raw);
+  free(raw);
+  return result;
+}
+
+// Visit the next allocation, counting the bytes visited, none at the end of a pass
+QUERY_ENGINE_RETURN_CODE compact_step_internal(struct query_engine_t *instance, size_t *visited) {
+  struct qe_compact *compact = instance->compact;
+  PALLOC_OFFSET      ptr     = compact->active ? compact->next : palloc_next(instance->fd, 0);
+  *visited        = 0;
+  compact->active = !!ptr;
+
+  // Release what the pass moved away from, instead of waiting for the next write
+  if (!ptr) return wal_flush_internal(instance);
+
+  compact->next   = palloc_next(instance->fd, ptr);
+  *visited        = palloc_size(instance->fd, ptr);
+  if (catalog_meta_internal(instance, ptr)) return QUERY_ENGINE_RETURN_OK;
+  if (wal_pending_internal(instance, ptr)) return QUERY_ENGINE_RETURN_OK;
+  if (snapshot_held_internal(instance, ptr)) return QUERY_ENGINE_RETURN_OK;
+  wal_prepare_internal(instance);
+  return compact_move_internal(instance, ptr, *visited);
+}
+
+// }}}
+
+// Transactions {{{
+
+struct qe_txn {
+  struct query_engine_t  *qe;
+  const void            **entries;
+  char                   *del;
+  size_t                  n;
+  size_t                  max;
+};
+
+struct qe_txn * qe_begin(struct query_engine_t *instance) {
+  struct qe_txn *txn = calloc(1, sizeof(struct qe_txn));
+  txn->qe = instance;
+  return txn;
+}
+
+QUERY_ENGINE_RETURN_CODE txn_push_internal(struct qe_txn *txn, const void *entry, char del) {
+  if (!txn) return QUERY_ENGINE_RETURN_ERR;
+  if (txn->n == txn->max) {
+    txn->max     = txn->max ? txn->max * 2 : 16;
+    txn->entries = realloc(txn->entries, txn->max * sizeof(void *));
+    txn->del     = realloc(txn->del, txn->max * sizeof(char));
+  }
+  txn->entries[txn->n] = entry;
+  txn->del[txn->n]     = del;
+  txn->n++;
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_txn_set(struct qe_txn *txn, const void *entry) {
+  return txn_push_internal(txn, entry, 0);
+}
+
+QUERY_ENGINE_RETURN_CODE qe_txn_del(struct qe_txn *txn, const void *pattern) {
+  return txn_push_internal(txn, pattern, 1);
+}
+
+QUERY_ENGINE_RETURN_CODE qe_abort(struct qe_txn *txn) {
+  if (!txn) return QUERY_ENGINE_RETURN_OK;
+  free(txn->entries);
+  free(txn->del);
+  free(txn);
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+// }}}
+
+void * get_internal(struct query_engine_t *instance, const char *index, const void *pattern) {
+  struct qe_index       *idx = instance->index;
+  struct qe_index_entry  pattern_internal_entry;
+  struct qe_index_entry *entry;
+  void                  *record = NULL;
+  while(idx) {
+    if (strcmp(idx->name, index) == 0) break;
+    idx = idx->next;
+  }
+  if (!idx) {
+    // No such index
+    return NULL;
+  }
+
+  if (pattern_internal(idx, pattern, &pattern_internal_entry)) {
+    return NULL;
+  }
+
+  // Records the filter rules out aren't looked for
+  if (bloom_miss_internal(idx, &pattern_internal_entry)) {
+    key_free_internal(pattern_internal_entry.key);
+    return NULL;
+  }
+
+  // Hash indexes read the record while probing, there's no need to read it twice
+  // Others fetch the contents from the medium & deserialize by the client
+  if (idx->table) {
+    hash_find_internal(idx, pattern, &record);
+  } else {
+    entry  = mindex_get(idx->mindex, &pattern_internal_entry);
+    record = entry ? hydrate_internal(instance, entry->ptr, entry->size, 1) : NULL;
+  }
+  key_free_internal(pattern_internal_entry.key);
+  if (!record && idx->bloom && idx->bloom->ready) {
+    atomic_add_os(&(idx->bloom->false_positives), 1);
+  }
+  return record;
+}
+
+// Batched reads {{{
+//
+// qe_get_many resolves every pattern before reading any record, then reads
+// the records in offset order. Records close together on the medium share a
+// single read, and the kernel is told about every range before the first
+// one is read, so the reads are in flight together.
+
+// Compare slots of an entry list by the allocation their entry points to
+int entry_slot_cmp_internal(const void *a, const void *b, void *udata) {
+  const struct qe_index_entry *entry_a = *((struct qe_index_entry * const *)a);
+  const struct qe_index_entry *entry_b = *((struct qe_index_entry * const *)b);
+  if (entry_a->ptr < entry_b->ptr) return -1;
+  if (entry_a->ptr > entry_b->ptr) return  1;
+  return 0;
+}
+
+// Caller-owned records for the given entries, NULL where reading failed
+void read_many_internal(struct query_engine_t *instance, struct qe_index_entry **entries, void **records, size_t n) {
+  struct qe_index_entry ***order  = malloc((n ? n : 1) * sizeof(struct qe_index_entry **));
+  size_t                  *bounds = malloc((n + 1) * sizeof(size_t));
+  struct qe_cache_entry   *cached;
+  struct qe_index_entry   *entry;
+  struct buf              *contents;
+  struct buf               view;
+  PALLOC_OFFSET            start, end;
+  size_t                   i, j, k, m = 0, runs = 0;
+
+  // Cached & mapped records don't need any reads
+  for( i = 0 ; i < n ; i++ ) {
+    records[i] = NULL;
+    cached     = cache_get_internal(instance, entries[i]->ptr);
+    if (cached) {
+      records[i] = deserialize_internal(instance, &(cached->raw));
+      cache_release_internal(instance, cached);
+      continue;
+    }
+    if (map_internal(instance, entries[i]->ptr, entries[i]->size)) {
+      records[i] = hydrate_internal(instance, entries[i]->ptr, entries[i]->size, 1);
+      continue;
+    }
+    order[m++] = &(entries[i]);
+  }
+  sort_internal((void **)order, m, entry_slot_cmp_internal, NULL);
+
+  // Find neighbours, hinting at every range before reading any
+  for( i = 0 ; i < m ; i = j ) {
+    start = (*order[i])->ptr;
+    end   = start + (*order[i])->size;
+    for( j = i + 1 ; j < m ; j++ ) {
+      entry = *order[j];
+      if ((entry->ptr > end) && (entry->ptr - end > QE_COALESCE_GAP)) break;
+      if (entry->ptr + entry->size - start > QE_COALESCE_SPAN) break;
+      if (entry->ptr + entry->size > end) end = entry->ptr + entry->size;
+    }
+    prefetch_os(instance->fd, start, end - start);
+    bounds[runs++] = i;
+  }
+  bounds[runs] = m;
+
+  for( k = 0 ; k < runs ; k++ ) {
+    start = (*order[bounds[k]])->ptr;
+    end   = start;
+    for( i = bounds[k] ; i < bounds[k+1] ; i++ ) {
+      if ((*order[i])->ptr + (*order[i])->size > end) end = (*order[i])->ptr + (*order[i])->size;
+    }
+    contents = read_range_internal(instance, start, end - start);
+    if (!contents) continue;
+    for( i = bounds[k] ; i < bounds[k+1] ; i++ ) {
+      entry     = *order[i];
+      view.data = contents->data + (entry->ptr - start);
+      view.len  = entry->size;
+      view.cap  = entry->size;
+      stats_hydration_internal(instance);
+      records[order[i] - entries] = deserialize_internal(instance, &view);
+      if (!records[order[i] - entries]) continue;
+      cached = cache_put_internal(instance, entry->ptr, view.data, view.len, NULL);
+      if (cached) cache_release_internal(instance, cached);
+    }
+    buf_clear(contents);
+    free(contents);
+  }
+
+  free(bounds);
+  free(order);
+}
+
+QUERY_ENGINE_RETURN_CODE get_many_internal(struct query_engine_t *instance, const char *index, const void **patterns, size_t n, void **results) {
+  struct qe_index        *idx      = instance->index;
+  struct qe_index_entry **entries  = NULL;
+  struct qe_index_entry  *entry;
+  struct qe_index_entry   pattern;
+  size_t                 *owner    = NULL;
+  char                   *filtered;
+  void                  **records;
+  size_t                  count    = 0;
+  size_t                  max      = 0;
+  size_t                  i, j;
+  while(idx) {
+    if (strcmp(idx->name, index) == 0) break;
+    idx = idx->next;
+  }
+  if (!idx) {
+    // No such index
+    return QUERY_ENGINE_RETURN_ERR;
+  }
+
+  // Resolve everything first, hash indexes yielding every entry with a matching hash
+  filtered = calloc(n ? n : 1, sizeof(char));
+  for( i = 0 ; i < n ; i++ ) {
+    results[i] = NULL;
+    if (pattern_internal(idx, patterns[i], &pattern)) continue;
+    if (bloom_miss_internal(idx, &pattern)) {
+      filtered[i] = 1;
+      key_free_internal(pattern.key);
+      continue;
+    }
+    j = count;
+    if (idx->table) {
+      count = hash_candidates_internal(idx, hash_of_internal(idx, patterns[i]), &entries, &max, count);
+    } else if ((entry = mindex_get(idx->mindex, &pattern))) {
+      if (count == max) {
+        max     = max ? max * 2 : 16;
+        entries = realloc(entries, max * sizeof(struct qe_index_entry *));
+      }
+      entries[count++] = entry;
+    }
+    key_free_internal(pattern.key);
+    if (count > j) owner = realloc(owner, max * sizeof(size_t));
+    for( ; j < count ; j++ ) owner[j] = i;
+  }
+
+  records = calloc(count ? count : 1, sizeof(void *));
+  read_many_internal(instance, entries, records, count);
+
+  // Hash candidates only count if they're equal
+  for( j = 0 ; j < count ; j++ ) {
+    if (!records[j]) continue;
+    i = owner[j];
+    if (!results[i] && idx->table) {
+      stats_cmp_internal(idx);
+      if (idx->eq(patterns[i], records[j], instance->udata, idx->udata)) {
+        results[i] = records[j];
+        continue;
+      }
+    } else if (!results[i]) {
+      results[i] = records[j];
+      continue;
+    }
+    purge_record_internal(instance, records[j]);
+  }
+  for( i = 0 ; idx->bloom && idx->bloom->ready && (i < n) ; i++ ) {
+    if (!filtered[i] && !results[i]) atomic_add_os(&(idx->bloom->false_positives), 1);
+  }
+
+  free(records);
+  free(filtered);
+  free(entries);
+  free(owner);
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+// }}}
+
+struct qe_cursor {
+  struct query_engine_t *qe;
+  struct qe_index       *index;
+  struct qe_index_entry  lower;
+  struct qe_index_entry  upper;
+  int                    flags;
+  size_t                 pos;
+  size_t                 offset;
+  size_t                 limit;
+  int (*cmp)(struct qe_index *, struct qe_index_entry *, struct qe_index_entry *);
+};
+
+struct qe_cursor * cursor_open_internal(struct query_engine_t *instance, const char *index, const void *lower, const void *upper, int flags) {
+  struct qe_index  *idx = instance->index;
+  struct qe_cursor *cursor;
+  while(idx) {
+    if (strcmp(idx->name, index) == 0) break;
+    idx = idx->next;
+  }
+  if (!idx) {
+    // No such index
+    return NULL;
+  }
+
+  // Hash indexes have no order to walk
+  if (idx->table) return NULL;
+
+  // Prefixes only make sense on bytewise keys
+  if (flags & QUERY_ENGINE_CURSOR_PREFIX) {
+    if (!lower || !keyed_internal(idx) || idx->cmp) return NULL;
+    upper = lower;
+  }
+
+  cursor        = calloc(1, sizeof(struct qe_cursor));
+  cursor->qe    = instance;
+  cursor->index = idx;
+  cursor->flags = flags;
+  cursor->limit = SIZE_MAX;
+  cursor->cmp   = (flags & QUERY_ENGINE_CURSOR_PREFIX) ? bound_prefix_internal : bound_cmp_internal;
+  if (lower && pattern_internal(idx, lower, &(cursor->lower))) {
+    free(cursor);
+    return NULL;
+  }
+  if (upper && pattern_internal(idx, upper, &(cursor->upper))) {
+    key_free_internal(cursor->lower.key);
+    free(cursor);
+    return NULL;
+  }
+
+  // Position on the first entry within the bounds
+  if (flags & QUERY_ENGINE_CURSOR_REVERSE) {
+    cursor->pos = upper
+      ? bound_internal(idx, 0, &(cursor->upper), !(flags & QUERY_ENGINE_CURSOR_EXCLUDE_UPPER), cursor->cmp)
+      : idx->mindex->length;
+  } else {
+    cursor->pos = lower
+      ? bound_internal(idx, 0, &(cursor->lower), !!(flags & QUERY_ENGINE_CURSOR_EXCLUDE_LOWER), cursor->cmp)
+      : 0;
+  }
+
+  return cursor;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_cursor_limit(struct qe_cursor *cursor, size_t offset, size_t limit) {
+  if (!cursor) return QUERY_ENGINE_RETURN_ERR;
+  cursor->offset = offset;
+  cursor->limit  = limit;
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+void * cursor_next_internal(struct qe_cursor *cursor) {
+  struct qe_index       *idx;
+  struct qe_index_entry *entry;
+  struct qe_index_entry *bound;
+  struct qe_index_entry  hydrated;
+  void                  *record;
+  int                    result;
+  int                    reverse;
+  if (!cursor) return NULL;
+  if (!(cursor->limit)) return NULL;
+  idx     = cursor->index;
+  reverse = cursor->flags & QUERY_ENGINE_CURSOR_REVERSE;
+  bound   = reverse
+    ? (cursor->lower.hydrated ? &(cursor->lower) : NULL)
+    : (cursor->upper.hydrated ? &(cursor->upper) : NULL);
+
+  // Skipping entries doesn't need them, they're sorted
+  if (reverse) {
+    cursor->pos = (cursor->pos > cursor->offset) ? cursor->pos - cursor->offset : 0;
+  } else {
+    cursor->pos += cursor->offset;
+  }
+  cursor->offset = 0;
+
+  // The index may have shrunk since the last call
+  if (cursor->pos > idx->mindex->length) {
+    cursor->pos = idx->mindex->length;
+  }
+  if (reverse ? (cursor->pos == 0) : (cursor->pos >= idx->mindex->length)) {
+    cursor->limit = 0;
+    return NULL;
+  }
+  entry = idx->mindex->items[reverse ? cursor->pos - 1 : cursor->pos];
+
+  // Keyed indexes check the bound before touching the medium
+  record = NULL;
+  if (!keyed_internal(idx)) {
+    record = hydrate_internal(cursor->qe, entry->ptr, entry->size, 0);
+    if (!record) {
+      cursor->limit = 0;
+      return NULL;
+    }
+  }
+  if (bound) {
+    hydrated.ptr      = entry->ptr;
+    hydrated.hydrated = record;
+    hydrated.key      = entry->key;
+    result = cursor->cmp(idx, keyed_internal(idx) ? entry : &hydrated, bound);
+    if (reverse) result = -result;
+    if (
+      (result > 0) ||
+      ((result == 0) && (cursor->flags & (reverse ? QUERY_ENGINE_CURSOR_EXCLUDE_LOWER : QUERY_ENGINE_CURSOR_EXCLUDE_UPPER)) && !(cursor->flags & QUERY_ENGINE_CURSOR_PREFIX))
+    ) {
+      if (record) purge_record_internal(cursor->qe, record);
+      cursor->limit = 0;
+      return NULL;
+    }
+  }
+  if (!record) {
+    record = hydrate_internal(cursor->qe, entry->ptr, entry->size, 0);
+    if (!record) {
+      cursor->limit = 0;
+      return NULL;
+    }
+  }
+
+  // Advance
+  if (reverse) {
+    cursor->pos--;
+  } else {
+    cursor->pos++;
+  }
+  cursor->limit--;
+  return record;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_cursor_close(struct qe_cursor *cursor) {
+  if (!cursor) return QUERY_ENGINE_RETURN_OK;
+  key_free_internal(cursor->lower.key);
+  key_free_internal(cursor->upper.key);
+  free(cursor);
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+// Order statistics {{{
+//
+// Ordered indexes are sorted arrays, so an entry's position is its rank.
+// Counting a range takes two binary searches for its bounds, selecting by
+// position none at all. Keyed indexes compare keys held in memory, so
+// neither reads records from the medium, others hydrate the ones the
+// searches compare against.
+
+struct qe_index * order_index_internal(struct query_engine_t *instance, const char *index) {
+  struct qe_index *idx;
+  for( idx = instance->index ; idx ; idx = idx->next ) {
+    if (strcmp(idx->name, index) == 0) break;
+  }
+  return idx;
+}
+
+// Entries between the bounds, with the same flags as cursors (direction aside)
+QUERY_ENGINE_RETURN_CODE count_internal(struct query_engine_t *instance, const char *index, const void *lower, const void *upper, int flags, size_t *count) {
+  struct qe_index       *idx    = order_index_internal(instance, index);
+  struct qe_index_entry  lower_pattern, upper_pattern;
+  int                    prefix = flags & QUERY_ENGINE_CURSOR_PREFIX;
+  int (*cmp)(struct qe_index *, struct qe_index_entry *, struct qe_index_entry *) = prefix ? bound_prefix_internal : bound_cmp_internal;
+  size_t                 lo, hi;
+  *count = 0;
+  if (!idx) return QUERY_ENGINE_RETURN_ERR;
+
+  // Hash indexes only know how many entries they hold
+  if (idx->table) {
+    if (lower || upper) return QUERY_ENGINE_RETURN_ERR;
+    *count = idx->table->count;
+    return QUERY_ENGINE_RETURN_OK;
+  }
+  if (prefix) {
+    if (!lower || !keyed_internal(idx) || idx->cmp) return QUERY_ENGINE_RETURN_ERR;
+    upper = lower;
+  }
+
+  lo = 0;
+  hi = idx->mindex->length;
+  if (lower) {
+    if (pattern_internal(idx, lower, &lower_pattern)) return QUERY_ENGINE_RETURN_ERR;
+    lo = bound_internal(idx, 0, &lower_pattern, !prefix && (flags & QUERY_ENGINE_CURSOR_EXCLUDE_LOWER), cmp);
+    key_free_internal(lower_pattern.key);
+  }
+  if (upper) {
+    if (pattern_internal(idx, upper, &upper_pattern)) return QUERY_ENGINE_RETURN_ERR;
+    hi = bound_internal(idx, lo, &upper_pattern, prefix || !(flags & QUERY_ENGINE_CURSOR_EXCLUDE_UPPER), cmp);
+    key_free_internal(upper_pattern.key);
+  }
+  *count = (hi > lo) ? hi - lo : 0;
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+// Entries sorting before the pattern, which is where it is or would be
+QUERY_ENGINE_RETURN_CODE rank_internal(struct query_engine_t *instance, const char *index, const void *pattern, size_t *rank) {
+  struct qe_index       *idx = order_index_internal(instance, index);
+  struct qe_index_entry  entry;
+  *rank = 0;
+  if (!idx || idx->table) return QUERY_ENGINE_RETURN_ERR;
+  if (pattern_internal(idx, pattern, &entry)) return QUERY_ENGINE_RETURN_ERR;
+  *rank = bound_internal(idx, 0, &entry, 0, bound_cmp_internal);
+  key_free_internal(entry.key);
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+void * select_internal(struct query_engine_t *instance, const char *index, size_t position) {
+  struct qe_index       *idx = order_index_internal(instance, index);
+  struct qe_index_entry *entry;
+  if (!idx || idx->table) return NULL;
+  if (position >= idx->mindex->length) return NULL;
+  entry = idx->mindex->items[position];
+  return hydrate_internal(instance, entry->ptr, entry->size, 1);
+}
+
+// }}}
+
+// Scans {{{
+//
+// A scan lists the allocations holding records up-front, from the allocator
+// rather than an index, which may not hold every record, then splits them
+// into a contiguous stretch per thread. Every thread reads its stretch in
+// chunks of up to QE_SCAN_CHUNK bytes, asking the kernel to read ahead the
+// next chunk before going through the current one, so a scan takes a read
+// per chunk instead of one per record. Records are deserialized & filtered
+// by the threads themselves, matches are handed to emit one at a time.
+
+#define QE_SCAN_CHUNK    (1024 * 1024)
+#define QE_SCAN_THREADS  64
+
+struct qe_scan {
+  struct query_engine_t  *qe;
+  PALLOC_OFFSET          *ptrs;
+  PALLOC_SIZE            *sizes;
+  size_t                  n;
+  int                   (*filter)(const void *record, void *udata);
+  int                   (*emit)(void *record, void *udata);
+  void                   *udata;
+  mutex_os                lock;
+  uint64_t                stop;
+  uint64_t                failed;
+};
+
+struct qe_scan_job {
+  struct qe_scan *scan;
+  size_t          from;
+  size_t          to;
+};
+
+// Hand a match to emit, unless an earlier one stopped the scan
+void scan_emit_internal(struct qe_scan *scan, void *record) {
+  mutex_lock_os(&(scan->lock));
+  if (atomic_load_os(&(scan->stop))) {
+    mutex_unlock_os(&(scan->lock));
+    purge_record_internal(scan->qe, record);
+    return;
+  }
+  if (scan->emit(record, scan->udata)) atomic_add_os(&(scan->stop), 1);
+  mutex_unlock_os(&(scan->lock));
+}
+
+void * scan_worker_internal(void *arg) {
+  struct qe_scan_job *job    = arg;
+  struct qe_scan     *scan   = job->scan;
+  char               *buffer = malloc(QE_SCAN_CHUNK);
+  struct buf         *large;
+  struct buf          view;
+  const char         *data;
+  PALLOC_OFFSET       start, end;
+  size_t              i, j, r;
+  void               *record;
+
+  for( i = job->from ; (i < job->to) && !atomic_load_os(&(scan->stop)) ; i = j ) {
+
+    // Neighbouring allocations fitting a chunk, headers & holes included
+    start = scan->ptrs[i];
+    end   = start + scan->sizes[i];
+    for( j = i + 1 ; (j < job->to) && (scan->ptrs[j] + scan->sizes[j] - start <= QE_SCAN_CHUNK) ; j++ ) {
+      end = scan->ptrs[j] + scan->sizes[j];
+    }
+    if (j < job->to) prefetch_os(scan->qe->fd, end, QE_SCAN_CHUNK);
+
+    large = NULL;
+    data  = map_internal(scan->qe, start, end - start);
+    if (!data && (end - start <= QE_SCAN_CHUNK)) {
+      data = read_into_internal(scan->qe, start, end - start, buffer) ? NULL : buffer;
+    } else if (!data) {
+      large = read_range_internal(scan->qe, start, end - start);
+      data  = large ? large->data : NULL;
+    }
+    if (!data) {
+      atomic_add_os(&(scan->failed), 1);
+      break;
+    }
+
+    for( r = i ; r < j ; r++ ) {
+      stats_hydration_internal(scan->qe);
+      view.data = (char *)data + (scan->ptrs[r] - start);
+      view.len  = scan->sizes[r];
+      view.cap  = scan->sizes[r];
+      record    = deserialize_internal(scan->qe, &view);
+      if (!record) continue;
+      if (scan->filter && !scan->filter(record, scan->udata)) {
+        purge_record_internal(scan->qe, record);
+        continue;
+      }
+      scan_emit_internal(scan, record);
+    }
+    if (large) {
+      buf_clear(large);
+      free(large);
+    }
+  }
+
+  free(buffer);
+  return NULL;
+}
+
+// List the allocations holding records, in offset order
+// Every allocation but the catalog's, those held for snapshots & replaced ones waiting for the log
+size_t scan_list_internal(struct query_engine_t *instance, PALLOC_OFFSET **ptrs, PALLOC_SIZE **sizes) {
+  struct qe_wal          *wal      = instance->wal;
+  PALLOC_OFFSET          *pending  = NULL;
+  PALLOC_OFFSET           ptr      = 0;
+  size_t                  max      = 0;
+  size_t                  npending = 0;
+  size_t                  i, n     = 0;
+  *ptrs  = NULL;
+  *sizes = NULL;
+
+  if (wal && wal->npending) {
+    pending = malloc(wal->npending * sizeof(PALLOC_OFFSET));
+    for( i = 0 ; i < wal->npending ; i++ ) pending[npending++] = wal->pending[i].ptr;
+    qsort(pending, npending, sizeof(PALLOC_OFFSET), wal_ptr_cmp_internal);
+  }
+  while((ptr = palloc_next(instance->fd, ptr))) {
+    if (catalog_meta_internal(instance, ptr)) continue;
+    if (snapshot_held_internal(instance, ptr)) continue;
+    if (pending && bsearch(&ptr, pending, npending, sizeof(PALLOC_OFFSET), wal_ptr_cmp_internal)) continue;
+    if (n == max) {
+      max    = max ? max * 2 : 1024;
+      *ptrs  = realloc(*ptrs, max * sizeof(PALLOC_OFFSET));
+      *sizes = realloc(*sizes, max * sizeof(PALLOC_SIZE));
+    }
+    (*ptrs)[n]  = ptr;
+    (*sizes)[n] = palloc_size(instance->fd, ptr);
+    n++;
+  }
+  free(pending);
+  return n;
+}
+
+QUERY_ENGINE_RETURN_CODE scan_internal(struct query_engine_t *instance, int (*filter)(const void *record, void *udata), int (*emit)(void *record, void *udata), void *udata, size_t nthreads) {
+  struct qe_scan      scan    = { .qe = instance, .filter = filter, .emit = emit, .udata = udata };
+  struct qe_scan_job *jobs;
+  size_t              i;
+  thread_os          *threads;
+  char               *started;
+  if (!emit) return QUERY_ENGINE_RETURN_ERR;
+
+  scan.n = scan_list_internal(instance, &(scan.ptrs), &(scan.sizes));
+
+  if (!nthreads) nthreads = cpu_count_os();
+  if (nthreads > QE_SCAN_THREADS) nthreads = QE_SCAN_THREADS;
+  if (nthreads > scan.n) nthreads = scan.n;
+  if (!nthreads) nthreads = 1;
+  jobs    = calloc(nthreads, sizeof(struct qe_scan_job));
+  threads = calloc(nthreads, sizeof(thread_os));
+  started = calloc(nthreads, sizeof(char));
+  for( i = 0 ; i < nthreads ; i++ ) {
+    jobs[i].scan = &scan;
+    jobs[i].from = (scan.n * i) / nthreads;
+    jobs[i].to   = (scan.n * (i + 1)) / nthreads;
+  }
+
+  // The calling thread takes the first stretch
+  mutex_init_os(&(scan.lock));
+  for( i = 1 ; i < nthreads ; i++ ) {
+    started[i] = !thread_create_os(&threads[i], scan_worker_internal, &jobs[i]);
+  }
+  scan_worker_internal(&jobs[0]);
+  for( i = 1 ; i < nthreads ; i++ ) {
+    if (started[i]) {
+      thread_join_os(threads[i]);
+    } else {
+      scan_worker_internal(&jobs[i]);
+    }
+  }
+  mutex_destroy_os(&(scan.lock));
+
+  free(jobs);
+  free(threads);
+  free(started);
+  free(scan.ptrs);
+  free(scan.sizes);
+  return scan.failed ? QUERY_ENGINE_RETURN_ERR : QUERY_ENGINE_RETURN_OK;
+}
+
+// }}}
+
+// Snapshots {{{
+//
+// A snapshot lists the records under the write lock, from the allocator like
+// a scan does, then copies them without holding it. Until every running snapshot is done,
+// allocations writers release are held on to instead of freed, and
+// in-place updates become replacements, so the listed records stay as they
+// were until copied. The image holds nothing but the records, back to back,
+// between a header & a checksum of it all. The header tells whether they're
+// padded, restoring pads those that aren't.
+
+#define QE_SNAP_MAGIC    "QESNAPS"
+#define QE_SNAP_VERSION  1
+#define QE_SNAP_HEADER   32
+#define QE_SNAP_PADDED   1
+
+// Write all of it, the output may well be a pipe or socket
+QUERY_ENGINE_RETURN_CODE snapshot_write_internal(int fd, const char *data, size_t len, uint32_t *crc) {
+  ssize_t n;
+  *crc = crc32_internal(*crc, data, len);
+  while(len) {
+    n = write_os(fd, data, len);
+    if (n <= 0) return QUERY_ENGINE_RETURN_ERR;
+    data += n;
+    len  -= n;
+  }
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+QUERY_ENGINE_RETURN_CODE snapshot_read_internal(int fd, char *data, size_t len, uint32_t *crc) {
+  ssize_t n;
+  size_t  done = 0;
+  while(done < len) {
+    n = read_os(fd, data + done, len - done);
+    if (n <= 0) return QUERY_ENGINE_RETURN_ERR;
+    done += n;
+  }
+  *crc = crc32_internal(*crc, data, len);
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+// Pin the records as they are now, listing them & the change they go up to, all
+// taken from the allocator as a backup can't depend on an index holding each one
+size_t snapshot_begin_internal(struct query_engine_t *instance, PALLOC_OFFSET **ptrs, PALLOC_SIZE **sizes, uint64_t *seq) {
+  struct qe_snapshot *snapshot = instance->snapshot;
+  struct qe_changes  *changes  = instance->changes;
+  if (!snapshot) {
+    snapshot = calloc(1, sizeof(struct qe_snapshot));
+    mutex_init_os(&(snapshot->lock));
+    instance->snapshot = snapshot;
+  }
+  snapshot->refs++;
+  *seq = changes ? changes->seq : 0;
+  return scan_list_internal(instance, ptrs, sizes);
+}
+
+// The last snapshot done frees whatever was released meanwhile
+void snapshot_end_internal(struct query_engine_t *instance) {
+  struct qe_snapshot *snapshot = instance->snapshot;
+  size_t              i;
+  if (--(snapshot->refs)) return;
+  instance->snapshot = NULL;
+  for( i = 0 ; i < snapshot->nheld ; i++ ) {
+    release_internal(instance, snapshot->held[i]);
+  }
+  mutex_destroy_os(&(snapshot->lock));
+  free(snapshot->held);
+  free(snapshot);
+}
+
+// Copy the listed records, neighbouring ones read & streamed out at once
+QUERY_ENGINE_RETURN_CODE snapshot_copy_internal(struct query_engine_t *instance, int fd, const PALLOC_OFFSET *ptrs, const PALLOC_SIZE *sizes, size_t n, uint64_t seq) {
+  struct buf  out    = {0};
+  struct buf *large;
+  const char *data;
+  char        num[QE_SNAP_HEADER];
+  char       *buffer = malloc(QE_SCAN_CHUNK);
+  uint32_t    crc    = 0;
+  size_t      i, j, r;
+  PALLOC_OFFSET start, end;
+  QUERY_ENGINE_RETURN_CODE result = QUERY_ENGINE_RETURN_OK;
+
+  memset(num, 0, QE_SNAP_HEADER);
+  memcpy(num, QE_SNAP_MAGIC, 8);
+  enc_u32_internal(num +  8, QE_SNAP_VERSION);
+  enc_u32_internal(num + 12, padded_internal(instance) ? QE_SNAP_PADDED : 0);
+  enc_u64_internal(num + 16, n);
+  enc_u64_internal(num + 24, seq);
+  buf_append(&out, num, QE_SNAP_HEADER);
+
+  for( i = 0 ; (i < n) && !result ; i = j ) {
+    start = ptrs[i];
+    end   = start + sizes[i];
+    for( j = i + 1 ; (j < n) && (ptrs[j] + sizes[j] - start <= QE_SCAN_CHUNK) ; j++ ) {
+      end = ptrs[j] + sizes[j];
+    }
+    if (j < n) prefetch_os(instance->fd, end, QE_SCAN_CHUNK);
+
+    // Positional reads only, a mapping may be replaced by writers
+    large = NULL;
+    data  = NULL;
+    if (end - start <= QE_SCAN_CHUNK) {
+      data = read_into_internal(instance, start, end - start, buffer) ? NULL : buffer;
+    } else {
+      large = read_range_internal(instance, start, end - start);
+      data  = large ? large->data : NULL;
+    }
+    if (!data) result = QUERY_ENGINE_RETURN_ERR;
+
+    for( r = i ; (r < j) && !result ; r++ ) {
+      enc_u32_internal(num, sizes[r]);
+      buf_append(&out, num, 4);
+      buf_append(&out, data + (ptrs[r] - start), sizes[r]);
+    }
+    if (large) {
+      buf_clear(large);
+      free(large);
+    }
+    if (!result) result = snapshot_write_internal(fd, out.data, out.len, &crc);
+    out.len = 0;
+  }
+
+  if (!result) result = snapshot_write_internal(fd, out.data, out.len, &crc);
+  if (!result) {
+    enc_u32_internal(num, crc);
+    result = snapshot_write_internal(fd, num, 4, &crc);
+  }
+  buf_clear(&out);
+  free(buffer);
+  return result;
+}
+
+// Store the records of an image in fresh allocations, a batch at a time
+// Nothing of an image that fails to read stays behind
+QUERY_ENGINE_RETURN_CODE restore_internal(struct query_engine_t *instance, int fd, uint64_t *seq) {
+  struct buf    **batch  = NULL;
+  struct buf     *serialized;
+  struct buf      decoded;
+  PALLOC_OFFSET  *ptrs   = NULL;
+  void           *record;
+  char            num[QE_SNAP_HEADER];
+  char            unpacked[QE_SCRATCH];
+  uint64_t        count, i;
+  uint32_t        crc    = 0;
+  uint32_t        len, expect, flags;
+  size_t          b, nbatch = 0, bytes = 0;
+  int             state, plain;
+  QUERY_ENGINE_RETURN_CODE result = QUERY_ENGINE_RETURN_ERR;
+
+  // Indexes would have to follow, adding them afterwards builds them from the records
+  if (instance->index) return QUERY_ENGINE_RETURN_ERR;
+  if (snapshot_read_internal(fd, num, QE_SNAP_HEADER, &crc)) return QUERY_ENGINE_RETURN_ERR;
+  if (memcmp(num, QE_SNAP_MAGIC, 8) || (dec_u32_internal(num + 8) != QE_SNAP_VERSION)) return QUERY_ENGINE_RETURN_ERR;
+  flags = dec_u32_internal(num + 12);
+  count = dec_u64_internal(num + 16);
+  if (seq) *seq = dec_u64_internal(num + 24);
+  catalog_dirty_internal(instance);
+
+  ptrs  = calloc(count ? count : 1, sizeof(PALLOC_OFFSET));
+  batch = calloc(count ? count : 1, sizeof(struct buf *));
+  if (!ptrs || !batch) {
+    free(ptrs);
+    free(batch);
+    return QUERY_ENGINE_RETURN_ERR;
+  }
+  for( i = 0 ; i < count ; i++ ) {
+    if (snapshot_read_internal(fd, num, 4, &crc)) goto cleanup;
+    len      = dec_u32_internal(num);
+    batch[i] = calloc(1, sizeof(struct buf));
+    batch[i]->data = malloc(len ? len : 1);
+    batch[i]->cap  = len;
+    batch[i]->len  = len;
+    if (!batch[i]->data) goto cleanup;
+    if (snapshot_read_internal(fd, batch[i]->data, len, &crc)) goto cleanup;
+
+    // Plain records from a medium that didn't pad them are stored like qe_set would
+    plain = 0;
+    if (!(flags & QE_SNAP_PADDED) && padded_internal(instance)) {
+      state = codec_decode_internal(instance, batch[i], &decoded, unpacked);
+      if ((state > 0) && (decoded.data != unpacked)) free(decoded.data);
+      plain = !state;
+    }
+    if (plain) {
+      record     = deserialize_internal(instance, batch[i]);
+      serialized = record ? instance->serialize(record, instance->udata) : NULL;
+      if (record) purge_record_internal(instance, record);
+      if (!serialized) goto cleanup;
+      buf_clear(batch[i]);
+      free(batch[i]);
+      batch[i] = serialized;
+    }
+    ptrs[i] = palloc(instance->fd, batch[i]->len + plain);
+    if (!ptrs[i]) goto cleanup;
+    pad_internal(batch[i], palloc_size(instance->fd, ptrs[i]), !plain);
+    nbatch++;
+    bytes += batch[i]->len;
+
+    // Written in offset order, neighbours in a single write
+    if ((bytes >= QE_SCAN_CHUNK) || (i + 1 == count)) {
+      if (write_batch_internal(instance, ptrs + i + 1 - nbatch, batch + i + 1 - nbatch, nbatch)) goto cleanup;
+      for( b = i + 1 - nbatch ; b <= i ; b++ ) {
+        buf_clear(batch[b]);
+        free(batch[b]);
+        batch[b] = NULL;
+      }
+      nbatch = 0;
+      bytes  = 0;
+    }
+  }
+  expect = crc;
+  if (snapshot_read_internal(fd, num, 4, &crc)) goto cleanup;
+  if (dec_u32_internal(num) != expect) goto cleanup;
+
+  // Durable before it's done, the log starting over from the restored records
+  if (instance->wal) {
+    result = wal_checkpoint_internal(instance);
+  } else {
+    result = fsync_os(instance->fd) ? QUERY_ENGINE_RETURN_ERR : QUERY_ENGINE_RETURN_OK;
+  }
+
+cleanup:
+  for( i = 0 ; i < count ; i++ ) {
+    if (result && ptrs[i]) pfree(instance->fd, ptrs[i]);
+    if (!batch[i]) continue;
+    buf_clear(batch[i]);
+    free(batch[i]);
+  }
+  free(batch);
+  free(ptrs);
+  return result;
+}
+
+// }}}
+
+// Public API, taking the engine's lock {{{
+
+QUERY_ENGINE_RETURN_CODE qe_index_add(
+  struct query_engine_t *instance,
+  const char *name,
+  int (*cmp)(const void *a, const void *b, void *udata_qe, void *udata_index),
+  struct buf * (*key)(const void *entry, void *udata_qe, void *udata_index),
+  void *udata
+) {
+  struct qe_stats_span span;
+  stats_begin_internal(instance, &span);
+  rwlock_wrlock_os(instance->lock);
+  struct qe_index_def def = { .name = name, .cmp = cmp, .key = key, .udata = udata };
+  QUERY_ENGINE_RETURN_CODE result = index_add_many_internal(instance, &def, 1);
+  stats_end_internal(instance, QUERY_ENGINE_OP_INDEX_ADD, index_stats_internal(instance, name), &span);
+  rwlock_wrunlock_os(instance->lock);
+  return result;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_index_add_hash(
+  struct query_engine_t *instance,
+  const char *name,
+  uint64_t (*hash)(const void *entry, void *udata_qe, void *udata_index),
+  int (*eq)(const void *a, const void *b, void *udata_qe, void *udata_index),
+  void *udata
+) {
+  struct qe_stats_span span;
+  stats_begin_internal(instance, &span);
+  rwlock_wrlock_os(instance->lock);
+  struct qe_index_def def = { .name = name, .hash = hash, .eq = eq, .udata = udata };
+  QUERY_ENGINE_RETURN_CODE result = index_add_many_internal(instance, &def, 1);
+  stats_end_internal(instance, QUERY_ENGINE_OP_INDEX_ADD, index_stats_internal(instance, name), &span);
+  rwlock_wrunlock_os(instance->lock);
+  return result;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_index_add_typed(struct query_engine_t *instance, const char *name, int type, size_t offset, size_t length) {
+  struct qe_stats_span span;
+  stats_begin_internal(instance, &span);
+  rwlock_wrlock_os(instance->lock);
+  struct qe_index_def def = { .name = name, .type = type, .offset = offset, .length = length };
+  QUERY_ENGINE_RETURN_CODE result = index_add_many_internal(instance, &def, 1);
+  stats_end_internal(instance, QUERY_ENGINE_OP_INDEX_ADD, index_stats_internal(instance, name), &span);
+  rwlock_wrunlock_os(instance->lock);
+  return result;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_index_add_many(struct query_engine_t *instance, const struct qe_index_def *defs, size_t n) {
+  struct qe_stats_span span;
+  stats_begin_internal(instance, &span);
+  rwlock_wrlock_os(instance->lock);
+  QUERY_ENGINE_RETURN_CODE result = index_add_many_internal(instance, defs, n);
+  stats_end_internal(instance, QUERY_ENGINE_OP_INDEX_ADD, NULL, &span);
+  rwlock_wrunlock_os(instance->lock);
+  return result;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_index_del(struct query_engine_t *instance, const char *name) {
+  rwlock_wrlock_os(instance->lock);
+  QUERY_ENGINE_RETURN_CODE result = index_del_internal(instance, name);
+  rwlock_wrunlock_os(instance->lock);
+  return result;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_index_bloom(struct query_engine_t *instance, const char *name, uint64_t (*hash)(const void *entry, void *udata_qe, void *udata_index), double fpr) {
+  rwlock_wrlock_os(instance->lock);
+  QUERY_ENGINE_RETURN_CODE result = bloom_set_internal(instance, name, hash, fpr);
+  rwlock_wrunlock_os(instance->lock);
+  return result;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_index_bloom_stats(struct query_engine_t *instance, const char *name, struct qe_bloom_stats *stats) {
+  struct qe_index *idx;
+  struct qe_bloom *bloom;
+  QUERY_ENGINE_RETURN_CODE result = QUERY_ENGINE_RETURN_ERR;
+  memset(stats, 0, sizeof(struct qe_bloom_stats));
+  rwlock_rdlock_os(instance->lock);
+  for( idx = instance->index ; idx ; idx = idx->next ) {
+    if (strcmp(idx->name, name) == 0) break;
+  }
+  bloom = idx ? idx->bloom : NULL;
+  if (bloom && bloom->ready) {
+    stats->negatives       = atomic_load_os(&(bloom->negatives));
+    stats->false_positives = atomic_load_os(&(bloom->false_positives));
+    stats->entries         = bloom->count;
+    stats->capacity        = bloom->capacity;
+    stats->size            = bloom->m;
+    stats->hashes          = bloom->k;
+    result = QUERY_ENGINE_RETURN_OK;
+  }
+  rwlock_rdunlock_os(instance->lock);
+  return result;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_cache(struct query_engine_t *instance, size_t size) {
+  struct qe_cache *cache;
+  rwlock_wrlock_os(instance->lock);
+  if (!size) {
+    cache_free_internal(instance);
+  } else {
+    if (!instance->cache) {
+      cache           = calloc(1, sizeof(struct qe_cache));
+      cache->nbuckets = 64;
+      cache->buckets  = calloc(cache->nbuckets, sizeof(struct qe_cache_entry *));
+      mutex_init_os(&(cache->lock));
+      instance->cache = cache;
+    }
+    cache      = instance->cache;
+    cache->max = size;
+    mutex_lock_os(&(cache->lock));
+    cache_evict_internal(instance);
+    mutex_unlock_os(&(cache->lock));
+  }
+  rwlock_wrunlock_os(instance->lock);
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+// Only calls serialize, which doesn't need the lock
+struct buf * qe_compress_train(struct query_engine_t *instance, const void **records, size_t n, size_t size) {
+  struct buf **samples = calloc(n ? n : 1, sizeof(struct buf *));
+  struct buf  *dict;
+  size_t       i, m = 0;
+  for( i = 0 ; i < n ; i++ ) {
+    samples[m] = instance->serialize(records[i], instance->udata);
+    if (samples[m]) m++;
+  }
+  dict = codec_train_internal(samples, m, size);
+  for( i = 0 ; i < m ; i++ ) {
+    buf_clear(samples[i]);
+    free(samples[i]);
+  }
+  free(samples);
+  return dict;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_compress_dict(struct query_engine_t *instance, const struct buf *dict) {
+  struct qe_codec *codec;
+  if (dict && (dict->len > QE_CODEC_DICT_MAX)) return QUERY_ENGINE_RETURN_ERR;
+  rwlock_wrlock_os(instance->lock);
+  if (!instance->codec) instance->codec = calloc(1, sizeof(struct qe_codec));
+  codec = instance->codec;
+  buf_clear(&(codec->dict));
+  codec->id = 0;
+  if (dict && dict->len) {
+    buf_append(&(codec->dict), dict->data, dict->len);
+    codec->id = codec_sum_internal(dict->data, dict->len);
+    if (!codec->id) codec->id = 1;
+  }
+  rwlock_wrunlock_os(instance->lock);
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_cache_stats(struct query_engine_t *instance, struct qe_cache_stats *stats) {
+  struct qe_cache *cache;
+  memset(stats, 0, sizeof(struct qe_cache_stats));
+  rwlock_rdlock_os(instance->lock);
+  cache = instance->cache;
+  if (cache) {
+    mutex_lock_os(&(cache->lock));
+    stats->hits    = cache->hits;
+    stats->misses  = cache->misses;
+    stats->entries = cache->count;
+    stats->size    = cache->used;
+    stats->max     = cache->max;
+    mutex_unlock_os(&(cache->lock));
+  }
+  rwlock_rdunlock_os(instance->lock);
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_wal(struct query_engine_t *instance, size_t bytes, unsigned int ms) {
+  struct qe_wal *wal = instance->wal;
+  if (!wal) return QUERY_ENGINE_RETURN_ERR;
+  mutex_lock_os(&(wal->lock));
+  wal->bytes = bytes;
+  wal->ms    = ms;
+  mutex_unlock_os(&(wal->lock));
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+// Syncing happens outside the engine's lock, so concurrent writers share it
+QUERY_ENGINE_RETURN_CODE qe_sync(struct query_engine_t *instance) {
+  if (!instance->wal) {
+    if (changes_sync_internal(instance)) return QUERY_ENGINE_RETURN_ERR;
+    return fsync_os(instance->fd) ? QUERY_ENGINE_RETURN_ERR : QUERY_ENGINE_RETURN_OK;
+  }
+  return wal_sync_internal(instance, UINT64_MAX);
+}
+
+QUERY_ENGINE_RETURN_CODE qe_checkpoint(struct query_engine_t *instance) {
+  rwlock_wrlock_os(instance->lock);
+  QUERY_ENGINE_RETURN_CODE result = wal_checkpoint_internal(instance);
+  rwlock_wrunlock_os(instance->lock);
+  return result;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_stats(struct query_engine_t *instance, struct qe_stats *stats) {
+  if (!instance->stats) return QUERY_ENGINE_RETURN_ERR;
+  stats_copy_internal(stats, instance->stats);
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_index_stats(struct query_engine_t *instance, const char *index, struct qe_stats *stats) {
+  rwlock_rdlock_os(instance->lock);
+  struct qe_stats *index_stats = index_stats_internal(instance, index);
+  if (index_stats) stats_copy_internal(stats, index_stats);
+  rwlock_rdunlock_os(instance->lock);
+  return index_stats ? QUERY_ENGINE_RETURN_OK : QUERY_ENGINE_RETURN_ERR;
+}
+
+// Clearing isn't atomic, operations running meanwhile may be partially counted
+QUERY_ENGINE_RETURN_CODE qe_stats_reset(struct query_engine_t *instance) {
+  struct qe_index *idx;
+  if (!instance->stats) return QUERY_ENGINE_RETURN_ERR;
+  rwlock_wrlock_os(instance->lock);
+  memset(instance->stats, 0, sizeof(struct qe_stats));
+  for( idx = instance->index ; idx ; idx = idx->next ) {
+    if (idx->stats) memset(idx->stats, 0, sizeof(struct qe_stats));
+  }
+  rwlock_wrunlock_os(instance->lock);
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_set(struct query_engine_t *instance, const void *entry) {
+  return qe_set_many(instance, &entry, 1);
+}
+
+QUERY_ENGINE_RETURN_CODE qe_set_many(struct query_engine_t *instance, const void **entries, size_t n) {
+  struct qe_stats_span span;
+  stats_begin_internal(instance, &span);
+  rwlock_wrlock_os(instance->lock);
+  QUERY_ENGINE_RETURN_CODE result = set_many_internal(instance, entries, n);
+  uint64_t                 due    = wal_due_internal(instance);
+  map_sync_internal(instance);
+  rwlock_wrunlock_os(instance->lock);
+  if (due && wal_sync_internal(instance, due)) result = QUERY_ENGINE_RETURN_ERR;
+  stats_end_internal(instance, QUERY_ENGINE_OP_SET, NULL, &span);
+  return result;
+}
+
+// One allocation at a time, giving readers a chance in between
+QUERY_ENGINE_RETURN_CODE qe_compact(struct query_engine_t *instance, size_t budget) {
+  size_t   total = 0;
+  size_t   visited;
+  uint64_t due;
+  QUERY_ENGINE_RETURN_CODE result;
+  do {
+    rwlock_wrlock_os(instance->lock);
+    if (!instance->compact) instance->compact = calloc(1, sizeof(struct qe_compact));
+    result = compact_step_internal(instance, &visited);
+    due    = wal_due_internal(instance);
+    map_sync_internal(instance);
+    rwlock_wrunlock_os(instance->lock);
+    if (due && wal_sync_internal(instance, due)) result = QUERY_ENGINE_RETURN_ERR;
+    if (result) return result;
+    total += visited;
+  } while(visited && (!budget || (total < budget)));
+  return visited ? QUERY_ENGINE_RETURN_MORE : QUERY_ENGINE_RETURN_OK;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_commit(struct qe_txn *txn) {
+  struct query_engine_t *instance = txn ? txn->qe : NULL;
+  struct qe_stats_span   span;
+  if (!txn) return QUERY_ENGINE_RETURN_ERR;
+  stats_begin_internal(instance, &span);
+  rwlock_wrlock_os(instance->lock);
+  QUERY_ENGINE_RETURN_CODE result = batch_internal(instance, txn->entries, txn->del, txn->n);
+  uint64_t                 due    = wal_due_internal(instance);
+  map_sync_internal(instance);
+  rwlock_wrunlock_os(instance->lock);
+  if (due && wal_sync_internal(instance, due)) result = QUERY_ENGINE_RETURN_ERR;
+  stats_end_internal(instance, QUERY_ENGINE_OP_SET, NULL, &span);
+  qe_abort(txn);
+  return result;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_del(struct query_engine_t *instance, const void *pattern) {
+  struct qe_stats_span span;
+  stats_begin_internal(instance, &span);
+  rwlock_wrlock_os(instance->lock);
+  QUERY_ENGINE_RETURN_CODE result = del_internal(instance, pattern);
+  uint64_t                 due    = wal_due_internal(instance);
+  rwlock_wrunlock_os(instance->lock);
+  if (due && wal_sync_internal(instance, due)) result = QUERY_ENGINE_RETURN_ERR;
+  stats_end_internal(instance, QUERY_ENGINE_OP_DEL, NULL, &span);
+  return result;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_update(struct query_engine_t *instance, const char *index, const void *pattern, const void *entry) {
+  struct qe_stats_span span;
+  stats_begin_internal(instance, &span);
+  rwlock_wrlock_os(instance->lock);
+  QUERY_ENGINE_RETURN_CODE result = update_internal(instance, index, pattern, entry);
+  uint64_t                 due    = wal_due_internal(instance);
+  map_sync_internal(instance);
+  rwlock_wrunlock_os(instance->lock);
+  if (due && wal_sync_internal(instance, due)) result = QUERY_ENGINE_RETURN_ERR;
+  stats_end_internal(instance, QUERY_ENGINE_OP_SET, NULL, &span);
+  return result;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_get_many(struct query_engine_t *instance, const char *index, const void **patterns, size_t n, void **results) {
+  struct qe_stats_span span;
+  stats_begin_internal(instance, &span);
+  rwlock_rdlock_os(instance->lock);
+  QUERY_ENGINE_RETURN_CODE result = get_many_internal(instance, index, patterns, n, results);
+  stats_end_internal(instance, QUERY_ENGINE_OP_GET, index_stats_internal(instance, index), &span);
+  rwlock_rdunlock_os(instance->lock);
+  return result;
+}
+
+void * qe_get(struct query_engine_t *instance, const char *index, void *pattern) {
+  struct qe_stats_span span;
+  stats_begin_internal(instance, &span);
+  rwlock_rdlock_os(instance->lock);
+  void *result = get_internal(instance, index, pattern);
+  stats_end_internal(instance, QUERY_ENGINE_OP_GET, index_stats_internal(instance, index), &span);
+  rwlock_rdunlock_os(instance->lock);
+  return result;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_count(struct query_engine_t *instance, const char *index, const void *lower, const void *upper, int flags, size_t *count) {
+  rwlock_rdlock_os(instance->lock);
+  QUERY_ENGINE_RETURN_CODE result = count_internal(instance, index, lower, upper, flags, count);
+  rwlock_rdunlock_os(instance->lock);
+  return result;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_rank(struct query_engine_t *instance, const char *index, const void *pattern, size_t *rank) {
+  rwlock_rdlock_os(instance->lock);
+  QUERY_ENGINE_RETURN_CODE result = rank_internal(instance, index, pattern, rank);
+  rwlock_rdunlock_os(instance->lock);
+  return result;
+}
+
+void * qe_select(struct query_engine_t *instance, const char *index, size_t position) {
+  struct qe_stats_span span;
+  stats_begin_internal(instance, &span);
+  rwlock_rdlock_os(instance->lock);
+  void *result = select_internal(instance, index, position);
+  stats_end_internal(instance, QUERY_ENGINE_OP_GET, index_stats_internal(instance, index), &span);
+  rwlock_rdunlock_os(instance->lock);
+  return result;
+}
+
+// Writers wait for the whole scan
+QUERY_ENGINE_RETURN_CODE qe_scan(struct query_engine_t *instance, int (*filter)(const void *record, void *udata), int (*emit)(void *record, void *udata), void *udata, size_t nthreads) {
+  rwlock_rdlock_os(instance->lock);
+  QUERY_ENGINE_RETURN_CODE result = scan_internal(instance, filter, emit, udata, nthreads);
+  rwlock_rdunlock_os(instance->lock);
+  return result;
+}
+
+// Changes are only appended by writers, so readers see a stable feed
+QUERY_ENGINE_RETURN_CODE qe_changes_since(struct query_engine_t *instance, uint64_t seq, int (*callback)(uint64_t seq, int type, void *record, void *udata), void *udata) {
+  rwlock_rdlock_os(instance->lock);
+  QUERY_ENGINE_RETURN_CODE result = changes_since_internal(instance, seq, callback, udata);
+  rwlock_rdunlock_os(instance->lock);
+  return result;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_changes_seq(struct query_engine_t *instance, uint64_t *seq) {
+  struct qe_changes *changes = instance->changes;
+  if (!changes) return QUERY_ENGINE_RETURN_ERR;
+  rwlock_rdlock_os(instance->lock);
+  *seq = changes->seq;
+  rwlock_rdunlock_os(instance->lock);
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+// Writers only wait for the records to be listed, not for them to be copied
+QUERY_ENGINE_RETURN_CODE qe_snapshot(struct query_engine_t *instance, int fd) {
+  PALLOC_OFFSET *ptrs;
+  PALLOC_SIZE   *sizes;
+  uint64_t       seq;
+  size_t         n;
+  rwlock_wrlock_os(instance->lock);
+  n = snapshot_begin_internal(instance, &ptrs, &sizes, &seq);
+  rwlock_wrunlock_os(instance->lock);
+  QUERY_ENGINE_RETURN_CODE result = snapshot_copy_internal(instance, fd, ptrs, sizes, n, seq);
+  rwlock_wrlock_os(instance->lock);
+  snapshot_end_internal(instance);
+  rwlock_wrunlock_os(instance->lock);
+  free(ptrs);
+  free(sizes);
+  return result;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_restore(struct query_engine_t *instance, int fd, uint64_t *seq) {
+  rwlock_wrlock_os(instance->lock);
+  QUERY_ENGINE_RETURN_CODE result = restore_internal(instance, fd, seq);
+  map_sync_internal(instance);
+  rwlock_wrunlock_os(instance->lock);
+  return result;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_changes_trim(struct query_engine_t *instance, uint64_t seq) {
+  rwlock_wrlock_os(instance->lock);
+  QUERY_ENGINE_RETURN_CODE result = changes_trim_internal(instance, seq);
+  rwlock_wrunlock_os(instance->lock);
+  return result;
+}
+
+struct qe_cursor * qe_cursor_open(struct query_engine_t *instance, const char *index, const void *lower, const void *upper, int flags) {
+  rwlock_rdlock_os(instance->lock);
+  struct qe_cursor *result = cursor_open_internal(instance, index, lower, upper, flags);
+  rwlock_rdunlock_os(instance->lock);
+  return result;
+}
+
+void * qe_cursor_next(struct qe_cursor *cursor) {
+  if (!cursor) return NULL;
+  rwlock_rdlock_os(cursor->qe->lock);
+  void *result = cursor_next_internal(cursor);
+  rwlock_rdunlock_os(cursor->qe->lock);
+  return result;
+}
+
+// }}}
+
+// Sharding {{{
+//
+// A sharded engine is a set of independent engines, one file each, with
+// records routed by a hash of their shard key. Every engine keeps its own
+// lock, allocator & indexes, so writers on different shards don't wait for
+// each other. Batches are split per shard, large ones written by a thread
+// per shard. Lookups on the index holding the shard key go to a single
+// shard, others ask every shard. Cursors walk every shard, merging by the
+// index's order.
+
+#define QE_SHARD_PARALLEL  256
+
+struct qe_shards {
+  size_t                   n;
+  struct query_engine_t  **engines;
+  char                    *index;
+  uint64_t               (*shard)(const void *entry, void *udata);
+  void                    *udata;
+};
+
+struct qe_shards_job {
+  struct query_engine_t     *qe;
+  const void               **entries;
+  size_t                     n;
+  const struct qe_index_def *defs;
+  QUERY_ENGINE_RETURN_CODE   result;
+};
+
+struct qe_shards_cursor {
+  struct qe_shards   *shards;
+  struct qe_index    *index;
+  struct qe_cursor  **cursors;
+  void              **heads;
+  struct buf        **keys;
+  int                 flags;
+  size_t              offset;
+  size_t              limit;
+};
+
+size_t shards_route_internal(const struct qe_shards *shards, const void *entry) {
+  return mix_internal(shards->shard(entry, shards->udata)) % shards->n;
+}
+
+// Run a job per shard, a thread each except for the calling one
+void shards_run_internal(struct qe_shards_job *jobs, size_t njobs, void * (*fn)(void *)) {
+  thread_os *threads = calloc(njobs ? njobs : 1, sizeof(thread_os));
+  char      *started = calloc(njobs ? njobs : 1, sizeof(char));
+  size_t     i;
+  for( i = 1 ; i < njobs ; i++ ) {
+    started[i] = !thread_create_os(&threads[i], fn, &jobs[i]);
+  }
+  if (njobs) fn(&jobs[0]);
+  for( i = 1 ; i < njobs ; i++ ) {
+    if (started[i]) {
+      thread_join_os(threads[i]);
+    } else {
+      fn(&jobs[i]);
+    }
+  }
+  free(threads);
+  free(started);
+}
+
+void * shards_set_internal(void *arg) {
+  struct qe_shards_job *job = arg;
+  job->result = qe_set_many(job->qe, job->entries, job->n);
+  return NULL;
+}
+
+void * shards_index_internal(void *arg) {
+  struct qe_shards_job *job = arg;
+  job->result = qe_index_add_many(job->qe, job->defs, job->n);
+  return NULL;
+}
+
+struct qe_shards * qe_shards_init(const char *filename, size_t n, const char *index, uint64_t (*shard)(const void *entry, void *udata), struct buf * (*serialize)(const void *, void *), void * (*deserialize)(const struct buf *, void*), void (*purge)(void*, void*), void *udata, PALLOC_FLAGS flags) {
+  struct qe_shards *shards;
+  char             *path;
+  size_t            i;
+  if (!n || !shard) return NULL;
+  shards          = calloc(1, sizeof(struct qe_shards));
+  shards->n       = n;
+  shards->engines = calloc(n, sizeof(struct query_engine_t *));
+  shards->index   = index ? strdup(index) : NULL;
+  shards->shard   = shard;
+  shards->udata   = udata;
+  path            = malloc(strlen(filename) + 24);
+  for( i = 0 ; i < n ; i++ ) {
+    sprintf(path, "%s.%zu", filename, i);
+    shards->engines[i] = qe_init(path, serialize, deserialize, purge, udata, flags);
+    if (!shards->engines[i]) {
+      free(path);
+      qe_shards_close(shards);
+      return NULL;
+    }
+  }
+  free(path);
+  return shards;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_shards_close(struct qe_shards *shards) {
+  QUERY_ENGINE_RETURN_CODE result = QUERY_ENGINE_RETURN_OK;
+  size_t                   i;
+  if (!shards) return QUERY_ENGINE_RETURN_ERR;
+  for( i = 0 ; i < shards->n ; i++ ) {
+    if (shards->engines[i] && qe_close(shards->engines[i])) result = QUERY_ENGINE_RETURN_ERR;
+  }
+  free(shards->engines);
+  free(shards->index);
+  free(shards);
+  return result;
+}
+
+struct query_engine_t * qe_shards_engine(struct qe_shards *shards, size_t shard) {
+  if (shard >= shards->n) return NULL;
+  return shards->engines[shard];
+}
+
+// Every shard builds its indexes at the same time
+QUERY_ENGINE_RETURN_CODE qe_shards_index_add_many(struct qe_shards *shards, const struct qe_index_def *defs, size_t n) {
+  struct qe_shards_job *jobs   = calloc(shards->n, sizeof(struct qe_shards_job));
+  QUERY_ENGINE_RETURN_CODE result = QUERY_ENGINE_RETURN_OK;
+  size_t                i;
+  for( i = 0 ; i < shards->n ; i++ ) {
+    jobs[i].qe   = shards->engines[i];
+    jobs[i].defs = defs;
+    jobs[i].n    = n;
+  }
+  shards_run_internal(jobs, shards->n, shards_index_internal);
+  for( i = 0 ; i < shards->n ; i++ ) {
+    if (jobs[i].result) result = QUERY_ENGINE_RETURN_ERR;
+  }
+  free(jobs);
+  return result;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_shards_index_del(struct qe_shards *shards, const char *name) {
+  QUERY_ENGINE_RETURN_CODE result = QUERY_ENGINE_RETURN_OK;
+  size_t                   i;
+  for( i = 0 ; i < shards->n ; i++ ) {
+    if (qe_index_del(shards->engines[i], name)) result = QUERY_ENGINE_RETURN_ERR;
+  }
+  return result;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_shards_set(struct qe_shards *shards, const void *entry) {
+  return qe_set(shards->engines[shards_route_internal(shards, entry)], entry);
+}
+
+// Split per shard, keeping the order within each, so later entries still win
+QUERY_ENGINE_RETURN_CODE qe_shards_set_many(struct qe_shards *shards, const void **entries, size_t n) {
+  struct qe_shards_job *jobs   = calloc(shards->n, sizeof(struct qe_shards_job));
+  const void          **sorted = calloc(n ? n : 1, sizeof(void *));
+  size_t               *route  = calloc(n ? n : 1, sizeof(size_t));
+  size_t                i, njobs, pos;
+  QUERY_ENGINE_RETURN_CODE result = QUERY_ENGINE_RETURN_OK;
+
+  for( i = 0 ; i < n ; i++ ) {
+    route[i] = shards_route_internal(shards, entries[i]);
+    jobs[route[i]].n++;
+  }
+  for( i = 0, pos = 0 ; i < shards->n ; i++ ) {
+    jobs[i].qe      = shards->engines[i];
+    jobs[i].entries = sorted + pos;
+    pos            += jobs[i].n;
+    jobs[i].n       = 0;
+  }
+  for( i = 0 ; i < n ; i++ ) {
+    jobs[route[i]].entries[jobs[route[i]].n++] = entries[i];
+  }
+
+  // Only shards with something to write, small batches aren't worth a thread
+  for( i = 0, njobs = 0 ; i < shards->n ; i++ ) {
+    if (jobs[i].n) jobs[njobs++] = jobs[i];
+  }
+  if (n >= QE_SHARD_PARALLEL) {
+    shards_run_internal(jobs, njobs, shards_set_internal);
+  } else {
+    for( i = 0 ; i < njobs ; i++ ) shards_set_internal(&jobs[i]);
+  }
+  for( i = 0 ; i < njobs ; i++ ) {
+    if (jobs[i].result) result = QUERY_ENGINE_RETURN_ERR;
+  }
+
+  free(jobs);
+  free(sorted);
+  free(route);
+  return result;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_shards_del(struct qe_shards *shards, const void *pattern) {
+  return qe_del(shards->engines[shards_route_internal(shards, pattern)], pattern);
+}
+
+// First shard holding a match, unless the index holds the shard key
+void * qe_shards_get(struct qe_shards *shards, const char *index, void *pattern) {
+  void   *record = NULL;
+  size_t  i;
+  if (shards->index && (strcmp(shards->index, index) == 0)) {
+    return qe_get(shards->engines[shards_route_internal(shards, pattern)], index, pattern);
+  }
+  for( i = 0 ; (i < shards->n) && !record ; i++ ) {
+    record = qe_get(shards->engines[i], index, pattern);
+  }
+  return record;
+}
+
+// Shards hold disjoint records, their counts add up
+QUERY_ENGINE_RETURN_CODE qe_shards_count(struct qe_shards *shards, const char *index, const void *lower, const void *upper, int flags, size_t *count) {
+  size_t i, n;
+  *count = 0;
+  for( i = 0 ; i < shards->n ; i++ ) {
+    if (qe_count(shards->engines[i], index, lower, upper, flags, &n)) return QUERY_ENGINE_RETURN_ERR;
+    *count += n;
+  }
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+// Order of two records on an index, as the engine itself would compare their entries
+int shards_cmp_internal(struct qe_shards_cursor *cursor, size_t a, size_t b) {
+  struct qe_index *idx = cursor->index;
+  if (!keyed_internal(idx)) {
+    return idx->cmp(cursor->heads[a], cursor->heads[b], idx->qe->udata, idx->udata);
+  }
+  if (idx->cmp) {
+    return idx->cmp(cursor->keys[a], cursor->keys[b], idx->qe->udata, idx->udata);
+  }
+  return key_cmp_internal(cursor->keys[a], cursor->keys[b]);
+}
+
+struct qe_shards_cursor * qe_shards_cursor_open(struct qe_shards *shards, const char *index, const void *lower, const void *upper, int flags) {
+  struct qe_shards_cursor *cursor = calloc(1, sizeof(struct qe_shards_cursor));
+  struct qe_index         *idx;
+  size_t                   i;
+  cursor->shards  = shards;
+  cursor->flags   = flags;
+  cursor->limit   = SIZE_MAX;
+  cursor->cursors = calloc(shards->n, sizeof(struct qe_cursor *));
+  cursor->heads   = calloc(shards->n, sizeof(void *));
+  cursor->keys    = calloc(shards->n, sizeof(struct buf *));
+
+  // Every shard has the same indexes, the first one's decides the order
+  rwlock_rdlock_os(shards->engines[0]->lock);
+  for( idx = shards->engines[0]->index ; idx ; idx = idx->next ) {
+    if (strcmp(idx->name, index) == 0) break;
+  }
+  rwlock_rdunlock_os(shards->engines[0]->lock);
+  cursor->index = idx;
+
+  for( i = 0 ; idx && (i < shards->n) ; i++ ) {
+    cursor->cursors[i] = qe_cursor_open(shards->engines[i], index, lower, upper, flags);
+    if (!cursor->cursors[i]) break;
+  }
+  if (!idx || (i < shards->n)) {
+    qe_shards_cursor_close(cursor);
+    return NULL;
+  }
+  return cursor;
+}
+
+// Every shard returns up to offset + limit records, the merge skips the offset
+QUERY_ENGINE_RETURN_CODE qe_shards_cursor_limit(struct qe_shards_cursor *cursor, size_t offset, size_t limit) {
+  size_t i;
+  if (!cursor) return QUERY_ENGINE_RETURN_ERR;
+  cursor->offset = offset;
+  cursor->limit  = limit;
+  for( i = 0 ; i < cursor->shards->n ; i++ ) {
+    qe_cursor_limit(cursor->cursors[i], 0, (limit > SIZE_MAX - offset) ? SIZE_MAX : offset + limit);
+  }
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+void * qe_shards_cursor_next(struct qe_shards_cursor *cursor) {
+  size_t  i, best;
+  void   *record;
+  int     order;
+  if (!cursor) return NULL;
+  while(cursor->limit) {
+
+    // Refill the heads of shards that returned theirs
+    for( i = 0 ; i < cursor->shards->n ; i++ ) {
+      if (cursor->heads[i] || !cursor->cursors[i]) continue;
+      cursor->heads[i] = qe_cursor_next(cursor->cursors[i]);
+      if (!cursor->heads[i]) {
+        qe_cursor_close(cursor->cursors[i]);
+        cursor->cursors[i] = NULL;
+        continue;
+      }
+      if (keyed_internal(cursor->index)) {
+        cursor->keys[i] = key_internal(cursor->index, cursor->heads[i], NULL);
+      }
+    }
+
+    // Lowest head, or highest in reverse, first shard on a tie
+    best = cursor->shards->n;
+    for( i = 0 ; i < cursor->shards->n ; i++ ) {
+      if (!cursor->heads[i]) continue;
+      if (best == cursor->shards->n) {
+        best = i;
+        continue;
+      }
+      if (keyed_internal(cursor->index) && (!cursor->keys[i] || !cursor->keys[best])) continue;
+      order = shards_cmp_internal(cursor, i, best);
+      if ((cursor->flags & QUERY_ENGINE_CURSOR_REVERSE) ? (order > 0) : (order < 0)) best = i;
+    }
+    if (best == cursor->shards->n) return NULL;
+
+    record = cursor->heads[best];
+    cursor->heads[best] = NULL;
+    key_free_internal(cursor->keys[best]);
+    cursor->keys[best] = NULL;
+    if (cursor->offset) {
+      cursor->offset--;
+      purge_record_internal(cursor->shards->engines[best], record);
+      continue;
+    }
+    if (cursor->limit != SIZE_MAX) cursor->limit--;
+    return record;
+  }
+  return NULL;
+}
+
+QUERY_ENGINE_RETURN_CODE qe_shards_cursor_close(struct qe_shards_cursor *cursor) {
+  size_t i;
+  if (!cursor) return QUERY_ENGINE_RETURN_ERR;
+  for( i = 0 ; i < cursor->shards->n ; i++ ) {
+    if (cursor->cursors[i]) qe_cursor_close(cursor->cursors[i]);
+    if (cursor->heads[i]) purge_record_internal(cursor->shards->engines[i], cursor->heads[i]);
+    key_free_internal(cursor->keys[i]);
+  }
+  free(cursor->cursors);
+  free(cursor->heads);
+  free(cursor->keys);
+  free(cursor);
+  return QUERY_ENGINE_RETURN_OK;
+}
+
+// }}}
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
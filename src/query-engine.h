@@ -5,6 +5,8 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+
 #include "finwo/palloc.h"
 #include "tidwall/buf.h"
 
@@ -16,6 +18,25 @@ extern "C" {
 #define QUERY_ENGINE_RETURN_CODE   int
 #define QUERY_ENGINE_RETURN_OK     0
 #define QUERY_ENGINE_RETURN_ERR   -1
+#define QUERY_ENGINE_RETURN_MORE   1
+
+/// Besides the palloc flags, qe_init accepts the following flags:
+///
+/// - `QUERY_ENGINE_MMAP`: read records through a mapping of the medium,
+///   handing deserialize a buffer pointing into the mapping instead of a
+///   copy. That buffer is only valid during the call. Platforms without
+///   mmap fall back to regular reads.
+/// - `QUERY_ENGINE_WAL`: log mutations to `<filename>.wal`, see below.
+/// - `QUERY_ENGINE_STATS`: keep counters & latency histograms, see below.
+/// - `QUERY_ENGINE_COMPRESS`: compress records before storing them, see below.
+/// - `QUERY_ENGINE_CHANGES`: keep a feed of changes in `<filename>.changes`, see below.
+
+#define QUERY_ENGINE_MMAP          (1 << 16)
+#define QUERY_ENGINE_WAL           (1 << 17)
+#define QUERY_ENGINE_STATS         (1 << 18)
+#define QUERY_ENGINE_COMPRESS      (1 << 19)
+#define QUERY_ENGINE_CHANGES       (1 << 20)
+#define QUERY_ENGINE_FLAGS         (QUERY_ENGINE_MMAP | QUERY_ENGINE_WAL | QUERY_ENGINE_STATS | QUERY_ENGINE_COMPRESS | QUERY_ENGINE_CHANGES)
 
 struct query_engine_t {
   PALLOC_FD fd;
@@ -23,18 +44,526 @@ struct query_engine_t {
   void       * (*deserialize)(const struct buf *, void *);
   void         (*purge)(void *, void *);
   void       * index;
+  void       * catalog;
+  void       * map;
+  void       * lock;
+  void       * cache;
+  void       * wal;
+  void       * stats;
+  void       * compact;
+  void       * codec;
+  void       * changes;
+  void       * snapshot;
   void       * udata;
 };
 
+///
+/// Threads
+/// -------
+///
+/// An engine can be shared between threads. Reads (qe_get & cursors) run
+/// concurrently, using positional reads only, while mutations and index
+/// changes get the engine to themselves. The callbacks given to the engine
+/// and its indexes may therefore be called from multiple threads at once.
+/// qe_close must not run concurrently with anything else on the engine.
+
 struct query_engine_t * qe_init(const char *filename, struct buf * (*serialize)(const void *, void *), void * (*deserialize)(const struct buf *, void*), void (*purge)(void*, void*), void *udata, PALLOC_FLAGS flags);
 QUERY_ENGINE_RETURN_CODE qe_close(struct query_engine_t *instance);
 
-QUERY_ENGINE_RETURN_CODE qe_index_add(struct query_engine_t *instance, const char *name, int (*cmp)(const void *a, const void *b, void *udata_qe, void *udata_index), void *udata);
+///
+/// Record cache
+/// ------------
+///
+/// qe_cache enables a cache of records read by qe_get and comparisons,
+/// holding up to `size` bytes of serialized records, least recently used
+/// ones being evicted first. Comparisons on a cached record don't deserialize
+/// it again, qe_get only deserializes the cached copy. Calling it again
+/// resizes the cache, a size of 0 disables it. qe_cache_stats reports its
+/// hit & miss counters, to size it by.
+
+struct qe_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  size_t   entries;
+  size_t   size;
+  size_t   max;
+};
+
+QUERY_ENGINE_RETURN_CODE qe_cache(struct query_engine_t *instance, size_t size);
+QUERY_ENGINE_RETURN_CODE qe_cache_stats(struct query_engine_t *instance, struct qe_cache_stats *stats);
+
+///
+/// Compression
+/// -----------
+///
+/// With QUERY_ENGINE_COMPRESS, every serialized record of 32 bytes or more is
+/// compressed with a fast LZ77 codec before it's stored, unless that doesn't
+/// make it smaller. Compressed records carry a small header with a checksum,
+/// so they coexist with plain ones: media can be opened with or without the
+/// flag, and records are decompressed before deserialize regardless. The
+/// record cache holds records as stored, so it fits more compressed ones.
+///
+/// Small records hardly compress on their own. qe_compress_train builds a
+/// dictionary of up to `size` bytes (at most 64KiB) from content common to
+/// the given sample records, and qe_compress_dict gives the engine such a
+/// dictionary to compress against. The dictionary isn't stored on the
+/// medium: records compressed with it can only be read while the engine
+/// has the same one, so callers persist it & hand it over on every
+/// qe_init. Other records can't be read while they're missing their dictionary:
+/// qe_get returns NULL for them. A NULL or empty dictionary stops using one.
+
+struct buf * qe_compress_train(struct query_engine_t *instance, const void **records, size_t n, size_t size);
+QUERY_ENGINE_RETURN_CODE qe_compress_dict(struct query_engine_t *instance, const struct buf *dict);
+
+///
+/// Indexes
+/// -------
+///
+/// Every index orders the records by `cmp`, which receives 2 deserialized
+/// records. Comparing that way reads both records from the medium, so an
+/// index can instead be given a `key` callback, which extracts a compact key
+/// from a record into a newly allocated buffer. Those keys are kept in memory,
+/// so lookups only touch the medium for the record that is returned. On keyed
+/// indexes, `cmp` receives the 2 key buffers instead of the records, or may be
+/// NULL to order keys bytewise.
+///
+/// On media created by qe_init, indexes are persisted by qe_close and loaded
+/// by qe_index_add when re-opened, instead of scanning all records. Persisted
+/// indexes are discarded on the first mutation, when not closed cleanly and
+/// by qe_index_del, so changing the ordering of an index requires calling
+/// qe_index_del before adding it again.
+///
+/// qe_index_add_hash adds an index answering only equality lookups, at the
+/// cost of a single probe instead of a binary search. `hash` returns the hash
+/// of a record, `eq` returns nonzero if 2 records are equal, and records that
+/// are equal must hash the same. The hash of every record is kept in memory
+/// next to its allocation, so qe_get reads only records with a matching hash,
+/// which usually is just the one returned. The table grows by moving a few
+/// entries on every mutation instead of all at once. Hash indexes take part
+/// in replacing records like any other index, but can't be iterated by
+/// qe_cursor_open.
+///
+/// Indexes without a persisted copy are built from a single scan of the
+/// medium, which reads every record once. The scan is split over a few
+/// threads, which deserialize the records and extract keys. Each index then
+/// sorts its entries in parallel runs and merges them in one pass. While
+/// sorting an index that compares records, up to 256 MiB of records are kept
+/// in memory, so those comparisons don't read the medium again. The
+/// callbacks have to be safe to call from multiple threads at once, just as
+/// they are for concurrent readers. qe_index_add_many adds several indexes
+/// at once, and those lacking a persisted copy share the same scan. It adds
+/// either all of them or, if any is invalid or its name is already taken,
+/// none.
+///
+/// qe_index_add_typed adds a keyed index with a built-in key type, read from
+/// the serialized record at `offset`. Its keys are compared inline, without
+/// calling back into the application, and index builds don't deserialize
+/// records at all if every index being built is typed. Records too short to
+/// hold the key aren't indexed by it, whether they're set or found by a
+/// build, as long as another index holds them. Plain records are stored
+/// padded with a byte they don't end in, so their exact length is known
+/// without deserializing them, and `deserialize` gets that padding along.
+/// Media created before records were padded lack the mark new ones get, and
+/// typed keys of their records come from deserializing & serializing them
+/// again, so index builds on those do deserialize. qe_restore pads the records of
+/// images taken from them. Lookups serialize the pattern to find its key, so
+/// `serialize` has to accept patterns as well. The key types are:
+///
+/// - `QUERY_ENGINE_KEY_UINT`: little-endian unsigned integer of `length`
+///   bytes, being 1, 2, 4 or 8.
+/// - `QUERY_ENGINE_KEY_INT`: same, but signed.
+/// - `QUERY_ENGINE_KEY_BYTES`: `length` bytes, ordered bytewise.
+/// - `QUERY_ENGINE_KEY_PREFIXED`: bytes preceded by their little-endian
+///   length of `length` bytes (1, 2 or 4), ordered bytewise with shorter
+///   ones first on equal prefixes. Prefix cursors work on these.
+///
+/// The same goes for a qe_index_def with a `type`, which then can't have any
+/// callbacks.
+
+#define QUERY_ENGINE_KEY_NONE      0
+#define QUERY_ENGINE_KEY_UINT      1
+#define QUERY_ENGINE_KEY_INT       2
+#define QUERY_ENGINE_KEY_BYTES     3
+#define QUERY_ENGINE_KEY_PREFIXED  4
+
+struct qe_index_def {
+  const char *name;
+  int          (*cmp)(const void *a, const void *b, void *udata_qe, void *udata_index);
+  struct buf * (*key)(const void *entry, void *udata_qe, void *udata_index);
+  uint64_t     (*hash)(const void *entry, void *udata_qe, void *udata_index);
+  int          (*eq)(const void *a, const void *b, void *udata_qe, void *udata_index);
+  void        *udata;
+  int          type;
+  size_t       offset;
+  size_t       length;
+};
+
+QUERY_ENGINE_RETURN_CODE qe_index_add(struct query_engine_t *instance, const char *name, int (*cmp)(const void *a, const void *b, void *udata_qe, void *udata_index), struct buf * (*key)(const void *entry, void *udata_qe, void *udata_index), void *udata);
+QUERY_ENGINE_RETURN_CODE qe_index_add_hash(struct query_engine_t *instance, const char *name, uint64_t (*hash)(const void *entry, void *udata_qe, void *udata_index), int (*eq)(const void *a, const void *b, void *udata_qe, void *udata_index), void *udata);
+QUERY_ENGINE_RETURN_CODE qe_index_add_typed(struct query_engine_t *instance, const char *name, int type, size_t offset, size_t length);
+QUERY_ENGINE_RETURN_CODE qe_index_add_many(struct query_engine_t *instance, const struct qe_index_def *defs, size_t n);
 QUERY_ENGINE_RETURN_CODE qe_index_del(struct query_engine_t *instance, const char *name);
 
+///
+/// Bloom filters
+/// -------------
+///
+/// qe_index_bloom gives an index a counting Bloom filter, so qe_get on it
+/// returns NULL for most absent records without touching the index or the
+/// medium. The filter is sized for a false-positive rate of `fpr`, taking
+/// about 1.44 * log2(1/fpr) bytes per record, and is rebuilt at twice the
+/// size when the index outgrows it. An fpr of 0 removes the filter.
+///
+/// `hash` receives what the index compares, being the key on keyed indexes
+/// and the record otherwise, and has to return the same hash for entries
+/// comparing equal. It may be NULL on keyed indexes without `cmp`, which hash
+/// the key's bytes, and on hash indexes, which use their own hash. Building
+/// the filter of an index comparing records reads every record once, the
+/// filter is persisted along with the index. qe_index_bloom_stats reports
+/// how many lookups the filter answered and how many it let through for
+/// records that weren't there.
+
+struct qe_bloom_stats {
+  uint64_t     negatives;
+  uint64_t     false_positives;
+  size_t       entries;
+  size_t       capacity;
+  size_t       size;
+  unsigned int hashes;
+};
+
+QUERY_ENGINE_RETURN_CODE qe_index_bloom(struct query_engine_t *instance, const char *name, uint64_t (*hash)(const void *entry, void *udata_qe, void *udata_index), double fpr);
+QUERY_ENGINE_RETURN_CODE qe_index_bloom_stats(struct query_engine_t *instance, const char *name, struct qe_bloom_stats *stats);
+
+///
+/// Records
+/// -------
+///
+/// qe_set stores a record, replacing any record it compares equal to in any
+/// index. qe_set_many does the same for a batch in one go, serializing and
+/// allocating the whole batch before writing it in offset order, with
+/// neighbouring allocations in a single vectored write, and merging the
+/// sorted batch into every index in a single pass. Later entries in the
+/// batch replace earlier ones, as if set one by one.
+///
+/// qe_get_many looks up `n` patterns on one index, storing the record found
+/// for `patterns[i]`, or NULL, in `results[i]`. Every pattern is resolved
+/// before any record is read, after which the records are read in offset
+/// order, neighbouring ones in a single read. On Linux, the kernel is asked
+/// to prefetch every range before the first one is read. Results are owned
+/// by the caller, as with qe_get.
+///
+/// qe_update replaces the record `pattern` finds on `index` with `entry`,
+/// returning QUERY_ENGINE_RETURN_ERR if there's no such record. If the
+/// serialized (and possibly compressed) entry fits the allocation of the old
+/// record, it's overwritten in place, and only indexes in which the record
+/// sorts or hashes differently are updated. Otherwise, or when the entry
+/// would replace another record in an index it moved in, the old record is
+/// deleted and the entry set in a single batch, as a qe_commit would. With
+/// QUERY_ENGINE_WAL, an in-place update syncs the log before overwriting, as
+/// the old record can't be recovered afterwards. Counted as qe_set in the
+/// statistics.
+
 QUERY_ENGINE_RETURN_CODE qe_set(struct query_engine_t *instance, const void *entry);
+QUERY_ENGINE_RETURN_CODE qe_set_many(struct query_engine_t *instance, const void **entries, size_t n);
 QUERY_ENGINE_RETURN_CODE qe_del(struct query_engine_t *instance, const void *pattern);
+QUERY_ENGINE_RETURN_CODE qe_update(struct query_engine_t *instance, const char *index, const void *pattern, const void *entry);
 void * qe_get(struct query_engine_t *instance, const char *index, void *pattern);
+QUERY_ENGINE_RETURN_CODE qe_get_many(struct query_engine_t *instance, const char *index, const void **patterns, size_t n, void **results);
+
+///
+/// Transactions
+/// ------------
+///
+/// qe_begin starts buffering qe_txn_set & qe_txn_del calls, which only take
+/// effect on qe_commit. Commit applies them all at once, as a single batch
+/// like qe_set_many, so readers see either none or all of them and the log
+/// holds them in a single record. Operations apply in the order given, later
+/// ones winning over earlier ones they collide with. Entries & patterns must
+/// stay valid until the transaction is committed or aborted, reads don't see
+/// uncommitted operations and concurrent transactions aren't checked for
+/// conflicts. qe_commit & qe_abort both release the transaction.
+
+struct qe_txn;
+
+struct qe_txn * qe_begin(struct query_engine_t *instance);
+QUERY_ENGINE_RETURN_CODE qe_txn_set(struct qe_txn *txn, const void *entry);
+QUERY_ENGINE_RETURN_CODE qe_txn_del(struct qe_txn *txn, const void *pattern);
+QUERY_ENGINE_RETURN_CODE qe_commit(struct qe_txn *txn);
+QUERY_ENGINE_RETURN_CODE qe_abort(struct qe_txn *txn);
+
+///
+/// Write-ahead log
+/// ---------------
+///
+/// Without QUERY_ENGINE_WAL, records are written in place and only synced by
+/// qe_close, qe_sync or the PALLOC_SYNC flag. With it, every
+/// qe_set, qe_set_many and qe_del appends the bytes it writes and the records
+/// it drops to the log before the change becomes visible. qe_init replays the
+/// log after a crash, discarding torn log records and freeing allocations no
+/// committed mutation accounts for. The medium itself is only synced when the
+/// log is checkpointed, which qe_close, qe_checkpoint and a log grown past
+/// 64 MiB do.
+///
+/// By default a mutation returns once the log is synced. Writers waiting at
+/// the same time share a single fsync. qe_wal relaxes that to syncing once
+/// `bytes` of log are pending or the oldest pending mutation is `ms` old,
+/// checked on every mutation (0 disables either). Mutations in between
+/// survive a crash of the process, not of the machine, until qe_sync is
+/// called, which syncs whatever is pending (or the medium, without a log).
+
+QUERY_ENGINE_RETURN_CODE qe_wal(struct query_engine_t *instance, size_t bytes, unsigned int ms);
+QUERY_ENGINE_RETURN_CODE qe_sync(struct query_engine_t *instance);
+QUERY_ENGINE_RETURN_CODE qe_checkpoint(struct query_engine_t *instance);
+
+///
+/// Compaction
+/// ----------
+///
+/// Deleted & replaced records leave holes in the medium. qe_compact moves
+/// live records into the first hole before them that fits, front to back,
+/// updating the offsets held by every index. It visits allocations until
+/// `budget` bytes of them have been visited, returning
+/// QUERY_ENGINE_RETURN_MORE if the pass isn't done yet, so it can be spread
+/// over many calls. The next call continues where the last one stopped, and
+/// a call after a finished pass starts a new one. A budget of 0 runs the
+/// whole pass at once. The write lock is only held for a single record at a
+/// time, so reads and writes continue while compaction runs. Moves are
+/// logged like any other write, and they discard the persisted indexes just
+/// like any other write.
+///
+/// Free space is left for new records to use, because palloc offers no way
+/// to shrink the medium. After a pass the free space sits at the end, so the
+/// medium doesn't grow again until the live data outgrows it.
+
+QUERY_ENGINE_RETURN_CODE qe_compact(struct query_engine_t *instance, size_t budget);
+
+///
+/// Statistics
+/// ----------
+///
+/// With QUERY_ENGINE_STATS, the engine counts comparisons, records read from
+/// the medium (hydrations), deserialize & purge calls and bytes read & written,
+/// and keeps a call count, bytes & latency histogram per operation: qe_get,
+/// qe_set (including qe_set_many & qe_commit), qe_del and qe_index_add.
+/// Without the flag, all of that costs a pointer check.
+///
+/// qe_stats copies the engine-wide counters, qe_index_stats those of a single
+/// index, covering its comparisons and the qe_get & qe_index_add calls on it.
+/// Latencies are in nanoseconds, in buckets of at most 12.5% wide, and
+/// qe_histogram_percentile returns the upper bound of the bucket a percentile
+/// (0-100) falls in. qe_stats_reset clears everything.
+
+#define QUERY_ENGINE_OP_GET             0
+#define QUERY_ENGINE_OP_SET             1
+#define QUERY_ENGINE_OP_DEL             2
+#define QUERY_ENGINE_OP_INDEX_ADD       3
+#define QUERY_ENGINE_OPS                4
+#define QUERY_ENGINE_HISTOGRAM_BUCKETS  496
+
+struct qe_histogram {
+  uint64_t count;
+  uint64_t total;
+  uint64_t max;
+  uint64_t bucket[QUERY_ENGINE_HISTOGRAM_BUCKETS];
+};
+
+struct qe_op_stats {
+  uint64_t            calls;
+  uint64_t            bytes_read;
+  uint64_t            bytes_written;
+  struct qe_histogram latency;
+};
+
+struct qe_stats {
+  uint64_t           cmps;
+  uint64_t           hydrations;
+  uint64_t           deserializes;
+  uint64_t           purges;
+  uint64_t           bytes_read;
+  uint64_t           bytes_written;
+  struct qe_op_stats op[QUERY_ENGINE_OPS];
+};
+
+QUERY_ENGINE_RETURN_CODE qe_stats(struct query_engine_t *instance, struct qe_stats *stats);
+QUERY_ENGINE_RETURN_CODE qe_index_stats(struct query_engine_t *instance, const char *index, struct qe_stats *stats);
+QUERY_ENGINE_RETURN_CODE qe_stats_reset(struct query_engine_t *instance);
+uint64_t qe_histogram_percentile(const struct qe_histogram *histogram, double percentile);
+
+///
+/// Cursors
+/// -------
+///
+/// A cursor walks an index in order, between an optional `lower` and `upper`
+/// pattern (inclusive unless excluded by flag, NULL meaning unbounded), and
+/// returns a newly deserialized record on each qe_cursor_next until NULL.
+/// Records are only read when returned, skipping `offset` entries through
+/// qe_cursor_limit doesn't read them at all.
+///
+/// With QUERY_ENGINE_CURSOR_PREFIX, `lower` is a pattern for a key prefix and
+/// `upper` is ignored, which requires an index with a key and no `cmp`.
+///
+/// Mutations while a cursor is open may cause entries to be skipped or
+/// repeated, a cursor must be closed before its index is removed.
+
+#define QUERY_ENGINE_CURSOR_DEFAULT        0
+#define QUERY_ENGINE_CURSOR_REVERSE        1
+#define QUERY_ENGINE_CURSOR_EXCLUDE_LOWER  2
+#define QUERY_ENGINE_CURSOR_EXCLUDE_UPPER  4
+#define QUERY_ENGINE_CURSOR_PREFIX         8
+
+struct qe_cursor;
+
+struct qe_cursor * qe_cursor_open(struct query_engine_t *instance, const char *index, const void *lower, const void *upper, int flags);
+QUERY_ENGINE_RETURN_CODE qe_cursor_limit(struct qe_cursor *cursor, size_t offset, size_t limit);
+void * qe_cursor_next(struct qe_cursor *cursor);
+QUERY_ENGINE_RETURN_CODE qe_cursor_close(struct qe_cursor *cursor);
+
+///
+/// Order statistics
+/// ----------------
+///
+/// qe_count counts the entries of an ordered index between `lower` and
+/// `upper`, taking the same patterns & flags as qe_cursor_open (without
+/// QUERY_ENGINE_CURSOR_REVERSE, which changes nothing). On a hash index, it
+/// only counts all entries, with both bounds NULL. qe_rank gives the number
+/// of entries sorting before `pattern`, which is the position of the record
+/// it matches if there is one. qe_select returns the record at a position,
+/// NULL past the end, owned by the caller as with qe_get.
+///
+/// Counting & ranking take a binary search per bound, selecting takes none.
+/// On indexes with a key, none of them read records from the medium besides
+/// the one qe_select returns.
+
+QUERY_ENGINE_RETURN_CODE qe_count(struct query_engine_t *instance, const char *index, const void *lower, const void *upper, int flags, size_t *count);
+QUERY_ENGINE_RETURN_CODE qe_rank(struct query_engine_t *instance, const char *index, const void *pattern, size_t *rank);
+void * qe_select(struct query_engine_t *instance, const char *index, size_t position);
+
+///
+/// Scans
+/// -----
+///
+/// qe_scan visits every record on the medium, in order of their location
+/// rather than by any index. The medium is split into a stretch per thread
+/// (`nthreads`, 0 for one per core), each read sequentially in chunks of up
+/// to 1 MiB with the next chunk read ahead. Threads deserialize records and
+/// call `filter` on them at the same time, so it has to be thread-safe. A
+/// record `filter` returns non-zero for (or every record, with a NULL filter)
+/// is handed to `emit`, which owns it from then on. `emit` is never called
+/// concurrently and stops the scan by returning non-zero.
+///
+/// The scan holds a read lock on the engine, so writers wait for it to
+/// finish. Neither callback may call into the engine.
+
+QUERY_ENGINE_RETURN_CODE qe_scan(struct query_engine_t *instance, int (*filter)(const void *record, void *udata), int (*emit)(void *record, void *udata), void *udata, size_t nthreads);
+
+///
+/// Change feed
+/// -----------
+///
+/// With QUERY_ENGINE_CHANGES, every committed mutation appends its changes to
+/// `<filename>.changes`, each under the next sequence number: a
+/// `QUERY_ENGINE_CHANGE_DEL` holding every record it drops, followed by a
+/// `QUERY_ENGINE_CHANGE_SET` holding every record it stores. Replacing a
+/// record, by qe_set or qe_update alike, gives a delete of the old record and
+/// a set of the new one, so applying the changes in order to a copy keyed any
+/// way leaves it matching the engine. The sequence numbers persist across
+/// qe_init. Compaction doesn't change any record, so it isn't in the feed.
+///
+/// qe_changes_since hands every change after `seq` to `callback`, in order,
+/// along with a record deserialized from the change, owned by the callback.
+/// Starting at 0 replays the whole feed, returning a non-zero value stops it.
+/// Calls hold a read lock on the engine, so the callback may not call into
+/// it. qe_changes_seq gives the sequence number of the latest change.
+/// qe_changes_trim drops the changes up to `seq` once every consumer has
+/// seen them, after which asking for changes since an earlier one returns
+/// QUERY_ENGINE_RETURN_ERR, telling the consumer to start over from a copy.
+///
+/// Changes are written before the mutation is logged, and synced with the
+/// write-ahead log (or with the medium, by qe_sync, without one), so after a
+/// crash the feed may hold trailing changes of mutations that didn't survive
+/// it. Deleting or replacing reads the old record from the medium to put it
+/// in the feed.
+
+#define QUERY_ENGINE_CHANGE_SET    1
+#define QUERY_ENGINE_CHANGE_DEL    2
+
+QUERY_ENGINE_RETURN_CODE qe_changes_since(struct query_engine_t *instance, uint64_t seq, int (*callback)(uint64_t seq, int type, void *record, void *udata), void *udata);
+QUERY_ENGINE_RETURN_CODE qe_changes_seq(struct query_engine_t *instance, uint64_t *seq);
+QUERY_ENGINE_RETURN_CODE qe_changes_trim(struct query_engine_t *instance, uint64_t seq);
+
+///
+/// Snapshots
+/// ---------
+///
+/// qe_snapshot writes a consistent image of the records as they were when
+/// it was called to `fd`, which may be a file, pipe or socket. Writers are
+/// only held up while the records are listed. While the image is written,
+/// allocations they release are held on to rather than freed, and qe_update
+/// replaces records instead of overwriting them, so nothing the image still
+/// has to copy changes. The image holds just the records as stored, without
+/// holes, indexes or allocator state, so it's no larger than the data in it.
+///
+/// qe_restore reads such an image from `fd` into an engine without indexes,
+/// storing every record anew. Indexes added afterwards are built from the
+/// restored records. A truncated or corrupted image returns
+/// QUERY_ENGINE_RETURN_ERR, leaving nothing of it behind. `seq`, unless
+/// NULL, receives the latest change of the snapshotted engine's change feed
+/// (0 without one), so a follower restoring a snapshot continues with the
+/// changes since that. Records compressed with a dictionary need that same
+/// dictionary to be read after restoring.
+///
+/// Without QUERY_ENGINE_WAL, a crash while a snapshot is being written can
+/// bring back records dropped during it, as their allocations weren't freed.
+
+QUERY_ENGINE_RETURN_CODE qe_snapshot(struct query_engine_t *instance, int fd);
+QUERY_ENGINE_RETURN_CODE qe_restore(struct query_engine_t *instance, int fd, uint64_t *seq);
+
+///
+/// Sharding
+/// --------
+///
+/// qe_shards_init opens `n` engines as one, in `<filename>.0` up to
+/// `<filename>.<n-1>`, all with the same callbacks & flags. Records are routed
+/// by the hash `shard` returns for them, so every record & delete pattern has
+/// to carry its shard key, and a database has to be re-opened with the same
+/// `n`. Every shard has its own lock, so writers on different shards proceed
+/// in parallel.
+///
+/// qe_shards_index_add_many adds indexes to every shard, building them at
+/// the same time. Indexes only keep records unique within a shard, which
+/// makes the shard key part of every index' identity. qe_shards_set_many
+/// splits a batch per shard, writing large ones with a thread per shard. It
+/// is atomic within a shard, not across shards.
+///
+/// qe_shards_get on `index`, the index holding the shard key given to
+/// qe_shards_init (may be NULL), only asks the shard the pattern routes to.
+/// On other indexes, it returns the match of the first shard having one.
+/// Cursors on a sharded engine walk all shards at once, merging them in the
+/// index's order. With qe_shards_cursor_limit, every shard reads up to
+/// `offset + limit` records, of which the merge skips `offset`.
+/// qe_shards_count adds up the counts of all shards.
+///
+/// qe_shards_engine gives access to a single shard, for what's not covered
+/// here (statistics, compaction, caches, the log).
+
+struct qe_shards;
+struct qe_shards_cursor;
+
+struct qe_shards * qe_shards_init(const char *filename, size_t n, const char *index, uint64_t (*shard)(const void *entry, void *udata), struct buf * (*serialize)(const void *, void *), void * (*deserialize)(const struct buf *, void*), void (*purge)(void*, void*), void *udata, PALLOC_FLAGS flags);
+QUERY_ENGINE_RETURN_CODE qe_shards_close(struct qe_shards *shards);
+struct query_engine_t * qe_shards_engine(struct qe_shards *shards, size_t shard);
+QUERY_ENGINE_RETURN_CODE qe_shards_index_add_many(struct qe_shards *shards, const struct qe_index_def *defs, size_t n);
+QUERY_ENGINE_RETURN_CODE qe_shards_index_del(struct qe_shards *shards, const char *name);
+QUERY_ENGINE_RETURN_CODE qe_shards_set(struct qe_shards *shards, const void *entry);
+QUERY_ENGINE_RETURN_CODE qe_shards_set_many(struct qe_shards *shards, const void **entries, size_t n);
+QUERY_ENGINE_RETURN_CODE qe_shards_del(struct qe_shards *shards, const void *pattern);
+void * qe_shards_get(struct qe_shards *shards, const char *index, void *pattern);
+struct qe_shards_cursor * qe_shards_cursor_open(struct qe_shards *shards, const char *index, const void *lower, const void *upper, int flags);
+QUERY_ENGINE_RETURN_CODE qe_shards_cursor_limit(struct qe_shards_cursor *cursor, size_t offset, size_t limit);
+void * qe_shards_cursor_next(struct qe_shards_cursor *cursor);
+QUERY_ENGINE_RETURN_CODE qe_shards_cursor_close(struct qe_shards_cursor *cursor);
+QUERY_ENGINE_RETURN_CODE qe_shards_count(struct qe_shards *shards, const char *index, const void *lower, const void *upper, int flags, size_t *count);
 
 #ifdef __cplusplus
 } // extern "C"
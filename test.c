@@ -2,8 +2,14 @@
 extern "C" {
 #endif
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "finwo/assert.h"
 #include "tidwall/buf.h"
@@ -28,8 +34,10 @@ struct buf * serialize(const void *entry_raw, void *udata) {
   return output;
 }
 
+int deserialize_count = 0;
 void * deserialize(const struct buf *raw, void *udata) {
   ASSERT("_des:: QE userdata is correct", udata == QEUD_A) NULL;
+  __atomic_add_fetch(&deserialize_count, 1, __ATOMIC_RELAXED);
   struct entry *output = calloc(1, sizeof(struct entry));
   struct buf   *dupped = calloc(1, sizeof(struct buf));
   output->data         = calloc(1, sizeof(struct buf));
@@ -51,6 +59,28 @@ int cmp(const void *a, const void *b, void *udata_qe, void *udata_idx) {
   return strcmp(ea->name, eb->name);
 }
 
+struct buf * key(const void *entry_raw, void *udata_qe, void *udata_idx) {
+  ASSERT("_key:: QE  userdata is correct", udata_qe  == QEUD_A) NULL;
+  ASSERT("_key:: IDX userdata is correct", udata_idx == QEUD_B) NULL;
+  struct entry *entry  = (struct entry *)entry_raw;
+  struct buf   *output = calloc(1, sizeof(struct buf));
+  buf_append(output, entry->name, strlen(entry->name));
+  return output;
+}
+
+uint64_t hash(const void *entry_raw, void *udata_qe, void *udata_idx) {
+  ASSERT("_hsh:: QE  userdata is correct", udata_qe  == QEUD_A) 0;
+  ASSERT("_hsh:: IDX userdata is correct", udata_idx == QEUD_B) 0;
+  const char *name   = ((struct entry *)entry_raw)->name;
+  uint64_t    output = 14695981039346656037ULL;
+  while(*name) output = (output ^ (unsigned char)*(name++)) * 1099511628211ULL;
+  return output;
+}
+
+int eq(const void *a, const void *b, void *udata_qe, void *udata_idx) {
+  return cmp(a, b, udata_qe, udata_idx) == 0;
+}
+
 void purge(void *entry_raw, void *udata) {
   ASSERT("_pur:: QE userdata is correct", udata == QEUD_A);
   struct entry *entry = (struct entry *)entry_raw;
@@ -75,12 +105,12 @@ char *random_str(int len) {
 void test_main() {
   struct query_engine_t *qe = qe_init("pizza.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
 
-  ASSERT("Adding the 'nam' index returns OK"       , qe_index_add(qe, "nam", &cmp, QEUD_B) == QUERY_ENGINE_RETURN_OK );
-  ASSERT("Adding duplicate 'nam' index returns ERR", qe_index_add(qe, "nam", &cmp, QEUD_B) == QUERY_ENGINE_RETURN_ERR);
+  ASSERT("Adding the 'nam' index returns OK"       , qe_index_add(qe, "nam", &cmp, NULL, QEUD_B) == QUERY_ENGINE_RETURN_OK );
+  ASSERT("Adding duplicate 'nam' index returns ERR", qe_index_add(qe, "nam", &cmp, NULL, QEUD_B) == QUERY_ENGINE_RETURN_ERR);
 
   ASSERT("Removing 'nam' index returns OK"       , qe_index_del(qe, "nam") == QUERY_ENGINE_RETURN_OK);
   ASSERT("Removing non-existing index returns OK", qe_index_del(qe, "nam") == QUERY_ENGINE_RETURN_OK);
-  ASSERT("Re-adding 'nam' index return OK"       , qe_index_add(qe, "nam", &cmp, QEUD_B) == QUERY_ENGINE_RETURN_OK );
+  ASSERT("Re-adding 'nam' index return OK"       , qe_index_add(qe, "nam", &cmp, NULL, QEUD_B) == QUERY_ENGINE_RETURN_OK );
 
   // Build random entry
   struct entry *e_00 = calloc(1, sizeof(struct entry));
@@ -115,12 +145,1821 @@ void test_main() {
   ASSERT("get returns the null on known missing key", f_01 == NULL);
 }
 
+void test_keyed() {
+  unlink("keyed.db");
+  struct query_engine_t *qe = qe_init("keyed.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+
+  ASSERT("Index without cmp or key returns ERR", qe_index_add(qe, "nil", NULL, NULL, QEUD_B) == QUERY_ENGINE_RETURN_ERR);
+  ASSERT("Adding keyed 'key' index returns OK" , qe_index_add(qe, "key", NULL, &key, QEUD_B) == QUERY_ENGINE_RETURN_OK );
+
+  // Fill with some entries
+  struct entry *e_00 = NULL;
+  for(int i=0; i<64; i++) {
+    struct entry *e = calloc(1, sizeof(struct entry));
+    e->name         = random_str(8);
+    e->data         = calloc(1, sizeof(struct buf));
+    buf_append(e->data, "abc", 3);
+    qe_set(qe, e);
+    if (e_00) purge(e, QEUD_A);
+    else e_00 = e;
+  }
+
+  // A lookup only deserializes the returned record
+  deserialize_count  = 0;
+  struct entry *p_00 = &(struct entry){ .name = e_00->name };
+  struct entry *f_00 = qe_get(qe, "key", p_00);
+  ASSERT("keyed get returns the non-null on known good key", f_00 != NULL                       );
+  ASSERT("keyed get deserializes a single record"          , deserialize_count == 1             );
+  ASSERT("key of keyed entry matches"                      , strcmp(f_00->name, e_00->name) == 0);
+  purge(f_00, QEUD_A);
+
+  // Replacing & removing entries keeps the index consistent
+  buf_append(e_00->data, "def", 3);
+  qe_set(qe, e_00);
+  f_00 = qe_get(qe, "key", p_00);
+  ASSERT("keyed get returns the replaced entry", f_00 && f_00->data->len >= 6 && memcmp(f_00->data->data, "abcdef", 6) == 0);
+  if (f_00) purge(f_00, QEUD_A);
+  qe_del(qe, p_00);
+  ASSERT("keyed get returns null after delete", qe_get(qe, "key", p_00) == NULL);
+
+  // Re-opening rebuilds the keyed index from the medium
+  qe_close(qe);
+  qe = qe_init("keyed.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  ASSERT("Re-adding keyed 'key' index returns OK", qe_index_add(qe, "key", NULL, &key, QEUD_B) == QUERY_ENGINE_RETURN_OK);
+  ASSERT("deleted entry stays deleted on re-open", qe_get(qe, "key", p_00) == NULL);
+
+  purge(e_00, QEUD_A);
+  qe_close(qe);
+}
+
+void test_hash() {
+  unlink("hash.db");
+  struct query_engine_t *qe = qe_init("hash.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+
+  ASSERT("Hash index without eq returns ERR"   , qe_index_add_hash(qe, "nil", &hash, NULL, QEUD_B) == QUERY_ENGINE_RETURN_ERR);
+  ASSERT("Adding hash 'hsh' index returns OK"  , qe_index_add_hash(qe, "hsh", &hash, &eq, QEUD_B) == QUERY_ENGINE_RETURN_OK );
+  ASSERT("Hash index can't be iterated"        , qe_cursor_open(qe, "hsh", NULL, NULL, 0) == NULL);
+
+  // Enough records to grow the table a few times
+  struct entry *e = calloc(1, sizeof(struct entry));
+  e->name         = calloc(16, sizeof(char));
+  e->data         = calloc(1, sizeof(struct buf));
+  buf_append(e->data, "abc", 3);
+  for(int i=0; i<1000; i++) {
+    snprintf(e->name, 16, "h%04d", i);
+    qe_set(qe, e);
+  }
+
+  // A lookup only deserializes the returned record
+  int found = 0;
+  deserialize_count = 0;
+  for(int i=0; i<1000; i++) {
+    snprintf(e->name, 16, "h%04d", i);
+    struct entry *f = qe_get(qe, "hsh", e);
+    if (f && strcmp(f->name, e->name) == 0) found++;
+    if (f) purge(f, QEUD_A);
+  }
+  ASSERT("hash get finds every record"          , found == 1000);
+  ASSERT("hash get deserializes a single record", deserialize_count == 1000);
+
+  // Replacing & removing entries keeps the index consistent
+  snprintf(e->name, 16, "h%04d", 42);
+  buf_append(e->data, "def", 3);
+  qe_set(qe, e);
+  struct entry *f_42 = qe_get(qe, "hsh", e);
+  ASSERT("hash get returns the replaced entry", f_42 && f_42->data->len >= 6 && memcmp(f_42->data->data, "abcdef", 6) == 0);
+  if (f_42) purge(f_42, QEUD_A);
+  qe_del(qe, e);
+  ASSERT("hash get returns null after delete", qe_get(qe, "hsh", e) == NULL);
+
+  // Later entries in a batch replace earlier equal ones
+  struct entry *b_00 = &(struct entry){ .name = "b0", .data = &(struct buf){ .data = "old", .len = 3 } };
+  struct entry *b_01 = &(struct entry){ .name = "b0", .data = &(struct buf){ .data = "new", .len = 3 } };
+  const void *batch[] = { b_00, b_01 };
+  qe_set_many(qe, batch, 2);
+  struct entry *f_b0 = qe_get(qe, "hsh", b_00);
+  ASSERT("hash batch keeps the last equal entry", f_b0 && memcmp(f_b0->data->data, "new", 3) == 0);
+  if (f_b0) purge(f_b0, QEUD_A);
+
+  // Re-opening loads the persisted table, hashes included
+  qe_close(qe);
+  qe = qe_init("hash.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  deserialize_count = 0;
+  ASSERT("Re-adding persisted 'hsh' index returns OK", qe_index_add_hash(qe, "hsh", &hash, &eq, QEUD_B) == QUERY_ENGINE_RETURN_OK);
+  ASSERT("persisted hash index loads without deserializing", deserialize_count == 0);
+  snprintf(e->name, 16, "h%04d", 999);
+  struct entry *f_999 = qe_get(qe, "hsh", e);
+  ASSERT("persisted hash index finds known good key", f_999 && strcmp(f_999->name, e->name) == 0);
+  if (f_999) purge(f_999, QEUD_A);
+  snprintf(e->name, 16, "h%04d", 42);
+  ASSERT("deleted entry stays deleted on re-open", qe_get(qe, "hsh", e) == NULL);
+
+  purge(e, QEUD_A);
+  qe_close(qe);
+}
+
+void test_bloom() {
+  unlink("bloom.db");
+  struct query_engine_t *qe = qe_init("bloom.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  struct qe_bloom_stats  stats;
+  qe_index_add(qe, "key", NULL, &key, QEUD_B);
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+
+  ASSERT("Filter on unknown index returns ERR"     , qe_index_bloom(qe, "nil", NULL, 0.01) == QUERY_ENGINE_RETURN_ERR);
+  ASSERT("Filter on records without hash is ERR"   , qe_index_bloom(qe, "nam", NULL, 0.01) == QUERY_ENGINE_RETURN_ERR);
+  ASSERT("Filter on bytewise keys returns OK"      , qe_index_bloom(qe, "key", NULL, 0.01) == QUERY_ENGINE_RETURN_OK );
+  ASSERT("Filter on records with hash returns OK"  , qe_index_bloom(qe, "nam", &hash, 0.01) == QUERY_ENGINE_RETURN_OK );
+
+  // Enough records to outgrow the initial filter
+  struct entry *e = calloc(1, sizeof(struct entry));
+  e->name         = calloc(16, sizeof(char));
+  e->data         = calloc(1, sizeof(struct buf));
+  buf_append(e->data, "abc", 3);
+  for(int i=0; i<2048; i++) {
+    snprintf(e->name, 16, "b%04d", i);
+    qe_set(qe, e);
+  }
+  qe_index_bloom_stats(qe, "key", &stats);
+  ASSERT("filter grows along with the index", stats.entries == 2048 && stats.capacity >= 2048);
+
+  // Known records always pass the filter
+  int found = 0;
+  for(int i=0; i<2048; i++) {
+    snprintf(e->name, 16, "b%04d", i);
+    struct entry *f = qe_get(qe, "key", e);
+    if (f) found++;
+    if (f) purge(f, QEUD_A);
+  }
+  ASSERT("filtered get finds every record", found == 2048);
+
+  // Absent records mostly don't reach the medium
+  deserialize_count = 0;
+  for(int i=0; i<1000; i++) {
+    snprintf(e->name, 16, "m%04d", i);
+    qe_get(qe, "key", e);
+    qe_get(qe, "nam", e);
+  }
+  qe_index_bloom_stats(qe, "key", &stats);
+  ASSERT("filter answers most absent lookups", stats.negatives > 950 && stats.negatives + stats.false_positives == 1000);
+  qe_index_bloom_stats(qe, "nam", &stats);
+  ASSERT("record filter answers most absent lookups", stats.negatives > 950 && stats.negatives + stats.false_positives == 1000);
+  ASSERT("absent lookups barely deserialize", deserialize_count < 200);
+
+  // Deletes are removed from the filter
+  snprintf(e->name, 16, "b%04d", 42);
+  qe_del(qe, e);
+  qe_index_bloom_stats(qe, "key", &stats);
+  ASSERT("deleted record leaves the filter", stats.entries == 2047);
+  ASSERT("deleted record isn't found", qe_get(qe, "key", e) == NULL);
+
+  // Re-opening loads the persisted filter instead of building it
+  qe_close(qe);
+  qe = qe_init("bloom.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  qe_index_add(qe, "key", NULL, &key, QEUD_B);
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+  deserialize_count = 0;
+  ASSERT("Re-adding persisted filter returns OK", qe_index_bloom(qe, "nam", &hash, 0.01) == QUERY_ENGINE_RETURN_OK);
+  ASSERT("persisted filter loads without deserializing", deserialize_count == 0);
+  qe_index_bloom_stats(qe, "nam", &stats);
+  ASSERT("persisted filter holds every record", stats.entries == 2047);
+  ASSERT("index without filter reports ERR", qe_index_bloom_stats(qe, "key", &stats) == QUERY_ENGINE_RETURN_ERR);
+  snprintf(e->name, 16, "b%04d", 7);
+  struct entry *f_07 = qe_get(qe, "nam", e);
+  ASSERT("persisted filter passes known good key", f_07 != NULL);
+  if (f_07) purge(f_07, QEUD_A);
+
+  purge(e, QEUD_A);
+  qe_close(qe);
+}
+
+// Offset of the last allocation on the medium
+PALLOC_OFFSET last_alloc(struct query_engine_t *qe) {
+  PALLOC_OFFSET ptr  = 0;
+  PALLOC_OFFSET last = 0;
+  while((ptr = palloc_next(qe->fd, ptr))) last = ptr;
+  return last;
+}
+
+void test_compact() {
+  unlink("compact.db");
+  struct query_engine_t *qe = qe_init("compact.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  qe_index_add(qe, "key", NULL, &key, QEUD_B);
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+  qe_index_add_hash(qe, "hsh", &hash, &eq, QEUD_B);
+
+  struct entry *e = calloc(1, sizeof(struct entry));
+  e->name         = calloc(16, sizeof(char));
+  e->data         = calloc(1, sizeof(struct buf));
+  buf_append(e->data, "abc", 3);
+  for(int i=0; i<256; i++) {
+    snprintf(e->name, 16, "c%04d", i);
+    qe_set(qe, e);
+  }
+
+  // Leave holes at the front
+  for(int i=0; i<128; i++) {
+    snprintf(e->name, 16, "c%04d", i);
+    qe_del(qe, e);
+  }
+  PALLOC_OFFSET before = last_alloc(qe);
+
+  // Small budgets spread the pass over multiple calls
+  int calls = 1;
+  QUERY_ENGINE_RETURN_CODE result;
+  while((result = qe_compact(qe, 256)) == QUERY_ENGINE_RETURN_MORE) calls++;
+  ASSERT("compaction finishes without errors", result == QUERY_ENGINE_RETURN_OK);
+  ASSERT("compaction with a budget takes multiple calls", calls > 1);
+  ASSERT("compaction moves records to the front", last_alloc(qe) < before);
+
+  // Every index points at the moved records
+  int found = 0;
+  for(int i=0; i<256; i++) {
+    snprintf(e->name, 16, "c%04d", i);
+    const char *indexes[] = { "key", "nam", "hsh" };
+    for(int j=0; j<3; j++) {
+      struct entry *f = qe_get(qe, indexes[j], e);
+      if (f && (i >= 128) && strcmp(f->name, e->name) == 0 && memcmp(f->data->data, "abc", 3) == 0) found++;
+      if (f && (i <  128)) found = -1000;
+      if (f) purge(f, QEUD_A);
+    }
+  }
+  ASSERT("moved records are found through every index", found == 3 * 128);
+
+  // Moved records survive re-opening
+  qe_close(qe);
+  qe = qe_init("compact.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  qe_index_add(qe, "key", NULL, &key, QEUD_B);
+  ASSERT("full pass on a compact medium returns OK", qe_compact(qe, 0) == QUERY_ENGINE_RETURN_OK);
+  found = 0;
+  for(int i=128; i<256; i++) {
+    snprintf(e->name, 16, "c%04d", i);
+    struct entry *f = qe_get(qe, "key", e);
+    if (f && strcmp(f->name, e->name) == 0) found++;
+    if (f) purge(f, QEUD_A);
+  }
+  ASSERT("moved records survive re-opening", found == 128);
+
+  purge(e, QEUD_A);
+  qe_close(qe);
+}
+
+void test_index_many() {
+  unlink("many.db");
+  struct query_engine_t *qe = qe_init("many.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  qe_index_add(qe, "key", NULL, &key, QEUD_B);
+
+  struct entry *e = calloc(1, sizeof(struct entry));
+  e->name         = calloc(16, sizeof(char));
+  e->data         = calloc(1, sizeof(struct buf));
+  buf_append(e->data, "abc", 3);
+  for(int i=0; i<4096; i++) {
+    snprintf(e->name, 16, "m%04d", (i * 2011) % 4096);
+    qe_set(qe, e);
+  }
+  qe_close(qe);
+  qe = qe_init("many.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+
+  // Invalid or duplicate definitions add nothing at all
+  struct qe_index_def dups[] = {
+    { .name = "nam", .cmp = &cmp, .udata = QEUD_B },
+    { .name = "nam", .key = &key, .udata = QEUD_B },
+  };
+  ASSERT("Adding duplicate definitions returns ERR", qe_index_add_many(qe, dups, 2) == QUERY_ENGINE_RETURN_ERR);
+  ASSERT("failed definitions add no index", qe_get(qe, "nam", e) == NULL && qe_index_add(qe, "nam", &cmp, NULL, QEUD_B) == QUERY_ENGINE_RETURN_OK);
+  qe_index_del(qe, "nam");
+
+  // A single scan serves every index lacking a persisted copy
+  struct qe_index_def defs[] = {
+    { .name = "key" , .key  = &key ,              .udata = QEUD_B },
+    { .name = "nam" , .cmp  = &cmp ,              .udata = QEUD_B },
+    { .name = "hsh" , .hash = &hash, .eq = &eq,   .udata = QEUD_B },
+    { .name = "key2", .key  = &key ,              .udata = QEUD_B },
+  };
+  deserialize_count = 0;
+  ASSERT("Adding many indexes returns OK", qe_index_add_many(qe, defs, 4) == QUERY_ENGINE_RETURN_OK);
+  ASSERT("many indexes deserialize every record once", deserialize_count == 4096);
+
+  // Every index finds every record
+  int found = 0;
+  for(int i=0; i<4096; i++) {
+    snprintf(e->name, 16, "m%04d", i);
+    for(int j=0; j<4; j++) {
+      struct entry *f = qe_get(qe, defs[j].name, e);
+      if (f && strcmp(f->name, e->name) == 0) found++;
+      if (f) purge(f, QEUD_A);
+    }
+  }
+  ASSERT("bulk built indexes find every record", found == 4 * 4096);
+
+  // Sorted as if inserted one by one
+  int sorted = 1;
+  int count  = 0;
+  char last[16] = "";
+  struct qe_cursor *cursor = qe_cursor_open(qe, "nam", NULL, NULL, 0);
+  struct entry *f;
+  while((f = qe_cursor_next(cursor))) {
+    if (strcmp(last, f->name) >= 0) sorted = 0;
+    strcpy(last, f->name);
+    count++;
+    purge(f, QEUD_A);
+  }
+  qe_cursor_close(cursor);
+  ASSERT("bulk built index is sorted", sorted && count == 4096);
+
+  purge(e, QEUD_A);
+  qe_close(qe);
+}
+
+void test_compress() {
+  unlink("compress.db");
+  unlink("plain.db");
+  struct query_engine_t *qe    = qe_init("compress.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC | QUERY_ENGINE_COMPRESS | QUERY_ENGINE_STATS);
+  struct query_engine_t *plain = qe_init("plain.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC | QUERY_ENGINE_STATS);
+  qe_index_add(qe, "key", NULL, &key, QEUD_B);
+  qe_index_add(plain, "key", NULL, &key, QEUD_B);
+
+  // Repetitive payloads, as serialized structured records tend to be
+  char          name[16];
+  struct buf    data = { 0 };
+  struct entry *e    = &(struct entry){ .name = name, .data = &data };
+  struct entry *f;
+  for(int i=0; i<16; i++) buf_append(&data, "{\"kind\":\"pizza\",\"size\":32},", 28);
+  for(int i=0; i<64; i++) {
+    snprintf(name, sizeof(name), "z%02d", i);
+    qe_set(qe, e);
+    qe_set(plain, e);
+  }
+
+  struct qe_stats stats, plain_stats;
+  qe_stats(qe, &stats);
+  qe_stats(plain, &plain_stats);
+  ASSERT("compressed records take less room", stats.bytes_written * 4 < plain_stats.bytes_written);
+  qe_close(plain);
+
+  int found = 0;
+  for(int i=0; i<64; i++) {
+    snprintf(name, sizeof(name), "z%02d", i);
+    f = qe_get(qe, "key", e);
+    if (f && f->data->len == data.len && memcmp(f->data->data, data.data, data.len) == 0) found++;
+    if (f) purge(f, QEUD_A);
+  }
+  ASSERT("compressed records read back intact", found == 64);
+
+  // Plain & compressed records coexist when re-opened without compression
+  qe_close(qe);
+  qe = qe_init("compress.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  qe_index_add(qe, "key", NULL, &key, QEUD_B);
+  snprintf(name, sizeof(name), "p00");
+  qe_set(qe, e);
+  f = qe_get(qe, "key", e);
+  ASSERT("plain record reads back next to compressed ones", f && f->data->len >= data.len && memcmp(f->data->data, data.data, data.len) == 0);
+  if (f) purge(f, QEUD_A);
+  snprintf(name, sizeof(name), "z42");
+  f = qe_get(qe, "key", e);
+  ASSERT("compressed record reads back without the flag", f && f->data->len == data.len && memcmp(f->data->data, data.data, data.len) == 0);
+  if (f) purge(f, QEUD_A);
+  qe_close(qe);
+
+  // Small records need a dictionary to compress
+  unlink("compress.db");
+  unlink("plain.db");
+  qe = qe_init("compress.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC | QUERY_ENGINE_COMPRESS | QUERY_ENGINE_STATS);
+  qe_index_add(qe, "key", NULL, &key, QEUD_B);
+  struct buf    small = { .data = "{\"kind\":\"margherita\",\"size\":32,\"crust\":\"thin\"}", .len = 47 };
+  struct entry  samples[32];
+  char          names[32][16];
+  const void   *sample_list[32];
+  for(int i=0; i<32; i++) {
+    snprintf(names[i], sizeof(names[i]), "d%02d", i);
+    samples[i].name = names[i];
+    samples[i].data = &small;
+    sample_list[i]  = &samples[i];
+  }
+  plain = qe_init("plain.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC | QUERY_ENGINE_COMPRESS | QUERY_ENGINE_STATS);
+  qe_index_add(plain, "key", NULL, &key, QEUD_B);
+  qe_stats(plain, &plain_stats);
+  qe_set_many(plain, sample_list, 32);
+  uint64_t without = plain_stats.bytes_written;
+  qe_stats(plain, &plain_stats);
+  without = plain_stats.bytes_written - without;
+  qe_close(plain);
+
+  struct buf *dict = qe_compress_train(qe, sample_list, 32, 1024);
+  ASSERT("training builds a dictionary", dict && dict->len > 0 && dict->len <= 1024);
+  ASSERT("dictionary is accepted", qe_compress_dict(qe, dict) == QUERY_ENGINE_RETURN_OK);
+  qe_stats(qe, &stats);
+  uint64_t with = stats.bytes_written;
+  qe_set_many(qe, sample_list, 32);
+  qe_stats(qe, &stats);
+  with = stats.bytes_written - with;
+  ASSERT("dictionary compresses small records", with * 4 < without * 3);
+
+  // Records compressed against a dictionary need it to be read
+  qe_close(qe);
+  qe = qe_init("compress.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  qe_index_add(qe, "key", NULL, &key, QEUD_B);
+  ASSERT("record is unreadable without its dictionary", qe_get(qe, "key", &samples[7]) == NULL);
+  qe_compress_dict(qe, dict);
+  f = qe_get(qe, "key", &samples[7]);
+  ASSERT("record reads back with its dictionary", f && strcmp(f->name, "d07") == 0 && f->data->len == small.len && memcmp(f->data->data, small.data, small.len) == 0);
+  if (f) purge(f, QEUD_A);
+
+  buf_clear(dict);
+  free(dict);
+  buf_clear(&data);
+  qe_close(qe);
+}
+
+// Serialized as "<name>\n<int32 value><uint8 length><tag>"
+void typed_record(struct entry *e, char *name, struct buf *data, int i) {
+  char    tag[16];
+  int32_t value = ((i * 37) % 64) - 32;
+  snprintf(name, 16, "t%07d", i);
+  snprintf(tag, sizeof(tag), "%s-%d", i % 2 ? "odd" : "even", i);
+  data->len = 0;
+  for(int k=0; k<4; k++) buf_append(data, (char[]){ (char)(((uint32_t)value >> (k*8)) & 0xFF) }, 1);
+  buf_append(data, (char[]){ (char)strlen(tag) }, 1);
+  buf_append(data, tag, strlen(tag));
+  e->name = name;
+  e->data = data;
+}
+
+int32_t typed_value(const struct entry *e) {
+  uint32_t value = 0;
+  for(int k=0; k<4; k++) value |= ((uint32_t)(unsigned char)e->data->data[k]) << (k*8);
+  return (int32_t)value;
+}
+
+void test_typed() {
+  unlink("typed.db");
+  struct query_engine_t *qe = qe_init("typed.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+
+  struct qe_index_def bad = { .name = "bad", .cmp = &cmp, .type = QUERY_ENGINE_KEY_UINT, .offset = 9, .length = 4, .udata = QEUD_B };
+  ASSERT("Typed index of odd width returns ERR"       , qe_index_add_typed(qe, "bad", QUERY_ENGINE_KEY_UINT, 9, 3) == QUERY_ENGINE_RETURN_ERR);
+  ASSERT("Typed index with a callback returns ERR"    , qe_index_add_many(qe, &bad, 1) == QUERY_ENGINE_RETURN_ERR);
+  ASSERT("Adding unsigned 'uid' index returns OK"     , qe_index_add_typed(qe, "uid", QUERY_ENGINE_KEY_UINT, 9, 4) == QUERY_ENGINE_RETURN_OK);
+  ASSERT("Adding signed 'sid' index returns OK"       , qe_index_add_typed(qe, "sid", QUERY_ENGINE_KEY_INT, 9, 4) == QUERY_ENGINE_RETURN_OK);
+  ASSERT("Adding fixed bytes 'nam' index returns OK"  , qe_index_add_typed(qe, "nam", QUERY_ENGINE_KEY_BYTES, 0, 8) == QUERY_ENGINE_RETURN_OK);
+  ASSERT("Adding prefixed bytes 'tag' index returns OK", qe_index_add_typed(qe, "tag", QUERY_ENGINE_KEY_PREFIXED, 13, 1) == QUERY_ENGINE_RETURN_OK);
+
+  char          names[64][16];
+  struct buf    datas[64];
+  struct entry  batch[64];
+  const void   *entries[64];
+  memset(datas, 0, sizeof(datas));
+  for(int i=0; i<64; i++) {
+    typed_record(&batch[i], names[i], &datas[i], i);
+    entries[i] = &batch[i];
+  }
+  qe_set_many(qe, entries, 64);
+
+  // Integers order numerically, signed or not
+  int n, ordered;
+  int64_t last;
+  struct entry *f;
+  struct qe_cursor *cursor = qe_cursor_open(qe, "sid", NULL, NULL, QUERY_ENGINE_CURSOR_DEFAULT);
+  for( n = 0, ordered = 1, last = INT64_MIN ; (f = qe_cursor_next(cursor)) ; n++ ) {
+    ordered &= typed_value(f) > last;
+    last     = typed_value(f);
+    purge(f, QEUD_A);
+  }
+  qe_cursor_close(cursor);
+  ASSERT("signed keys iterate in numeric order", n == 64 && ordered);
+  cursor = qe_cursor_open(qe, "uid", NULL, NULL, QUERY_ENGINE_CURSOR_DEFAULT);
+  for( n = 0, ordered = 1, last = -1 ; (f = qe_cursor_next(cursor)) ; n++ ) {
+    ordered &= (int64_t)(uint32_t)typed_value(f) > last;
+    last     = (uint32_t)typed_value(f);
+    purge(f, QEUD_A);
+  }
+  qe_cursor_close(cursor);
+  ASSERT("unsigned keys iterate in numeric order", n == 64 && ordered);
+
+  // Lookups only deserialize the returned record
+  char         name[16];
+  struct buf   data = { 0 };
+  struct entry pattern;
+  typed_record(&pattern, name, &data, 42);
+  deserialize_count = 0;
+  f = qe_get(qe, "nam", &pattern);
+  ASSERT("typed get returns the record", f && strcmp(f->name, "t0000042") == 0);
+  ASSERT("typed get deserializes a single record", deserialize_count == 1);
+  if (f) purge(f, QEUD_A);
+
+  // Prefixed keys support prefix cursors
+  data.len = 0;
+  buf_append(&data, "\0\0\0\0\4odd-", 9);
+  cursor = qe_cursor_open(qe, "tag", &pattern, NULL, QUERY_ENGINE_CURSOR_PREFIX);
+  for( n = 0, ordered = 1 ; (f = qe_cursor_next(cursor)) ; n++ ) {
+    ordered &= atoi(f->name + 1) % 2 == 1;
+    purge(f, QEUD_A);
+  }
+  qe_cursor_close(cursor);
+  ASSERT("prefix cursor on typed keys finds matching records", n == 32 && ordered);
+
+  // Building a typed index doesn't deserialize anything
+  qe_close(qe);
+  qe = qe_init("typed.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  ASSERT("Re-adding persisted 'sid' index returns OK", qe_index_add_typed(qe, "sid", QUERY_ENGINE_KEY_INT, 9, 4) == QUERY_ENGINE_RETURN_OK);
+  qe_index_del(qe, "sid");
+  deserialize_count = 0;
+  ASSERT("Rebuilding 'sid' index returns OK", qe_index_add_typed(qe, "sid", QUERY_ENGINE_KEY_INT, 9, 4) == QUERY_ENGINE_RETURN_OK);
+  ASSERT("typed index builds without deserializing", deserialize_count == 0);
+  typed_record(&pattern, name, &data, 7);
+  f = qe_get(qe, "sid", &pattern);
+  ASSERT("rebuilt typed index finds known good key", f && strcmp(f->name, "t0000007") == 0);
+  if (f) purge(f, QEUD_A);
+
+  for(int i=0; i<64; i++) buf_clear(&datas[i]);
+  buf_clear(&data);
+  qe_close(qe);
+
+  // Records too short for a typed key are stored, but not indexed by it, however it's built
+  // Long ones end in their key, so key 0 looks just like the padding of short ones
+  unlink("typed-short.db");
+  qe = qe_init("typed-short.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+  for(int i=0; i<10; i++) {
+    snprintf(names[i], sizeof(names[i]), "%c%d", i < 8 ? 'l' : 's', i);
+    buf_append(&datas[i], "0123456789", i < 8 ? 9 : 2);
+    if (i < 8) buf_append(&datas[i], (char[]){ (char)i, 0, 0, 0 }, 4);
+    batch[i].name = names[i];
+    batch[i].data = &datas[i];
+    qe_set(qe, &batch[i]);
+  }
+  size_t count = 0;
+  ASSERT("Adding typed 't' index over short records returns OK", qe_index_add_typed(qe, "t", QUERY_ENGINE_KEY_UINT, 12, 4) == QUERY_ENGINE_RETURN_OK);
+  qe_count(qe, "t", NULL, NULL, QUERY_ENGINE_CURSOR_DEFAULT, &count);
+  ASSERT("bulk built typed index skips short records", count == 8);
+  f = qe_get(qe, "t", &batch[0]);
+  ASSERT("short records don't take the key of their padding", f && strcmp(f->name, "l0") == 0);
+  if (f) purge(f, QEUD_A);
+  snprintf(names[10], sizeof(names[10]), "s10");
+  buf_append(&datas[10], "01", 2);
+  batch[10].name = names[10];
+  batch[10].data = &datas[10];
+  ASSERT("setting a record too short for a typed index returns OK", qe_set(qe, &batch[10]) == QUERY_ENGINE_RETURN_OK);
+  f = qe_get(qe, "nam", &batch[10]);
+  ASSERT("short record is found through another index", f && strcmp(f->name, "s10") == 0);
+  if (f) purge(f, QEUD_A);
+  ASSERT("deleting a bulk indexed short record returns OK", qe_del(qe, &batch[9]) == QUERY_ENGINE_RETURN_OK);
+  ASSERT("deleting a record ending in zeroes returns OK", qe_del(qe, &batch[1]) == QUERY_ENGINE_RETURN_OK);
+  cursor = qe_cursor_open(qe, "t", NULL, NULL, QUERY_ENGINE_CURSOR_DEFAULT);
+  for( n = 0, ordered = 1 ; (f = qe_cursor_next(cursor)) ; n++ ) {
+    ordered &= (f->name[0] == 'l') && (f->data->data[9] == (n ? n + 1 : 0));
+    purge(f, QEUD_A);
+  }
+  qe_cursor_close(cursor);
+  ASSERT("typed index holds no stale entries", n == 7 && ordered);
+
+  for(int i=0; i<11; i++) buf_clear(&datas[i]);
+  qe_close(qe);
+
+  // Media from before records were padded hold them as-is, ending in the key here
+  unlink("typed-legacy.db");
+  PALLOC_FD fd = palloc_open("typed-legacy.db", PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  palloc_init(fd, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  for(int i=0; i<10; i++) {
+    char record[16] = "u0\nabcde";
+    record[1] = (char)('0' + i);
+    for(int k=0; k<8; k++) record[8 + k] = (char)(((uint64_t)(100 + i) >> (k*8)) & 0xFF);
+    pwrite(fd, record, 16, palloc(fd, 16));
+  }
+  palloc_close(fd);
+  qe = qe_init("typed-legacy.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+  ASSERT("Adding typed 'id' index over unpadded records returns OK", qe_index_add_typed(qe, "id", QUERY_ENGINE_KEY_UINT, 8, 8) == QUERY_ENGINE_RETURN_OK);
+  qe_count(qe, "id", NULL, NULL, QUERY_ENGINE_CURSOR_DEFAULT, &count);
+  ASSERT("typed index holds every unpadded record", count == 10);
+  snprintf(names[0], sizeof(names[0]), "u3");
+  datas[0].len = 0;
+  buf_append(&datas[0], "abcde", 5);
+  buf_append(&datas[0], (char[]){ 103, 0, 0, 0, 0, 0, 0, 0 }, 8);
+  batch[0].name = names[0];
+  batch[0].data = &datas[0];
+  f = qe_get(qe, "id", &batch[0]);
+  ASSERT("typed get finds an unpadded record", f && strcmp(f->name, "u3") == 0);
+  if (f) purge(f, QEUD_A);
+  qe_del(qe, &batch[0]);
+  qe_count(qe, "id", NULL, NULL, QUERY_ENGINE_CURSOR_DEFAULT, &count);
+  ASSERT("deleting an unpadded record drops its typed entry", count == 9);
+  int img = open("typed-legacy.img", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  qe_snapshot(qe, img);
+  close(img);
+  qe_close(qe);
+
+  // Restored into a new medium, they're padded like any other
+  unlink("typed-restore.db");
+  qe  = qe_init("typed-restore.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  img = open("typed-legacy.img", O_RDONLY);
+  ASSERT("restoring unpadded records returns OK", qe_restore(qe, img, NULL) == QUERY_ENGINE_RETURN_OK);
+  close(img);
+  qe_index_add_typed(qe, "id", QUERY_ENGINE_KEY_UINT, 8, 8);
+  qe_count(qe, "id", NULL, NULL, QUERY_ENGINE_CURSOR_DEFAULT, &count);
+  ASSERT("restored unpadded records keep their typed keys", count == 9);
+  buf_clear(&datas[0]);
+  qe_close(qe);
+  unlink("typed-legacy.img");
+}
+
+void test_persist() {
+  unlink("persist.db");
+  struct query_engine_t *qe = qe_init("persist.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+
+  struct entry *e_00 = calloc(1, sizeof(struct entry));
+  e_00->data         = calloc(1, sizeof(struct buf));
+  buf_append(e_00->data, "abc", 3);
+  for(int i=0; i<32; i++) {
+    e_00->name = random_str(8);
+    qe_set(qe, e_00);
+    if (i < 31) free(e_00->name);
+  }
+  qe_close(qe);
+
+  // Re-opening loads the index instead of scanning & comparing records
+  struct entry *p_00 = &(struct entry){ .name = e_00->name };
+  deserialize_count  = 0;
+  qe = qe_init("persist.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  ASSERT("Re-adding persisted 'nam' index returns OK", qe_index_add(qe, "nam", &cmp, NULL, QEUD_B) == QUERY_ENGINE_RETURN_OK);
+  ASSERT("persisted index loads without deserializing", deserialize_count == 0);
+  struct entry *f_00 = qe_get(qe, "nam", p_00);
+  ASSERT("persisted index finds known good key", f_00 && strcmp(f_00->name, e_00->name) == 0);
+  if (f_00) purge(f_00, QEUD_A);
+
+  // Mutate without closing, as if crashed
+  free(e_00->name);
+  e_00->name = random_str(8);
+  qe_set(qe, e_00);
+
+  // The stale copy is not used, the index is rebuilt
+  struct query_engine_t *qe2 = qe_init("persist.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  deserialize_count = 0;
+  ASSERT("Re-adding stale 'nam' index returns OK", qe_index_add(qe2, "nam", &cmp, NULL, QEUD_B) == QUERY_ENGINE_RETURN_OK);
+  ASSERT("stale index is rebuilt from the medium", deserialize_count > 0);
+  p_00 = &(struct entry){ .name = e_00->name };
+  f_00 = qe_get(qe2, "nam", p_00);
+  ASSERT("rebuilt index finds entry written before crash", f_00 && strcmp(f_00->name, e_00->name) == 0);
+  if (f_00) purge(f_00, QEUD_A);
+  qe_close(qe2);
+
+  purge(e_00, QEUD_A);
+}
+
+void test_cursor() {
+  unlink("cursor.db");
+  struct query_engine_t *qe = qe_init("cursor.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+  qe_index_add(qe, "key", NULL, &key, QEUD_B);
+
+  char name[16];
+  struct entry *e_00 = &(struct entry){ .name = name, .data = &(struct buf){ .data = "x", .len = 1 } };
+  for(int i=0; i<20; i++) {
+    snprintf(name, sizeof(name), "%c%02d", i < 10 ? 'a' : 'b', i);
+    qe_set(qe, e_00);
+  }
+
+  struct entry *p_lo = &(struct entry){ .name = "a03" };
+  struct entry *p_hi = &(struct entry){ .name = "b12" };
+  struct entry *p_ab = &(struct entry){ .name = "b"   };
+  struct entry *f_00;
+  struct qe_cursor *cursor;
+  int n, ordered;
+
+  cursor = qe_cursor_open(qe, "nam", p_lo, p_hi, QUERY_ENGINE_CURSOR_DEFAULT);
+  for( n = 0, ordered = 1 ; (f_00 = qe_cursor_next(cursor)) ; n++ ) {
+    ordered &= atoi(f_00->name + 1) == n + 3;
+    purge(f_00, QEUD_A);
+  }
+  qe_cursor_close(cursor);
+  ASSERT("inclusive range returns all entries in between", n == 10);
+  ASSERT("inclusive range returns entries in order"      , ordered);
+
+  cursor = qe_cursor_open(qe, "key", p_lo, p_hi, QUERY_ENGINE_CURSOR_REVERSE | QUERY_ENGINE_CURSOR_EXCLUDE_LOWER | QUERY_ENGINE_CURSOR_EXCLUDE_UPPER);
+  for( n = 0, ordered = 1 ; (f_00 = qe_cursor_next(cursor)) ; n++ ) {
+    ordered &= atoi(f_00->name + 1) == 11 - n;
+    purge(f_00, QEUD_A);
+  }
+  qe_cursor_close(cursor);
+  ASSERT("exclusive reverse range skips the bounds", n == 8);
+  ASSERT("reverse range returns entries in order"  , ordered);
+
+  cursor = qe_cursor_open(qe, "key", p_ab, NULL, QUERY_ENGINE_CURSOR_PREFIX);
+  qe_cursor_limit(cursor, 2, 3);
+  for( n = 0, ordered = 1 ; (f_00 = qe_cursor_next(cursor)) ; n++ ) {
+    ordered &= atoi(f_00->name + 1) == n + 12;
+    purge(f_00, QEUD_A);
+  }
+  qe_cursor_close(cursor);
+  ASSERT("prefix scan honors offset & limit", n == 3 && ordered);
+
+  cursor = qe_cursor_open(qe, "nam", p_ab, NULL, QUERY_ENGINE_CURSOR_PREFIX);
+  ASSERT("prefix scan requires a bytewise key", cursor == NULL);
+
+  cursor = qe_cursor_open(qe, "nam", NULL, NULL, QUERY_ENGINE_CURSOR_REVERSE);
+  for( n = 0 ; (f_00 = qe_cursor_next(cursor)) ; n++ ) purge(f_00, QEUD_A);
+  qe_cursor_close(cursor);
+  ASSERT("unbounded cursor returns all entries", n == 20);
+
+  qe_close(qe);
+}
+
+void test_count() {
+  unlink("count.db");
+  struct query_engine_t *qe = qe_init("count.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC | QUERY_ENGINE_STATS);
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+  qe_index_add_typed(qe, "typ", QUERY_ENGINE_KEY_BYTES, 0, 4);
+  qe_index_add(qe, "key", NULL, &key, QEUD_B);
+  qe_index_add_hash(qe, "hsh", &hash, &eq, QEUD_B);
+
+  char          names[100][16];
+  struct buf    data = { .data = "abc", .len = 3 };
+  struct entry  batch[100];
+  const void   *entries[100];
+  for(int i=0; i<100; i++) {
+    snprintf(names[i], sizeof(names[i]), "c%03d", 99 - i);
+    batch[i].name = names[i];
+    batch[i].data = &data;
+    entries[i]    = &batch[i];
+  }
+  qe_set_many(qe, entries, 100);
+
+  // batch[i] holds c(99-i)
+  struct entry   *lower = &batch[89], *upper = &batch[70], *prefix = &(struct entry){ .name = "c04", .data = &data };
+  struct qe_stats before, after;
+  size_t          count, rank;
+  const char     *indexes[] = { "nam", "typ", "key" };
+  for(int k=0; k<3; k++) {
+    qe_stats(qe, &before);
+    ASSERT("count returns OK", qe_count(qe, indexes[k], NULL, NULL, QUERY_ENGINE_CURSOR_DEFAULT, &count) == QUERY_ENGINE_RETURN_OK);
+    ASSERT("count without bounds counts all", count == 100);
+    qe_count(qe, indexes[k], lower, upper, QUERY_ENGINE_CURSOR_DEFAULT, &count);
+    ASSERT("count includes both bounds", count == 20);
+    qe_count(qe, indexes[k], lower, upper, QUERY_ENGINE_CURSOR_EXCLUDE_LOWER | QUERY_ENGINE_CURSOR_EXCLUDE_UPPER, &count);
+    ASSERT("count excludes bounds by flag", count == 18);
+    qe_count(qe, indexes[k], upper, NULL, QUERY_ENGINE_CURSOR_DEFAULT, &count);
+    ASSERT("count from a lower bound", count == 71);
+    qe_count(qe, indexes[k], upper, lower, QUERY_ENGINE_CURSOR_DEFAULT, &count);
+    ASSERT("count of an empty range is 0", count == 0);
+    ASSERT("rank returns OK", qe_rank(qe, indexes[k], upper, &rank) == QUERY_ENGINE_RETURN_OK);
+    ASSERT("rank is the position", rank == 29);
+    struct entry *f_00 = qe_select(qe, indexes[k], rank);
+    ASSERT("select returns the record at a position", f_00 && !strcmp(f_00->name, "c029"));
+    if (f_00) purge(f_00, QEUD_A);
+    ASSERT("select past the end returns NULL", qe_select(qe, indexes[k], 100) == NULL);
+    qe_stats(qe, &after);
+    ASSERT("keyed order statistics only read what's selected", k == 0 || after.hydrations - before.hydrations == 1);
+  }
+
+  ASSERT("count by prefix returns OK", qe_count(qe, "key", prefix, NULL, QUERY_ENGINE_CURSOR_PREFIX, &count) == QUERY_ENGINE_RETURN_OK);
+  ASSERT("count by prefix counts matches", count == 10);
+  ASSERT("count by prefix needs a bytewise key", qe_count(qe, "nam", prefix, NULL, QUERY_ENGINE_CURSOR_PREFIX, &count) == QUERY_ENGINE_RETURN_ERR);
+  ASSERT("count on a hash index counts all", qe_count(qe, "hsh", NULL, NULL, QUERY_ENGINE_CURSOR_DEFAULT, &count) == QUERY_ENGINE_RETURN_OK && count == 100);
+  ASSERT("count on a hash index has no range", qe_count(qe, "hsh", lower, NULL, QUERY_ENGINE_CURSOR_DEFAULT, &count) == QUERY_ENGINE_RETURN_ERR);
+  ASSERT("rank on a hash index returns ERR", qe_rank(qe, "hsh", lower, &rank) == QUERY_ENGINE_RETURN_ERR);
+  ASSERT("count on unknown index returns ERR", qe_count(qe, "nil", NULL, NULL, QUERY_ENGINE_CURSOR_DEFAULT, &count) == QUERY_ENGINE_RETURN_ERR);
+  qe_close(qe);
+}
+
+struct scan_state {
+  int  emitted;
+  int  stop;
+  char seen[300];
+};
+
+int scan_filter(const void *record, void *udata) {
+  ASSERT("_scf:: scan userdata is handed over", udata != NULL) 0;
+  return (atoi(((const struct entry *)record)->name + 1) % 2) == 0;
+}
+
+int scan_emit(void *record, void *udata) {
+  struct scan_state *state = udata;
+  int                i     = atoi(((struct entry *)record)->name + 1);
+  if ((i >= 0) && (i < 300)) state->seen[i]++;
+  purge(record, QEUD_A);
+  return ++(state->emitted) == state->stop;
+}
+
+// Orders by contents, which most records share
+int scan_data_cmp(const void *a, const void *b, void *udata_qe, void *udata_idx) {
+  const struct buf *da  = ((const struct entry *)a)->data;
+  const struct buf *db  = ((const struct entry *)b)->data;
+  size_t            len = da->len < db->len ? da->len : db->len;
+  int               result = memcmp(da->data, db->data, len);
+  if (result) return result;
+  return (da->len > db->len) - (da->len < db->len);
+}
+
+void test_scan() {
+  unlink("scan.db");
+  unlink("scan.db.wal");
+  struct query_engine_t *qe = qe_init("scan.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC | QUERY_ENGINE_WAL);
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+
+  char          names[300][16];
+  struct buf    data = { .data = "abc", .len = 3 };
+  struct entry  batch[300];
+  const void   *entries[300];
+  for(int i=0; i<300; i++) {
+    snprintf(names[i], sizeof(names[i]), "s%03d", i);
+    batch[i].name = names[i];
+    batch[i].data = &data;
+    entries[i]    = &batch[i];
+  }
+  qe_set_many(qe, entries, 300);
+
+  // Replaced records stay allocated until the log is synced
+  qe_wal(qe, 1024 * 1024, 60000);
+  qe_set(qe, &batch[4]);
+
+  size_t threads[] = { 1, 4, 0 };
+  for(int k=0; k<3; k++) {
+    struct scan_state state = { .stop = -1 };
+    int               once  = 1;
+    ASSERT("scan returns OK", qe_scan(qe, &scan_filter, &scan_emit, &state, threads[k]) == QUERY_ENGINE_RETURN_OK);
+    for(int i=0; i<300; i++) {
+      if (state.seen[i] != ((i % 2) ? 0 : 1)) once = 0;
+    }
+    ASSERT("scan emits every match once", once && state.emitted == 150);
+  }
+
+  struct scan_state state = { .stop = 5 };
+  qe_scan(qe, NULL, &scan_emit, &state, 4);
+  ASSERT("scan stops when emit says so", state.emitted == 5);
+  ASSERT("scan needs an emit", qe_scan(qe, NULL, NULL, &state, 1) == QUERY_ENGINE_RETURN_ERR);
+  qe_close(qe);
+
+  // Persisted indexes aren't records
+  qe = qe_init("scan.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC | QUERY_ENGINE_MMAP);
+  struct scan_state all = { .stop = -1 };
+  qe_scan(qe, NULL, &scan_emit, &all, 2);
+  ASSERT("scan without indexes sees every record", all.emitted == 300);
+
+  // A typed index added last may skip records, scans & snapshots don't
+  struct buf   longer = { .data = "abcdef", .len = 6 };
+  struct entry extra[10];
+  char         extra_names[10][16];
+  size_t       count  = 0;
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+  for(int i=0; i<10; i++) {
+    snprintf(extra_names[i], sizeof(extra_names[i]), "l%03d", i);
+    extra[i].name = extra_names[i];
+    extra[i].data = &longer;
+    qe_set(qe, &extra[i]);
+  }
+  ASSERT("Adding typed 't' index last returns OK", qe_index_add_typed(qe, "t", QUERY_ENGINE_KEY_BYTES, 0, 9) == QUERY_ENGINE_RETURN_OK);
+  qe_count(qe, "t", NULL, NULL, QUERY_ENGINE_CURSOR_DEFAULT, &count);
+  ASSERT("typed index holds the long records only", count == 10);
+  struct scan_state typed = { .stop = -1 };
+  qe_scan(qe, NULL, &scan_emit, &typed, 2);
+  ASSERT("scan sees records the last index skips", typed.emitted == 310);
+
+  // An index added over existing records keeps one per key, the others are still there
+  qe_index_add(qe, "dat", &scan_data_cmp, NULL, QEUD_B);
+  qe_count(qe, "dat", NULL, NULL, QUERY_ENGINE_CURSOR_DEFAULT, &count);
+  struct scan_state shared = { .stop = -1 };
+  qe_scan(qe, NULL, &scan_emit, &shared, 2);
+  ASSERT("scan sees records a non-unique index dropped", count < 310 && shared.emitted == 310);
+  int fd = open("scan.img", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ASSERT("snapshot returns OK", qe_snapshot(qe, fd) == QUERY_ENGINE_RETURN_OK);
+  close(fd);
+  qe_close(qe);
+
+  unlink("scan-restore.db");
+  qe = qe_init("scan-restore.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  fd = open("scan.img", O_RDONLY);
+  ASSERT("restore returns OK", qe_restore(qe, fd, NULL) == QUERY_ENGINE_RETURN_OK);
+  close(fd);
+  struct scan_state restored = { .stop = -1 };
+  qe_scan(qe, NULL, &scan_emit, &restored, 2);
+  ASSERT("snapshot holds records the last index skips", restored.emitted == 310);
+  qe_close(qe);
+  unlink("scan.img");
+}
+
+struct changes_state {
+  uint64_t first;
+  uint64_t last;
+  uint64_t stop;
+  int      ordered;
+  int      dels;
+  char     live[600];
+  char     data[600];
+};
+
+// A follower applying the feed to its own copy
+int changes_apply(uint64_t seq, int type, void *record, void *udata) {
+  struct changes_state *state = udata;
+  struct entry         *entry = record;
+  int                   i     = entry ? atoi(entry->name + 1) : -1;
+  if (!state->first) state->first = seq;
+  if (state->last && (seq != state->last + 1)) state->ordered = 0;
+  state->last = seq;
+  if ((i >= 0) && (i < 600)) {
+    state->live[i] = type == QUERY_ENGINE_CHANGE_SET;
+    state->data[i] = entry->data->len ? entry->data->data[0] : 0;
+  }
+  if (type == QUERY_ENGINE_CHANGE_DEL) state->dels++;
+  purge(record, QEUD_A);
+  return seq == state->stop;
+}
+
+// Whether the follower's copy matches the engine
+int changes_match(struct query_engine_t *qe, struct changes_state *state) {
+  char          name[16];
+  struct entry  pattern = { .name = name };
+  struct entry *found;
+  int           match   = 1;
+  for(int i=0; i<600; i++) {
+    snprintf(name, sizeof(name), "c%03d", i);
+    found = qe_get(qe, "nam", &pattern);
+    if ((found != NULL) != (state->live[i] != 0)) match = 0;
+    if (found && (found->data->data[0] != state->data[i])) match = 0;
+    if (found) purge(found, QEUD_A);
+  }
+  return match;
+}
+
+void test_changes() {
+  unlink("changes.db");
+  unlink("changes.db.wal");
+  unlink("changes.db.changes");
+  struct query_engine_t *qe = qe_init("changes.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC | QUERY_ENGINE_WAL | QUERY_ENGINE_CHANGES);
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+  qe_index_add_hash(qe, "hsh", &hash, &eq, QEUD_B);
+
+  uint64_t seq = 1;
+  ASSERT("a fresh feed starts at 0", qe_changes_seq(qe, &seq) == QUERY_ENGINE_RETURN_OK && seq == 0);
+
+  char          names[600][16];
+  struct buf    data_abc = { .data = "abc", .len = 3 };
+  struct buf    data_xyz = { .data = "xyz", .len = 3 };
+  struct buf    data_big = { .data = "a much longer value", .len = 19 };
+  struct entry  batch[600];
+  const void   *entries[600];
+  for(int i=0; i<600; i++) {
+    snprintf(names[i], sizeof(names[i]), "c%03d", i);
+    batch[i].name = names[i];
+    batch[i].data = &data_abc;
+    entries[i]    = &batch[i];
+  }
+  qe_set_many(qe, entries, 50);
+  qe_changes_seq(qe, &seq);
+  ASSERT("every stored record is a change", seq == 50);
+
+  // Replacing gives a delete & a set, in place or not
+  struct entry replace = { .name = names[3], .data = &data_big };
+  struct entry update  = { .name = names[10], .data = &data_xyz };
+  qe_set(qe, &replace);
+  qe_del(qe, &batch[7]);
+  qe_update(qe, "hsh", &batch[10], &update);
+  struct qe_txn *txn = qe_begin(qe);
+  qe_txn_set(txn, &batch[60]);
+  qe_txn_del(txn, &batch[20]);
+  qe_commit(txn);
+  qe_changes_seq(qe, &seq);
+  ASSERT("replaces & deletes are changes", seq == 57);
+
+  struct changes_state all = { .ordered = 1 };
+  ASSERT("changes since 0 returns OK", qe_changes_since(qe, 0, &changes_apply, &all) == QUERY_ENGINE_RETURN_OK);
+  ASSERT("changes come in order", all.ordered && all.first == 1 && all.last == 57);
+  ASSERT("dropped records are in the feed", all.dels == 4);
+  ASSERT("the feed replays the engine", changes_match(qe, &all));
+
+  struct changes_state tail = { .ordered = 1 };
+  qe_changes_since(qe, 53, &changes_apply, &tail);
+  ASSERT("changes since a sequence number start after it", tail.first == 54 && tail.last == 57);
+  struct changes_state none = { .ordered = 1 };
+  qe_changes_since(qe, 57, &changes_apply, &none);
+  ASSERT("no changes since the latest", none.first == 0);
+  struct changes_state stop = { .ordered = 1, .stop = 3 };
+  qe_changes_since(qe, 0, &changes_apply, &stop);
+  ASSERT("the callback stops the feed", stop.last == 3);
+  ASSERT("changes need a callback", qe_changes_since(qe, 0, NULL, NULL) == QUERY_ENGINE_RETURN_ERR);
+  qe_close(qe);
+
+  // Sequence numbers persist, a torn change is ignored
+  FILE *fp = fopen("changes.db.changes", "ab");
+  fwrite("QECR\x10\0\0\0", 1, 8, fp);
+  fclose(fp);
+  qe = qe_init("changes.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC | QUERY_ENGINE_CHANGES);
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+  qe_changes_seq(qe, &seq);
+  ASSERT("sequence numbers survive a reopen", seq == 57);
+  qe_set_many(qe, entries + 100, 500);
+  qe_changes_seq(qe, &seq);
+  ASSERT("sequence numbers continue after a reopen", seq == 557);
+
+  struct changes_state later = { .ordered = 1 };
+  qe_changes_since(qe, 300, &changes_apply, &later);
+  ASSERT("changes since a sequence number deep in the feed", later.ordered && later.first == 301 && later.last == 557);
+  struct changes_state replay = { .ordered = 1 };
+  qe_changes_since(qe, 0, &changes_apply, &replay);
+  ASSERT("the reopened feed replays the engine", replay.ordered && changes_match(qe, &replay));
+
+  // Trimmed changes are gone, the rest stays
+  ASSERT("trim returns OK", qe_changes_trim(qe, 300) == QUERY_ENGINE_RETURN_OK);
+  ASSERT("changes before the trimmed ones return ERR", qe_changes_since(qe, 299, &changes_apply, &none) == QUERY_ENGINE_RETURN_ERR);
+  struct changes_state trimmed = { .ordered = 1 };
+  qe_changes_since(qe, 300, &changes_apply, &trimmed);
+  ASSERT("changes after the trimmed ones remain", trimmed.ordered && trimmed.first == 301 && trimmed.last == 557);
+  qe_close(qe);
+
+  qe = qe_init("changes.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC | QUERY_ENGINE_CHANGES);
+  qe_changes_seq(qe, &seq);
+  struct changes_state reopened = { .ordered = 1 };
+  qe_changes_since(qe, 400, &changes_apply, &reopened);
+  ASSERT("a trimmed feed survives a reopen", seq == 557 && reopened.first == 401 && reopened.last == 557);
+  ASSERT("trimmed changes stay gone", qe_changes_since(qe, 0, &changes_apply, &none) == QUERY_ENGINE_RETURN_ERR);
+  qe_close(qe);
+
+  qe = qe_init("changes.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  ASSERT("changes need QUERY_ENGINE_CHANGES", qe_changes_since(qe, 0, &changes_apply, &none) == QUERY_ENGINE_RETURN_ERR);
+  qe_close(qe);
+}
+
+struct snapshot_job {
+  struct query_engine_t *qe;
+  int                    fd;
+  int                    result;
+};
+
+void * snapshot_writer(void *arg) {
+  struct snapshot_job *job = arg;
+  job->result = qe_snapshot(job->qe, job->fd);
+  close(job->fd);
+  return NULL;
+}
+
+// How many records an engine has & whether they all hold the given data
+int snapshot_check(struct query_engine_t *qe, const char *data, int *count) {
+  struct qe_cursor *cursor = qe_cursor_open(qe, "nam", NULL, NULL, QUERY_ENGINE_CURSOR_DEFAULT);
+  struct entry     *found;
+  int               match  = 1;
+  for( *count = 0 ; (found = qe_cursor_next(cursor)) ; (*count)++ ) {
+    if (strncmp(found->data->data, data, strlen(data))) match = 0;
+    purge(found, QEUD_A);
+  }
+  qe_cursor_close(cursor);
+  return match;
+}
+
+#define SNAPSHOT_RECORDS 1500
+void test_snapshot() {
+  unlink("snapshot.db");
+  unlink("snapshot.db.wal");
+  unlink("snapshot.db.changes");
+  unlink("restore.db");
+  unlink("restore.db.wal");
+  struct query_engine_t *qe = qe_init("snapshot.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC | QUERY_ENGINE_WAL | QUERY_ENGINE_CHANGES);
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+
+  static char   names[SNAPSHOT_RECORDS][16];
+  static struct entry batch[SNAPSHOT_RECORDS];
+  static const void  *entries[SNAPSHOT_RECORDS];
+  static char   old[1000], new[1000], big[1100];
+  memset(old, 'o', sizeof(old));
+  memset(new, 'n', sizeof(new));
+  memset(big, 'b', sizeof(big));
+  memcpy(old, "old-", 4);
+  struct buf    data_old = { .data = old, .len = sizeof(old) };
+  struct buf    data_new = { .data = new, .len = sizeof(new) };
+  struct buf    data_big = { .data = big, .len = sizeof(big) };
+  for(int i=0; i<SNAPSHOT_RECORDS; i++) {
+    snprintf(names[i], sizeof(names[i]), "p%05d", i);
+    batch[i].name = names[i];
+    batch[i].data = &data_old;
+    entries[i]    = &batch[i];
+  }
+  qe_set_many(qe, entries, SNAPSHOT_RECORDS);
+
+  // The snapshot blocks on a full pipe after its first MiB, writers carry on meanwhile
+  int                 fds[2];
+  char                header[32];
+  pthread_t           writer;
+  struct snapshot_job job = { .qe = qe };
+  pipe(fds);
+  job.fd = fds[1];
+  pthread_create(&writer, NULL, snapshot_writer, &job);
+  int got = 0;
+  while(got < 32) got += read(fds[0], header + got, 32 - got);
+
+  struct entry update = { .data = &data_new };
+  struct entry grow   = { .data = &data_big };
+  for(int i=SNAPSHOT_RECORDS-300; i<SNAPSHOT_RECORDS; i++) {
+    if (i % 3 == 0) qe_del(qe, &batch[i]);
+    update.name = grow.name = names[i];
+    if (i % 3 == 1) qe_update(qe, "nam", &batch[i], &update);
+    if (i % 3 == 2) qe_set(qe, &grow);
+  }
+  for(int i=0; i<100; i++) {
+    update.name = names[i];
+    qe_set(qe, &update);
+  }
+
+  FILE *img = fopen("snapshot.img", "wb");
+  fwrite(header, 1, 32, img);
+  char   chunk[4096];
+  size_t size = 32;
+  ssize_t n;
+  while((n = read(fds[0], chunk, sizeof(chunk))) > 0) {
+    fwrite(chunk, 1, n, img);
+    size += n;
+  }
+  fclose(img);
+  close(fds[0]);
+  pthread_join(writer, NULL);
+  ASSERT("snapshot returns OK", job.result == QUERY_ENGINE_RETURN_OK);
+  ASSERT("snapshot skips the holes", size < (SNAPSHOT_RECORDS * 1100) + 4096);
+
+  int count;
+  snapshot_check(qe, "", &count);
+  ASSERT("writers went ahead during the snapshot", count == SNAPSHOT_RECORDS - 100);
+  struct scan_state live = { .stop = -1 };
+  qe_scan(qe, NULL, &scan_emit, &live, 1);
+  ASSERT("released allocations are freed after the snapshot", live.emitted == count);
+
+  // The image holds the records as they were when it started
+  struct query_engine_t *restored = qe_init("restore.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC | QUERY_ENGINE_WAL);
+  uint64_t seq = 0;
+  int fd = open("snapshot.img", O_RDONLY);
+  ASSERT("restore returns OK", qe_restore(restored, fd, &seq) == QUERY_ENGINE_RETURN_OK);
+  close(fd);
+  ASSERT("restore hands over the change it goes up to", seq == SNAPSHOT_RECORDS);
+  qe_index_add(restored, "nam", &cmp, NULL, QEUD_B);
+  ASSERT("the snapshot is consistent", snapshot_check(restored, "old-", &count) && count == SNAPSHOT_RECORDS);
+  fd = open("snapshot.img", O_RDONLY);
+  ASSERT("restore needs an engine without indexes", qe_restore(restored, fd, NULL) == QUERY_ENGINE_RETURN_ERR);
+  close(fd);
+  qe_close(restored);
+  qe_close(qe);
+
+  // Torn images leave nothing behind
+  truncate("snapshot.img", size - 100);
+  unlink("restore.db");
+  unlink("restore.db.wal");
+  restored = qe_init("restore.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  fd = open("snapshot.img", O_RDONLY);
+  ASSERT("restoring a torn image returns ERR", qe_restore(restored, fd, NULL) == QUERY_ENGINE_RETURN_ERR);
+  close(fd);
+  struct scan_state none = { .stop = -1 };
+  qe_scan(restored, NULL, &scan_emit, &none, 1);
+  ASSERT("a torn image leaves no records", none.emitted == 0);
+  qe_close(restored);
+
+  // Every record makes it into the image, whatever the indexes hold
+  unlink("snapshot-shared.db");
+  qe = qe_init("snapshot-shared.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+  struct buf   kinds[2] = { { .data = "x", .len = 1 }, { .data = "y", .len = 1 } };
+  struct entry shared[10];
+  char         shared_names[10][16];
+  for(int i=0; i<10; i++) {
+    snprintf(shared_names[i], sizeof(shared_names[i]), "n%d", i);
+    shared[i].name = shared_names[i];
+    shared[i].data = &kinds[i % 2];
+    qe_set(qe, &shared[i]);
+  }
+  qe_index_add(qe, "dat", &scan_data_cmp, NULL, QEUD_B);
+  size_t indexed = 0;
+  qe_count(qe, "dat", NULL, NULL, QUERY_ENGINE_CURSOR_DEFAULT, &indexed);
+  ASSERT("a non-unique index added late drops records", indexed < 10);
+  fd = open("snapshot.img", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ASSERT("snapshot after a non-unique index returns OK", qe_snapshot(qe, fd) == QUERY_ENGINE_RETURN_OK);
+  close(fd);
+  qe_close(qe);
+  unlink("restore.db");
+  restored = qe_init("restore.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  fd = open("snapshot.img", O_RDONLY);
+  qe_restore(restored, fd, NULL);
+  close(fd);
+  qe_index_add(restored, "nam", &cmp, NULL, QEUD_B);
+  qe_count(restored, "nam", NULL, NULL, QUERY_ENGINE_CURSOR_DEFAULT, &indexed);
+  ASSERT("snapshot holds records a non-unique index dropped", indexed == 10);
+  qe_close(restored);
+  unlink("snapshot-shared.db");
+  unlink("snapshot.img");
+}
+
+void test_set_many() {
+  unlink("many.db");
+  struct query_engine_t *qe = qe_init("many.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+  qe_index_add(qe, "key", NULL, &key, QEUD_B);
+
+  struct entry *e_00 = &(struct entry){ .name = "k05", .data = &(struct buf){ .data = "old", .len = 3 } };
+  qe_set(qe, e_00);
+
+  // Batch with a duplicate & a replacement of an existing record
+  char names[16][16];
+  struct buf    data_abc = { .data = "abc", .len = 3 };
+  struct buf    data_new = { .data = "new", .len = 3 };
+  struct entry  batch[16];
+  const void   *entries[16];
+  for(int i=0; i<16; i++) {
+    snprintf(names[i], sizeof(names[i]), "k%02d", i == 15 ? 3 : i);
+    batch[i].name = names[i];
+    batch[i].data = i == 15 ? &data_new : &data_abc;
+    entries[i]    = &batch[i];
+  }
+  ASSERT("set_many returns OK", qe_set_many(qe, entries, 16) == QUERY_ENGINE_RETURN_OK);
+
+  int n, ordered;
+  struct entry *f_00;
+  struct qe_cursor *cursor = qe_cursor_open(qe, "nam", NULL, NULL, QUERY_ENGINE_CURSOR_DEFAULT);
+  for( n = 0, ordered = 1 ; (f_00 = qe_cursor_next(cursor)) ; n++ ) {
+    ordered &= atoi(f_00->name + 1) == n;
+    purge(f_00, QEUD_A);
+  }
+  qe_cursor_close(cursor);
+  ASSERT("set_many stores unique entries in order", n == 15 && ordered);
+
+  f_00 = qe_get(qe, "key", &(struct entry){ .name = "k03" });
+  ASSERT("later batch entry replaces earlier one", f_00 && memcmp(f_00->data->data, "new", 3) == 0);
+  if (f_00) purge(f_00, QEUD_A);
+  f_00 = qe_get(qe, "key", &(struct entry){ .name = "k05" });
+  ASSERT("batch entry replaces existing record", f_00 && memcmp(f_00->data->data, "abc", 3) == 0);
+  if (f_00) purge(f_00, QEUD_A);
+
+  qe_close(qe);
+}
+
+void test_get_many() {
+  unlink("get-many.db");
+  struct query_engine_t *qe = qe_init("get-many.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+  qe_index_add(qe, "key", NULL, &key, QEUD_B);
+  qe_index_add_hash(qe, "hsh", &hash, &eq, QEUD_B);
+
+  char          names[64][16];
+  struct buf    data = { .data = "abc", .len = 3 };
+  struct entry  batch[64];
+  const void   *entries[64];
+  for(int i=0; i<64; i++) {
+    snprintf(names[i], sizeof(names[i]), "g%02d", i);
+    batch[i].name = names[i];
+    batch[i].data = &data;
+    entries[i]    = &batch[i];
+  }
+  qe_set_many(qe, entries, 64);
+
+  // Patterns in reverse, with a missing key & a duplicate
+  struct entry  missing = { .name = "nope" };
+  const void   *patterns[34];
+  void         *results[34];
+  for(int i=0; i<32; i++) patterns[i] = &batch[62 - 2 * i];
+  patterns[32] = &missing;
+  patterns[33] = &batch[0];
+
+  // Only the cmp index deserializes while comparing
+  const char *indexes[] = { "nam", "key", "hsh" };
+  for(int k=0; k<3; k++) {
+    int found = 0;
+    deserialize_count = 0;
+    ASSERT("get_many returns OK", qe_get_many(qe, indexes[k], patterns, 34, (void **)results) == QUERY_ENGINE_RETURN_OK);
+    for(int i=0; i<32; i++) {
+      struct entry *f = results[i];
+      if (f && strcmp(f->name, names[62 - 2 * i]) == 0) found++;
+      if (f) purge(f, QEUD_A);
+    }
+    ASSERT("get_many finds every record in pattern order", found == 32);
+    ASSERT("get_many returns null on a missing key"      , results[32] == NULL);
+    ASSERT("get_many returns duplicates separately"      , results[33] && strcmp(((struct entry *)results[33])->name, "g00") == 0);
+    ASSERT("get_many deserializes returned records only" , k == 0 || deserialize_count == 33);
+    if (results[33]) purge(results[33], QEUD_A);
+  }
+
+  ASSERT("get_many on unknown index returns ERR", qe_get_many(qe, "nil", patterns, 34, (void **)results) == QUERY_ENGINE_RETURN_ERR);
+  qe_close(qe);
+}
+
+int update_count(struct query_engine_t *qe) {
+  struct qe_cursor *cursor = qe_cursor_open(qe, "nam", NULL, NULL, QUERY_ENGINE_CURSOR_DEFAULT);
+  struct entry     *f_00;
+  int               found  = 0;
+  while((f_00 = qe_cursor_next(cursor))) {
+    found++;
+    purge(f_00, QEUD_A);
+  }
+  qe_cursor_close(cursor);
+  return found;
+}
+
+// Whether every index finds name with data starting with the given prefix, or none does
+int update_found(struct query_engine_t *qe, char *name, const char *prefix) {
+  const char   *indexes[] = { "nam", "key", "hsh", "typ" };
+  struct entry  pattern   = { .name = name, .data = &(struct buf){ .data = "", .len = 0 } };
+  struct entry *f_00;
+  int           found     = 0;
+  for(int k=0; k<4; k++) {
+    f_00 = qe_get(qe, indexes[k], &pattern);
+    if (f_00 && prefix && f_00->data->len >= strlen(prefix) && !memcmp(f_00->data->data, prefix, strlen(prefix))) found++;
+    if (f_00) purge(f_00, QEUD_A);
+    else if (!prefix) found++;
+  }
+  return found == 4;
+}
+
+void test_update() {
+  unlink("update.db");
+  struct query_engine_t *qe = qe_init("update.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC | QUERY_ENGINE_STATS);
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+  qe_index_add(qe, "key", NULL, &key, QEUD_B);
+  qe_index_add_hash(qe, "hsh", &hash, &eq, QEUD_B);
+  qe_index_add_typed(qe, "typ", QUERY_ENGINE_KEY_BYTES, 0, 3);
+
+  char         names[16][16];
+  char         large[256];
+  struct buf   data = { .data = "abcdef", .len = 6 };
+  struct entry batch[16];
+  const void  *entries[16];
+  for(int i=0; i<16; i++) {
+    snprintf(names[i], sizeof(names[i]), "u%02d", i);
+    batch[i].name = names[i];
+    batch[i].data = &data;
+    entries[i]    = &batch[i];
+  }
+  qe_set_many(qe, entries, 16);
+
+  // Same keys & a smaller record, only the record itself changes
+  struct qe_stats before, after;
+  struct entry   *e_00 = &(struct entry){ .name = names[3], .data = &(struct buf){ .data = "xyz", .len = 3 } };
+  qe_index_stats(qe, "nam", &before);
+  ASSERT("update in place returns OK", qe_update(qe, "key", &batch[3], e_00) == QUERY_ENGINE_RETURN_OK);
+  qe_index_stats(qe, "nam", &after);
+  ASSERT("update in place leaves unmoved indexes alone", after.cmps - before.cmps == 1);
+  ASSERT("update in place is found on every index"     , update_found(qe, names[3], "xyz"));
+  ASSERT("update in place keeps the record count"      , update_count(qe) == 16);
+
+  // Larger than the allocation
+  memset(large, 'L', sizeof(large));
+  e_00->data = &(struct buf){ .data = large, .len = sizeof(large) };
+  ASSERT("update not fitting returns OK"       , qe_update(qe, "nam", &batch[3], e_00) == QUERY_ENGINE_RETURN_OK);
+  ASSERT("update not fitting is found"         , update_found(qe, names[3], "LLLL"));
+  ASSERT("update not fitting keeps the count"  , update_count(qe) == 16);
+
+  // Moving in every index
+  char renamed[] = "v05";
+  e_00->name = renamed;
+  e_00->data = &(struct buf){ .data = "moved", .len = 5 };
+  ASSERT("update changing keys returns OK"     , qe_update(qe, "hsh", &batch[5], e_00) == QUERY_ENGINE_RETURN_OK);
+  ASSERT("update changing keys drops old keys" , update_found(qe, names[5], NULL));
+  ASSERT("update changing keys adds new keys"  , update_found(qe, renamed, "moved"));
+  ASSERT("update changing keys keeps the count", update_count(qe) == 16);
+
+  // Landing on another record replaces it, like qe_set
+  e_00->name = names[7];
+  e_00->data = &(struct buf){ .data = "was6", .len = 4 };
+  ASSERT("update onto another record returns OK", qe_update(qe, "typ", &batch[6], e_00) == QUERY_ENGINE_RETURN_OK);
+  ASSERT("update onto another record drops it"  , update_found(qe, names[6], NULL) && update_found(qe, names[7], "was6"));
+  ASSERT("update onto another record replaces"  , update_count(qe) == 15);
+
+  char missing[] = "zzz";
+  e_00->name = missing;
+  ASSERT("update of a missing record returns ERR", qe_update(qe, "nam", e_00, e_00) == QUERY_ENGINE_RETURN_ERR);
+  ASSERT("update on unknown index returns ERR"   , qe_update(qe, "nil", &batch[0], &batch[0]) == QUERY_ENGINE_RETURN_ERR);
+  qe_close(qe);
+
+  // In place with a log, surviving a crash
+  unlink("update-wal.db");
+  unlink("update-wal.db.wal");
+  int status;
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    qe = qe_init("update-wal.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC | QUERY_ENGINE_WAL);
+    qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+    qe_set(qe, &batch[0]);
+    qe_checkpoint(qe);
+    e_00->name = names[0];
+    e_00->data = &(struct buf){ .data = "xyz", .len = 3 };
+    qe_update(qe, "nam", &batch[0], e_00);
+    _exit(0);
+  }
+  waitpid(pid, &status, 0);
+  qe = qe_init("update-wal.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC | QUERY_ENGINE_WAL);
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+  struct entry *f_00 = qe_get(qe, "nam", &batch[0]);
+  ASSERT("update in place survives a crash", f_00 && f_00->data->len >= 3 && !memcmp(f_00->data->data, "xyz", 3));
+  if (f_00) purge(f_00, QEUD_A);
+  qe_close(qe);
+}
+
+void test_txn() {
+  unlink("txn.db");
+  struct query_engine_t *qe = qe_init("txn.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+  qe_index_add(qe, "key", NULL, &key, QEUD_B);
+
+  struct buf    data_old = { .data = "old", .len = 3 };
+  struct buf    data_new = { .data = "new", .len = 3 };
+  struct entry  t01_old  = { .name = "t01", .data = &data_old };
+  struct entry  t01_new  = { .name = "t01", .data = &data_new };
+  struct entry  t02      = { .name = "t02", .data = &data_old };
+  struct entry  t03      = { .name = "t03", .data = &data_new };
+  struct entry  t04      = { .name = "t04", .data = &data_new };
+  struct entry *f_00;
+  qe_set(qe, &t01_old);
+  qe_set(qe, &t02);
+
+  // Nothing is visible before commit
+  struct qe_txn *txn = qe_begin(qe);
+  qe_txn_set(txn, &t03);
+  qe_txn_del(txn, &t01_old);
+  qe_txn_set(txn, &t01_new);
+  qe_txn_del(txn, &(struct entry){ .name = "t02" });
+  qe_txn_set(txn, &t04);
+  qe_txn_del(txn, &(struct entry){ .name = "t04" });
+  f_00 = qe_get(qe, "nam", &t03);
+  ASSERT("uncommitted set is invisible", f_00 == NULL);
+  if (f_00) purge(f_00, QEUD_A);
+  ASSERT("commit returns OK", qe_commit(txn) == QUERY_ENGINE_RETURN_OK);
+
+  // Applied in order
+  f_00 = qe_get(qe, "key", &t01_new);
+  ASSERT("later set in a transaction wins", f_00 && memcmp(f_00->data->data, "new", 3) == 0);
+  if (f_00) purge(f_00, QEUD_A);
+  f_00 = qe_get(qe, "nam", &t02);
+  ASSERT("transaction deletes existing record", f_00 == NULL);
+  if (f_00) purge(f_00, QEUD_A);
+  f_00 = qe_get(qe, "key", &t03);
+  ASSERT("transaction stores new record", f_00 != NULL);
+  if (f_00) purge(f_00, QEUD_A);
+  f_00 = qe_get(qe, "nam", &t04);
+  ASSERT("transaction deletes its own record", f_00 == NULL);
+  if (f_00) purge(f_00, QEUD_A);
+
+  // Aborting drops everything
+  txn = qe_begin(qe);
+  qe_txn_set(txn, &t02);
+  qe_abort(txn);
+  f_00 = qe_get(qe, "nam", &t02);
+  ASSERT("aborted set is dropped", f_00 == NULL);
+  if (f_00) purge(f_00, QEUD_A);
+
+  qe_close(qe);
+}
+
+void test_mmap() {
+  unlink("mmap.db");
+  struct query_engine_t *qe = qe_init("mmap.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC | QUERY_ENGINE_MMAP);
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+
+  // Records written after the medium got mapped are readable as well
+  char name[16];
+  struct entry *e_00 = &(struct entry){ .name = name, .data = &(struct buf){ .data = "abc", .len = 3 } };
+  struct entry *f_00;
+  int found = 0;
+  for(int i=0; i<32; i++) {
+    snprintf(name, sizeof(name), "m%02d", i);
+    qe_set(qe, e_00);
+    f_00 = qe_get(qe, "nam", e_00);
+    if (f_00 && strcmp(f_00->name, name) == 0) found++;
+    if (f_00) purge(f_00, QEUD_A);
+  }
+  ASSERT("mapped get returns every record written", found == 32);
+
+  qe_close(qe);
+}
+
+void test_cache() {
+  unlink("cache.db");
+  struct query_engine_t *qe = qe_init("cache.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+  qe_cache(qe, 4096);
+
+  char name[16];
+  struct entry *e_00 = &(struct entry){ .name = name, .data = &(struct buf){ .data = "abc", .len = 3 } };
+  struct entry *f_00;
+  struct qe_cache_stats stats;
+  for(int i=0; i<16; i++) {
+    snprintf(name, sizeof(name), "c%02d", i);
+    qe_set(qe, e_00);
+  }
+
+  // Repeated lookups are served from the cache
+  snprintf(name, sizeof(name), "c07");
+  for(int i=0; i<4; i++) {
+    f_00 = qe_get(qe, "nam", e_00);
+    ASSERT("cached get returns the record", f_00 && strcmp(f_00->name, "c07") == 0);
+    if (f_00) purge(f_00, QEUD_A);
+  }
+  qe_cache_stats(qe, &stats);
+  ASSERT("cache registered hits", stats.hits > 0);
+  ASSERT("cache holds entries", stats.entries > 0);
+  ASSERT("cache stays within budget", stats.size <= 4096);
+
+  // Overwritten & deleted records don't linger
+  e_00->data = &(struct buf){ .data = "defg", .len = 4 };
+  qe_set(qe, e_00);
+  f_00 = qe_get(qe, "nam", e_00);
+  ASSERT("overwritten record is returned", f_00 && memcmp(f_00->data->data, "defg", 4) == 0);
+  if (f_00) purge(f_00, QEUD_A);
+  qe_del(qe, e_00);
+  f_00 = qe_get(qe, "nam", e_00);
+  ASSERT("deleted record is gone", f_00 == NULL);
+
+  // A small budget evicts, disabling drops everything
+  qe_cache(qe, 256);
+  qe_cache_stats(qe, &stats);
+  ASSERT("shrunk cache stays within budget", stats.size <= 256);
+  qe_cache(qe, 0);
+  qe_cache_stats(qe, &stats);
+  ASSERT("disabled cache holds nothing", stats.entries == 0);
+
+  qe_close(qe);
+}
+
+void test_stats() {
+  unlink("stats.db");
+  struct query_engine_t *qe = qe_init("stats.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC | QUERY_ENGINE_STATS);
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+
+  char name[16];
+  struct entry *e_00 = &(struct entry){ .name = name, .data = &(struct buf){ .data = "abc", .len = 3 } };
+  struct entry *f_00;
+  struct qe_stats stats;
+  for(int i=0; i<8; i++) {
+    snprintf(name, sizeof(name), "s%02d", i);
+    qe_set(qe, e_00);
+  }
+  for(int i=0; i<10; i++) {
+    snprintf(name, sizeof(name), "s%02d", i % 8);
+    f_00 = qe_get(qe, "nam", e_00);
+    if (f_00) purge(f_00, QEUD_A);
+  }
+  qe_del(qe, e_00);
+
+  ASSERT("stats are available", qe_stats(qe, &stats) == QUERY_ENGINE_RETURN_OK);
+  ASSERT("calls are counted per operation", stats.op[QUERY_ENGINE_OP_SET].calls == 8 && stats.op[QUERY_ENGINE_OP_GET].calls == 10 && stats.op[QUERY_ENGINE_OP_DEL].calls == 1 && stats.op[QUERY_ENGINE_OP_INDEX_ADD].calls == 1);
+  ASSERT("every call has a latency", stats.op[QUERY_ENGINE_OP_GET].latency.count == 10);
+  ASSERT("comparisons & hydrations are counted", stats.cmps > 0 && stats.hydrations > 0 && stats.deserializes > 0);
+  ASSERT("bytes are counted per operation", stats.op[QUERY_ENGINE_OP_SET].bytes_written >= 8 * 7 && stats.op[QUERY_ENGINE_OP_GET].bytes_read > 0);
+  ASSERT("percentiles are ordered", qe_histogram_percentile(&(stats.op[QUERY_ENGINE_OP_GET].latency), 50) <= qe_histogram_percentile(&(stats.op[QUERY_ENGINE_OP_GET].latency), 99));
+  ASSERT("percentiles stay within the maximum", qe_histogram_percentile(&(stats.op[QUERY_ENGINE_OP_GET].latency), 100) <= stats.op[QUERY_ENGINE_OP_GET].latency.max);
+
+  ASSERT("index stats are available", qe_index_stats(qe, "nam", &stats) == QUERY_ENGINE_RETURN_OK);
+  ASSERT("index counts its own gets", stats.op[QUERY_ENGINE_OP_GET].calls == 10 && stats.op[QUERY_ENGINE_OP_SET].calls == 0);
+  ASSERT("index counts its comparisons", stats.cmps > 0);
+
+  qe_stats_reset(qe);
+  qe_stats(qe, &stats);
+  ASSERT("reset clears counters", stats.cmps == 0 && stats.op[QUERY_ENGINE_OP_GET].calls == 0);
+  qe_close(qe);
+
+  qe = qe_init("stats.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  ASSERT("stats are off by default", qe_stats(qe, &stats) == QUERY_ENGINE_RETURN_ERR);
+  qe_close(qe);
+}
+
+void test_wal() {
+  unlink("wal.db");
+  unlink("wal.db.wal");
+  char *names[] = { "w-a", "w-b", "w-c", "w-d" };
+  struct entry *e_00 = &(struct entry){ .data = &(struct buf){ .data = "abc", .len = 3 } };
+  struct entry *f_00;
+  struct query_engine_t *qe;
+  struct qe_cursor *cursor;
+  int found, status;
+
+  // Crash after committing, leaving a torn allocation & log record behind
+  pid_t pid = fork();
+  if (pid == 0) {
+    qe = qe_init("wal.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC | QUERY_ENGINE_WAL);
+    qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+    for(int i=0; i<3; i++) {
+      e_00->name = names[i];
+      qe_set(qe, e_00);
+    }
+    e_00->name = names[1];
+    qe_del(qe, e_00);
+    qe_wal(qe, 1024 * 1024, 60000);
+    e_00->name = names[3];
+    qe_set(qe, e_00);
+    qe_sync(qe);
+    PALLOC_OFFSET torn = palloc(qe->fd, 8);
+    pwrite(qe->fd, "torn\nabc", 8, torn);
+    FILE *log = fopen("wal.db.wal", "ab");
+    fwrite("QEWR\x40\0\0\0", 1, 8, log);
+    fclose(log);
+    _exit(0);
+  }
+  waitpid(pid, &status, 0);
+  ASSERT("crashing writer exited", WIFEXITED(status));
+
+  // Committed mutations are there, torn ones aren't
+  qe = qe_init("wal.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC | QUERY_ENGINE_WAL);
+  ASSERT("engine with log re-opens", qe != NULL);
+  if (!qe) return;
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+  for(int i=0; i<4; i++) {
+    e_00->name = names[i];
+    f_00 = qe_get(qe, "nam", e_00);
+    ASSERT("recovered record matches commits", (i == 1) ? (f_00 == NULL) : (f_00 && strcmp(f_00->name, names[i]) == 0));
+    if (f_00) purge(f_00, QEUD_A);
+  }
+  found  = 0;
+  cursor = qe_cursor_open(qe, "nam", NULL, NULL, QUERY_ENGINE_CURSOR_DEFAULT);
+  while((f_00 = qe_cursor_next(cursor))) {
+    found++;
+    purge(f_00, QEUD_A);
+  }
+  qe_cursor_close(cursor);
+  ASSERT("torn allocation got dropped", found == 3);
+
+  // Checkpoints keep everything
+  e_00->name = names[1];
+  qe_set(qe, e_00);
+  ASSERT("checkpoint succeeds", qe_checkpoint(qe) == QUERY_ENGINE_RETURN_OK);
+  qe_close(qe);
+  qe = qe_init("wal.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC | QUERY_ENGINE_WAL);
+  qe_index_add(qe, "nam", &cmp, NULL, QEUD_B);
+  f_00 = qe_get(qe, "nam", e_00);
+  ASSERT("record set before checkpoint persists", f_00 && strcmp(f_00->name, names[1]) == 0);
+  if (f_00) purge(f_00, QEUD_A);
+  qe_close(qe);
+}
+
+uint64_t shard(const void *entry_raw, void *udata) {
+  ASSERT("_shd:: QE userdata is correct", udata == QEUD_A) 0;
+  return hash(entry_raw, QEUD_A, QEUD_B);
+}
+
+void test_shards() {
+  char path[32];
+  for(int i=0; i<4; i++) {
+    snprintf(path, sizeof(path), "shards.db.%d", i);
+    unlink(path);
+  }
+  struct qe_shards *shards = qe_shards_init("shards.db", 4, "nam", &shard, &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  ASSERT("sharded engine opens", shards != NULL);
+  if (!shards) return;
+  struct qe_index_def defs[] = {
+    { .name = "nam", .cmp = &cmp, .udata = QEUD_B },
+    { .name = "typ", .type = QUERY_ENGINE_KEY_BYTES, .offset = 0, .length = 3 },
+  };
+  ASSERT("sharded indexes get added", qe_shards_index_add_many(shards, defs, 2) == QUERY_ENGINE_RETURN_OK);
+
+  char          names[64][16];
+  struct buf    data = { .data = "abc", .len = 3 };
+  struct entry  batch[64];
+  const void   *entries[64];
+  for(int i=0; i<64; i++) {
+    snprintf(names[i], sizeof(names[i]), "h%02d", 63 - i);
+    batch[i].name = names[i];
+    batch[i].data = &data;
+    entries[i]    = &batch[i];
+  }
+  ASSERT("sharded batch returns OK", qe_shards_set_many(shards, entries, 60) == QUERY_ENGINE_RETURN_OK);
+  for(int i=60; i<64; i++) {
+    ASSERT("sharded set returns OK", qe_shards_set(shards, &batch[i]) == QUERY_ENGINE_RETURN_OK);
+  }
+
+  // Every shard gets a share
+  int spread = 0;
+  for(int i=0; i<4; i++) {
+    struct qe_cursor *cursor = qe_cursor_open(qe_shards_engine(shards, i), "nam", NULL, NULL, QUERY_ENGINE_CURSOR_DEFAULT);
+    struct entry     *f_00   = qe_cursor_next(cursor);
+    if (f_00) spread++;
+    if (f_00) purge(f_00, QEUD_A);
+    qe_cursor_close(cursor);
+  }
+  ASSERT("records spread over shards", spread == 4);
+  ASSERT("shards past the last don't exist", qe_shards_engine(shards, 4) == NULL);
+
+  // Routed & fanned out lookups
+  int found = 0;
+  for(int i=0; i<64; i++) {
+    struct entry *f_00 = qe_shards_get(shards, "nam", &batch[i]);
+    struct entry *f_01 = qe_shards_get(shards, "typ", &batch[i]);
+    if (f_00 && f_01 && !strcmp(f_00->name, names[i]) && !strcmp(f_01->name, names[i])) found++;
+    if (f_00) purge(f_00, QEUD_A);
+    if (f_01) purge(f_01, QEUD_A);
+  }
+  ASSERT("sharded get finds every record", found == 64);
+
+  // Merged cursors, in both directions & limited
+  const char *indexes[] = { "nam", "typ" };
+  for(int k=0; k<2; k++) {
+    struct qe_shards_cursor *cursor = qe_shards_cursor_open(shards, indexes[k], NULL, NULL, QUERY_ENGINE_CURSOR_DEFAULT);
+    struct entry            *f_00;
+    int                      ordered = 1;
+    found = 0;
+    while((f_00 = qe_shards_cursor_next(cursor))) {
+      snprintf(path, sizeof(path), "h%02d", found++);
+      if (strcmp(f_00->name, path)) ordered = 0;
+      purge(f_00, QEUD_A);
+    }
+    qe_shards_cursor_close(cursor);
+    ASSERT("sharded cursor merges in order", ordered && found == 64);
+
+    cursor = qe_shards_cursor_open(shards, indexes[k], NULL, &batch[58], QUERY_ENGINE_CURSOR_REVERSE);
+    qe_shards_cursor_limit(cursor, 2, 3);
+    ordered = 1;
+    found   = 0;
+    while((f_00 = qe_shards_cursor_next(cursor))) {
+      snprintf(path, sizeof(path), "h%02d", 3 - found++);
+      if (strcmp(f_00->name, path)) ordered = 0;
+      purge(f_00, QEUD_A);
+    }
+    qe_shards_cursor_close(cursor);
+    ASSERT("sharded reverse cursor skips & limits", ordered && found == 3);
+  }
+  ASSERT("sharded cursor on unknown index is NULL", qe_shards_cursor_open(shards, "nil", NULL, NULL, QUERY_ENGINE_CURSOR_DEFAULT) == NULL);
+
+  size_t count;
+  ASSERT("sharded count returns OK", qe_shards_count(shards, "typ", &batch[63], &batch[54], QUERY_ENGINE_CURSOR_DEFAULT, &count) == QUERY_ENGINE_RETURN_OK);
+  ASSERT("sharded count adds up the shards", count == 10);
+  ASSERT("sharded del returns OK", qe_shards_del(shards, &batch[10]) == QUERY_ENGINE_RETURN_OK);
+  ASSERT("sharded close returns OK", qe_shards_close(shards) == QUERY_ENGINE_RETURN_OK);
+
+  // Same shards after re-opening
+  shards = qe_shards_init("shards.db", 4, "nam", &shard, &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  qe_shards_index_add_many(shards, defs, 2);
+  found = 0;
+  for(int i=0; i<64; i++) {
+    struct entry *f_00 = qe_shards_get(shards, "nam", &batch[i]);
+    if (f_00 && !strcmp(f_00->name, names[i])) found++;
+    if (f_00) purge(f_00, QEUD_A);
+  }
+  ASSERT("sharded records persist, deletes too", found == 63);
+  qe_shards_close(shards);
+}
+
+struct query_engine_t *threads_qe = NULL;
+char                   threads_names[64][16];
+
+void * threads_reader(void *arg) {
+  int *found = (int *)arg;
+  struct entry *f_00;
+  for(int i=0; i<256; i++) {
+    f_00 = qe_get(threads_qe, "nam", &(struct entry){ .name = threads_names[i % 64] });
+    if (f_00 && strcmp(f_00->name, threads_names[i % 64]) == 0) (*found)++;
+    if (f_00) purge(f_00, QEUD_A);
+  }
+  return NULL;
+}
+
+void test_threads() {
+  unlink("threads.db");
+  threads_qe = qe_init("threads.db", &serialize, &deserialize, &purge, QEUD_A, PALLOC_DEFAULT | PALLOC_DYNAMIC | QUERY_ENGINE_MMAP);
+  qe_index_add(threads_qe, "nam", &cmp, NULL, QEUD_B);
+
+  struct entry *e_00 = &(struct entry){ .data = &(struct buf){ .data = "abc", .len = 3 } };
+  for(int i=0; i<64; i++) {
+    snprintf(threads_names[i], sizeof(threads_names[i]), "t%02d", i);
+    e_00->name = threads_names[i];
+    qe_set(threads_qe, e_00);
+  }
+
+  // Readers run alongside each other & a writer adding other records
+  pthread_t readers[4];
+  int       found[4] = {0};
+  for(int i=0; i<4; i++) {
+    pthread_create(&readers[i], NULL, threads_reader, &found[i]);
+  }
+  char name[16];
+  e_00->name = name;
+  for(int i=0; i<64; i++) {
+    snprintf(name, sizeof(name), "w%02d", i);
+    qe_set(threads_qe, e_00);
+  }
+  for(int i=0; i<4; i++) {
+    pthread_join(readers[i], NULL);
+  }
+  ASSERT("concurrent readers find every record", found[0] == 256 && found[1] == 256 && found[2] == 256 && found[3] == 256);
+
+  qe_close(threads_qe);
+}
+
 int main() {
 
   // Seed random
   srand(time(NULL));
 
   RUN(test_main);
+  RUN(test_keyed);
+  RUN(test_hash);
+  RUN(test_bloom);
+  RUN(test_index_many);
+  RUN(test_typed);
+  RUN(test_persist);
+  RUN(test_cursor);
+  RUN(test_count);
+  RUN(test_scan);
+  RUN(test_changes);
+  RUN(test_snapshot);
+  RUN(test_set_many);
+  RUN(test_get_many);
+  RUN(test_update);
+  RUN(test_txn);
+  RUN(test_mmap);
+  RUN(test_cache);
+  RUN(test_compress);
+  RUN(test_wal);
+  RUN(test_compact);
+  RUN(test_stats);
+  RUN(test_shards);
+  RUN(test_threads);
   return TEST_REPORT();
 }
 
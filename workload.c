@@ -0,0 +1,450 @@
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "query-engine.h"
+
+// Workload benchmarks, reporting as JSON
+//
+// For every combination of record count & value size, this loads a fresh
+// medium and measures:
+//
+// - bulk loading through qe_set_many
+// - qe_init & loading the persisted index, with a cold page cache
+// - rebuilding the index from a scan of the medium
+// - YCSB-style mixes over a scrambled zipfian key distribution:
+//   A (50% read, 50% update), B (95% read, 5% update), C (read only, cold &
+//   warm page cache) and E (95% short scans, 5% inserts)
+// - file size amplification after churn, before & after qe_compact
+//
+// Usage: workload [--records=1000,10000] [--values=16,1024,65536] [--ops=N]
+//                 [--max-bytes=N] [--seed=N] [--file=path] [--out=path]
+//                 [--compress] [--cache=bytes]
+
+#define KEY_LEN      16
+#define LOAD_BATCH   1024
+#define SCAN_MAX     100
+#define ZIPF_THETA   0.99
+
+struct record {
+  char    key[KEY_LEN];
+  size_t  len;
+  char   *value;
+};
+
+struct options {
+  size_t       records[16];
+  size_t       nrecords;
+  size_t       values[16];
+  size_t       nvalues;
+  size_t       ops;
+  size_t       max_bytes;
+  uint64_t     seed;
+  const char  *file;
+  const char  *out;
+  int          compress;
+  size_t       cache;
+};
+
+struct zipf {
+  uint64_t n;
+  double   alpha;
+  double   zetan;
+  double   eta;
+  double   half_pow_theta;
+};
+
+struct latencies {
+  double *samples;
+  size_t  n;
+};
+
+uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+// xorshift64*, deterministic per seed
+uint64_t rng_next() {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 2685821657736338717ULL;
+}
+
+double rng_unit() {
+  return (double)(rng_next() >> 11) / 9007199254740992.0;
+}
+
+uint64_t mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+double now_s() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
+}
+
+// As YCSB's ZipfianGenerator, O(n) to set up
+void zipf_init(struct zipf *zipf, uint64_t n) {
+  double zeta2 = 1.0 + pow(0.5, ZIPF_THETA);
+  zipf->n      = n;
+  zipf->alpha  = 1.0 / (1.0 - ZIPF_THETA);
+  zipf->zetan  = 0;
+  for(uint64_t i=1; i<=n; i++) zipf->zetan += 1.0 / pow((double)i, ZIPF_THETA);
+  zipf->eta            = (1.0 - pow(2.0 / (double)n, 1.0 - ZIPF_THETA)) / (1.0 - (zeta2 / zipf->zetan));
+  zipf->half_pow_theta = pow(0.5, ZIPF_THETA);
+}
+
+// Popular items are scattered over the keyspace, as with YCSB's scrambled zipfian
+uint64_t zipf_next(const struct zipf *zipf) {
+  double   u  = rng_unit();
+  double   uz = u * zipf->zetan;
+  uint64_t rank;
+  if (uz < 1.0) {
+    rank = 0;
+  } else if (uz < 1.0 + zipf->half_pow_theta) {
+    rank = 1;
+  } else {
+    rank = (uint64_t)((double)zipf->n * pow((zipf->eta * u) - zipf->eta + 1.0, zipf->alpha));
+  }
+  return mix(rank) % zipf->n;
+}
+
+// Keys are spread out, so inserts land all over the index
+void key_of(char *key, uint64_t id) {
+  char tmp[KEY_LEN + 1];
+  snprintf(tmp, sizeof(tmp), "%016llx", (unsigned long long)mix(id + 1));
+  memcpy(key, tmp, KEY_LEN);
+}
+
+struct buf * serialize(const void *record_raw, void *udata) {
+  const struct record *record = record_raw;
+  struct buf          *output = calloc(1, sizeof(struct buf));
+  buf_append(output, record->key, KEY_LEN);
+  if (record->len) buf_append(output, record->value, record->len);
+  return output;
+}
+
+void * deserialize(const struct buf *raw, void *udata) {
+  struct record *output = calloc(1, sizeof(struct record));
+  if (raw->len < KEY_LEN) {
+    free(output);
+    return NULL;
+  }
+  memcpy(output->key, raw->data, KEY_LEN);
+  output->len   = raw->len - KEY_LEN;
+  output->value = malloc(output->len ? output->len : 1);
+  memcpy(output->value, raw->data + KEY_LEN, output->len);
+  return output;
+}
+
+void purge(void *record_raw, void *udata) {
+  struct record *record = record_raw;
+  if (!record) return;
+  free(record->value);
+  free(record);
+}
+
+void latencies_add(struct latencies *lat, double seconds) {
+  lat->samples[lat->n++] = seconds * 1e6;
+}
+
+int latency_cmp(const void *a, const void *b) {
+  double da = *(const double *)a;
+  double db = *(const double *)b;
+  return (da > db) - (da < db);
+}
+
+double latency_pct(const struct latencies *lat, double pct) {
+  size_t i;
+  if (!lat->n) return 0;
+  i = (size_t)((pct / 100.0) * (double)(lat->n - 1));
+  return lat->samples[i];
+}
+
+void json_latencies(FILE *out, struct latencies *lat) {
+  qsort(lat->samples, lat->n, sizeof(double), latency_cmp);
+  fprintf(out, "{\"p50\":%.2f,\"p95\":%.2f,\"p99\":%.2f,\"max\":%.2f}",
+    latency_pct(lat, 50), latency_pct(lat, 95), latency_pct(lat, 99), latency_pct(lat, 100)
+  );
+}
+
+uint64_t file_size(const char *filename) {
+  struct stat st;
+  if (stat(filename, &st)) return 0;
+  return (uint64_t)st.st_size;
+}
+
+// Have the kernel forget the file's pages, so the next reads hit the disk
+// Only supported where posix_fadvise is, elsewhere "cold" is just as warm
+int drop_cache(const char *filename) {
+#if defined(POSIX_FADV_DONTNEED)
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return 0;
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+void fill_value(struct record *record, size_t len) {
+  record->len = len;
+  for(size_t i=0; i<len; i++) record->value[i] = "abcdefghijklmnopqrstuvwxyz012345"[rng_next() & 31];
+}
+
+struct query_engine_t * open_engine(const struct options *opts) {
+  PALLOC_FLAGS flags = PALLOC_DEFAULT | PALLOC_DYNAMIC | (opts->compress ? QUERY_ENGINE_COMPRESS : 0);
+  struct query_engine_t *qe = qe_init(opts->file, &serialize, &deserialize, &purge, NULL, flags);
+  if (qe && opts->cache) qe_cache(qe, opts->cache);
+  return qe;
+}
+
+// Runs a mix of reads, updates, scans & inserts, printing its JSON object
+// Percentages are cumulative: read, then update, then scan, the rest inserts
+void run_mix(FILE *out, struct query_engine_t *qe, const struct options *opts, const char *name, const char *cache, int read_pct, int update_pct, int scan_pct, uint64_t *count, size_t value_size) {
+  struct latencies  lat   = { .samples = malloc(opts->ops * sizeof(double)), .n = 0 };
+  struct record     pattern = { .len = 0, .value = NULL };
+  struct record     update  = { .value = malloc(value_size ? value_size : 1) };
+  struct record    *found;
+  struct qe_cursor *cursor;
+  struct zipf       zipf;
+  size_t            i, j, len, misses = 0;
+  double            start, op, total;
+  int               dice;
+
+  zipf_init(&zipf, *count);
+  start = now_s();
+  for( i = 0 ; i < opts->ops ; i++ ) {
+    dice = (int)(rng_next() % 100);
+    op   = now_s();
+    if (dice < read_pct) {
+      key_of(pattern.key, zipf_next(&zipf));
+      found = qe_get(qe, "id", &pattern);
+      if (!found) misses++;
+      purge(found, NULL);
+    } else if (dice < read_pct + update_pct) {
+      key_of(update.key, zipf_next(&zipf));
+      fill_value(&update, value_size);
+      qe_set(qe, &update);
+    } else if (dice < read_pct + update_pct + scan_pct) {
+      key_of(pattern.key, zipf_next(&zipf));
+      len    = 1 + (rng_next() % SCAN_MAX);
+      cursor = qe_cursor_open(qe, "id", &pattern, NULL, QUERY_ENGINE_CURSOR_DEFAULT);
+      qe_cursor_limit(cursor, 0, len);
+      for( j = 0 ; (found = qe_cursor_next(cursor)) ; j++ ) purge(found, NULL);
+      qe_cursor_close(cursor);
+    } else {
+      key_of(update.key, (*count)++);
+      fill_value(&update, value_size);
+      qe_set(qe, &update);
+    }
+    latencies_add(&lat, now_s() - op);
+  }
+  total = now_s() - start;
+
+  fprintf(out, "{\"name\":\"%s\",\"cache\":\"%s\",\"ops\":%zu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"misses\":%zu,\"latency_us\":",
+    name, cache, opts->ops, total, (double)opts->ops / total, misses
+  );
+  json_latencies(out, &lat);
+  fprintf(out, "}");
+  free(lat.samples);
+  free(update.value);
+}
+
+void run_config(FILE *out, const struct options *opts, size_t records, size_t value_size) {
+  struct query_engine_t *qe;
+  struct record         *batch   = calloc(LOAD_BATCH, sizeof(struct record));
+  const void           **entries = calloc(LOAD_BATCH, sizeof(void *));
+  struct latencies       lat     = { .samples = malloc(((records / LOAD_BATCH) + 1) * sizeof(double)), .n = 0 };
+  struct record          update  = { .value = malloc((value_size * 2) + 1) };
+  uint64_t               count   = records;
+  uint64_t              *lens    = calloc(records, sizeof(uint64_t));
+  uint64_t               live, before, after;
+  size_t                 i, j, n;
+  double                 start, op, load, init, index_load, index_build, compact;
+  int                    cold;
+
+  for( i = 0 ; i < LOAD_BATCH ; i++ ) {
+    batch[i].value = malloc(value_size ? value_size : 1);
+    entries[i]     = &batch[i];
+  }
+
+  // Bulk load into a fresh medium
+  unlink(opts->file);
+  qe = open_engine(opts);
+  qe_index_add_typed(qe, "id", QUERY_ENGINE_KEY_BYTES, 0, KEY_LEN);
+  start = now_s();
+  for( i = 0 ; i < records ; i += n ) {
+    n = records - i < LOAD_BATCH ? records - i : LOAD_BATCH;
+    for( j = 0 ; j < n ; j++ ) {
+      key_of(batch[j].key, i + j);
+      fill_value(&batch[j], value_size);
+      lens[i + j] = KEY_LEN + value_size;
+    }
+    op = now_s();
+    qe_set_many(qe, entries, n);
+    latencies_add(&lat, (now_s() - op) / (double)n);
+  }
+  load = now_s() - start;
+  qe_close(qe);
+
+  // Re-opening loads the persisted index
+  cold  = drop_cache(opts->file);
+  start = now_s();
+  qe    = open_engine(opts);
+  init  = now_s() - start;
+  start = now_s();
+  qe_index_add_typed(qe, "id", QUERY_ENGINE_KEY_BYTES, 0, KEY_LEN);
+  index_load = now_s() - start;
+
+  fprintf(out, "{\"records\":%zu,\"value_size\":%zu,\"compress\":%s,\"cache_bytes\":%zu,", records, value_size, opts->compress ? "true" : "false", opts->cache);
+  fprintf(out, "\"load\":{\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"latency_us\":", load, (double)records / load);
+  json_latencies(out, &lat);
+  fprintf(out, "},\"open\":{\"cold\":%s,\"init_ms\":%.3f,\"index_load_ms\":%.3f,", cold ? "true" : "false", init * 1e3, index_load * 1e3);
+
+  // Without a persisted copy, the index is built from a scan
+  qe_index_del(qe, "id");
+  start = now_s();
+  qe_index_add_typed(qe, "id", QUERY_ENGINE_KEY_BYTES, 0, KEY_LEN);
+  index_build = now_s() - start;
+  fprintf(out, "\"index_build_ms\":%.3f},\"workloads\":[", index_build * 1e3);
+
+  // Reads first, cold & warm, before anything changes the records
+  qe_close(qe);
+  cold = drop_cache(opts->file);
+  qe   = open_engine(opts);
+  qe_index_add_typed(qe, "id", QUERY_ENGINE_KEY_BYTES, 0, KEY_LEN);
+  run_mix(out, qe, opts, "C", cold ? "cold" : "warm", 100, 0, 0, &count, value_size);
+  fprintf(out, ",");
+  run_mix(out, qe, opts, "C", "warm", 100, 0, 0, &count, value_size);
+  fprintf(out, ",");
+  run_mix(out, qe, opts, "B", "warm", 95, 5, 0, &count, value_size);
+  fprintf(out, ",");
+  run_mix(out, qe, opts, "A", "warm", 50, 50, 0, &count, value_size);
+  fprintf(out, ",");
+  run_mix(out, qe, opts, "E", "warm", 0, 0, 95, &count, value_size);
+  fprintf(out, "],");
+
+  // Churn: rewrite half the records at varying sizes, a third of those through a delete
+  lens = realloc(lens, count * sizeof(uint64_t));
+  for( i = records ; i < count ; i++ ) lens[i] = KEY_LEN + value_size;
+  for( i = 0 ; i < count / 2 ; i++ ) {
+    j = rng_next() % count;
+    key_of(update.key, j);
+    if (!(rng_next() % 3)) qe_del(qe, &update);
+    fill_value(&update, (value_size / 2) + (rng_next() % (value_size + 1)));
+    qe_set(qe, &update);
+    lens[j] = KEY_LEN + update.len;
+  }
+  for( i = 0, live = 0 ; i < count ; i++ ) live += lens[i];
+  qe_close(qe);
+  before = file_size(opts->file);
+
+  // Compaction moves live records into the holes churn left behind
+  qe    = open_engine(opts);
+  qe_index_add_typed(qe, "id", QUERY_ENGINE_KEY_BYTES, 0, KEY_LEN);
+  start = now_s();
+  while(qe_compact(qe, 0) == QUERY_ENGINE_RETURN_MORE);
+  compact = now_s() - start;
+  qe_close(qe);
+  after = file_size(opts->file);
+
+  fprintf(out, "\"churn\":{\"records\":%llu,\"live_bytes\":%llu,\"file_bytes\":%llu,\"amplification\":%.3f,\"compact_ms\":%.3f,\"compacted_file_bytes\":%llu,\"compacted_amplification\":%.3f}}",
+    (unsigned long long)count, (unsigned long long)live, (unsigned long long)before, (double)before / (double)live,
+    compact * 1e3, (unsigned long long)after, (double)after / (double)live
+  );
+
+  for( i = 0 ; i < LOAD_BATCH ; i++ ) free(batch[i].value);
+  free(batch);
+  free(entries);
+  free(lat.samples);
+  free(update.value);
+  free(lens);
+  unlink(opts->file);
+}
+
+size_t parse_list(const char *arg, size_t *list, size_t max) {
+  size_t n = 0;
+  char  *end;
+  while(*arg && (n < max)) {
+    list[n++] = strtoull(arg, &end, 10);
+    if (*end != ',') break;
+    arg = end + 1;
+  }
+  return n;
+}
+
+int main(int argc, char **argv) {
+  struct options opts = {
+    .records   = { 1000, 10000 },
+    .nrecords  = 2,
+    .values    = { 16, 1024, 65536 },
+    .nvalues   = 3,
+    .ops       = 10000,
+    .max_bytes = 256 * 1024 * 1024,
+    .seed      = 1,
+    .file      = "workload.db",
+    .out       = NULL,
+  };
+  FILE   *out = stdout;
+  size_t  r, v;
+  int     first = 1;
+
+  for(int i=1; i<argc; i++) {
+    if (!strncmp(argv[i], "--records=", 10)) {
+      opts.nrecords = parse_list(argv[i] + 10, opts.records, 16);
+    } else if (!strncmp(argv[i], "--values=", 9)) {
+      opts.nvalues = parse_list(argv[i] + 9, opts.values, 16);
+    } else if (!strncmp(argv[i], "--ops=", 6)) {
+      opts.ops = strtoull(argv[i] + 6, NULL, 10);
+    } else if (!strncmp(argv[i], "--max-bytes=", 12)) {
+      opts.max_bytes = strtoull(argv[i] + 12, NULL, 10);
+    } else if (!strncmp(argv[i], "--seed=", 7)) {
+      opts.seed = strtoull(argv[i] + 7, NULL, 10);
+    } else if (!strncmp(argv[i], "--file=", 7)) {
+      opts.file = argv[i] + 7;
+    } else if (!strncmp(argv[i], "--out=", 6)) {
+      opts.out = argv[i] + 6;
+    } else if (!strcmp(argv[i], "--compress")) {
+      opts.compress = 1;
+    } else if (!strncmp(argv[i], "--cache=", 8)) {
+      opts.cache = strtoull(argv[i] + 8, NULL, 10);
+    } else {
+      fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+      return 1;
+    }
+  }
+  rng_state ^= mix(opts.seed);
+  if (opts.out && !(out = fopen(opts.out, "w"))) {
+    fprintf(stderr, "Could not open %s\n", opts.out);
+    return 1;
+  }
+
+  // Combinations over the size limit are skipped, 10^7 records of 64KiB won't fit anywhere
+  fprintf(out, "{\"benchmark\":\"query-engine workload\",\"ops\":%zu,\"seed\":%llu,\"runs\":[", opts.ops, (unsigned long long)opts.seed);
+  for( r = 0 ; r < opts.nrecords ; r++ ) {
+    for( v = 0 ; v < opts.nvalues ; v++ ) {
+      if (!opts.records[r] || (opts.records[r] * (KEY_LEN + opts.values[v]) > opts.max_bytes)) continue;
+      if (!first) fprintf(out, ",");
+      run_config(out, &opts, opts.records[r], opts.values[v]);
+      fflush(out);
+      first = 0;
+    }
+  }
+  fprintf(out, "]}\n");
+  if (out != stdout) fclose(out);
+  return 0;
+}